@@ -161,6 +161,8 @@ void print_cpuinfo(void)
 		panic("Can't write FS Base from userspace, and no FASTCALL support!");
 		#endif
 	}
+	if (ebx & (1 << 19))
+		cpu_set_feat(CPU_FEAT_X86_ADX);
 	cpuid(0x80000001, 0x0, &eax, &ebx, &ecx, &edx);
 	if (edx & (1 << 27)) {
 		printk("RDTSCP supported\n");
@@ -1036,6 +1036,8 @@ static bool handle_vmexit_ept_fault(struct vm_trapframe *tf)
 	int prot = 0;
 	int ret;
 
+	if (vmm_ring_doorbell(tf))
+		return TRUE;
 	prot |= tf->tf_exit_qual & VMX_EPT_FAULT_READ ? PROT_READ : 0;
 	prot |= tf->tf_exit_qual & VMX_EPT_FAULT_WRITE ? PROT_WRITE : 0;
 	prot |= tf->tf_exit_qual & VMX_EPT_FAULT_INS ? PROT_EXEC : 0;
@@ -19,6 +19,8 @@
 #include "vmm.h"
 #include <trap.h>
 #include <umem.h>
+#include <ns.h>
+#include <error.h>
 
 #include <arch/x86.h>
 #include <ros/procinfo.h>
@@ -150,6 +152,11 @@ void __vmm_struct_cleanup(struct proc *p)
 			destroy_guest_pcore(vmm->guest_pcores[i]);
 	}
 	kfree(vmm->guest_pcores);
+	for (int i = 0; i < vmm->nr_doorbells; i++)
+		cclose(vmm->doorbells[i].chan);
+	kfree(vmm->doorbells);
+	vmm->doorbells = NULL;
+	vmm->nr_doorbells = 0;
 	ept_flush(p->env_pgdir.eptp);
 	vmm->vmmcp = FALSE;
 }
@@ -179,6 +186,269 @@ int vmm_poke_guest(struct proc *p, int guest_pcoreid)
 	return 0;
 }
 
+static struct vmm_doorbell *__vmm_find_doorbell(struct vmm *vmm,
+                                                uintptr_t gpa, uint64_t value,
+                                                int flags)
+{
+	struct vmm_doorbell *db;
+
+	for (int i = 0; i < vmm->nr_doorbells; i++) {
+		db = &vmm->doorbells[i];
+		if (db->gpa != gpa)
+			continue;
+		if ((db->flags & VMM_DB_ANY_VALUE) || (flags & VMM_DB_ANY_VALUE)
+		    || db->value == value)
+			return db;
+	}
+	return NULL;
+}
+
+/* Registers a doorbell: guest writes of value to gpa kick the eventfd at fd.
+ * Caller holds the vmm qlock.  Throws on error. */
+void vmm_add_doorbell(struct proc *p, uintptr_t gpa, uint64_t value, int fd,
+                      int flags)
+{
+	struct vmm *vmm = &p->vmm;
+	struct vmm_doorbell *db;
+	struct chan *c;
+
+	if (flags & ~VMM_DB_ALL_FLAGS)
+		error(EINVAL, "Bad doorbell flags 0x%x (0x%x)", flags,
+		      VMM_DB_ALL_FLAGS);
+	if (!vmm->doorbells)
+		vmm->doorbells = kzmalloc(sizeof(struct vmm_doorbell) *
+		                          VMM_MAX_DOORBELLS, MEM_WAIT);
+	c = fdtochan(&p->open_files, fd, O_WRITE, FALSE, TRUE);
+	if (!efd_is_efd(c)) {
+		cclose(c);
+		error(EINVAL, "Doorbell fd %d is not an eventfd", fd);
+	}
+	spin_lock(&vmm->db_lock);
+	if (__vmm_find_doorbell(vmm, gpa, value, flags)) {
+		spin_unlock(&vmm->db_lock);
+		cclose(c);
+		error(EEXIST, "Doorbell for gpa %p value 0x%lx exists", gpa,
+		      value);
+	}
+	if (vmm->nr_doorbells == VMM_MAX_DOORBELLS) {
+		spin_unlock(&vmm->db_lock);
+		cclose(c);
+		error(ENOSPC, "Out of doorbells (max %d)", VMM_MAX_DOORBELLS);
+	}
+	db = &vmm->doorbells[vmm->nr_doorbells];
+	db->gpa = gpa;
+	db->value = value;
+	db->flags = flags;
+	db->chan = c;
+	vmm->nr_doorbells++;
+	spin_unlock(&vmm->db_lock);
+}
+
+/* Removes the doorbell for (gpa, value).  With VMM_DB_ANY_VALUE, removes the
+ * first doorbell for gpa.  Caller holds the vmm qlock.  Throws on error. */
+void vmm_del_doorbell(struct proc *p, uintptr_t gpa, uint64_t value,
+                      int flags)
+{
+	struct vmm *vmm = &p->vmm;
+	struct vmm_doorbell *db;
+	struct chan *c;
+
+	spin_lock(&vmm->db_lock);
+	db = vmm->doorbells ? __vmm_find_doorbell(vmm, gpa, value, flags)
+	                    : NULL;
+	if (!db) {
+		spin_unlock(&vmm->db_lock);
+		error(ENOENT, "No doorbell for gpa %p value 0x%lx", gpa, value);
+	}
+	c = db->chan;
+	*db = vmm->doorbells[--vmm->nr_doorbells];
+	spin_unlock(&vmm->db_lock);
+	cclose(c);
+}
+
+static uint64_t *vmtf_reg(struct vm_trapframe *tf, int reg)
+{
+	switch (reg) {
+	case 0:
+		return &tf->tf_rax;
+	case 1:
+		return &tf->tf_rcx;
+	case 2:
+		return &tf->tf_rdx;
+	case 3:
+		return &tf->tf_rbx;
+	case 4:
+		return &tf->tf_rsp;
+	case 5:
+		return &tf->tf_rbp;
+	case 6:
+		return &tf->tf_rsi;
+	case 7:
+		return &tf->tf_rdi;
+	case 8:
+		return &tf->tf_r8;
+	case 9:
+		return &tf->tf_r9;
+	case 10:
+		return &tf->tf_r10;
+	case 11:
+		return &tf->tf_r11;
+	case 12:
+		return &tf->tf_r12;
+	case 13:
+		return &tf->tf_r13;
+	case 14:
+		return &tf->tf_r14;
+	case 15:
+		return &tf->tf_r15;
+	}
+	panic("Unknown reg %d\n", reg);
+}
+
+/* Decodes a 64 bit mode MMIO store: mov r/m, reg (88, 89) or mov r/m, imm (c6,
+ * c7), with optional 66, 67, and REX prefixes.  That's what guests use for
+ * doorbell writes (e.g. Linux's writel()); anything fancier goes to the VMM.
+ * insn has len valid bytes.  Returns the instruction's length, or 0 if we
+ * couldn't decode it. */
+static size_t vmm_decode_store(struct vm_trapframe *tf, uint8_t *insn,
+                               size_t len, uint64_t *val)
+{
+	size_t i = 0;
+	uint8_t rex = 0, opcode, modrm, reg;
+	int op_bytes = 4, imm_bytes = 0;
+
+	while (i < len && (insn[i] == 0x66 || insn[i] == 0x67)) {
+		if (insn[i] == 0x66)
+			op_bytes = 2;
+		i++;
+	}
+	if (i < len && (insn[i] & 0xf0) == 0x40)
+		rex = insn[i++];
+	if (i + 2 > len)
+		return 0;
+	if (rex & 0x08)
+		op_bytes = 8;
+	opcode = insn[i++];
+	switch (opcode) {
+	case 0x88:
+		op_bytes = 1;
+		break;
+	case 0x89:
+		break;
+	case 0xc6:
+		op_bytes = 1;
+		imm_bytes = 1;
+		break;
+	case 0xc7:
+		imm_bytes = MIN(op_bytes, 4);
+		break;
+	default:
+		return 0;
+	}
+	modrm = insn[i++];
+	reg = (modrm >> 3) & 7;
+	switch (modrm >> 6) {
+	case 0:
+		if ((modrm & 7) == 5)
+			i += 4;		/* rip + disp32 */
+		break;
+	case 1:
+		i += 1;
+		break;
+	case 2:
+		i += 4;
+		break;
+	case 3:
+		return 0;		/* register destination */
+	}
+	if ((modrm & 7) == 4) {
+		/* SIB, which has a disp32 if there's no base */
+		if (i >= len)
+			return 0;
+		if ((modrm >> 6) == 0 && (insn[i] & 7) == 5)
+			i += 4;
+		i++;
+	}
+	if (i + imm_bytes > len)
+		return 0;
+	if (imm_bytes) {
+		if (reg != 0)
+			return 0;
+		*val = 0;
+		for (int j = 0; j < imm_bytes; j++)
+			*val |= (uint64_t)insn[i + j] << (8 * j);
+		/* imm32s are sign-extended for 64 bit stores */
+		if (op_bytes == 8 && (*val & (1ULL << 31)))
+			*val |= 0xffffffff00000000ULL;
+		return i + imm_bytes;
+	}
+	reg += rex & 0x04 ? 8 : 0;
+	/* Without a REX, byte regs 4-7 are ah, ch, dh, and bh */
+	if (op_bytes == 1 && !rex && reg >= 4)
+		*val = *vmtf_reg(tf, reg - 4) >> 8;
+	else
+		*val = *vmtf_reg(tf, reg);
+	if (op_bytes < 8)
+		*val &= (1ULL << (op_bytes * 8)) - 1;
+	return i;
+}
+
+#define VMX_CS_AR_L			(1 << 13)
+
+/* Called on EPT violations.  If the guest wrote to one of our doorbells, kick
+ * the doorbell's eventfd and skip the instruction, instead of reflecting the
+ * fault to the VMM.  Don't block: we're in the vmexit path.
+ *
+ * The guest's instruction and page tables are mapped in the EPT (it's
+ * executing), so they're in our KPT too and the copy_from_user()s won't
+ * block. */
+bool vmm_ring_doorbell(struct vm_trapframe *tf)
+{
+	struct vmm *vmm = &current->vmm;
+	struct vmm_doorbell *db;
+	uint8_t insn[VMM_MAX_INSN_SZ];
+	uintptr_t rip_gpa;
+	size_t insn_len, fetch_len;
+	uint64_t val;
+	bool found = FALSE;
+
+	if (!ACCESS_ONCE(vmm->nr_doorbells))
+		return FALSE;
+	if (!(tf->tf_exit_qual & VMX_EPT_FAULT_WRITE))
+		return FALSE;
+	spin_lock(&vmm->db_lock);
+	for (int i = 0; i < vmm->nr_doorbells; i++) {
+		if (vmm->doorbells[i].gpa == tf->tf_guest_pa) {
+			found = TRUE;
+			break;
+		}
+	}
+	spin_unlock(&vmm->db_lock);
+	if (!found)
+		return FALSE;
+	if (!(vmcs_read(GUEST_CS_AR_BYTES) & VMX_CS_AR_L))
+		return FALSE;
+	rip_gpa = gva2gpa(current, PTE_ADDR(tf->tf_cr3), tf->tf_rip);
+	if (!rip_gpa)
+		return FALSE;
+	/* Don't cross a page: the next one might not be contiguous. */
+	fetch_len = MIN(sizeof(insn), PGSIZE - PGOFF(rip_gpa));
+	if (memcpy_from_user(current, insn, (void*)rip_gpa, fetch_len))
+		return FALSE;
+	insn_len = vmm_decode_store(tf, insn, fetch_len, &val);
+	if (!insn_len)
+		return FALSE;
+	spin_lock(&vmm->db_lock);
+	db = __vmm_find_doorbell(vmm, tf->tf_guest_pa, val, 0);
+	if (db)
+		efd_kick(db->chan);
+	spin_unlock(&vmm->db_lock);
+	if (!db)
+		return FALSE;
+	tf->tf_rip += insn_len;
+	return TRUE;
+}
+
 struct guest_pcore *lookup_guest_pcore(struct proc *p, int guest_pcoreid)
 {
 	struct guest_pcore **array;
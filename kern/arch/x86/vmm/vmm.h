@@ -17,6 +17,15 @@ static inline int cpu_has_svm(const char **msg)
 }
 
 #define VMM_VMEXIT_NR_TYPES		65
+#define VMM_MAX_DOORBELLS		64
+#define VMM_MAX_INSN_SZ			15
+
+struct vmm_doorbell {
+	uintptr_t			gpa;
+	uint64_t			value;
+	int				flags;
+	struct chan			*chan;
+};
 
 struct vmm {
 	spinlock_t lock;	/* protects guest_pcore assignment */
@@ -46,6 +55,12 @@ struct vmm {
 	struct guest_pcore **guest_pcores;
 	size_t gpc_array_elem;
 	unsigned long vmexits[VMM_VMEXIT_NR_TYPES];
+
+	/* Doorbells are added and removed under the qlock.  The array is
+	 * allocated once; the db_lock protects its contents. */
+	spinlock_t db_lock;
+	unsigned int nr_doorbells;
+	struct vmm_doorbell *doorbells;
 };
 
 void vmm_init(void);
@@ -56,6 +71,11 @@ void __vmm_add_gpcs(struct proc *p, unsigned int nr_more_gpcs,
                     struct vmm_gpcore_init *u_gpcis);
 void __vmm_struct_cleanup(struct proc *p);
 int vmm_poke_guest(struct proc *p, int guest_pcoreid);
+void vmm_add_doorbell(struct proc *p, uintptr_t gpa, uint64_t value, int fd,
+                      int flags);
+void vmm_del_doorbell(struct proc *p, uintptr_t gpa, uint64_t value,
+                      int flags);
+bool vmm_ring_doorbell(struct vm_trapframe *tf);
 
 struct guest_pcore *create_guest_pcore(struct proc *p,
                                        struct vmm_gpcore_init *gpci);
@@ -1280,10 +1280,12 @@ static void __consq_fire_taps(uint32_t srcid, long a0, long a1, long a2)
 	struct fd_tap *tap_i;
 	int filter = a0;
 
+	event_batch_start();
 	spin_lock(&cons_q_lock);
 	SLIST_FOREACH (tap_i, &cons_q_fd_taps, link)
 		fire_tap(tap_i, filter);
 	spin_unlock(&cons_q_lock);
+	event_batch_end();
 }
 
 static void cons_q_wake_cb(struct queue *q, void *data, int filter)
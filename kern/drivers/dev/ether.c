@@ -406,9 +406,11 @@ static int etheroq(struct ether *ether, struct block *bp)
 
 	ether->outpackets++;
 
+	/* Finalize before linearizing, while the extra_data still has any
+	 * checksums from when the data was written. */
+	ptclcsum_finalize(bp, ether->feat);
 	if (!(ether->feat & NETF_SG))
 		bp = linearizeblock(bp);
-	ptclcsum_finalize(bp, ether->feat);
 	/*
 	 * Check if the packet has to be placed back onto the input queue,
 	 * i.e. if it's a loopback or broadcast packet or the interface is
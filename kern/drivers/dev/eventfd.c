@@ -18,6 +18,7 @@
 #include <error.h>
 #include <sys/queue.h>
 #include <fdtap.h>
+#include <event.h>
 #include <syscall.h>
 
 struct dev efd_devtab;
@@ -146,10 +147,12 @@ static void efd_fire_taps(struct eventfd *efd, int filter)
 	/* We're not expecting many FD taps, so it's not worth splitting readers
 	 * from writers or anything like that.
 	 * TODO: (RCU) Locking to protect the list and the tap's existence. */
+	event_batch_start();
 	spin_lock(&efd->tap_lock);
 	SLIST_FOREACH(tap_i, &efd->fd_taps, link)
 		fire_tap(tap_i, filter);
 	spin_unlock(&efd->tap_lock);
+	event_batch_end();
 }
 
 static int has_counts(void *arg)
@@ -238,6 +241,30 @@ success:
 	efd_fire_taps(efd, FDTAP_FILT_READABLE);
 }
 
+/* Returns TRUE if c is an eventfd's efd file, i.e. something efd_kick() can
+ * use. */
+bool efd_is_efd(struct chan *c)
+{
+	return &devtab[c->type] == &efd_devtab && c->qid.path == Qefd;
+}
+
+/* Adds one to the counter on behalf of the kernel, e.g. a VMM doorbell.  This
+ * never blocks, so it's safe from IRQ and vmexit context.  If the counter is
+ * full, the kick is dropped: the reader has plenty of pending counts. */
+void efd_kick(struct chan *c)
+{
+	struct eventfd *efd = c->aux;
+	unsigned long old_count;
+
+	do {
+		old_count = atomic_read(&efd->counter);
+		if (old_count == EFD_MAX_VAL)
+			return;
+	} while (!atomic_cas(&efd->counter, old_count, old_count + 1));
+	rendez_wakeup(&efd->rv_readers);
+	efd_fire_taps(efd, FDTAP_FILT_READABLE);
+}
+
 static size_t efd_write(struct chan *c, void *ubuf, size_t n, off64_t offset)
 {
 	struct eventfd *efd = c->aux;
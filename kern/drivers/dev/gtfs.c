@@ -26,8 +26,14 @@ static char *devname(void)
 struct gtfs {
 	struct tree_filesystem		tfs;
 	struct kref			users;
+	struct shrinker			shrinker;
 };
 
+/* Max number of unused files we try to prune per shrinker call. */
+#define GTFS_SHRINK_BATCH		64
+
+static size_t gtfs_shrink(struct shrinker *s, size_t goal);
+
 /* Blob hanging off the fs_file->priv.  The backend chans are only accessed,
  * (changed or used) with the corresponding fs_file qlock held.  That's the
  * primary use of the qlock - we might be able to avoid qlocking with increfs
@@ -195,6 +201,7 @@ static void gtfs_release(struct kref *kref)
 {
 	struct gtfs *gtfs = container_of(kref, struct gtfs, users);
 
+	unregister_shrinker(&gtfs->shrinker);
 	tfs_frontend_purge(&gtfs->tfs, purge_cb);
 	/* this is the ref from attach */
 	assert(kref_refcnt(&gtfs->tfs.root->kref) == 1);
@@ -395,6 +402,8 @@ static void gtfs_tf_couple_backend(struct tree_file *tf, struct chan *backend)
 		error(ENOMEM, "chandirstat failed");
 	fs_file_copy_from_dir(&tf->file, dir);
 	kfree(dir);
+	/* Clean pages can always be reread from the backend. */
+	tf->file.pm->pm_flags |= PM_F_RECLAIMABLE;
 	/* For sync_metadata */
 	gp->be_length = tf->file.dir.length;
 	gp->be_mode = tf->file.dir.mode;
@@ -700,6 +709,8 @@ static bool gtfs_fs_can_grow_to(struct fs_file *f, size_t len)
 struct fs_file_ops gtfs_fs_ops = {
 	.readpage = gtfs_pm_readpage,
 	.writepage = gtfs_pm_writepage,
+	.pin = tf_pm_pin,
+	.unpin = tf_pm_unpin,
 	.punch_hole = gtfs_fs_punch_hole,
 	.can_grow_to = gtfs_fs_can_grow_to,
 };
@@ -772,6 +783,11 @@ static struct chan *gtfs_attach(char *arg)
 	/* need another ref on root for the frontend chan */
 	tf_kref_get(tfs->root);
 	chan_set_tree_file(frontend, tfs->root);
+	gtfs->shrinker.name = "gtfs_lru";
+	gtfs->shrinker.priority = SHRINKER_PRIO_META;
+	gtfs->shrinker.shrink = gtfs_shrink;
+	gtfs->shrinker.priv = gtfs;
+	register_shrinker(&gtfs->shrinker);
 	poperror();
 	return frontend;
 }
@@ -792,27 +808,20 @@ static bool lru_prune_cb(struct tree_file *tf)
 	return true;
 }
 
-static void pressure_dfs_cb(struct tree_file *tf)
+/* Shrinker, called under memory pressure.  The page map shrinker already
+ * drops clean pages from our files (they are PM_F_RECLAIMABLE), and the TFS
+ * drops negative entries.  We prune unused files from the LRU: this writes
+ * back dirty files, then if they haven't been used since we started, it'll
+ * delete the frontend TF, which will delete the entire page cache entry.  The
+ * heavy lifting is done by TF code. */
+static size_t gtfs_shrink(struct shrinker *s, size_t goal)
 {
-	if (!tree_file_is_dir(tf))
-		pm_free_unused_pages(tf->file.pm);
-}
+	struct gtfs *gtfs = s->priv;
+	size_t nr_freed;
 
-/* Under memory pressure, there are a bunch of things we can do. */
-static void gtfs_free_memory(struct gtfs *gtfs)
-{
-	/* This attempts to remove every file from the LRU.  It'll write back
-	 * dirty files, then if they haven't been used since we started, it'll
-	 * delete the frontend TF, which will delete the entire page cache
-	 * entry.  The heavy lifting is done by TF code. */
-	tfs_lru_for_each(&gtfs->tfs, lru_prune_cb, -1);
-	/* This drops the negative TFs.  It's not a huge deal, since they are
-	 * small, but perhaps it'll help. */
-	tfs_lru_prune_neg(&gtfs->tfs);
-	/* This will attempt to free memory from all files in the frontend,
-	 * regardless of whether or not they are in use.  This might help if you
-	 * have some large files that happened to be open. */
-	tfs_frontend_for_each(&gtfs->tfs, pressure_dfs_cb);
+	nr_freed = tfs_lru_for_each(&gtfs->tfs, lru_prune_cb,
+				    GTFS_SHRINK_BATCH);
+	return nr_freed * sizeof(struct tree_file);
 }
 
 static void gtfs_sync_tf(struct tree_file *tf)
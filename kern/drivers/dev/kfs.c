@@ -126,6 +126,8 @@ static bool kfs_fs_can_grow_to(struct fs_file *f, size_t len)
 struct fs_file_ops kfs_fs_ops = {
 	.readpage = kfs_pm_readpage,
 	.writepage = kfs_pm_writepage,
+	.pin = tf_pm_pin,
+	.unpin = tf_pm_unpin,
 	.punch_hole = kfs_fs_punch_hole,
 	.can_grow_to = kfs_fs_can_grow_to,
 };
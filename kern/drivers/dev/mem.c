@@ -2,7 +2,7 @@
  * Barret Rhoden <brho@cs.berkeley.edu>
  * See LICENSE for details.
  *
- * #mem, memory diagnostics (arenas and slabs)
+ * #mem, memory diagnostics (arenas, slabs, and reclaim)
  */
 
 #include <ns.h>
@@ -13,6 +13,7 @@
 #include <error.h>
 #include <syscall.h>
 #include <sys/queue.h>
+#include <reclaim.h>
 
 struct dev mem_devtab;
 
@@ -28,6 +29,8 @@ enum {
 	Qfree,
 	Qkmemstat,
 	Qslab_trace,
+	Qreclaim,
+	Qblock_pools,
 };
 
 static struct dirtab mem_dir[] = {
@@ -37,6 +40,8 @@ static struct dirtab mem_dir[] = {
 	{"free", {Qfree, 0, QTFILE}, 0, 0444},
 	{"kmemstat", {Qkmemstat, 0, QTFILE}, 0, 0444},
 	{"slab_trace", {Qslab_trace, 0, QTFILE}, 0, 0444},
+	{"reclaim", {Qreclaim, 0, QTFILE}, 0, 0444},
+	{"block_pools", {Qblock_pools, 0, QTFILE}, 0, 0444},
 };
 
 /* Protected by the arenas_and_slabs_lock */
@@ -364,6 +369,12 @@ static struct chan *mem_open(struct chan *c, int omode)
 	case Qkmemstat:
 		c->synth_buf = build_kmemstat();
 		break;
+	case Qreclaim:
+		c->synth_buf = reclaim_build_stats();
+		break;
+	case Qblock_pools:
+		c->synth_buf = block_pool_build_stats();
+		break;
 	}
 	c->mode = openmode(omode);
 	c->flag |= COPEN;
@@ -380,6 +391,8 @@ static void mem_close(struct chan *c)
 	case Qslab_stats:
 	case Qfree:
 	case Qkmemstat:
+	case Qreclaim:
+	case Qblock_pools:
 		kfree(c->synth_buf);
 		c->synth_buf = NULL;
 		break;
@@ -410,6 +423,8 @@ static size_t mem_read(struct chan *c, void *ubuf, size_t n, off64_t offset)
 	case Qslab_stats:
 	case Qfree:
 	case Qkmemstat:
+	case Qreclaim:
+	case Qblock_pools:
 		sza = c->synth_buf;
 		return readstr(offset, ubuf, n, sza->buf);
 	case Qslab_trace:
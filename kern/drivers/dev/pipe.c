@@ -37,6 +37,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <net/ip.h>
+#include <event.h>
 
 struct dev pipedevtab;
 
@@ -562,6 +563,7 @@ static void pipe_wake_cb(struct queue *q, void *data, int filter)
 	struct fd_tap *tap_i;
 	struct chan *chan;
 
+	event_batch_start();
 	spin_lock(&p->tap_lock);
 	SLIST_FOREACH(tap_i, &p->data_taps, link) {
 		chan = tap_i->chan;
@@ -598,6 +600,7 @@ static void pipe_wake_cb(struct queue *q, void *data, int filter)
 		fire_tap(tap_i, filter);
 	}
 	spin_unlock(&p->tap_lock);
+	event_batch_end();
 }
 
 static int pipetapfd(struct chan *chan, struct fd_tap *tap, int cmd)
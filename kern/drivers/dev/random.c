@@ -19,8 +19,42 @@
 #include <smp.h>
 #include <net/ip.h>
 #include <random/fortuna.h>
+#include <random/chacha20.h>
+#include <percpu.h>
+#include <time.h>
+
+/*
+ * Fortuna, behind rl, is the entropy pool, but readers don't use it directly.
+ * Each core has a ChaCha20 generator keyed from Fortuna, which it reseeds every
+ * RANDOM_RESEED_USEC or RANDOM_RESEED_BYTES of output, or after someone adds
+ * entropy.  The generators are only touched with IRQs off, on their own core,
+ * so readers don't share any locks or cache lines.
+ *
+ * Each generator buffers some keystream for small reads.  Whenever it refills
+ * the buffer, the first 32 bytes become its next key and are erased, and so
+ * are bytes once they are handed out.  Someone who reads a core's state later
+ * can't recover earlier output.  Large reads take a one-time key from the
+ * buffer and generate directly into the caller's buffer with IRQs on.
+ */
+#define RANDOM_RESEED_USEC	(60 * 1000000)
+#define RANDOM_RESEED_BYTES	(16 << 20)
+#define RANDOM_BULK_MIN		256
+#define RANDOM_BUF_BLOCKS	8
+
+struct random_pcpu {
+	struct chacha20_ctx ctx;
+	uint8_t buf[RANDOM_BUF_BLOCKS * CHACHA20_BLOCK_SIZE];
+	unsigned int buf_pos;	/* next unused byte */
+	unsigned long seed_gen;
+	uint64_t seed_tsc;
+	uint64_t nr_bytes;	/* since the last reseed */
+};
 
 static qlock_t rl;
+static DEFINE_PERCPU(struct random_pcpu, random_pcpu);
+/* Bumped when entropy is added, so every core reseeds.  Starts ahead of the
+ * cores, so they seed on their first read. */
+static unsigned long random_seed_gen = 1;
 
 /*
  * Add entropy. This is not currently used but we might want to hook it into a
@@ -37,61 +71,131 @@ void random_add(void *xp)
 	}
 
 	fortuna_add_entropy(xp, sizeof(xp));
+	random_seed_gen++;
 	qunlock(&rl);
 
 	poperror();
 }
 
-/*
- *  consume random bytes
- */
-uint32_t random_read(void *xp, uint32_t n)
+/* Refills the buffer, taking the next key from its start.  IRQs are off. */
+static void random_refill(struct random_pcpu *rp)
 {
-	ERRSTACK(1);
-
-	qlock(&rl);
+	chacha20_blocks(&rp->ctx, rp->buf, RANDOM_BUF_BLOCKS);
+	chacha20_init(&rp->ctx, rp->buf, 0);
+	memset(rp->buf, 0, CHACHA20_KEY_SIZE);
+	rp->buf_pos = CHACHA20_KEY_SIZE;
+}
 
-	if (waserror()) {
-		qunlock(&rl);
-		nexterror();
+/* Hands out n bytes from the buffer, erasing them.  IRQs are off. */
+static void random_take(struct random_pcpu *rp, uint8_t *dst, size_t n)
+{
+	size_t amt;
+
+	while (n) {
+		if (rp->buf_pos == sizeof(rp->buf))
+			random_refill(rp);
+		amt = MIN(n, sizeof(rp->buf) - rp->buf_pos);
+		memcpy(dst, rp->buf + rp->buf_pos, amt);
+		memset(rp->buf + rp->buf_pos, 0, amt);
+		rp->buf_pos += amt;
+		dst += amt;
+		n -= amt;
 	}
+}
 
-	fortuna_get_bytes(n, xp);
-	qunlock(&rl);
+/* Racy, since we might not be on rp's core.  The worst that happens is that
+ * we reseed the wrong core or a little late. */
+static bool random_needs_seed(struct random_pcpu *rp)
+{
+	return rp->seed_gen != ACCESS_ONCE(random_seed_gen) ||
+	       rp->nr_bytes >= RANDOM_RESEED_BYTES ||
+	       tsc2usec(read_tsc() - rp->seed_tsc) >= RANDOM_RESEED_USEC;
+}
 
-	poperror();
+/* Mixes fresh Fortuna output into our core's key.  We keep the old key's
+ * contribution, so a weak reseed can't make things worse. */
+static void random_reseed(void)
+{
+	uint8_t seed[CHACHA20_KEY_SIZE], key[CHACHA20_KEY_SIZE];
+	struct random_pcpu *rp;
+	unsigned long gen;
+	int8_t irq_state = 0;
 
-	return n;
+	qlock(&rl);
+	gen = random_seed_gen;
+	fortuna_get_bytes(sizeof(seed), seed);
+	qunlock(&rl);
+
+	disable_irqsave(&irq_state);
+	rp = PERCPU_VARPTR(random_pcpu);
+	if (rp->seed_gen) {
+		random_take(rp, key, sizeof(key));
+		for (int i = 0; i < sizeof(key); i++)
+			key[i] ^= seed[i];
+	} else {
+		memcpy(key, seed, sizeof(key));
+	}
+	chacha20_init(&rp->ctx, key, 0);
+	memset(rp->buf, 0, sizeof(rp->buf));
+	rp->buf_pos = sizeof(rp->buf);
+	rp->seed_gen = gen;
+	rp->seed_tsc = read_tsc();
+	rp->nr_bytes = 0;
+	enable_irqsave(&irq_state);
+
+	memset(seed, 0, sizeof(seed));
+	memset(key, 0, sizeof(key));
 }
 
-/**
- * Fast random generator
- **/
-uint32_t urandom_read(void *xp, uint32_t n)
+/*
+ *  consume random bytes
+ */
+uint32_t random_read(void *xp, uint32_t n)
 {
-	uint64_t seed[16];
-	uint8_t *e, *p;
-	uint32_t x = 0;
-	uint64_t s0;
-	uint64_t s1;
-
-	if (n <= sizeof(seed))
-		return random_read(xp, n);
-	// The initial seed is from a good random pool.
-	random_read(seed, sizeof(seed));
-	p = xp;
-	for (e = p + n; p < e;) {
-		s0 = seed[x];
-		s1 = seed[x = (x + 1) & 15];
-		s1 ^= s1 << 31;
-		s1 ^= s1 >> 11;
-		s0 ^= s0 >> 30;
-		*p++ = (seed[x] = s0 ^ s1) * 1181783497276652981LL;
+	uint8_t small[RANDOM_BULK_MIN];
+	uint8_t key[CHACHA20_KEY_SIZE];
+	struct chacha20_ctx ctx;
+	struct random_pcpu *rp;
+	int8_t irq_state = 0;
+
+	/* Reseeding blocks, so we could end up on a core that has never been
+	 * seeded.  Never hand out output from the all-zero key. */
+	while (1) {
+		if (random_needs_seed(PERCPU_VARPTR(random_pcpu)))
+			random_reseed();
+		disable_irqsave(&irq_state);
+		rp = PERCPU_VARPTR(random_pcpu);
+		if (rp->seed_gen)
+			break;
+		enable_irqsave(&irq_state);
+	}
+	/* xp might be a user address, so we don't copy to it with IRQs off. */
+	rp->nr_bytes += n;
+	if (n < RANDOM_BULK_MIN) {
+		random_take(rp, small, n);
+		enable_irqsave(&irq_state);
+		memcpy(xp, small, n);
+		memset(small, 0, n);
+		return n;
 	}
+	random_take(rp, key, sizeof(key));
+	enable_irqsave(&irq_state);
 
+	chacha20_init(&ctx, key, 0);
+	memset(key, 0, sizeof(key));
+	chacha20_keystream(&ctx, xp, n);
+	memset(&ctx, 0, sizeof(ctx));
 	return n;
 }
 
+/*
+ * Same generator as random: there's no cheaper, weaker one.
+ */
+uint32_t urandom_read(void *xp, uint32_t n)
+{
+	return random_read(xp, n);
+}
+
 struct dev randomdevtab;
 
 static char *devname(void)
@@ -213,6 +213,9 @@ static int sdinitpart(struct sdunit *unit)
 	m = machp();
 #endif
 	if (unit->sectors > 0) {
+		/* the cache is indexed by the old geometry */
+		sdcache_sync(unit);
+		sdcache_inval(unit);
 		unit->sectors = unit->secsize = 0;
 		sdincvers(unit);
 	}
@@ -234,6 +237,7 @@ static int sdinitpart(struct sdunit *unit)
 		unit->dev->ifc->online(unit);
 	if (unit->sectors) {
 		sdincvers(unit);
+		sdcache_setup(unit);
 		sdaddpart(unit, "data", 0, unit->sectors);
 
 /*
@@ -845,6 +849,25 @@ static size_t sdbio(struct chan *c, int write, char *a, size_t len, off64_t off)
 		poperror();
 	}
 
+	/*
+	 * Cached units go through the block cache, which handles
+	 * partial sectors and does its own queueing.
+	 */
+	if (sdcache_enabled(unit)) {
+		offset = off % unit->secsize;
+		if (offset + len > nb * unit->secsize)
+			len = nb * unit->secsize - offset;
+		if (waserror()) {
+			kref_put(&sdev->r);
+			nexterror();
+		}
+		len = sdcache_io(unit, write, a, len,
+		                 bno * unit->secsize + offset);
+		poperror();
+		kref_put(&sdev->r);
+		return len;
+	}
+
 	b = kzmalloc(nb * unit->secsize, MEM_WAIT);
 	if (b == NULL)
 		error(ENOMEM, "%s: could not allocate %d bytes", __func__,
@@ -1199,6 +1222,7 @@ static size_t sdread(struct chan *c, void *a, size_t n, off64_t off)
 				pp++;
 			}
 		}
+		l = sdcache_ctl(unit, p + l, p + mm) - p;
 		qunlock(&unit->ctl);
 		kref_put(&sdev->r);
 		l = readstr(offset, a, n, p);
@@ -1356,6 +1380,18 @@ static size_t sdwrite(struct chan *c, void *a, size_t n, off64_t off)
 			if (unit->part == NULL)
 				error(EIO, "partition was NULL");
 			sddelpart(unit, cb->f[1]);
+		} else if (strcmp(cb->f[0], "cache") == 0) {
+			if (cb->nf != 2)
+				error(EINVAL, "cache got %d args, 2 required",
+				      cb->nf);
+			if (strcmp(cb->f[1], "on") == 0)
+				sdcache_enable(unit, TRUE);
+			else if (strcmp(cb->f[1], "off") == 0)
+				sdcache_enable(unit, FALSE);
+			else
+				error(EINVAL, "cache on|off");
+		} else if (strcmp(cb->f[0], "sync") == 0) {
+			sdcache_sync(unit);
 		} else if (unit->dev->ifc->wctl)
 			unit->dev->ifc->wctl(unit, cb);
 		else
@@ -1533,6 +1569,13 @@ static int unconfigure(char *spec)
 	devs[i] = NULL;
 	qunlock(&devslock);
 
+	/* write back cached blocks while the controller still works */
+	for (i = 0; i != sdev->nunit; i++) {
+		unit = sdev->unit[i];
+		if (unit)
+			sdcache_free(unit);
+	}
+
 	/* make sure no interrupts arrive anymore before removing resources */
 	if (sdev->enabled && sdev->ifc->disable)
 		sdev->ifc->disable(sdev);
@@ -0,0 +1,661 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Block cache and request queue for #sd units.
+ *
+ * Partition reads and writes of non-removable units go through a page cache, a
+ * page_map per unit indexed by device page, so overlapping partitions share
+ * pages.  The cache's page reads and writes become sd_breqs in a per-unit
+ * queue, sorted by block.  Dispatching takes the next run of the queue in
+ * ascending block order from where the last run ended (C-SCAN), and merges
+ * adjacent requests in the same direction into one driver bio.  A merged run
+ * goes to the driver's bbio as a block chain over the requests' pages, which
+ * the driver scatters and gathers; drivers without a bbio get no merging.
+ *
+ * Whoever waits for a request dispatches, so synchronous IO doesn't wait on
+ * another thread.  Readahead is asynchronous: the sdcache ktask dispatches it.
+ * The ktask leaves plugged queues alone, so a submitter can plug, queue a
+ * batch, and unplug, and the batch goes out merged.
+ *
+ * Writes are write-back: the page map flusher writes dirty pages, as does
+ * "sync" on the unit's ctl file.  Raw SCSI commands bypass the cache.
+ * Removable units don't use it at all, since their media can change under us.
+ *
+ * TODO: full-page writes still read the page first.  The pagemap has no way
+ * to insert a page that the caller will fill. */
+
+#include <assert.h>
+#include <error.h>
+#include <kmalloc.h>
+#include <kref.h>
+#include <kthread.h>
+#include <linker_func.h>
+#include <ns.h>
+#include <pagemap.h>
+#include <pmap.h>
+#include <rendez.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sd.h>
+
+/* Max requests merged into one bio */
+#define SD_RUN_MAX		32
+/* Sequential readahead window, in pages */
+#define SD_RA_MIN		4
+#define SD_RA_MAX		64
+
+struct sdcache;
+
+struct sd_breq {
+	TAILQ_ENTRY(sd_breq)		link;
+	struct sdcache			*sc;
+	uint64_t			bno;
+	uint32_t			nb;
+	int				write;
+	void				*buf;
+	int				error;
+	bool				done;
+	/* Async requests have a page and a completion.  The completion owns
+	 * (and frees) the request. */
+	struct page			*page;
+	void (*complete)(struct sd_breq *);
+};
+TAILQ_HEAD(sd_breq_tailq, sd_breq);
+
+struct sdcache {
+	struct sdunit			*unit;
+	struct page_map			pm;
+	bool				enabled;
+	unsigned int			pg_sects;	/* sectors per page */
+	unsigned long			nr_pages;
+
+	spinlock_t			lock;
+	struct sd_breq_tailq		queue;		/* sorted by bno */
+	unsigned int			nr_queued;
+	int				plugged;
+	uint64_t			head;		/* end of last run */
+	struct rendez			rv;		/* for sync waiters */
+	bool				pending;	/* on the ktask list */
+	TAILQ_ENTRY(sdcache)		pending_link;
+
+	/* Readahead state: unlocked hints */
+	unsigned long			ra_next;
+	unsigned long			ra_size;
+	unsigned long			ra_end;
+
+	/* Stats: unlocked, approximate */
+	uint64_t			nr_hits;
+	uint64_t			nr_misses;
+	uint64_t			nr_ra_pages;
+	uint64_t			nr_reqs;
+	uint64_t			nr_runs;
+	uint64_t			nr_merged;
+	uint64_t			nr_errors;
+};
+
+static spinlock_t sd_pending_lock = SPINLOCK_INITIALIZER;
+static TAILQ_HEAD(sdcache_tailq, sdcache) sd_pending =
+                          TAILQ_HEAD_INITIALIZER(sd_pending);
+static struct rendez sd_pending_rv;
+/* The cache the ktask is dispatching for, protected by sd_pending_lock */
+static struct sdcache *sd_ktask_sc;
+
+static struct sdcache *pm_to_sc(struct page_map *pm)
+{
+	return container_of(pm, struct sdcache, pm);
+}
+
+/* Sets up r to move page index idx.  The last page of the device might be
+ * short, and pages past the end are empty (nb == 0). */
+static void sd_breq_init(struct sdcache *sc, struct sd_breq *r,
+                         unsigned long idx, int write, void *buf)
+{
+	uint64_t sectors = sc->unit->sectors;
+
+	memset(r, 0, sizeof(struct sd_breq));
+	r->sc = sc;
+	r->write = write;
+	r->buf = buf;
+	r->bno = (uint64_t)idx * sc->pg_sects;
+	if (r->bno < sectors)
+		r->nb = MIN(sc->pg_sects, sectors - r->bno);
+	if (!write && r->nb < sc->pg_sects)
+		memset(buf + r->nb * sc->unit->secsize, 0,
+		       (sc->pg_sects - r->nb) * sc->unit->secsize);
+}
+
+/* Inserts r into the queue, in bno order.  Most inserts are at the tail.
+ * Caller holds the lock. */
+static void __sd_queue(struct sdcache *sc, struct sd_breq *r)
+{
+	struct sd_breq *i;
+
+	TAILQ_FOREACH_REVERSE(i, &sc->queue, sd_breq_tailq, link) {
+		if (i->bno <= r->bno) {
+			TAILQ_INSERT_AFTER(&sc->queue, i, r, link);
+			goto out;
+		}
+	}
+	TAILQ_INSERT_HEAD(&sc->queue, r, link);
+out:
+	sc->nr_queued++;
+	sc->nr_reqs++;
+}
+
+/* Pulls the next run off the queue: the first request at or past the head, or
+ * the lowest if there are none (C-SCAN), and whatever follows it contiguously
+ * in the same direction, up to SD_RUN_MAX requests (one if the driver has no
+ * bbio) and SDmaxio bytes.  Caller holds the lock.  Returns the number of
+ * requests in run. */
+static int __sd_next_run(struct sdcache *sc, struct sd_breq **run)
+{
+	struct sd_breq *r, *next;
+	uint32_t nb, max_nb;
+	int n = 0;
+	int max_n = sc->unit->dev->ifc->bbio ? SD_RUN_MAX : 1;
+
+	TAILQ_FOREACH(r, &sc->queue, link) {
+		if (r->bno >= sc->head)
+			break;
+	}
+	if (!r)
+		r = TAILQ_FIRST(&sc->queue);
+	if (!r)
+		return 0;
+	max_nb = SDmaxio / sc->unit->secsize;
+	run[n++] = r;
+	nb = r->nb;
+	for (next = TAILQ_NEXT(r, link); next && n < max_n;
+	     next = TAILQ_NEXT(next, link)) {
+		if (next->write != r->write ||
+		    next->bno != run[n - 1]->bno + run[n - 1]->nb ||
+		    nb + next->nb > max_nb)
+			break;
+		run[n++] = next;
+		nb += next->nb;
+	}
+	for (int i = 0; i < n; i++)
+		TAILQ_REMOVE(&sc->queue, run[i], link);
+	sc->nr_queued -= n;
+	sc->head = run[n - 1]->bno + run[n - 1]->nb;
+	sc->nr_runs++;
+	sc->nr_merged += n - 1;
+	return n;
+}
+
+/* Builds a block chain over a run's buffers, a block per request.  The buffers
+ * aren't the blocks' to free: sd_run_chain_free() takes them back first. */
+static struct block *sd_run_chain(struct sdcache *sc, struct sd_breq **run,
+                                  int n)
+{
+	struct block *bp = NULL, **tail = &bp, *b;
+
+	for (int i = 0; i < n; i++) {
+		b = block_alloc(0, MEM_WAIT);
+		block_add_extd(b, 1, MEM_WAIT);
+		b->extra_data[0].base = (uintptr_t)run[i]->buf;
+		b->extra_data[0].len = run[i]->nb * sc->unit->secsize;
+		b->extra_len = b->extra_data[0].len;
+		*tail = b;
+		tail = &b->next;
+	}
+	return bp;
+}
+
+static void sd_run_chain_free(struct block *bp)
+{
+	for (struct block *b = bp; b; b = b->next)
+		b->extra_data[0].base = 0;
+	freeblist(bp);
+}
+
+/* Calls the driver for a run of requests.  Merged runs go to bbio, which
+ * moves the requests' buffers in place. */
+static void sd_issue(struct sdcache *sc, struct sd_breq **run, int n)
+{
+	ERRSTACK(1);
+	struct sdunit *unit = sc->unit;
+	struct block *bp = NULL;
+	uint32_t nb = 0, off;
+	int32_t l;
+	int write = run[0]->write;
+
+	for (int i = 0; i < n; i++)
+		nb += run[i]->nb;
+	if (n > 1)
+		bp = sd_run_chain(sc, run, n);
+	if (waserror()) {
+		l = -1;
+	} else if (bp) {
+		l = unit->dev->ifc->bbio(unit, 0, write, bp, nb, run[0]->bno);
+	} else {
+		l = unit->dev->ifc->bio(unit, 0, write, run[0]->buf, nb,
+		                        run[0]->bno);
+	}
+	poperror();
+	if (bp)
+		sd_run_chain_free(bp);
+	off = 0;
+	for (int i = 0; i < n; i++) {
+		if (l < (int64_t)(off + run[i]->nb) * unit->secsize) {
+			run[i]->error = EIO;
+			sc->nr_errors++;
+		}
+		off += run[i]->nb;
+	}
+	for (int i = 0; i < n; i++) {
+		if (run[i]->complete) {
+			run[i]->complete(run[i]);
+		} else {
+			/* The waiter can return as soon as it sees done. */
+			wmb();
+			run[i]->done = TRUE;
+		}
+	}
+	rendez_wakeup(&sc->rv);
+}
+
+/* Dispatches one run, ignoring the plug.  Returns FALSE if the queue was
+ * empty. */
+static bool sd_dispatch_one(struct sdcache *sc)
+{
+	struct sd_breq *run[SD_RUN_MAX];
+	int n;
+
+	spin_lock(&sc->lock);
+	n = __sd_next_run(sc, run);
+	spin_unlock(&sc->lock);
+	if (!n)
+		return FALSE;
+	sd_issue(sc, run, n);
+	return TRUE;
+}
+
+static int sd_breq_is_done(void *arg)
+{
+	struct sd_breq *r = arg;
+
+	return r->done;
+}
+
+/* Waits for a sync request, dispatching in the meantime.  If r isn't on the
+ * queue anymore, someone else is issuing it. */
+static int sd_wait(struct sdcache *sc, struct sd_breq *r)
+{
+	while (!sd_breq_is_done(r)) {
+		if (sd_dispatch_one(sc))
+			continue;
+		rendez_sleep(&sc->rv, sd_breq_is_done, r);
+	}
+	return r->error;
+}
+
+static void sd_plug(struct sdcache *sc)
+{
+	spin_lock(&sc->lock);
+	sc->plugged++;
+	spin_unlock(&sc->lock);
+}
+
+/* Hands anything still queued to the ktask. */
+static void sd_unplug(struct sdcache *sc)
+{
+	bool kick;
+
+	spin_lock(&sc->lock);
+	sc->plugged--;
+	kick = !sc->plugged && sc->nr_queued;
+	spin_unlock(&sc->lock);
+	if (!kick)
+		return;
+	spin_lock(&sd_pending_lock);
+	if (!sc->pending) {
+		sc->pending = TRUE;
+		TAILQ_INSERT_TAIL(&sd_pending, sc, pending_link);
+	}
+	spin_unlock(&sd_pending_lock);
+	rendez_wakeup(&sd_pending_rv);
+}
+
+static void sd_submit(struct sdcache *sc, struct sd_breq *r)
+{
+	spin_lock(&sc->lock);
+	__sd_queue(sc, r);
+	spin_unlock(&sc->lock);
+}
+
+static int sd_has_pending(void *arg)
+{
+	return !TAILQ_EMPTY(&sd_pending);
+}
+
+static void sdcache_ktask(void *arg)
+{
+	struct sdcache *sc;
+
+	while (1) {
+		rendez_sleep(&sd_pending_rv, sd_has_pending, NULL);
+		spin_lock(&sd_pending_lock);
+		sc = TAILQ_FIRST(&sd_pending);
+		/* sdcache_free() could have beaten us to it */
+		if (!sc) {
+			spin_unlock(&sd_pending_lock);
+			continue;
+		}
+		TAILQ_REMOVE(&sd_pending, sc, pending_link);
+		sc->pending = FALSE;
+		sd_ktask_sc = sc;
+		spin_unlock(&sd_pending_lock);
+		/* Whoever plugged will kick us again when they unplug. */
+		while (!ACCESS_ONCE(sc->plugged) && sd_dispatch_one(sc))
+			;
+		spin_lock(&sd_pending_lock);
+		sd_ktask_sc = NULL;
+		spin_unlock(&sd_pending_lock);
+	}
+}
+
+static void __init sdcache_init(void)
+{
+	rendez_init(&sd_pending_rv);
+	ktask("sdcache", sdcache_ktask, NULL);
+}
+init_func_2(sdcache_init);
+
+static int sd_pm_io(struct page_map *pm, struct page *pg, int write)
+{
+	struct sdcache *sc = pm_to_sc(pm);
+	struct sd_breq r;
+
+	sd_breq_init(sc, &r, pg->pg_index, write, page2kva(pg));
+	if (!r.nb)
+		return 0;
+	sd_submit(sc, &r);
+	return sd_wait(sc, &r) ? -EIO : 0;
+}
+
+static int sd_pm_readpage(struct page_map *pm, struct page *pg)
+{
+	int ret = sd_pm_io(pm, pg, 0);
+
+	if (!ret)
+		atomic_or(&pg->pg_flags, PG_UPTODATE);
+	return ret;
+}
+
+static int sd_pm_writepage(struct page_map *pm, struct page *pg)
+{
+	int ret = sd_pm_io(pm, pg, 1);
+
+	if (ret)
+		printk("%s: lost write of page %lu\n",
+		       pm_to_sc(pm)->unit->sdperm.name, pg->pg_index);
+	return ret;
+}
+
+static void sd_ra_complete(struct sd_breq *r)
+{
+	struct page *pg = r->page;
+
+	if (!r->error)
+		atomic_or(&pg->pg_flags, PG_UPTODATE);
+	unlock_page(pg);
+	pm_put_page(pg);
+	kfree(r);
+}
+
+static void sd_pm_readpages(struct page_map *pm, struct page **pages,
+                            unsigned int nr)
+{
+	struct sdcache *sc = pm_to_sc(pm);
+	struct sd_breq *r;
+
+	sd_plug(sc);
+	for (unsigned int i = 0; i < nr; i++) {
+		r = kmalloc(sizeof(struct sd_breq), MEM_WAIT);
+		sd_breq_init(sc, r, pages[i]->pg_index, 0,
+			     page2kva(pages[i]));
+		r->page = pages[i];
+		r->complete = sd_ra_complete;
+		if (!r->nb) {
+			sd_ra_complete(r);
+			continue;
+		}
+		sd_submit(sc, r);
+	}
+	sd_unplug(sc);
+}
+
+static void sd_pm_writepages(struct page_map *pm, struct page **pages,
+                             unsigned int nr)
+{
+	struct sdcache *sc = pm_to_sc(pm);
+	struct sd_breq *reqs;
+
+	reqs = kmalloc(nr * sizeof(struct sd_breq), MEM_WAIT);
+	sd_plug(sc);
+	for (unsigned int i = 0; i < nr; i++) {
+		sd_breq_init(sc, &reqs[i], pages[i]->pg_index, 1,
+			     page2kva(pages[i]));
+		if (!reqs[i].nb)
+			reqs[i].done = TRUE;
+		else
+			sd_submit(sc, &reqs[i]);
+	}
+	sd_unplug(sc);
+	for (unsigned int i = 0; i < nr; i++) {
+		if (sd_wait(sc, &reqs[i]))
+			printk("%s: lost write of page %lu\n",
+			       sc->unit->sdperm.name, pages[i]->pg_index);
+	}
+	kfree(reqs);
+}
+
+/* Units are freed only when their sdev has no refs. */
+static bool sd_pm_pin(struct page_map *pm)
+{
+	return kref_get_not_zero(&pm_to_sc(pm)->unit->dev->r, 1) != NULL;
+}
+
+static void sd_pm_unpin(struct page_map *pm)
+{
+	kref_put(&pm_to_sc(pm)->unit->dev->r);
+}
+
+static struct page_map_operations sd_pm_ops = {
+	.readpage = sd_pm_readpage,
+	.writepage = sd_pm_writepage,
+	.pin = sd_pm_pin,
+	.unpin = sd_pm_unpin,
+	.readpages = sd_pm_readpages,
+	.writepages = sd_pm_writepages,
+};
+
+/* Called when the unit comes online, with its ctl qlocked.  The cache must be
+ * empty, i.e. new or after sdcache_inval(). */
+void sdcache_setup(struct sdunit *unit)
+{
+	struct sdcache *sc = unit->cache;
+
+	if (unit->inquiry[1] & SDinq1removable)
+		return;
+	if (!unit->secsize || unit->secsize > PGSIZE ||
+	    PGSIZE % unit->secsize)
+		return;
+	if (!sc) {
+		sc = kzmalloc(sizeof(struct sdcache), MEM_WAIT);
+		sc->unit = unit;
+		pm_init(&sc->pm, &sd_pm_ops, NULL);
+		sc->pm.pm_flags |= PM_F_RECLAIMABLE;
+		spinlock_init(&sc->lock);
+		TAILQ_INIT(&sc->queue);
+		rendez_init(&sc->rv);
+		sc->enabled = TRUE;
+		unit->cache = sc;
+	}
+	sc->pg_sects = PGSIZE / unit->secsize;
+	sc->nr_pages = DIV_ROUND_UP(unit->sectors, sc->pg_sects);
+	sc->ra_next = 0;
+	sc->ra_size = 0;
+	sc->ra_end = 0;
+}
+
+bool sdcache_enabled(struct sdunit *unit)
+{
+	return unit->cache && unit->cache->enabled && unit->cache->pg_sects;
+}
+
+void sdcache_sync(struct sdunit *unit)
+{
+	if (unit->cache)
+		pm_writeback_pages(&unit->cache->pm);
+}
+
+/* Drops every page, clean or dirty.  Sync first if you want the data. */
+void sdcache_inval(struct sdunit *unit)
+{
+	if (!unit->cache)
+		return;
+	pm_remove_or_zero_pages(&unit->cache->pm, 0, ULONG_MAX);
+	unit->cache->pg_sects = 0;
+}
+
+void sdcache_free(struct sdunit *unit)
+{
+	struct sdcache *sc = unit->cache;
+
+	if (!sc)
+		return;
+	pm_writeback_pages(&sc->pm);
+	/* Finish any queued readahead ourselves, then make sure the ktask is
+	 * done with sc: neither its list nor its loop can still point at it. */
+	while (sd_dispatch_one(sc))
+		;
+	spin_lock(&sd_pending_lock);
+	if (sc->pending) {
+		TAILQ_REMOVE(&sd_pending, sc, pending_link);
+		sc->pending = FALSE;
+	}
+	while (sd_ktask_sc == sc) {
+		spin_unlock(&sd_pending_lock);
+		kthread_usleep(1000);
+		spin_lock(&sd_pending_lock);
+	}
+	spin_unlock(&sd_pending_lock);
+	pm_destroy(&sc->pm);
+	kfree(sc);
+	unit->cache = NULL;
+}
+
+/* "cache on|off" */
+void sdcache_enable(struct sdunit *unit, bool on)
+{
+	struct sdcache *sc = unit->cache;
+
+	if (!sc)
+		error(ENODEV, "%s has no cache", unit->sdperm.name);
+	if (sc->enabled == on)
+		return;
+	if (!on) {
+		sc->enabled = FALSE;
+		/* Uncached IO won't see these pages, so don't keep them. */
+		pm_writeback_pages(&sc->pm);
+		pm_remove_or_zero_pages(&sc->pm, 0, ULONG_MAX);
+	} else {
+		sc->enabled = TRUE;
+	}
+}
+
+/* Grows the readahead window on sequential reads, and starts reading the
+ * window past [first, last] asynchronously. */
+static void sd_readahead(struct sdcache *sc, unsigned long first,
+                         unsigned long last)
+{
+	unsigned long start, end;
+
+	if (first == sc->ra_next || first + 1 == sc->ra_next)
+		sc->ra_size = MIN(sc->ra_size ? sc->ra_size * 2 : SD_RA_MIN,
+				  SD_RA_MAX);
+	else
+		sc->ra_size = 0;
+	sc->ra_next = last + 1;
+	if (!sc->ra_size)
+		return;
+	start = MAX(last + 1, sc->ra_end);
+	end = MIN(last + 1 + sc->ra_size, sc->nr_pages);
+	if (start >= end)
+		return;
+	sc->ra_end = end;
+	sc->nr_ra_pages += end - start;
+	pm_readahead(&sc->pm, start, end - start);
+}
+
+/* Reads or writes len bytes at byte offset off of the unit, through the cache.
+ * Returns the amount done, which is short only on an error after some
+ * progress. */
+size_t sdcache_io(struct sdunit *unit, int write, void *a, size_t len,
+                  uint64_t off)
+{
+	struct sdcache *sc = unit->cache;
+	struct page *page;
+	unsigned long first, last, idx;
+	size_t pg_off, amt, done = 0;
+	int ret;
+
+	if (!len)
+		return 0;
+	first = off >> PGSHIFT;
+	last = (off + len - 1) >> PGSHIFT;
+	/* Read in whatever we're missing as a batch, rather than a page at a
+	 * time, and wait for it by dispatching it ourselves. */
+	pm_readahead(&sc->pm, first, last - first + 1);
+	while (sd_dispatch_one(sc))
+		;
+	if (!write)
+		sd_readahead(sc, first, last);
+	while (done < len) {
+		idx = (off + done) >> PGSHIFT;
+		pg_off = PGOFF(off + done);
+		amt = MIN(len - done, PGSIZE - pg_off);
+		if (!pm_load_page_nowait(&sc->pm, idx, &page)) {
+			sc->nr_hits++;
+		} else {
+			sc->nr_misses++;
+			ret = pm_load_page(&sc->pm, idx, &page);
+			if (ret) {
+				if (done)
+					break;
+				error(-ret, "%s: can't load page %lu",
+				      unit->sdperm.name, idx);
+			}
+		}
+		if (write) {
+			memcpy(page2kva(page) + pg_off, a + done, amt);
+			pm_set_page_dirty(page);
+		} else {
+			memcpy(a + done, page2kva(page) + pg_off, amt);
+		}
+		pm_put_page(page);
+		done += amt;
+	}
+	if (write)
+		pm_balance_dirty();
+	return done;
+}
+
+char *sdcache_ctl(struct sdunit *unit, char *p, char *e)
+{
+	struct sdcache *sc = unit->cache;
+
+	if (!sc)
+		return p;
+	p = seprintf(p, e, "cache %s pages %lu dirty %lu queued %u\n",
+	             sc->enabled ? "on" : "off", sc->pm.pm_num_pages,
+	             sc->pm.pm_nr_dirty, sc->nr_queued);
+	p = seprintf(p, e, "cachestats hits %llu misses %llu readahead %llu\n",
+	             sc->nr_hits, sc->nr_misses, sc->nr_ra_pages);
+	p = seprintf(p, e, "iostats reqs %llu runs %llu merged %llu errors %llu\n",
+	             sc->nr_reqs, sc->nr_runs, sc->nr_merged, sc->nr_errors);
+	return p;
+}
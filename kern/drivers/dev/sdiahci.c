@@ -64,6 +64,11 @@ enum { NCtlr = 16,
 	* either the hardware is broken or we've got a bug in this driver.
 	*/
        Maxintrspertick = 2000, /* was 1000 */
+
+       Maxsect = 128, /* sectors per queued request from iario */
+       Maxtries = 10,
+       Nqhist = 6,    /* log2 buckets, queue depth 1 to ANSLOTS */
+       Nlathist = 24, /* log2 buckets, latency in usec */
 };
 
 /* pci space configuration */
@@ -122,9 +127,35 @@ static char *descmode[] = {
 };
 
 static char *flagname[] = {
-    "llba", "smart", "power", "nop", "atapi", "atapi16",
+    "llba", "smart", "power", "nop", "atapi", "atapi16", "ncq",
 };
 
+struct drive;
+
+/* A queued read or write of count sectors at lba.  The memory is either the
+ * kernel buffer data or the block chain bp (from iabbio()).  done() is called
+ * with the drive locked, usually from the interrupt handler, so it must not
+ * block. */
+struct ahcireq {
+	TAILQ_ENTRY(ahcireq) link;
+	struct drive *d;
+	int write;
+	uint64_t lba;
+	int count;
+	void *data;
+	struct block *bp;
+
+	void (*done)(struct ahcireq *);
+	void *arg;
+	bool finished; /* for ahcisyncio() */
+
+	int status;
+	int slot; /* -1 if not issued */
+	int tries;
+	uint64_t issued; /* nsec() */
+};
+TAILQ_HEAD(ahcireq_tailq, ahcireq);
+
 struct drive {
 	spinlock_t Lock;
 
@@ -161,6 +192,21 @@ struct drive {
 
 	uint32_t lastintr0;
 	uint32_t intrs;
+
+	/* queued I/O, protected by Lock */
+	struct ahcireq_tailq q;
+	struct ahcireq *qslot[ANSLOTS];
+	uint32_t qbusy; /* slots in flight */
+	int nslots;     /* ANSLOTS with NCQ, 1 without */
+	int qdepth;
+	int nqueued;
+	int qstall;        /* don't issue: slot 0 in use or port recovering */
+	bool qrecover;     /* satakproc needs to recover the port */
+	struct rendez qrendez;
+	uint64_t nqio;
+	uint64_t nqerr;
+	uint64_t qdepthhist[Nqhist];
+	uint64_t qlathist[Nlathist];
 };
 
 struct ctlr {
@@ -683,6 +729,10 @@ static int64_t ahciidentify(struct aportc *pc, uint16_t *id)
 		if (i & (1 << 14))
 			pm->feat |= Dnop;
 	}
+
+	i = gbit16(id + 76);
+	if ((pm->feat & Datapi) == 0 && i != 0xffff && i & (1 << 8))
+		pm->feat |= Dncq;
 	return s;
 }
 
@@ -864,8 +914,8 @@ static int ahciconfigdrive(struct drive *d)
 	pm = d->portc.pm;
 	if (pm->list == 0) {
 		setupfis(&pm->fis);
-		pm->list = malign(ALIST_SIZE, 1024);
-		pm->ctab = malign(ACTAB_PRDT + APRDT_SIZE, 128);
+		pm->list = malign(ALIST_SIZE * ANSLOTS, 1024);
+		pm->ctab = malign(ACTAB_SIZE * ANSLOTS, 128);
 	}
 
 	if (d->unit)
@@ -992,6 +1042,7 @@ static int identify(struct drive *d)
 	int64_t osectors, s;
 	unsigned char oserial[21];
 	struct sdunit *u;
+	uint32_t hcap;
 
 	if (d->info == NULL) {
 		d->infosz = 512 * sizeof(uint16_t);
@@ -1012,6 +1063,16 @@ static int identify(struct drive *d)
 	osectors = d->sectors;
 	memmove(oserial, d->serial, sizeof d->serial);
 
+	/* the queue is stopped while we're not Dready, so this can't change
+	 * under any in-flight commands. */
+	d->nslots = 1;
+	hcap = ahci_hba_read32(d->ctlr->hba, HBA_CAP);
+	if ((hcap & Hsncq) == 0)
+		d->portm.feat &= ~Dncq;
+	if (d->portm.feat & Dncq)
+		d->nslots = MIN(((hcap >> 8) & 0x1f) + 1,
+		                (gbit16(id + 75) & 0x1f) + 1);
+
 	u = d->unit;
 	d->sectors = s;
 	d->secsize = u->secsize;
@@ -1047,6 +1108,395 @@ static void clearci(void *p)
 	}
 }
 
+/*
+ * Queued I/O.
+ *
+ * Reads and writes are ahcireqs, queued per drive and issued under d->Lock
+ * into free command slots: READ/WRITE FPDMA QUEUED in up to ANSLOTS slots if
+ * the HBA and drive do NCQ, otherwise plain DMA commands one at a time in slot
+ * 0.  The interrupt handler reaps completions and issues more.
+ *
+ * Everything else (identify, smart, flush, etc.) still uses slot 0 under the
+ * port qlock.  lockready() stalls the queue and waits for it to drain first.
+ * Errors and resets put the in-flight requests back on the queue, to be
+ * reissued once the port is back.
+ */
+
+/* Adds PRDT entries for the kernel memory [va, va + len) to ctab, after its
+ * first nprd entries, merging physically contiguous pages.  Returns the new
+ * number of entries, or -1 if it doesn't fit or isn't word aligned. */
+static int ahciprdtadd(void *ctab, int nprd, void *va, size_t len)
+{
+	void *prdt;
+	uintptr_t pa;
+	uint64_t last;
+	uint32_t dbc;
+	size_t amt;
+
+	while (len) {
+		amt = MIN(len, PGSIZE - PGOFF(va));
+		pa = PADDR(va);
+		if ((pa | amt) & 1)
+			return -1;
+		if (nprd) {
+			prdt = ctab + ACTAB_PRDT + (nprd - 1) * APRDT_SIZE;
+			last = (uint64_t)ahci_prdt_read32(prdt, APRDT_DBAHI)
+			       << 32 | ahci_prdt_read32(prdt, APRDT_DBA);
+			dbc = ahci_prdt_read32(prdt, APRDT_COUNT) & 0x3fffff;
+			dbc++;
+			if (last + dbc == pa && dbc + amt <= APRDT_MAXDBC) {
+				ahci_prdt_write32(prdt, APRDT_COUNT,
+				                  dbc + amt - 1);
+				goto next;
+			}
+		}
+		if (nprd == ANPRDT)
+			return -1;
+		prdt = ctab + ACTAB_PRDT + nprd++ * APRDT_SIZE;
+		ahci_prdt_write32(prdt, APRDT_DBA, paddr_low32(va));
+		ahci_prdt_write32(prdt, APRDT_DBAHI, paddr_high32(va));
+		ahci_prdt_write32(prdt, APRDT_RES, 0);
+		ahci_prdt_write32(prdt, APRDT_COUNT, amt - 1);
+	next:
+		va += amt;
+		len -= amt;
+	}
+	return nprd;
+}
+
+/* Builds ctab's PRDT from a block chain, including the blocks' extra data. */
+static int ahciprdtblock(void *ctab, struct block *bp)
+{
+	int i, nprd;
+	struct extra_bdata *ebd;
+
+	nprd = 0;
+	for (; bp != NULL; bp = bp->next) {
+		if (BHLEN(bp)) {
+			nprd = ahciprdtadd(ctab, nprd, bp->rp, BHLEN(bp));
+			if (nprd == -1)
+				return -1;
+		}
+		for (i = 0; i < bp->nr_extra_bufs; i++) {
+			ebd = &bp->extra_data[i];
+			if (ebd->base == 0 || ebd->len == 0)
+				continue;
+			nprd = ahciprdtadd(ctab, nprd,
+			                   (void *)(ebd->base + ebd->off),
+			                   ebd->len);
+			if (nprd == -1)
+				return -1;
+		}
+	}
+	return nprd;
+}
+
+/* Fills in slot's command header, FIS and PRDT for req.  Returns -1 if the
+ * PRDT can't describe req's memory. */
+static int ahcibuildq(struct drive *d, struct ahcireq *req, int slot)
+{
+	void *cfis, *list, *ctab;
+	unsigned char llba, c7;
+	int n, nprd, ncq;
+	uint64_t lba;
+	uint32_t flags;
+	static unsigned char tab[2][2] = {
+	    {0xc8, 0x25},
+	    {0xca, 0x35},
+	};
+
+	list = d->portm.list + slot * ALIST_SIZE;
+	ctab = d->portm.ctab + slot * ACTAB_SIZE;
+	cfis = ctab;
+	ncq = d->portm.feat & Dncq;
+	lba = req->lba;
+	n = req->count;
+
+	if (req->bp != NULL)
+		nprd = ahciprdtblock(ctab, req->bp);
+	else
+		nprd = ahciprdtadd(ctab, 0, req->data, n * d->unit->secsize);
+	if (nprd <= 0)
+		return -1;
+
+	memset(cfis, 0, 0x20);
+	ahci_cfis_write8(cfis, 0, 0x27);
+	ahci_cfis_write8(cfis, 1, 0x80);
+	ahci_cfis_write8(cfis, 4, lba);       /* lba 7:0 */
+	ahci_cfis_write8(cfis, 5, lba >> 8);  /* lba 15:8 */
+	ahci_cfis_write8(cfis, 6, lba >> 16); /* lba 23:16 */
+	ahci_cfis_write8(cfis, 8, lba >> 24); /* lba 31:24 */
+	ahci_cfis_write8(cfis, 9, lba >> 32); /* lba 39:32 */
+	ahci_cfis_write8(cfis, 10, lba >> 40); /* lba 47:40 */
+	if (ncq) {
+		/* the count goes in the features regs, the tag in count 7:3 */
+		ahci_cfis_write8(cfis, 2, req->write ? 0x61 : 0x60);
+		ahci_cfis_write8(cfis, 3, n);
+		ahci_cfis_write8(cfis, 7, 0x40);
+		ahci_cfis_write8(cfis, 11, n >> 8);
+		ahci_cfis_write8(cfis, 12, slot << 3);
+	} else {
+		llba = d->portm.feat & Dllba ? 1 : 0;
+		ahci_cfis_write8(cfis, 2, tab[req->write != 0][llba]);
+		c7 = Obs | 0x40; /* 0x40 == lba */
+		if (llba == 0)
+			c7 |= (lba >> 24) & 7;
+		ahci_cfis_write8(cfis, 7, c7);
+		ahci_cfis_write8(cfis, 12, n);      /* sector count */
+		ahci_cfis_write8(cfis, 13, n >> 8); /* sector count (exp) */
+	}
+
+	/* queued commands must not set prefetch */
+	flags = nprd * Lprdtl | 0x5;
+	if (!ncq)
+		flags |= Lpref;
+	if (req->write)
+		flags |= Lwrite;
+	ahci_list_write32(list, ALIST_FLAGS, flags);
+	ahci_list_write32(list, ALIST_LEN, 0);
+	ahci_list_write32(list, ALIST_CTAB, paddr_low32(ctab));
+	ahci_list_write32(list, ALIST_CTABHI, paddr_high32(ctab));
+	return 0;
+}
+
+/* drive must be locked */
+static void ahcireqdone(struct drive *d, struct ahcireq *req, int status)
+{
+	if (status != SDok)
+		d->nqerr++;
+	req->status = status;
+	req->done(req);
+}
+
+/* Issues queued requests into free slots.  drive must be locked. */
+static void ahcikick(struct drive *d)
+{
+	struct ahcireq *req;
+	uint32_t bit;
+	int slot;
+
+	while ((req = TAILQ_FIRST(&d->q)) != NULL) {
+		if (d->state != Dready || d->qstall || d->qdepth >= d->nslots)
+			return;
+		TAILQ_REMOVE(&d->q, req, link);
+		d->nqueued--;
+		slot = __builtin_ctz(~d->qbusy);
+		if (ahcibuildq(d, req, slot) == -1) {
+			printd("%s: can't map request @%lld\n",
+			       d->unit->sdperm.name, req->lba);
+			ahcireqdone(d, req, SDeio);
+			continue;
+		}
+		bit = 1 << slot;
+		req->slot = slot;
+		req->issued = nsec();
+		d->qslot[slot] = req;
+		d->qbusy |= bit;
+		if (d->qdepth++ == 0)
+			d->intick = ms();
+		d->active = d->qdepth;
+		d->qdepthhist[LOG2_DOWN(d->qdepth)]++;
+		if (d->portm.feat & Dncq)
+			ahci_port_write32(d->port, PORT_SACT, bit);
+		ahci_port_write32(d->port, PORT_CI, bit);
+	}
+}
+
+/* Completes the in-flight requests the HBA is done with.  Called from the
+ * interrupt handler, with the drive locked. */
+static void ahcireap(struct drive *d)
+{
+	struct ahcireq *req;
+	uint32_t busy, done;
+	uint64_t usec;
+	int slot;
+
+	busy = ahci_port_read32(d->port, PORT_CI);
+	if (d->portm.feat & Dncq)
+		busy |= ahci_port_read32(d->port, PORT_SACT);
+	done = d->qbusy & ~busy;
+	if (done == 0)
+		return;
+	while (done) {
+		slot = __builtin_ctz(done);
+		done &= ~(1 << slot);
+		req = d->qslot[slot];
+		d->qslot[slot] = NULL;
+		d->qbusy &= ~(1 << slot);
+		d->qdepth--;
+		usec = (nsec() - req->issued) / 1000;
+		d->qlathist[MIN(LOG2_DOWN(usec), Nlathist - 1)]++;
+		d->nqio++;
+		ahcireqdone(d, req, SDok);
+	}
+	/* intick is the last sign of life, for westerndigitalhung */
+	d->intick = ms();
+	d->active = d->qdepth;
+	if (d->qbusy == 0)
+		rendez_wakeup(&d->qrendez);
+}
+
+/* Puts the in-flight requests back on the head of the queue, once an error or
+ * reset stopped the port (clearci).  Requests that run out of tries fail.
+ * drive must be locked. */
+static void ahcirequeue(struct drive *d)
+{
+	struct ahcireq *req;
+	int slot;
+
+	for (slot = ANSLOTS - 1; slot >= 0; slot--) {
+		req = d->qslot[slot];
+		if (req == NULL)
+			continue;
+		d->qslot[slot] = NULL;
+		req->slot = -1;
+		if (++req->tries >= Maxtries) {
+			ahcireqdone(d, req, SDeio);
+			continue;
+		}
+		TAILQ_INSERT_HEAD(&d->q, req, link);
+		d->nqueued++;
+	}
+	d->qbusy = 0;
+	d->qdepth = 0;
+	d->active = 0;
+	rendez_wakeup(&d->qrendez);
+}
+
+/* drive must be locked */
+static void ahcienqueue(struct drive *d, struct ahcireq *req)
+{
+	req->d = d;
+	req->status = SDnostatus;
+	req->slot = -1;
+	req->tries = 0;
+	TAILQ_INSERT_TAIL(&d->q, req, link);
+	d->nqueued++;
+}
+
+/* Queues req for I/O.  req->done() will be called once it completes or fails,
+ * with req->status set. */
+static void ahcisubmit(struct drive *d, struct ahcireq *req)
+{
+	spin_lock_irqsave(&d->Lock);
+	ahcienqueue(d, req);
+	ahcikick(d);
+	spin_unlock_irqsave(&d->Lock);
+}
+
+/* Gives up on req.  If the drive has it, the drive is hung: we stop the port
+ * and have checkdrive reset it, which requeues everything else.  Returns FALSE
+ * if req finished after all. */
+static bool ahcicancel(struct drive *d, struct ahcireq *req)
+{
+	bool ret;
+
+	spin_lock_irqsave(&d->Lock);
+	if (req->slot != -1) {
+		printd("%s: drive hung; resetting [%#lx] ci %#lx\n",
+		       d->unit->sdperm.name,
+		       ahci_port_read32(d->port, PORT_TFD),
+		       ahci_port_read32(d->port, PORT_CI));
+		d->state = Dreset;
+		clearci(d->port);
+		ahcirequeue(d);
+	}
+	ret = !req->finished;
+	if (ret) {
+		TAILQ_REMOVE(&d->q, req, link);
+		d->nqueued--;
+	}
+	spin_unlock_irqsave(&d->Lock);
+	return ret;
+}
+
+static void ahcisyncdone(struct ahcireq *req)
+{
+	struct drive *d = req->d;
+
+	/* the waiter can return as soon as it sees finished */
+	wmb();
+	req->finished = TRUE;
+	rendez_wakeup(&d->qrendez);
+}
+
+static int ahcireqfinished(void *v)
+{
+	struct ahcireq *req = v;
+
+	return req->finished;
+}
+
+/* Runs reqs concurrently and waits for all of them.  Returns SDok, the status
+ * of the first that failed, or SDtimeout if one didn't complete within three
+ * seconds, in which case the rest are cancelled too. */
+static int ahcisyncio(struct drive *d, struct ahcireq *reqs, int nreq)
+{
+	ERRSTACK(1);
+	struct ahcireq *req;
+	int i, status;
+
+	spin_lock_irqsave(&d->Lock);
+	for (i = 0; i < nreq; i++) {
+		reqs[i].done = ahcisyncdone;
+		reqs[i].finished = FALSE;
+		ahcienqueue(d, &reqs[i]);
+	}
+	ahcikick(d);
+	spin_unlock_irqsave(&d->Lock);
+
+	status = SDok;
+	for (i = 0; i < nreq; i++) {
+		req = &reqs[i];
+		if (status != SDtimeout) {
+			/* don't sleep here forever */
+			while (waserror())
+				poperror();
+			rendez_sleep_timeout(&d->qrendez, ahcireqfinished, req,
+			                     (3 * 1000) * 1000);
+			poperror();
+		}
+		if (!ahcireqfinished(req) && ahcicancel(d, req)) {
+			status = SDtimeout;
+			continue;
+		}
+		if (req->status != SDok && status == SDok)
+			status = req->status;
+	}
+	return status;
+}
+
+static int ahciidleq(void *v)
+{
+	struct drive *d = v;
+
+	return d->qbusy == 0;
+}
+
+/* Stops issuing queued I/O and waits for the in-flight commands, so the caller
+ * can use slot 0.  If the drive hangs, checkdrive will reset it, which
+ * requeues everything.  Call with the port qlocked. */
+static void ahcistall(struct drive *d)
+{
+	ERRSTACK(1);
+
+	spin_lock_irqsave(&d->Lock);
+	d->qstall++;
+	spin_unlock_irqsave(&d->Lock);
+	while (waserror())
+		poperror();
+	rendez_sleep(&d->qrendez, ahciidleq, d);
+	poperror();
+}
+
+static void ahciunstall(struct drive *d)
+{
+	spin_lock_irqsave(&d->Lock);
+	d->qstall--;
+	ahcikick(d);
+	spin_unlock_irqsave(&d->Lock);
+}
+
 static void updatedrive(struct drive *d)
 {
 	uint32_t cause, serr, task, sstatus, ie, s0, pr, ewake;
@@ -1064,6 +1514,8 @@ static void updatedrive(struct drive *d)
 	if (d->unit && d->unit->sdperm.name)
 		name = d->unit->sdperm.name;
 
+	if (d->qbusy)
+		ahcireap(d);
 	if (ahci_port_read32(port, PORT_CI) == 0) {
 		d->portm.flag |= Fdone;
 		rendez_wakeup(&d->portm.Rendez);
@@ -1127,7 +1579,17 @@ static void updatedrive(struct drive *d)
 	ahci_port_write32(port, PORT_SERR, serr);
 	if (ewake) {
 		clearci(port);
+		/* queued commands wait for satakproc to recover the port */
+		if (d->qbusy) {
+			ahcirequeue(d);
+			if (!d->qrecover) {
+				d->qrecover = TRUE;
+				d->qstall++;
+			}
+		}
 		rendez_wakeup(&d->portm.Rendez);
+	} else {
+		ahcikick(d);
 	}
 	last = cause;
 }
@@ -1196,6 +1658,7 @@ static void resetdisk(struct drive *d)
 	if (d->state != Dready || d->state != Dnew)
 		d->portm.flag |= Ferror;
 	clearci(port); /* satisfy sleep condition. */
+	ahcirequeue(d);
 	rendez_wakeup(&d->portm.Rendez);
 	if (stat != (Devpresent | Devphycomm)) {
 		/* device absent or phy not communicating */
@@ -1248,7 +1711,10 @@ static int newdrive(struct drive *d)
 		if (ahcirecover(pc) == -1)
 			goto lose;
 	}
-	setstate(d, Dready);
+	spin_lock_irqsave(&d->Lock);
+	d->state = Dready;
+	ahcikick(d);
+	spin_unlock_irqsave(&d->Lock);
 	qunlock(&pc->pm->ql);
 
 	iprintd("%s: %sLBA %llu sectors: %s %s %s %s\n", d->unit->sdperm.name,
@@ -1280,6 +1746,23 @@ static void westerndigitalhung(struct drive *d)
 
 static uint16_t olds[NCtlr * NCtlrdrv];
 
+/* after a queued command failed, the port needs recovery before we issue
+ * more. */
+static void recoverqueue(struct drive *d)
+{
+	qlock(&d->portm.ql);
+	if (ahcirecover(&d->portc) == -1) {
+		printd("ahci: recoverqueue: fails\n");
+		setstate(d, Dreset);
+	}
+	spin_lock_irqsave(&d->Lock);
+	d->qrecover = FALSE;
+	d->qstall--;
+	ahcikick(d);
+	spin_unlock_irqsave(&d->Lock);
+	qunlock(&d->portm.ql);
+}
+
 static int doportreset(struct drive *d)
 {
 	int i;
@@ -1294,12 +1777,25 @@ static int doportreset(struct drive *d)
 	return i;
 }
 
+/* drive must be locked */
+static void failqueue(struct drive *d)
+{
+	struct ahcireq *req;
+
+	while ((req = TAILQ_FIRST(&d->q)) != NULL) {
+		TAILQ_REMOVE(&d->q, req, link);
+		d->nqueued--;
+		ahcireqdone(d, req, SDeio);
+	}
+}
+
 /* drive must be locked */
 static void statechange(struct drive *d)
 {
 	switch (d->state) {
 	case Dnull:
 	case Doffline:
+		failqueue(d);
 		if (d->unit->sectors != 0) {
 			d->sectors = 0;
 			d->mediachange = 1;
@@ -1341,6 +1837,12 @@ static void checkdrive(struct drive *d, int i)
 	}
 	westerndigitalhung(d);
 
+	if (d->qrecover && d->state == Dready) {
+		spin_unlock_irqsave(&d->Lock);
+		recoverqueue(d);
+		spin_lock_irqsave(&d->Lock);
+	}
+
 	switch (d->state) {
 	case Dnull:
 	case Dready:
@@ -1412,6 +1914,7 @@ static void checkdrive(struct drive *d, int i)
 		       diskstates[d->state], d->mode, s);
 		d->portm.flag |= Ferror;
 		clearci(d->port);
+		ahcirequeue(d);
 		rendez_wakeup(&d->portm.Rendez);
 		if ((s & Devdet) == 0) { /* no device */
 			d->state = Dmissing;
@@ -1659,80 +2162,6 @@ static int iaonline(struct sdunit *unit)
 	return r;
 }
 
-/* returns locked list! */
-static void *ahcibuild(struct drive *d, unsigned char *cmd, void *data, int n,
-                       int64_t lba)
-{
-	void *cfis, *list, *prdt, *ctab;
-	unsigned char acmd, dir, llba, c7;
-	struct aportm *pm;
-	uint32_t flags;
-	static unsigned char tab[2][2] = {
-	    {0xc8, 0x25},
-	    {0xca, 0x35},
-	};
-
-	pm = &d->portm;
-	dir = *cmd != 0x28;
-	llba = pm->feat & Dllba ? 1 : 0;
-	acmd = tab[dir][llba];
-	qlock(&pm->ql);
-	list = pm->list;
-	ctab = pm->ctab;
-	cfis = ctab;
-
-	ahci_cfis_write8(cfis, 0, 0x27);
-	ahci_cfis_write8(cfis, 1, 0x80);
-	ahci_cfis_write8(cfis, 2, acmd);
-	ahci_cfis_write8(cfis, 3, 0);
-
-	ahci_cfis_write8(cfis, 4, lba);       /* sector			lba low
-	                                         7:0 */
-	ahci_cfis_write8(cfis, 5, lba >> 8);  /* cylinder low	lba mid	15:8 */
-	ahci_cfis_write8(cfis, 6, lba >> 16); /* cylinder hi	lba hi	23:16 */
-	c7 = Obs | 0x40;                      /* 0x40 == lba */
-	if (llba == 0)
-		c7 |= (lba >> 24) & 7;
-	ahci_cfis_write8(cfis, 7, c7);
-
-	ahci_cfis_write8(
-	    cfis, 8,
-	    lba >> 24); /* sector (exp)			lba	31:24 */
-	ahci_cfis_write8(cfis, 9,
-	                 lba >> 32); /* cylinder low (exp)	lba	39:32 */
-	ahci_cfis_write8(
-	    cfis, 10, lba >> 48);      /* cylinder hi (exp)		lba	48:40 */
-	ahci_cfis_write8(cfis, 11, 0); /* features (exp); */
-
-	ahci_cfis_write8(cfis, 12, n);      /* sector count */
-	ahci_cfis_write8(cfis, 13, n >> 8); /* sector count (exp) */
-	ahci_cfis_write8(cfis, 14, 0);      /* r */
-	ahci_cfis_write8(cfis, 15, 0);      /* control */
-
-	ahci_cfis_write8(cfis, 16, 0);
-	ahci_cfis_write8(cfis, 17, 0);
-	ahci_cfis_write8(cfis, 18, 0);
-	ahci_cfis_write8(cfis, 19, 0);
-
-	flags = 1 << 16 | Lpref | 0x5; /* Lpref ?? */
-	if (dir == Write)
-		flags |= Lwrite;
-	ahci_list_write32(list, ALIST_FLAGS, flags);
-	ahci_list_write32(list, ALIST_LEN, 0);
-	ahci_list_write32(list, ALIST_CTAB, paddr_low32(ctab));
-	ahci_list_write32(list, ALIST_CTABHI, paddr_high32(ctab));
-
-	prdt = ctab + ACTAB_PRDT;
-	ahci_prdt_write32(prdt, APRDT_DBA, paddr_low32(data));
-	ahci_prdt_write32(prdt, APRDT_DBAHI, paddr_high32(data));
-	if (d->unit == NULL)
-		panic("ahcibuild: NULL d->unit");
-	ahci_prdt_write32(prdt, APRDT_COUNT,
-	                  1 << 31 | (d->unit->secsize * n - 2) | 1);
-
-	return list;
-}
-
 static void *ahcibuildpkt(struct aportm *pm, struct sdreq *r, void *data, int n)
 {
 	int fill, len, i;
@@ -1821,6 +2250,7 @@ static int lockready(struct drive *d)
 	int i;
 
 	qlock(&d->portm.ql);
+	ahcistall(d);
 	while ((i = waitready(d)) == 1) { /* could wait forever? */
 		qunlock(&d->portm.ql);
 		esleep(1);
@@ -1829,6 +2259,12 @@ static int lockready(struct drive *d)
 	return i;
 }
 
+static void unlockready(struct drive *d)
+{
+	ahciunstall(d);
+	qunlock(&d->portm.ql);
+}
+
 static int flushcache(struct drive *d)
 {
 	int i;
@@ -1836,7 +2272,7 @@ static int flushcache(struct drive *d)
 	i = -1;
 	if (lockready(d) == 0)
 		i = ahciflushcache(&d->portc);
-	qunlock(&d->portm.ql);
+	unlockready(d);
 	return i;
 }
 
@@ -1963,14 +2399,11 @@ retry:
 
 static int iario(struct sdreq *r)
 {
-	ERRSTACK(1);
-	int i, n, count, try
-		, max, flag, task;
+	int i, n, count, nreq;
 	uint64_t lba;
 	char *name;
 	unsigned char *cmd, *data;
-	void *port;
-	struct Asleep as;
+	struct ahcireq *reqs;
 	struct ctlr *c;
 	struct drive *d;
 	struct sdunit *unit;
@@ -1982,7 +2415,6 @@ static int iario(struct sdreq *r)
 		return iariopkt(r, d);
 	cmd = r->cmd;
 	name = d->unit->sdperm.name;
-	port = d->port;
 
 	if (r->cmd[0] == 0x35 || r->cmd[0] == 0x91) {
 		if (flushcache(d) == 0)
@@ -2009,87 +2441,186 @@ static int iario(struct sdreq *r)
 		return SDok;
 	if (r->dlen < count * unit->secsize)
 		count = r->dlen / unit->secsize;
-	max = 128;
+	if (count == 0) {
+		r->rlen = 0;
+		r->status = SDok;
+		return SDok;
+	}
 
-	try
-		= 0;
-retry:
+	/* split into Maxsect requests and let the drive have them all at
+	 * once */
+	nreq = DIV_ROUND_UP(count, Maxsect);
+	reqs = kzmalloc(nreq * sizeof(struct ahcireq), MEM_WAIT);
 	data = r->data;
-	while (count > 0) {
-		n = count;
-		if (n > max)
-			n = max;
-		ahcibuild(d, cmd, data, n, lba);
-		switch (waitready(d)) {
-		case -1:
-			qunlock(&d->portm.ql);
-			return SDeio;
-		case 1:
-			qunlock(&d->portm.ql);
-			esleep(1);
-			goto retry;
-		}
-		/* d->portm qlock held here */
-		spin_lock_irqsave(&d->Lock);
-		d->portm.flag = 0;
-		spin_unlock_irqsave(&d->Lock);
-		ahci_port_write32(port, PORT_CI, 1);
+	for (i = 0; i < nreq; i++) {
+		n = MIN(count, Maxsect);
+		reqs[i].write = *cmd == 0x2a;
+		reqs[i].lba = lba + i * Maxsect;
+		reqs[i].count = n;
+		reqs[i].data = data;
+		count -= n;
+		data += n * unit->secsize;
+	}
+
+	while ((i = waitready(d)) == 1)
+		esleep(1);
+	if (i == -1) {
+		kfree(reqs);
+		return SDeio;
+	}
+	i = ahcisyncio(d, reqs, nreq);
+	kfree(reqs);
+	switch (i) {
+	case SDok:
+		break;
+	case SDtimeout:
+		printd("%s: i/o not done after 3 seconds\n", name);
+		r->status = SDcheck;
+		return SDcheck;
+	default:
+		printk("%s: i/o error @%lld\n", name, lba);
+		r->status = SDeio;
+		return SDeio;
+	}
+	r->rlen = data - (unsigned char *)r->data;
+	r->status = SDok;
+	return SDok;
+}
 
-		as.p = port;
-		as.i = 1;
-		d->intick = ms();
-		d->active++;
+/* Worst case PRDT entries for b's memory: a page per entry. */
+static int ahciblockprds(struct block *b)
+{
+	struct extra_bdata *ebd;
+	int nprd;
 
-		while (waserror())
-			poperror();
-		/* don't sleep here forever */
-		rendez_sleep_timeout(&d->portm.Rendez, ahciclear, &as,
-		                     (3 * 1000) * 1000);
-		poperror();
-		if (!ahciclear(&as)) {
-			qunlock(&d->portm.ql);
-			printd("%s: ahciclear not true after 3 seconds\n",
-			       name);
-			r->status = SDcheck;
-			return SDcheck;
-		}
+	nprd = DIV_ROUND_UP(PGOFF(b->rp) + BHLEN(b), PGSIZE);
+	for (int i = 0; i < b->nr_extra_bufs; i++) {
+		ebd = &b->extra_data[i];
+		if (ebd->base == 0 || ebd->len == 0)
+			continue;
+		nprd += DIV_ROUND_UP(PGOFF(ebd->base + ebd->off) + ebd->len,
+		                     PGSIZE);
+	}
+	return nprd;
+}
 
-		d->active--;
-		spin_lock_irqsave(&d->Lock);
-		flag = d->portm.flag;
-		task = ahci_port_read32(port, PORT_TFD);
-		spin_unlock_irqsave(&d->Lock);
+/* ATAPI units don't queue: move bp's buffers one at a time. */
+static int32_t iabbiopkt(struct sdunit *unit, int lun, int write,
+                         struct block *bp, uint64_t bno)
+{
+	struct extra_bdata *ebd;
+	int32_t l, tot = 0;
+	uint32_t nb;
 
-		if ((task & (Efatal << 8)) ||
-		    ((task & (ASbsy | ASdrq)) && d->state == Dready)) {
-			ahci_port_write32(port, PORT_CI, 0);
-			ahcirecover(&d->portc);
-			task = ahci_port_read32(port, PORT_TFD);
+	for (; bp != NULL; bp = bp->next) {
+		if (BHLEN(bp)) {
+			nb = BHLEN(bp) / unit->secsize;
+			l = scsibio(unit, lun, write, bp->rp, nb, bno);
+			if (l != nb * unit->secsize)
+				return -1;
+			tot += l;
+			bno += nb;
 		}
-		qunlock(&d->portm.ql);
-		if (flag == 0) {
-			if (++try == 10) {
-				printd("%s: bad disk\n", name);
-				r->status = SDeio;
-				return SDeio;
-			}
-			printd("%s: retry blk %lld\n", name, lba);
-			goto retry;
+		for (int i = 0; i < bp->nr_extra_bufs; i++) {
+			ebd = &bp->extra_data[i];
+			if (ebd->base == 0 || ebd->len == 0)
+				continue;
+			nb = ebd->len / unit->secsize;
+			l = scsibio(unit, lun, write,
+			            (void *)(ebd->base + ebd->off), nb, bno);
+			if (l != nb * unit->secsize)
+				return -1;
+			tot += l;
+			bno += nb;
 		}
-		if (flag & Ferror) {
-			printk("%s: i/o error task=%#x @%lld\n", name, task,
-			       lba);
-			r->status = SDeio;
-			return SDeio;
+	}
+	return tot;
+}
+
+/* bio on the memory of a block chain, header and extra data, so callers can
+ * gather scattered buffers into one transfer.  Every buffer must be a whole
+ * number of sectors.  The chain is split into queued requests at block
+ * boundaries and put back together before we return.  Returns the bytes moved,
+ * or -1. */
+static int32_t iabbio(struct sdunit *unit, int lun, int write,
+                      struct block *bp, int32_t nb, uint64_t bno)
+{
+	struct ctlr *c;
+	struct drive *d;
+	struct ahcireq *reqs, *req;
+	struct block *b, *last;
+	int i, nprd, bnprd, nreq, status;
+	uint32_t bnb, secsize;
+	uint64_t lba;
+
+	c = unit->dev->ctlr;
+	d = c->drive[unit->subno];
+	secsize = unit->secsize;
+	if (nb == 0)
+		return 0;
+	if (d->portm.feat & Datapi)
+		return iabbiopkt(unit, lun, write, bp, bno);
+
+	nreq = 0;
+	for (b = bp; b != NULL; b = b->next)
+		nreq++;
+	reqs = kzmalloc(nreq * sizeof(struct ahcireq), MEM_WAIT);
+	nreq = 0;
+	req = NULL;
+	nprd = 0;
+	last = NULL;
+	lba = bno;
+	status = SDok;
+	for (b = bp; b != NULL; last = b, b = b->next) {
+		bnb = BLEN(b) / secsize;
+		bnprd = ahciblockprds(b);
+		if (BLEN(b) % secsize || bnb > Maxsect || bnprd > ANPRDT) {
+			status = SDeio;
+			break;
+		}
+		if (req == NULL || req->count + bnb > Maxsect ||
+		    nprd + bnprd > ANPRDT) {
+			if (last != NULL)
+				last->next = NULL;
+			req = &reqs[nreq++];
+			req->write = write;
+			req->lba = lba;
+			req->bp = b;
+			nprd = 0;
 		}
+		req->count += bnb;
+		nprd += bnprd;
+		lba += bnb;
+	}
+	if (status == SDok && lba - bno != nb)
+		status = SDeio;
+	if (status == SDok) {
+		while ((i = waitready(d)) == 1)
+			esleep(1);
+		if (i == -1)
+			status = SDeio;
+		else
+			status = ahcisyncio(d, reqs, nreq);
+	}
 
-		count -= n;
-		lba += n;
-		data += n * unit->secsize;
+	/* put the chain back together */
+	for (i = 0; i + 1 < nreq; i++) {
+		for (b = reqs[i].bp; b->next != NULL; b = b->next)
+			;
+		b->next = reqs[i + 1].bp;
+	}
+	kfree(reqs);
+	switch (status) {
+	case SDok:
+		return nb * secsize;
+	case SDtimeout:
+		printd("%s: i/o not done after 3 seconds\n",
+		       d->unit->sdperm.name);
+		return -1;
+	default:
+		printk("%s: i/o error @%lld\n", d->unit->sdperm.name, bno);
+		return -1;
 	}
-	r->rlen = data - (unsigned char *)r->data;
-	r->status = SDok;
-	return SDok;
 }
 
 /*
@@ -2202,6 +2733,9 @@ static int newctlr(struct ctlr *ctlr, struct sdev *sdev, int nunit)
 		drive->portc.pm = &drive->portm;
 		qlock_init(&drive->portm.ql);
 		rendez_init(&drive->portm.Rendez);
+		TAILQ_INIT(&drive->q);
+		rendez_init(&drive->qrendez);
+		drive->nslots = 1;
 		drive->driveno = n++;
 		ctlr->drive[drive->driveno] = drive;
 		iadrive[niadrive + drive->driveno] = drive;
@@ -2318,6 +2852,7 @@ static int iarctl(struct sdunit *u, char *p, int l)
 	struct ctlr *c;
 	struct drive *d;
 	uint32_t serror, task, cmd, ci, is, sig, sstatus;
+	int i;
 
 	c = u->dev->ctlr;
 	if (c == NULL) {
@@ -2360,6 +2895,19 @@ static int iarctl(struct sdunit *u, char *p, int l)
 	if (d->unit == NULL)
 		panic("iarctl: nil d->unit");
 	p = seprintf(p, e, "geometry %llu %lu\n", d->sectors, d->unit->secsize);
+	p = seprintf(p, e,
+	             "queue\t%s slots %d depth %d queued %d io %llu err %llu\n",
+	             d->portm.feat & Dncq ? "ncq" : "dma", d->nslots, d->qdepth,
+	             d->nqueued, d->nqio, d->nqerr);
+	p = seprintf(p, e, "qdepth\t");
+	for (i = 0; i < Nqhist; i++)
+		p = seprintf(p, e, "%d:%llu ", 1 << i, d->qdepthhist[i]);
+	p = seprintf(p, e, "\nlatency\t");
+	for (i = 0; i < Nlathist; i++)
+		if (d->qlathist[i])
+			p = seprintf(p, e, "%luus:%llu ", 1UL << i,
+			             d->qlathist[i]);
+	p = seprintf(p, e, "\n");
 	return p - op;
 }
 
@@ -2392,7 +2940,7 @@ static void runsmartable(struct drive *d, int i)
 	ERRSTACK(1);
 
 	if (waserror()) {
-		qunlock(&d->portm.ql);
+		unlockready(d);
 		d->smartrs = 0;
 		nexterror();
 	}
@@ -2400,7 +2948,7 @@ static void runsmartable(struct drive *d, int i)
 		error(EIO, "runsmartable: lockready returned -1");
 	d->smartrs = smart(&d->portc, i);
 	d->portm.smart = 0;
-	qunlock(&d->portm.ql);
+	unlockready(d);
 	poperror();
 }
 
@@ -2433,6 +2981,16 @@ static void changemedia(struct sdunit *u)
 	spin_unlock_irqsave(&d->Lock);
 }
 
+static void resetqstats(struct drive *d)
+{
+	spin_lock_irqsave(&d->Lock);
+	d->nqio = 0;
+	d->nqerr = 0;
+	memset(d->qdepthhist, 0, sizeof(d->qdepthhist));
+	memset(d->qlathist, 0, sizeof(d->qlathist));
+	spin_unlock_irqsave(&d->Lock);
+}
+
 static int iawctl(struct sdunit *u, struct cmdbuf *cmd)
 {
 	ERRSTACK(1);
@@ -2462,28 +3020,30 @@ static int iawctl(struct sdunit *u, struct cmdbuf *cmd)
 			return -1;
 		}
 		if (waserror()) {
-			qunlock(&d->portm.ql);
+			unlockready(d);
 			nexterror();
 		}
 		if (lockready(d) == -1)
 			error(EIO, "%s: lockready returned -1", __func__);
 		nop(&d->portc);
-		qunlock(&d->portm.ql);
+		unlockready(d);
 		poperror();
-	} else if (strcmp(f[0], "reset") == 0)
+	} else if (strcmp(f[0], "qreset") == 0)
+		resetqstats(d);
+	else if (strcmp(f[0], "reset") == 0)
 		forcestate(d, "reset");
 	else if (strcmp(f[0], "smart") == 0) {
 		if (d->smartrs == 0)
 			sdierror(cmd, "smart not enabled");
 		if (waserror()) {
-			qunlock(&d->portm.ql);
+			unlockready(d);
 			d->smartrs = 0;
 			nexterror();
 		}
 		if (lockready(d) == -1)
 			error(EIO, "%s: lockready returned -1", __func__);
 		d->portm.smart = 2 + smartrs(&d->portc);
-		qunlock(&d->portm.ql);
+		unlockready(d);
 		poperror();
 	} else if (strcmp(f[0], "smartdisable") == 0)
 		runsmartable(d, 1);
@@ -2616,4 +3176,5 @@ struct sdifc sdiahciifc = {
     scsibio,   NULL, /* probe */
     NULL,            /* clear */
     iartopctl, iawtopctl,
+    iabbio,
 };
@@ -159,6 +159,8 @@ static bool tmpfs_fs_can_grow_to(struct fs_file *f, size_t len)
 struct fs_file_ops tmpfs_fs_ops = {
 	.readpage = tmpfs_pm_readpage,
 	.writepage = tmpfs_pm_writepage,
+	.pin = tf_pm_pin,
+	.unpin = tf_pm_unpin,
 	.punch_hole = tmpfs_fs_punch_hole,
 	.can_grow_to = tmpfs_fs_can_grow_to,
 };
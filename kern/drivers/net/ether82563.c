@@ -1108,6 +1108,8 @@ static void i82563replenish(struct ctlr *ctlr)
 	struct rd *rd;
 	int rdt;
 	struct block *bp;
+	struct block *bps[32];
+	int nr_bps = 0, bp_i = 0;
 
 	rdt = ctlr->rdt;
 	while (NEXT_RING(rdt, Nrd) != ctlr->rdh) {
@@ -1116,11 +1118,17 @@ static void i82563replenish(struct ctlr *ctlr)
 			printd("#l%d: 82563: rx overrun\n", ctlr->edev->ctlrno);
 			break;
 		}
-		bp = block_alloc(ctlr->rbsz + Slop + Rbalign, MEM_ATOMIC);
-		if (bp == NULL) {
-			warn_once("OOM, trying to survive");
-			break;
+		if (bp_i == nr_bps) {
+			nr_bps = block_alloc_bulk(bps, MIN(ARRAY_SIZE(bps),
+					(ctlr->rdh - rdt - 1 + Nrd) % Nrd),
+					ctlr->rbsz + Slop + Rbalign, MEM_ATOMIC);
+			bp_i = 0;
+			if (!nr_bps) {
+				warn_once("OOM, trying to survive");
+				break;
+			}
 		}
+		bp = bps[bp_i++];
 		ctlr->rb[rdt] = bp;
 		rd->addr[0] = paddr_low32(bp->rp);
 		rd->addr[1] = paddr_high32(bp->rp);
@@ -1128,6 +1136,9 @@ static void i82563replenish(struct ctlr *ctlr)
 		ctlr->rdfree++;
 		rdt = NEXT_RING(rdt, Nrd);
 	}
+	/* Only if we hit an overrun */
+	while (bp_i < nr_bps)
+		freeb(bps[bp_i++]);
 	if (ctlr->rdt != rdt) {
 		ctlr->rdt = rdt;
 		wmb_f();
@@ -248,6 +248,7 @@ enum {
 
 // AHCI Command List Command Header
 // Each header is an element in the list which is up to 32 elements long
+#define ANSLOTS 32        // Command slots (headers) in a list
 #define ALIST_SIZE 0x20   // Size of the struct in memory, not for access
 #define ALIST_FLAGS  0x00 // Flags and PRDTL (PRDT Length)
 #define ALIST_LEN    0x04 // PRD byte count transferred
@@ -262,6 +263,7 @@ enum {
 #define APRDT_DBAHI 0x04 // Data Base Address upper 32 bits
 #define APRDT_RES   0x08 // Reserved
 #define APRDT_COUNT 0x0C // 31=Intr on Completion, 30:22=Reserved, 21:0=DBC
+#define APRDT_MAXDBC (4 * 1024 * 1024) // Max bytes for one element
 
 // AHCI Command Table
 // Note that there is no fixed size specified - there are 1 to 65,535 PRDT's
@@ -269,7 +271,9 @@ enum {
 #define ACTAB_CFIS  0x00 // Command Frame Information Struct (up to 64 bytes)
 #define ACTAB_ATAPI 0x40 // ATAPI Command (12 or 16 bytes)
 #define ACTAB_RES   0x50 // Reserved
-#define ACTAB_PRDT  0x80 // PRDT (up to 65,535 entries in spec, this has one)
+#define ACTAB_PRDT  0x80 // PRDT (up to 65,535 entries in spec, we have ANPRDT)
+#define ANPRDT 32         // PRDT elements per command table
+#define ACTAB_SIZE (ACTAB_PRDT + ANPRDT * APRDT_SIZE)
 
 // Portm flags (status flags?)
 enum {
@@ -285,6 +289,7 @@ enum {
 	Dnop = 1 << 3,
 	Datapi = 1 << 4,
 	Datapi16 = 1 << 5,
+	Dncq = 1 << 6,
 };
 
 struct aportm {
@@ -294,6 +299,8 @@ struct aportm {
 	unsigned char feat;
 	unsigned char smart;
 	struct afis fis;
+	/* ANSLOTS command headers and tables.  These point to slot 0, which is
+	 * used for non-queued commands. */
 	void *list;
 	void *ctab;
 };
@@ -13,6 +13,13 @@
 
 void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
                 uint32_t vcoreid);
+void send_event_batch(struct proc *p, struct event_queue *ev_q,
+                      struct event_msg *msgs, unsigned int nr,
+                      uint32_t vcoreid);
+void event_batch_start(void);
+void event_batch_end(void);
+bool event_batch_add(struct proc *p, struct event_queue *ev_q,
+                     struct event_msg *msg);
 void send_kernel_event(struct proc *p, struct event_msg *msg, uint32_t vcoreid);
 void post_vcore_event(struct proc *p, struct event_msg *msg, uint32_t vcoreid,
                       int ev_flags);
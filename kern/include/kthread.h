@@ -20,6 +20,7 @@ struct errbuf {
 
 struct proc;
 struct kthread;
+struct event_queue;
 struct kth_db_info;
 TAILQ_HEAD(kthread_tailq, kthread);
 TAILQ_HEAD(kth_db_tailq, kth_db_info);
@@ -36,6 +37,17 @@ TAILQ_HEAD(kth_db_tailq, kth_db_info);
 /* These are the flags used for normal process context */
 #define KTH_DEFAULT_FLAGS		(KTH_SAVE_ADDR_SPACE)
 
+/* Events the kthread is holding on to, see event_batch_start() */
+#define EV_BATCH_MAX 16
+
+struct event_batch {
+	unsigned int			depth;
+	unsigned int			nr;
+	struct proc			*procs[EV_BATCH_MAX];
+	struct event_queue		*ev_qs[EV_BATCH_MAX];
+	struct event_msg		msgs[EV_BATCH_MAX];
+};
+
 /* This captures the essence of a kernel context that we want to suspend.  When
  * a kthread is running, we make sure its stacktop is the default kernel stack,
  * meaning it will receive the interrupts from userspace. */
@@ -53,6 +65,7 @@ struct kthread {
 	int				errno;
 	char				errstr[MAX_ERRSTR_LEN];
 	struct systrace_record		*strace;
+	struct event_batch		ev_batch;
 };
 
 #define KTH_DB_SEM			1
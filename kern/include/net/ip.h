@@ -34,7 +34,9 @@ enum {
 	Addrlen = 64,
 	Maxproto = 20,
 	Nhash = 64,
-	Maxincall = 500,
+	Maxincall = 500,	/* default listen backlog */
+	Maxbacklog = 4096,
+	Zcopymin = 16 * 1024,	/* default smallest zero-copy write */
 	Nchans = 256,
 	MAClen = 16,	/* longest mac address */
 
@@ -107,6 +109,12 @@ struct conv {
 	int reliable;		/* true if reliable udp */
 
 	struct conv *incall;	/* calls waiting to be listened for */
+	struct conv *incall_tail;
+	int nincall;
+	int backlog;		/* most calls we'll queue in incall */
+	bool reuseport;		/* may share its port with other listeners */
+	size_t zcopy_min;	/* writes this big aren't copied, 0 for off */
+	uint64_t zcopy_id;	/* id of the next zero-copy write */
 	struct conv *next;
 
 	struct queue *rq;	/* queued data waiting to be read */
@@ -131,7 +139,11 @@ struct conv {
 
 	struct route *r;	/* last route used */
 	uint32_t rgen;		/* routetable generation for *r */
+
+	TAILQ_ENTRY(conv) free_link;	/* on p->free_convs, under free_lock */
+	bool on_free_list;
 };
+TAILQ_HEAD(conv_tailq, conv);
 
 struct Ipifc;
 struct Fs;
@@ -251,6 +263,8 @@ struct Ipifc {
 	uint8_t recvra6;	/* == 1 => recv router advs on this ifc */
 	struct routerparams rp;	/* router parameters as in RFC 2461, pp.40--43.
 				   used only if node is router */
+
+	struct ipfq *fq;	/* fair queueing for output, if on */
 };
 
 /*
@@ -327,6 +341,12 @@ struct Proto {
 	uint16_t nextport;
 	uint16_t nextrport;
 
+	qlock_t clone_qlock;	/* adding convs, and the slow clone path */
+	spinlock_t free_lock;
+	struct conv_tailq free_convs;	/* closed convs, maybe reusable */
+	spinlock_t port_lock;
+	uint32_t *port_refs;	/* convs per lport, allocated on first use */
+
 	void *priv;
 };
 
@@ -399,6 +419,7 @@ int Fspcolstats(char *unused_char_p_t, int);
 int Fsproto(struct Fs *, struct Proto *);
 int Fsbuiltinproto(struct Fs *, uint8_t unused_uint8_t);
 struct conv *Fsprotoclone(struct Proto *, char *unused_char_p_t);
+void Fsconvlport(struct conv *c, uint16_t lport);
 struct Proto *Fsrcvpcol(struct Fs *, uint8_t unused_uint8_t);
 struct Proto *Fsrcvpcolx(struct Fs *, uint8_t unused_uint8_t);
 void Fsstdconnect(struct conv *, char **, int);
@@ -656,6 +677,31 @@ extern void ipifc_trace_block(struct Ipifc *ifc, struct block *bp);
 extern long ipselftabread(struct Fs *, char *a, uint32_t offset, int n);
 extern void ipsendra6(struct Fs *f, int on);
 
+/*
+ *  ipfq.c
+ */
+extern void ipfqbwrite(struct Ipifc *ifc, struct block *bp, int version,
+		       uint8_t *gate, struct conv *c);
+extern void ipfqflush(struct Ipifc *ifc);
+extern void ipfqctl(struct Ipifc *ifc, char **argv, int argc);
+extern int ipfqstate(struct Ipifc *ifc, char *state, int n);
+
+/*
+ *  ipzcopy.c
+ */
+extern size_t ipzcwrite(struct conv *c, void *va, size_t n, bool nonblock);
+
+/* Hands an IP packet to ifc's medium, through the fq if it has one.  Called
+ * with ifc rlocked. */
+static inline void ipifcbwrite(struct Ipifc *ifc, struct block *bp, int version,
+			       uint8_t *gate, struct conv *c)
+{
+	if (ifc->fq)
+		ipfqbwrite(ifc, bp, version, gate, c);
+	else
+		ifc->m->bwrite(ifc, bp, version, gate);
+}
+
 /*
  *  ip.c
  */
@@ -675,6 +721,17 @@ extern int ipoput6(struct Fs *, struct block *, int unused_int, int, int,
 		   struct conv *);
 extern int ipstats(struct Fs *, char *unused_char_p_t, int);
 extern uint16_t ptclbsum(uint8_t * unused_uint8_p_t, int);
+uint16_t ptclbcopysum(uint8_t *dst, uint8_t *src, int len);
+
+/* The checksum kernels ptclbsum() picks from, so the ktests can check and time
+ * each one.  usable is clear for the ones this CPU can't run. */
+struct ptclbsum_kernel {
+	const char *name;
+	uint16_t (*bsum)(uint8_t *addr, int len);
+	bool usable;
+};
+extern struct ptclbsum_kernel ptclbsum_kernels[];
+extern int nr_ptclbsum_kernels;
 extern uint16_t ptclcsum(struct block *, int unused_int, int);
 extern void ip_init(struct Fs *);
 extern void update_mtucache(uint8_t * unused_uint8_p_t, uint32_t);
@@ -51,6 +51,9 @@ enum {
 	TcptimerDONE = 2,
 	MAX_TIME = (1 << 20),	/* Forever */
 	TCP_ACK = 50,	/* Timed ack sequence in ms */
+	TCP_ACK_BATCH = 2,	/* Default data segs per forced ack */
+	TCP_MAX_ACK_BATCH = 64,
+	TCP_PACE_BATCH = 32,	/* Most convs the pacer sends for per pass */
 	MAXBACKMS = 9 * 60 * 1000, /* longest backoff time (ms) before hangup */
 
 	URG = 0x20,	/* Data marked urgent */
@@ -116,6 +119,7 @@ enum {
 	Maxlimbo = 1000,/* maximum procs waiting for response to SYN ACK */
 	NLHT = 256,	/* hash table size, must be a power of 2 */
 	LHTMASK = NLHT - 1,
+	SYNCOOKIE_PERIOD = 64000,	/* ms per syncookie counter tick */
 
 	HaveWS = 1 << 8,
 };
@@ -285,6 +289,22 @@ struct tcpctl {
 	uint32_t last_ack_sent;	/* to determine when to update timestamp */
 	bool sack_ok;		/* Can use SACK for this connection */
 	struct Ipifc *ifc;	/* Uncounted ref */
+	int ack_batch;		/* Force an ack every this many data segs */
+	uint64_t hp_acks;	/* Header prediction hits, pure acks */
+	uint64_t hp_data;	/* Header prediction hits, in-order data */
+	uint64_t hp_misses;	/* Established segs that took the slow path */
+
+	/* Pacing.  Once on, data segments leave no faster than pace_rate(),
+	 * which comes from cwind and a usec RTT, capped by max_rate. */
+	struct conv *conv;	/* Back pointer, for the pacer */
+	bool pacing;		/* Pace at the cwind / srtt rate */
+	bool pace_queued;	/* On tpriv's pace_list */
+	uint64_t max_rate;	/* Bytes/sec cap, 0 for none */
+	uint64_t pace_next;	/* TSC time the next data seg may leave */
+	TAILQ_ENTRY(tcpctl) pace_link;
+	uint64_t srtt_us;	/* Smoothed RTT in usec, 0 til sampled */
+	uint64_t rtt_us_start;	/* TSC time rtt_us_seq was sent, 0 if idle */
+	uint32_t rtt_us_seq;	/* Seq whose ack ends the usec RTT sample */
 
 	union {
 		Tcp4hdr tcp4hdr;
@@ -300,9 +320,12 @@ struct tcpctl {
  *  In particular they aren't on a listener's queue so that they don't figure in
  *  the input queue limit.
  *
- *  If 1/2 of a T3 was attacking SYN packets, we'ld have a permanent queue of
- *  70000 limbo'd calls.  Not great for a linear list but doable.  Therefore
- *  there is no hashing of this list.
+ *  Once Maxlimbo calls are waiting, new SYNs get a SYN cookie instead: the
+ *  SYN ACK's sequence number encodes the call, and the final ACK rebuilds the
+ *  limbo'd call from it.  Cookies can't remember window scaling or SACK.
+ *
+ *  Each bucket remembers when its next SYN ACK is due, so the retransmit
+ *  timer only walks the buckets that need it.
  */
 typedef struct limbo Limbo;
 struct limbo {
@@ -344,6 +367,9 @@ enum {
 	HlenErrs,
 	LenErrs,
 	OutOfOrder,
+	SynCookiesSent,
+	SynCookiesRecv,
+	SynCookiesFailed,
 
 	Nstats
 };
@@ -360,11 +386,21 @@ struct tcppriv {
 	/* calls in limbo waiting for an ACK to our SYN ACK */
 	int nlimbo;
 	Limbo *lht[NLHT];
+	uint64_t lht_due[NLHT];	/* next SYN ACK rexmit per bucket, 0 if none */
+
+	uint64_t syncookie_secret[2];
+	uint64_t last_syncookie;	/* when we last sent one */
 
 	/* for keeping track of tcpackproc */
 	qlock_t apl;
 	int ackprocstarted;
 
+	/* paced convs waiting to send, sorted by pace_next */
+	spinlock_t pace_lock;
+	TAILQ_HEAD(tcpctl_tailq, tcpctl) pace_list;
+	bool pace_kick;		/* pace_list has a new head */
+	struct rendez pace_rv;
+
 	uint32_t stats[Nstats];
 };
 
@@ -424,8 +424,21 @@ struct extra_bdata {
 	/* using u32s for packing reasons.  this means no extras > 4GB */
 	uint32_t off;
 	uint32_t len;
+	/* If csum_len, csum is the ptclbsum() of [base, base + csum_len).  It is
+	 * only good while the ebd still covers exactly that: off == 0 and len ==
+	 * csum_len.  Whoever sets base sets (or clears) csum_len. */
+	uint32_t csum_len;
+	uint16_t csum;
+	/* If set, base wasn't kmalloc'd (e.g. pinned user pages): the ebd holds
+	 * a ref on ext_ref instead of a kmalloc ref on base. */
+	struct kref *ext_ref;
 };
 
+static inline bool ebd_has_csum(struct extra_bdata *ebd)
+{
+	return ebd->csum_len && !ebd->off && ebd->len == ebd->csum_len;
+}
+
 struct block {
 	struct block *next;
 	struct block *list;
@@ -439,6 +452,8 @@ struct block {
 	uint16_t network_offset;	/* offset from rp */
 	uint16_t transport_offset;	/* offset from rp */
 	uint16_t tx_csum_offset;	/* offset from tx_offset to store csum */
+	uint16_t pool_core;		/* core whose block pool we return to */
+	uint8_t pool;			/* block pool + 1, 0 if not pooled */
 	/* might want something to track the next free extra_data slot */
 	size_t extra_len;
 	unsigned int nr_extra_bufs;
@@ -696,6 +711,8 @@ enum {
 	Qcoalesce	= (1 << 3),	/* coalesce empty packets on read */
 	Qkick		= (1 << 4),	/* always call kick() after qwrite */
 	Qdropoverflow	= (1 << 5),	/* drop writes that would block */
+	Qcsum		= (1 << 6),	/* checksum data as it is written */
+	Qbatch		= (1 << 7),	/* Qmsg reads get as many msgs as fit */
 };
 
 /* Per-process structs */
@@ -768,9 +785,15 @@ void addprog(struct proc *);
 void addrootfile(char *unused_char_p_t, uint8_t * unused_uint8_p_t, uint32_t);
 struct block *adjustblock(struct block *, int);
 struct block *block_alloc(size_t, int);
+int block_alloc_bulk(struct block **bps, unsigned int nr, size_t size,
+		     int mem_flags);
+struct sized_alloc *block_pool_build_stats(void);
 int block_add_extd(struct block *b, unsigned int nr_bufs, int mem_flags);
+int block_append_ebd(struct block *b, struct extra_bdata *from, int mem_flags);
 int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
                        uint32_t len, int mem_flags);
+void ebd_incref(struct extra_bdata *ebd);
+void ebd_decref(struct extra_bdata *ebd);
 void block_copy_metadata(struct block *new_b, struct block *old_b);
 void block_reset_metadata(struct block *b);
 void block_add_to_offsets(struct block *b, int delta);
@@ -943,6 +966,7 @@ struct block *qclone(struct queue *q, int header_len, int len,
                      uint32_t offset);
 struct block *blist_clone(struct block *blist, int header_len, int len,
                           uint32_t offset);
+int block_append_block(struct block *to, struct block *from, int mem_flags);
 size_t qdiscard(struct queue *q, size_t len);
 void qflush(struct queue *);
 void qfree(struct queue *);
@@ -956,15 +980,21 @@ size_t q_bytes_read(struct queue *q);
 void qdropoverflow(struct queue *, bool);
 void q_toggle_qmsg(struct queue *q, bool onoff);
 void q_toggle_qcoalesce(struct queue *q, bool onoff);
+void q_toggle_qcsum(struct queue *q, bool onoff);
+void q_toggle_qbatch(struct queue *q, bool onoff);
 struct queue *qopen(int unused_int, int, void (*)(void *), void *);
 ssize_t qpass(struct queue *, struct block *);
 ssize_t qpassnolim(struct queue *, struct block *);
+ssize_t qpass_merge(struct queue *q, struct block *b,
+                    bool (*merge)(struct block *last, struct block *b,
+                                  void *arg), void *arg);
 void qputback(struct queue *, struct block *);
 size_t qread(struct queue *q, void *va, size_t len);
 size_t qread_nonblock(struct queue *q, void *va, size_t len);
 void qreopen(struct queue *);
 void qsetlimit(struct queue *, size_t);
 size_t qgetlimit(struct queue *);
+int qstate(struct queue *);
 int qwindow(struct queue *);
 ssize_t qwrite(struct queue *, void *, int);
 ssize_t qwrite_nonblock(struct queue *, void *, int);
@@ -1118,6 +1148,10 @@ int fd_chan_ctl(int fd, int cmd, unsigned long arg1, unsigned long arg2,
 int fd_get_fd_flags(struct fd_table *fdt, int fd);
 int fd_set_fd_flags(struct fd_table *fdt, int fd, int new_fl);
 
+/* kern/drivers/dev/eventfd.c */
+bool efd_is_efd(struct chan *c);
+void efd_kick(struct chan *c);
+
 /* kern/drivers/dev/srv.c */
 char *srvname(struct chan *c);
 
@@ -46,6 +46,7 @@ struct page {
 	void				**pg_tree_slot;
 	void				*pg_private;
 	struct semaphore 		pg_sem;	
+	struct kref			pg_kref;	/* non-PM pages, e.g. CoW */
 	uint64_t			gpa;	/* physical address in guest */
 
 	bool				pg_is_free;	/* TODO: will remove */
@@ -72,6 +73,7 @@ void kpages_free(void *addr, size_t size);
 void *get_cont_pages(size_t order, int flags);
 void free_cont_pages(void *buf, size_t order);
 
+void page_incref(page_t *page);
 void page_decref(page_t *page);
 
 int page_is_free(size_t ppn);
@@ -79,8 +81,16 @@ void lock_page(struct page *page);
 void unlock_page(struct page *page);
 void print_pageinfo(struct page *page);
 static inline bool page_is_pagemap(struct page *page);
+static inline bool page_is_shared(struct page *page);
 
 static inline bool page_is_pagemap(struct page *page)
 {
 	return atomic_read(&page->pg_flags) & PG_PAGEMAP ? true : false;
 }
+
+/* Non-PM pages can be mapped by more than one process after a CoW fork.  A
+ * shared page must not be mapped writable by anyone. */
+static inline bool page_is_shared(struct page *page)
+{
+	return kref_refcnt(&page->pg_kref) > 1;
+}
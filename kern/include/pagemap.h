@@ -29,18 +29,43 @@ struct page_map {
 	struct page_map_operations	*pm_op;
 	spinlock_t			pm_lock;	/* for the VMR list */
 	struct vmr_tailq		pm_vmrs;
+	/* protected by the global dirty lock, in pagemap.c */
+	unsigned long			pm_nr_dirty;
+	uint64_t			pm_dirtied_at;	/* nsec */
+	TAILQ_ENTRY(page_map)		pm_dirty_link;
+	/* protected by the global LRU lock, in pagemap.c */
+	int				pm_flags;
+	TAILQ_ENTRY(page_map)		pm_lru_link;
 };
 
+/* Radix tree tags for pm_tree */
+#define PM_TAG_DIRTY		0
+
+/* pm_flags.  Set RECLAIMABLE before loading pages if clean pages can be dropped
+ * and read back later, i.e. there's a backing store.  Reclaimable PMs also need
+ * the pin ops. */
+#define PM_F_RECLAIMABLE	(1 << 0)
+#define PM_F_ON_LRU		(1 << 1)
+
 /* Operations performed on a page_map.  These are usually FS specific, which
  * get assigned when the inode is created.
  * Will fill these in as they are created/needed/used. */
 struct page_map_operations {
 	int (*readpage) (struct page_map *, struct page *);
 	int (*writepage) (struct page_map *, struct page *);
-/*	readpages: read a list of pages
-	writepage: write from a page to its backing store
-	writepages: write a list of pages
-	sync_page: start the IO of already scheduled ops
+	/* Optional: keep the PM's owner alive, so the background flusher can
+	 * write it back.  pin can fail if the owner is on its way out. */
+	bool (*pin) (struct page_map *);
+	void (*unpin) (struct page_map *);
+	/* Optional: start reading the locked, !UPTODATE pages, e.g. for
+	 * readahead.  This can return before the IO is done.  As each read
+	 * finishes, set UPTODATE (unless it failed), unlock the page and
+	 * pm_put_page() it. */
+	void (*readpages) (struct page_map *, struct page **, unsigned int);
+	/* Optional: write back a batch of pages, sorted by index.  Unlike
+	 * readpages, the IO is done when this returns. */
+	void (*writepages) (struct page_map *, struct page **, unsigned int);
+/*	sync_page: start the IO of already scheduled ops
 	set_page_dirty: mark the given page dirty
 	prepare_write: prepare to write (disk backed pages)
 	commit_write: complete a write (disk backed pages)
@@ -55,11 +80,15 @@ void pm_init(struct page_map *pm, struct page_map_operations *op, void *host);
 int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp);
 int pm_load_page_nowait(struct page_map *pm, unsigned long index,
                         struct page **pp);
+void pm_readahead(struct page_map *pm, unsigned long index,
+                  unsigned long nr_pgs);
 void pm_put_page(struct page *page);
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr);
 void pm_remove_vmr(struct page_map *pm, struct vm_region *vmr);
 void pm_remove_or_zero_pages(struct page_map *pm, unsigned long start_idx,
                              unsigned long nr_pgs);
+void pm_set_page_dirty(struct page *page);
+void pm_balance_dirty(void);
 void pm_writeback_pages(struct page_map *pm);
 void pm_free_unused_pages(struct page_map *pm);
 void pm_destroy(struct page_map *pm);
@@ -9,17 +9,30 @@
  * handle more items.  It won't allow the insertion of existing keys, and it
  * can fail due to lack of memory.
  *
- * There are some utility functions, probably unimplemented til we need them,
- * that will make the tree have enough memory for future calls.
+ * radix_preload() stocks a tree with enough rnodes for the next insert, so that
+ * callers can allocate before grabbing their locks.
  *
  * You can also store a tag along with the void* for a given item, and do
- * lookups based on those tags.  Or you will be able to, once it is
- * implemented. */
+ * lookups based on those tags.  Each rnode has a bitmap per tag, with a bit
+ * per slot.  For interior nodes, the bit means some item below that slot has
+ * the tag, so tagged walks can skip entire untagged subtrees.
+ *
+ * Multi-order entries cover 2^order keys with one item, e.g. a 2MB range of
+ * pages.  The entry lives in an rnode at level order / 6 + 1 (leaves are level
+ * 1), in 2^(order % 6) consecutive slots.  The first slot
+ * is the entry's real slot; the others are siblings that hold the same item,
+ * so lockless lookups of any key in the range find it.  Siblings never show up
+ * in walks or gang lookups, and tags are kept on the first slot. */
 
 #pragma once
 
 #define LOG_RNODE_SLOTS 6
 #define NR_RNODE_SLOTS (1 << LOG_RNODE_SLOTS)
+/* Tag bitmaps are a single word per rnode */
+#define RADIX_NR_TAGS 2
+/* Max number of levels, for 64 bit keys */
+#define RADIX_MAX_DEPTH ((sizeof(unsigned long) * 8 + LOG_RNODE_SLOTS - 1) \
+                         / LOG_RNODE_SLOTS)
 
 #include <ros/common.h>
 #include <kthread.h>
@@ -29,6 +42,11 @@
 struct radix_node {
 	struct rcu_head			rcu;
 	void				*items[NR_RNODE_SLOTS];
+	unsigned long			tags[RADIX_NR_TAGS];
+	/* Slot bitmaps for multi-order entries.  entries is only used in
+	 * interior nodes, for slots that hold an item instead of a child. */
+	unsigned long			entries;
+	unsigned long			siblings;
 	unsigned int			num_items;
 	bool				leaf;
 	struct radix_node		*parent;
@@ -56,12 +74,26 @@ struct radix_node {
  * manipulate pointers in the tree (pointers to or within rnodes).  We use RCU
  * for the item pointer too, so that our callers can use RCU if they want.  Both
  * the slot pointer and what it points to are protected by RCU.
+ *
+ * Tag set and clear don't need the writer's qlock; they sync with each other
+ * and with writers on the tag_lock.  The caller must keep the item from being
+ * deleted, e.g. by holding a ref on it, so that its rnodes stick around.
+ *
+ * The gang lookups are readers too.  They return items in key order, in one
+ * walk down the tree.
+ *
+ * The preload list is a stack of free rnodes, linked through their parent
+ * pointers and protected by the tag_lock.  radix_preload() doesn't need the
+ * writer's qlock.
  */
 struct radix_tree {
 	seq_ctr_t			seq;
+	spinlock_t			tag_lock;
 	struct radix_node		*root;
 	unsigned int			depth;
 	unsigned long			upper_bound;
+	struct radix_node		*preload;
+	unsigned int			nr_preload;
 };
 
 void radix_init(void);		/* initializes the whole radix system */
@@ -71,9 +103,15 @@ void radix_tree_destroy(struct radix_tree *tree);
 /* Item management */
 int radix_insert(struct radix_tree *tree, unsigned long key, void *item,
                  void ***slot_p);
+int radix_insert_order(struct radix_tree *tree, unsigned long key,
+                       unsigned int order, void *item, void ***slot_p);
 void *radix_delete(struct radix_tree *tree, unsigned long key);
 void *radix_lookup(struct radix_tree *tree, unsigned long key);
 void **radix_lookup_slot(struct radix_tree *tree, unsigned long key);
+/* indices is optional; it gets the first key of each item */
+unsigned int radix_gang_lookup(struct radix_tree *tree, void **results,
+                               unsigned long *indices, unsigned long first,
+                               unsigned int max_items);
 
 typedef bool (*radix_cb_t)(void **slot, unsigned long tree_idx, void *arg);
 void radix_for_each_slot(struct radix_tree *tree, radix_cb_t cb, void *arg);
@@ -92,8 +130,12 @@ void *radix_tag_set(struct radix_tree *tree, unsigned long key, int tag);
 void *radix_tag_clear(struct radix_tree *tree, unsigned long key, int tag);
 int radix_tag_get(struct radix_tree *tree, unsigned long key, int tag);
 int radix_tree_tagged(struct radix_tree *tree, int tag);
-int radix_tag_gang_lookup(struct radix_tree *tree, void **results,
-                          unsigned long first, unsigned int max_items, int tag);
+unsigned int radix_tag_gang_lookup(struct radix_tree *tree, void **results,
+                                   unsigned long *indices, unsigned long first,
+                                   unsigned int max_items, int tag);
+/* Like radix_for_each_slot, but only visits items with the tag */
+void radix_for_each_tagged_slot(struct radix_tree *tree, int tag,
+                                radix_cb_t cb, void *arg);
 
 /* Debugging */
 void print_radix_tree(struct radix_tree *tree);
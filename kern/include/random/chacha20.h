@@ -0,0 +1,22 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * ChaCha20 keystream generator (D. J. Bernstein's original variant: 64 bit
+ * block counter, 64 bit nonce). */
+
+#pragma once
+
+#include <ros/common.h>
+
+#define CHACHA20_KEY_SIZE	32
+#define CHACHA20_BLOCK_SIZE	64
+
+struct chacha20_ctx {
+	uint32_t			state[16];
+};
+
+void chacha20_init(struct chacha20_ctx *ctx, const uint8_t *key,
+                   uint64_t nonce);
+void chacha20_blocks(struct chacha20_ctx *ctx, uint8_t *dst,
+                     size_t nr_blocks);
+void chacha20_keystream(struct chacha20_ctx *ctx, uint8_t *dst, size_t len);
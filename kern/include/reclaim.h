@@ -0,0 +1,59 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Memory reclaim.
+ *
+ * Subsystems that cache memory they can give back (slab depots, page maps,
+ * tree_file caches, etc.) register a shrinker.  When free memory in the base
+ * arena drops below the low watermark, the page allocator pokes the reclaim
+ * ktask, which runs the shrinkers in priority order until free memory is back
+ * above the high watermark.  MEM_WAIT allocations that would otherwise OOM wait
+ * on reclaim instead.
+ *
+ * A shrinker's shrink() is called with a goal in bytes, and returns roughly how
+ * many bytes it freed.  It may block, but it must not wait on reclaim (i.e. no
+ * MEM_WAIT allocations that could fail without reclaim).  Shrinkers are called
+ * with the shrinker qlock held, so unregister_shrinker() waits for any
+ * in-progress calls. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <sys/queue.h>
+#include <arena.h>
+
+/* Lower priorities are called first.  Shrinkers that free pages to caches
+ * (e.g. page maps freeing to kpages' qcaches) should run before the shrinkers
+ * that drain those caches. */
+#define SHRINKER_PRIO_DATA		0
+#define SHRINKER_PRIO_META		1
+#define SHRINKER_PRIO_SLAB		2
+
+struct shrinker {
+	const char			*name;
+	int				priority;
+	size_t (*shrink)(struct shrinker *s, size_t goal);
+	void				*priv;
+	TAILQ_ENTRY(shrinker)		link;
+	/* Stats, protected by the shrinker qlock */
+	unsigned long			nr_calls;
+	size_t				amt_reclaimed;
+};
+TAILQ_HEAD(shrinker_tailq, shrinker);
+
+void register_shrinker(struct shrinker *s);
+void unregister_shrinker(struct shrinker *s);
+
+size_t reclaim_memory(size_t goal);
+void reclaim_poke(void);
+bool reclaim_wait(size_t amt);
+struct sized_alloc *reclaim_build_stats(void);
+
+extern size_t reclaim_low_wmark;
+
+/* Called by the page allocator.  Cheap enough to call on every allocation. */
+static inline void reclaim_check(void)
+{
+	if (arena_amt_free(base_arena) < reclaim_low_wmark)
+		reclaim_poke();
+}
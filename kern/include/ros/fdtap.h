@@ -29,6 +29,7 @@
 #define FDTAP_FILT_PRIORITY	0x00000100
 #define FDTAP_FILT_HANGUP	0x00000200
 #define FDTAP_FILT_RDHUP	0x00000400
+#define FDTAP_FILT_ZCOPY	0x00000800	/* zero-copy write done */
 
 /* When an event on FD matches filter, that event will be sent to ev_q with
  * ev_id, with an optional data blob passed back.  The specifics will depend on
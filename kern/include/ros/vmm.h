@@ -19,6 +19,8 @@
 #define VMM_CTL_SET_EXITS		2
 #define VMM_CTL_GET_FLAGS		3
 #define VMM_CTL_SET_FLAGS		4
+#define VMM_CTL_ADD_DOORBELL		5
+#define VMM_CTL_DEL_DOORBELL		6
 
 #define VMM_CTL_EXIT_HALT		(1 << 0)
 #define VMM_CTL_EXIT_PAUSE		(1 << 1)
@@ -27,3 +29,14 @@
 
 #define VMM_CTL_FL_KERN_PRINTC		(1 << 0)
 #define VMM_CTL_ALL_FLAGS		(VMM_CTL_FL_KERN_PRINTC)
+
+/* Doorbells: guest writes of a value to a GPA that the kernel completes by
+ * kicking an eventfd, instead of exiting to the VMM.  The args are:
+ *
+ * 	VMM_CTL_ADD_DOORBELL, gpa, value, eventfd's fd, flags
+ * 	VMM_CTL_DEL_DOORBELL, gpa, value, flags
+ *
+ * The written value is zero-extended to 64 bits before comparing.  With
+ * VMM_DB_ANY_VALUE, any write to the GPA rings the doorbell. */
+#define VMM_DB_ANY_VALUE		(1 << 0)
+#define VMM_DB_ALL_FLAGS		(VMM_DB_ANY_VALUE)
@@ -10,11 +10,13 @@
 /*
  * Storage Device.
  */
+struct block;
 struct devconf;
 struct sdev;
 struct sdifc;
 struct sdio;
 struct sdpart;
+struct sdcache;
 struct sdperm;
 struct sdreq;
 struct sdunit;
@@ -53,6 +55,8 @@ struct sdunit {
 	int state;
 	struct sdreq *req;
 	struct sdperm rawperm;
+
+	struct sdcache *cache; /* nil if uncached */
 };
 
 /*
@@ -93,6 +97,9 @@ struct sdifc {
 	void (*clear)(struct sdev *);
 	char *(*rtopctl)(struct sdev *, char *, char *);
 	int (*wtopctl)(struct sdev *, struct cmdbuf *);
+	/* optional: bio on a block chain's memory, for scatter/gather */
+	int32_t (*bbio)(struct sdunit *, int, int, struct block *, int32_t,
+	                uint64_t);
 };
 
 struct sdreq {
@@ -170,6 +177,16 @@ extern int sdsetsense(struct sdreq *, int, int, int, int);
 extern int sdmodesense(struct sdreq *, unsigned char *, void *, int);
 extern int sdfakescsi(struct sdreq *, void *, int);
 
+/* sdcache.c */
+extern void sdcache_setup(struct sdunit *);
+extern bool sdcache_enabled(struct sdunit *);
+extern void sdcache_sync(struct sdunit *);
+extern void sdcache_inval(struct sdunit *);
+extern void sdcache_free(struct sdunit *);
+extern void sdcache_enable(struct sdunit *, bool);
+extern size_t sdcache_io(struct sdunit *, int, void *, size_t, uint64_t);
+extern char *sdcache_ctl(struct sdunit *, char *, char *);
+
 /* sdscsi.c */
 extern int scsiverify(struct sdunit *);
 extern int scsionline(struct sdunit *);
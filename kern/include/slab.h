@@ -161,7 +161,7 @@ void *kmem_cache_zalloc(struct kmem_cache *cp, int flags);
 void kmem_cache_free(struct kmem_cache *cp, void *buf);
 /* Back end: internal functions */
 void kmem_cache_init(void);
-void kmem_cache_reap(struct kmem_cache *cp);
+size_t kmem_cache_reap(struct kmem_cache *cp);
 unsigned int kmc_nr_pcpu_caches(void);
 /* Low-level interface for creating/destroying; caller manages kc's memory */
 void __kmem_cache_create(struct kmem_cache *kc, const char *name,
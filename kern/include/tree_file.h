@@ -12,6 +12,7 @@
 #include <ns.h>
 #include <list.h>
 #include <rcu.h>
+#include <reclaim.h>
 
 struct tree_file;
 struct tree_filesystem;
@@ -83,6 +84,7 @@ struct tree_filesystem {
 	struct fs_file_ops		fs_ops;
 	qlock_t				rename_mtx;
 	struct tree_file		*root;
+	struct shrinker			neg_shrinker;
 	void				*priv;
 };
 
@@ -239,6 +241,8 @@ static inline void tree_file_perm_check(struct tree_file *tf, int omode)
 /* tree_file helpers */
 bool tf_kref_get(struct tree_file *tf);
 void tf_kref_put(struct tree_file *tf);
+bool tf_pm_pin(struct page_map *pm);
+void tf_pm_unpin(struct page_map *pm);
 struct tree_file *tree_file_alloc(struct tree_filesystem *tfs,
                                   struct tree_file *parent, const char *name);
 struct walkqid *tree_file_walk(struct tree_file *from, char **name,
@@ -282,6 +286,6 @@ void tfs_frontend_purge(struct tree_filesystem *tfs,
 void __tfs_dump(struct tree_filesystem *tfs);
 void __tfs_dump_tf(struct tree_file *tf);
 
-void tfs_lru_for_each(struct tree_filesystem *tfs, bool cb(struct tree_file *),
-                      size_t max_tfs);
-void tfs_lru_prune_neg(struct tree_filesystem *tfs);
+size_t tfs_lru_for_each(struct tree_filesystem *tfs,
+                        bool cb(struct tree_file *), size_t max_tfs);
+size_t tfs_lru_prune_neg(struct tree_filesystem *tfs);
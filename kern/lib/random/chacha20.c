@@ -0,0 +1,95 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * ChaCha20, as in "ChaCha, a variant of Salsa20" (Bernstein, 2008).
+ *
+ * The kernel doesn't use the FPU/SIMD registers, so this is the plain scalar
+ * version.  It's still a few times faster than Fortuna's AES per byte, and it
+ * has no tables to leak through the cache. */
+
+#include <random/chacha20.h>
+#include <string.h>
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d)					\
+do {									\
+	a += b; d ^= a; d = ROTL32(d, 16);				\
+	c += d; b ^= c; b = ROTL32(b, 12);				\
+	a += b; d ^= a; d = ROTL32(d, 8);				\
+	c += d; b ^= c; b = ROTL32(b, 7);				\
+} while (0)
+
+static uint32_t load32_le(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void store32_le(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+void chacha20_init(struct chacha20_ctx *ctx, const uint8_t *key,
+                   uint64_t nonce)
+{
+	/* "expand 32-byte k" */
+	ctx->state[0] = 0x61707865;
+	ctx->state[1] = 0x3320646e;
+	ctx->state[2] = 0x79622d32;
+	ctx->state[3] = 0x6b206574;
+	for (int i = 0; i < 8; i++)
+		ctx->state[4 + i] = load32_le(key + i * 4);
+	ctx->state[12] = 0;
+	ctx->state[13] = 0;
+	ctx->state[14] = nonce;
+	ctx->state[15] = nonce >> 32;
+}
+
+static void chacha20_block(struct chacha20_ctx *ctx, uint8_t *dst)
+{
+	uint32_t x[16];
+
+	memcpy(x, ctx->state, sizeof(x));
+	for (int i = 0; i < 10; i++) {
+		QUARTERROUND(x[0], x[4], x[8], x[12]);
+		QUARTERROUND(x[1], x[5], x[9], x[13]);
+		QUARTERROUND(x[2], x[6], x[10], x[14]);
+		QUARTERROUND(x[3], x[7], x[11], x[15]);
+		QUARTERROUND(x[0], x[5], x[10], x[15]);
+		QUARTERROUND(x[1], x[6], x[11], x[12]);
+		QUARTERROUND(x[2], x[7], x[8], x[13]);
+		QUARTERROUND(x[3], x[4], x[9], x[14]);
+	}
+	for (int i = 0; i < 16; i++)
+		store32_le(dst + i * 4, x[i] + ctx->state[i]);
+	if (!++ctx->state[12])
+		ctx->state[13]++;
+}
+
+/* Writes nr_blocks of keystream to dst. */
+void chacha20_blocks(struct chacha20_ctx *ctx, uint8_t *dst,
+                     size_t nr_blocks)
+{
+	for (size_t i = 0; i < nr_blocks; i++)
+		chacha20_block(ctx, dst + i * CHACHA20_BLOCK_SIZE);
+}
+
+/* Writes len bytes of keystream to dst.  A partial block at the end uses up
+ * the whole block. */
+void chacha20_keystream(struct chacha20_ctx *ctx, uint8_t *dst, size_t len)
+{
+	uint8_t tail[CHACHA20_BLOCK_SIZE];
+	size_t nr_blocks = len / CHACHA20_BLOCK_SIZE;
+
+	chacha20_blocks(ctx, dst, nr_blocks);
+	len -= nr_blocks * CHACHA20_BLOCK_SIZE;
+	if (len) {
+		chacha20_block(ctx, tail);
+		memcpy(dst + nr_blocks * CHACHA20_BLOCK_SIZE, tail, len);
+		memset(tail, 0, sizeof(tail));
+	}
+}
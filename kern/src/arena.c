@@ -48,9 +48,9 @@
  * - Blocking.  We'll probably want to reserve some memory for emergencies to
  *   help us get out of OOM.  So we might block when we're at low-mem, not at 0.
  *   We probably should have a sorted list of desired amounts, and unblockers
- *   poke the CV if the first waiter is likely to succeed.
- * - Reclaim: have a ktask that sleeps on a rendez.  We poke it, even from IRQ
- *   context.  It qlocks arenas_and_slabs_lock, then does the reclaim.
+ *   poke the CV if the first waiter is likely to succeed.  For now, MEM_WAIT
+ *   allocations from a base arena wait on the reclaim ktask (reclaim.c), and
+ *   only panic if it can't free anything.
  * - There's an issue with when slab objects get deconstructed, and how that
  *   interacts with what I wanted to do with kstacks and TLB shootdowns.  I
  *   think right now (2019-09) there is a problem with it.
@@ -103,6 +103,8 @@
 #include <hash.h>
 #include <slab.h>
 #include <kthread.h>
+#include <reclaim.h>
+#include <linker_func.h>
 
 struct arena_tailq all_arenas = TAILQ_HEAD_INITIALIZER(all_arenas);
 qlock_t arenas_and_slabs_lock = QLOCK_INITIALIZER(arenas_and_slabs_lock);
@@ -805,10 +807,13 @@ static bool get_more_resources(struct arena *arena, size_t size, int flags)
 			return FALSE;
 		}
 	} else {
-		/* TODO: allow blocking */
-		if (!(flags & MEM_ATOMIC))
+		if (flags & MEM_ATOMIC) {
+			reclaim_poke();
+			return FALSE;
+		}
+		/* MEM_WAIT: give reclaim a chance.  Our caller will retry. */
+		if (!reclaim_wait(size))
 			panic("OOM!");
-		return FALSE;
 	}
 	return TRUE;
 }
@@ -1452,6 +1457,35 @@ size_t arena_amt_total(struct arena *arena)
 	return arena->amt_total_segs;
 }
 
+/* Shrinker for the qcaches: gives their cached segments back to their arenas.
+ * This runs after the page map shrinkers, which free pages to the kpages
+ * qcaches. */
+static size_t arena_qcache_shrink(struct shrinker *s, size_t goal)
+{
+	struct arena *a_i;
+	size_t amt = 0;
+
+	qlock(&arenas_and_slabs_lock);
+	TAILQ_FOREACH(a_i, &all_arenas, next) {
+		for (int i = 0; i < a_i->qcache_max / a_i->quantum; i++)
+			amt += kmem_cache_reap(&a_i->qcaches[i]);
+	}
+	qunlock(&arenas_and_slabs_lock);
+	return amt;
+}
+
+static struct shrinker arena_qcache_shrinker = {
+	.name = "arena_qcaches",
+	.priority = SHRINKER_PRIO_SLAB,
+	.shrink = arena_qcache_shrink,
+};
+
+static void __init arena_reclaim_init(void)
+{
+	register_shrinker(&arena_qcache_shrinker);
+}
+init_func_2(arena_reclaim_init);
+
 void add_importing_arena(struct arena *source, struct arena *importer)
 {
 	qlock(&arenas_and_slabs_lock);
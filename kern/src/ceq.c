@@ -14,6 +14,10 @@
 #include <stdio.h>
 #include <umem.h>
 
+#define NR_RING_TRIES 10
+/* Most ring slots we claim at once in send_ceq_msgs() */
+#define CEQ_BULK_MAX 16
+
 static void error_addr(struct ceq *ceq, struct proc *p, void *addr)
 {
 	printk("[kernel] Invalid ceq (%p) bad addr %p for proc %d\n", ceq,
@@ -31,20 +35,17 @@ static void ceq_update_max_event(struct ceq *ceq, unsigned int new_max)
 	} while (!atomic_cas(&ceq->max_event_ever, old_max, new_max));
 }
 
-void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
+/* Coalesces msg into its ceq_event.  Returns TRUE if the caller needs to post
+ * the event's idx to the ring. */
+static bool ceq_coalesce_msg(struct ceq *ceq, struct proc *p,
+			     struct event_msg *msg)
 {
 	struct ceq_event *ceq_ev;
-	int32_t *ring_slot;
-	unsigned long my_slot;
-	int loops = 0;
-	#define NR_RING_TRIES 10
 
-	/* should have been checked by the kernel func that called us */
-	assert(is_user_rwaddr(ceq, sizeof(struct ceq)));
 	if (msg->ev_type >= ceq->nr_events) {
 		printk("[kernel] CEQ %p too small.  Wanted %d, had %d\n", ceq,
 		       msg->ev_type, ceq->nr_events);
-		return;
+		return FALSE;
 	}
 	ceq_update_max_event(ceq, msg->ev_type);
 	/* ACCESS_ONCE, prevent the compiler from rereading ceq->events later,
@@ -52,7 +53,7 @@ void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 	ceq_ev = &(ACCESS_ONCE(ceq->events))[msg->ev_type];
 	if (!is_user_rwaddr(ceq_ev, sizeof(struct ceq_event))) {
 		error_addr(ceq, p, ceq);
-		return;
+		return FALSE;
 	}
 	/* ideally, we'd like the blob to be posted after the coal, so that the
 	 * 'reason' for the blob is present when the blob is.  but we can't
@@ -71,7 +72,7 @@ void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 		break;
 	default:
 		printk("[kernel] CEQ %p invalid op %d\n", ceq, ceq->operation);
-		return;
+		return FALSE;
 	}
 	/* write before checking if we need to post (covered by the atomic) */
 	if (ceq_ev->idx_posted) {
@@ -80,7 +81,7 @@ void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 		 * ever have exit codes or something from send_*_msg, then we
 		 * can tell the kernel to not bother with INDIRS/IPIs/etc.  This
 		 * is unnecessary now since INDIRs are throttled */
-		return;
+		return FALSE;
 	}
 	/* at this point, we need to make sure the cons looks at our entry.  it
 	 * may have already done so while we were mucking around, but 'poking'
@@ -89,12 +90,23 @@ void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 	/* idx_posted write happens before the writes posting it.  the following
 	 * atomic provides the cpu mb() */
 	cmb();
+	return TRUE;
+}
+
+/* Posts nr event idxs to the ring, claiming all of their slots with one CAS. */
+static void ceq_post_ring(struct ceq *ceq, struct proc *p, int32_t *ev_types,
+			  unsigned int nr)
+{
+	int32_t *ring_slot;
+	unsigned long my_slot;
+	int loops = 0;
+
 	/* I considered checking the buffer for full-ness or the ceq overflow
-	 * here.  Those would be reads, which would require a wrmb() right above
-	 * for every ring post, all for something we check for later anyways and
-	 * for something that should be rare.  In return, when we are
-	 * overflowed, which should be rare if the user sizes their ring buffer
-	 * appropriately, we go through a little more hassle below. */
+	 * before setting idx_posted.  Those would be reads, which would require
+	 * a wrmb() for every ring post, all for something we check for later
+	 * anyways and for something that should be rare.  In return, when we
+	 * are overflowed, which should be rare if the user sizes their ring
+	 * buffer appropriately, we go through a little more hassle below. */
 	/* I tried doing this with fetch_and_add to avoid the while loop and
 	 * picking a number of times to try.  The trick is that you need to back
 	 * out, and could have multiple producers working on the same slot.
@@ -103,12 +115,15 @@ void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 	 * since there'd only be one consumer.  Theoretically, you could have a
 	 * producer delayed a long time that just clobbers an index at some
 	 * point in the future, or leaves an index in the non-init state (-1).
-	 * It's a mess. */
+	 * It's a mess.
+	 *
+	 * If all nr don't fit, we overflow instead of posting some of them.
+	 * The consumer's recovery will find all of the idx_posted events. */
 	do {
 		cmb();	/* reread the indices */
 		my_slot = atomic_read(&ceq->prod_idx);
-		if (__ring_full(ceq->ring_sz, my_slot,
-		                atomic_read(&ceq->cons_pub_idx))) {
+		if (__ring_nr_empty(ceq->ring_sz, my_slot,
+		                    atomic_read(&ceq->cons_pub_idx)) < nr) {
 			ceq->ring_overflowed = TRUE;
 			return;
 		}
@@ -116,18 +131,50 @@ void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 			ceq->ring_overflowed = TRUE;
 			return;
 		}
-	} while (!atomic_cas(&ceq->prod_idx, my_slot, my_slot + 1));
-	/* ring_slot is a user pointer, calculated by ring, my_slot, and sz */
-	ring_slot = &(ACCESS_ONCE(ceq->ring))[my_slot & (ceq->ring_sz - 1)];
-	if (!is_user_rwaddr(ring_slot, sizeof(int32_t))) {
-		/* This is a serious user error.  We're just bailing out, and
-		 * any consumers might be spinning waiting on us to produce.
-		 * Probably not though, since the ring slot is bad memory. */
-		error_addr(ceq, p, ring_slot);
-		return;
+	} while (!atomic_cas(&ceq->prod_idx, my_slot, my_slot + nr));
+	for (int i = 0; i < nr; i++) {
+		/* ring_slot is a user pointer, calculated by ring, my_slot, and
+		 * sz */
+		ring_slot = &(ACCESS_ONCE(ceq->ring))[(my_slot + i) &
+						      (ceq->ring_sz - 1)];
+		if (!is_user_rwaddr(ring_slot, sizeof(int32_t))) {
+			/* This is a serious user error.  We're just bailing
+			 * out, and any consumers might be spinning waiting on
+			 * us to produce.  Probably not though, since the ring
+			 * slot is bad memory. */
+			error_addr(ceq, p, ring_slot);
+			return;
+		}
+		/* At this point, we have a valid slot */
+		*ring_slot = ev_types[i];
+	}
+}
+
+void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
+{
+	send_ceq_msgs(ceq, p, msg, 1);
+}
+
+/* Sends nr messages to the ceq.  Each message is coalesced into its event, and
+ * the events that need to be posted share one claim of ring slots. */
+void send_ceq_msgs(struct ceq *ceq, struct proc *p, struct event_msg *msgs,
+                   unsigned int nr)
+{
+	int32_t ev_types[CEQ_BULK_MAX];
+	unsigned int nr_post = 0;
+
+	/* should have been checked by the kernel func that called us */
+	assert(is_user_rwaddr(ceq, sizeof(struct ceq)));
+	for (int i = 0; i < nr; i++) {
+		if (ceq_coalesce_msg(ceq, p, &msgs[i]))
+			ev_types[nr_post++] = msgs[i].ev_type;
+		if (nr_post == CEQ_BULK_MAX) {
+			ceq_post_ring(ceq, p, ev_types, nr_post);
+			nr_post = 0;
+		}
 	}
-	/* At this point, we have a valid slot */
-	*ring_slot = msg->ev_type;
+	if (nr_post)
+		ceq_post_ring(ceq, p, ev_types, nr_post);
 }
 
 void ceq_dumper(int pid, struct event_queue *ev_q)
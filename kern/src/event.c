@@ -17,6 +17,9 @@
 #include <assert.h>
 #include <pmap.h>
 #include <schedule.h>
+#include <kthread.h>
+#include <err.h>
+#include <syscall.h>
 
 /* Note these three helpers return the user address of the mbox, not the KVA.
  * Load current to access this, and it will work for any process. */
@@ -61,31 +64,38 @@ static void send_evbitmap_msg(struct evbitmap *evbm, struct event_msg *msg)
 	evbm->check_bits = TRUE;
 }
 
-/* Posts a message to the mbox.  mbox is a pointer to user-accessible memory.
+/* Posts nr messages to the mbox.  mbox is a pointer to user-accessible memory.
  * If mbox is a user-provided pointer, make sure that you've checked it.
  * Regardless make sure you have that process's address space loaded. */
-static void post_ev_msg(struct proc *p, struct event_mbox *mbox,
-                        struct event_msg *msg, int ev_flags)
+static void post_ev_msgs(struct proc *p, struct event_mbox *mbox,
+                         struct event_msg *msgs, unsigned int nr, int ev_flags)
 {
-	printd("[kernel] Sending event type %d to mbox %p\n",
-	       msg->ev_type, mbox);
+	printd("[kernel] Sending %d events, type %d to mbox %p\n", nr,
+	       msgs->ev_type, mbox);
 	/* Sanity check */
 	assert(p);
 	switch (mbox->type) {
 	case (EV_MBOX_UCQ):
-		send_ucq_msg(&mbox->ucq, p, msg);
+		send_ucq_msgs(&mbox->ucq, p, msgs, nr);
 		break;
 	case (EV_MBOX_BITMAP):
-		send_evbitmap_msg(&mbox->evbm, msg);
+		for (int i = 0; i < nr; i++)
+			send_evbitmap_msg(&mbox->evbm, &msgs[i]);
 		break;
 	case (EV_MBOX_CEQ):
-		send_ceq_msg(&mbox->ceq, p, msg);
+		send_ceq_msgs(&mbox->ceq, p, msgs, nr);
 		break;
 	default:
 		printk("[kernel] Unknown mbox type %d!\n", mbox->type);
 	}
 }
 
+static void post_ev_msg(struct proc *p, struct event_mbox *mbox,
+                        struct event_msg *msg, int ev_flags)
+{
+	post_ev_msgs(p, mbox, msg, 1, ev_flags);
+}
+
 /* Helper: use this when sending a message to a VCPD mbox.  It just posts to the
  * ev_mbox and sets notif pending.  Note this uses a userspace address for the
  * VCPD (though not a user's pointer). */
@@ -365,6 +375,16 @@ static void send_indir(struct proc *p, struct event_queue *ev_q,
  * where the kernel suggests, set EVENT_VCORE_APPRO(priate). */
 void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
                 uint32_t vcoreid)
+{
+	send_event_batch(p, ev_q, msg, 1, vcoreid);
+}
+
+/* Sends nr messages to ev_q, like send_event().  The messages are posted to the
+ * mbox in bulk, and the vcore is alerted (INDIR/IPI/wakeup) once for the whole
+ * batch.  SPAM_PUBLIC ev_qs still spam each message, since each one could end
+ * up at a different vcore. */
+void send_event_batch(struct proc *p, struct event_queue *ev_q,
+                      struct event_msg *msgs, unsigned int nr, uint32_t vcoreid)
 {
 	uintptr_t old_proc;
 	struct event_mbox *ev_mbox = 0;
@@ -373,7 +393,7 @@ void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
 	assert(p);
 	if (proc_is_dying(p))
 		return;
-	printd("[kernel] sending msg to proc %p, ev_q %p\n", p, ev_q);
+	printd("[kernel] sending %d msgs to proc %p, ev_q %p\n", nr, p, ev_q);
 	assert(is_user_rwaddr(ev_q, sizeof(struct event_queue)));
 	/* ev_q is a user pointer, so we need to make sure we're in the right
 	 * address space */
@@ -409,7 +429,8 @@ void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
 	 * and we'll prefer to send it to whatever vcoreid we determined at this
 	 * point (via APPRO or whatever). */
 	if (ev_q->ev_flags & EVENT_SPAM_PUBLIC) {
-		spam_public_msg(p, msg, vcoreid, ev_q->ev_flags);
+		for (int i = 0; i < nr; i++)
+			spam_public_msg(p, &msgs[i], vcoreid, ev_q->ev_flags);
 		goto wakeup;
 	}
 	/* We aren't spamming and we know the default vcore, and now we need to
@@ -435,7 +456,7 @@ void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
 		printk("[kernel] Illegal addr for ev_mbox\n");
 		goto out;
 	}
-	post_ev_msg(p, ev_mbox, msg, ev_q->ev_flags);
+	post_ev_msgs(p, ev_mbox, msgs, nr, ev_q->ev_flags);
 	wmb();	/* ensure ev_msg write is before alerting the vcore */
 	/* Prod/alert a vcore with an IPI or INDIR, if desired.  INDIR will also
 	 * call try_notify (IPI) later */
@@ -454,6 +475,88 @@ out:
 	switch_back(p, old_proc);
 }
 
+/* Helper: sends one run of a batch, catching any faults on the user's ev_q */
+static void __event_batch_send(struct proc *p, struct event_queue *ev_q,
+                               struct event_msg *msgs, unsigned int nr)
+{
+	ERRSTACK(1);
+
+	if (waserror()) {
+		warn("Event batch for proc %d threw %s", p->pid,
+		     current_errstr());
+		poperror();
+		return;
+	}
+	send_event_batch(p, ev_q, msgs, nr, 0);
+	poperror();
+}
+
+/* Sends every run of messages for the same proc and ev_q as one batch */
+static void event_batch_flush(struct event_batch *b)
+{
+	unsigned int i = 0, run;
+
+	while (i < b->nr) {
+		run = 1;
+		while ((i + run < b->nr) &&
+		       (b->procs[i + run] == b->procs[i]) &&
+		       (b->ev_qs[i + run] == b->ev_qs[i]))
+			run++;
+		__event_batch_send(b->procs[i], b->ev_qs[i], &b->msgs[i], run);
+		i += run;
+	}
+	for (i = 0; i < b->nr; i++)
+		proc_decref(b->procs[i]);
+	b->nr = 0;
+}
+
+/* Deferred event batches.  Between event_batch_start() and event_batch_end(),
+ * event_batch_add() holds on to messages instead of sending them, so that a
+ * storm of events for the same ev_q (e.g. FD taps) shares the slot claims and
+ * the alert to the vcore.  The batch is sent when it fills and when the
+ * outermost region ends.
+ *
+ * The batch belongs to the kthread, so regions nest and can block.  If a region
+ * can throw, its waserror handler must call event_batch_end(). */
+void event_batch_start(void)
+{
+	current_kthread->ev_batch.depth++;
+}
+
+void event_batch_end(void)
+{
+	struct event_batch *b = &current_kthread->ev_batch;
+
+	assert(b->depth);
+	if (--b->depth)
+		return;
+	event_batch_flush(b);
+}
+
+/* Adds msg to the current kthread's batch, to be sent as if by send_event(p,
+ * ev_q, msg, 0).  Returns FALSE if there is no batch, in which case the caller
+ * should send it. */
+bool event_batch_add(struct proc *p, struct event_queue *ev_q,
+                     struct event_msg *msg)
+{
+	struct kthread *kth = current_kthread;
+	struct event_batch *b;
+
+	if (!kth || in_irq_ctx(&per_cpu_info[core_id()]))
+		return FALSE;
+	b = &kth->ev_batch;
+	if (!b->depth)
+		return FALSE;
+	if (b->nr == EV_BATCH_MAX)
+		event_batch_flush(b);
+	proc_incref(p, 1);
+	b->procs[b->nr] = p;
+	b->ev_qs[b->nr] = ev_q;
+	b->msgs[b->nr] = *msg;
+	b->nr++;
+	return TRUE;
+}
+
 /* Send an event for the kernel event ev_num.  These are the "one sided" kernel
  * initiated events, that require a lookup of the ev_q in procdata.  This is
  * roughly equivalent to the old "proc_notify()" */
@@ -158,6 +158,10 @@ err_with_lock:
 /* Fires off tap, with the events of filter having occurred.  Returns -1 on
  * error, though this need a little more thought.
  *
+ * If the kthread has an event batch open, the event is added to the batch and
+ * sent when the batch ends.  Callers that fire a list of taps should open a
+ * batch around the list.
+ *
  * Some callers may require this to not block. */
 int fire_tap(struct fd_tap *tap, int filter)
 {
@@ -167,6 +171,11 @@ int fire_tap(struct fd_tap *tap, int filter)
 
 	if (!fire_filt)
 		return 0;
+	ev_msg.ev_type = tap->ev_id;	/* e.g. CEQ idx */
+	ev_msg.ev_arg2 = fire_filt;	/* e.g. CEQ coalesce */
+	ev_msg.ev_arg3 = tap->data;	/* e.g. CEQ data */
+	if (event_batch_add(tap->proc, tap->ev_q, &ev_msg))
+		return 0;
 	if (waserror()) {
 		/* The process owning the tap could trigger a kernel PF, as with
 		 * any send_event() call.  Eventually we'll catch that with
@@ -176,9 +185,6 @@ int fire_tap(struct fd_tap *tap, int filter)
 		poperror();
 		return -1;
 	}
-	ev_msg.ev_type = tap->ev_id;	/* e.g. CEQ idx */
-	ev_msg.ev_arg2 = fire_filt;	/* e.g. CEQ coalesce */
-	ev_msg.ev_arg3 = tap->data;	/* e.g. CEQ data */
 	send_event(tap->proc, tap->ev_q, &ev_msg, 0);
 	poperror();
 	return 0;
@@ -0,0 +1,276 @@
+#include <radix.h>
+#include <ktest.h>
+#include <time.h>
+#include <ros/errno.h>
+#include <linker_func.h>
+
+KTEST_SUITE("RADIX")
+
+/* Any non-zero item will do */
+static void *key_item(unsigned long key)
+{
+	return (void*)(key + 1);
+}
+
+static bool test_insert_lookup(void)
+{
+	struct radix_tree tree;
+	unsigned long keys[] = {0, 1, 63, 64, 4095, 4096, 1UL << 30,
+	                        1UL << 40};
+
+	radix_tree_init(&tree);
+	for (int i = 0; i < ARRAY_SIZE(keys); i++)
+		KT_ASSERT(!radix_insert(&tree, keys[i], key_item(keys[i]),
+					NULL));
+	KT_ASSERT(radix_insert(&tree, 64, key_item(64), NULL) == -EEXIST);
+	for (int i = 0; i < ARRAY_SIZE(keys); i++)
+		KT_ASSERT(radix_lookup(&tree, keys[i]) == key_item(keys[i]));
+	KT_ASSERT(!radix_lookup(&tree, 2));
+	KT_ASSERT(!radix_lookup(&tree, (1UL << 40) + 1));
+	for (int i = 0; i < ARRAY_SIZE(keys); i++)
+		KT_ASSERT(radix_delete(&tree, keys[i]) == key_item(keys[i]));
+	radix_tree_destroy(&tree);
+	return true;
+}
+
+static bool test_gang_lookup(void)
+{
+	struct radix_tree tree;
+	void *items[16];
+	unsigned long idx[16];
+	unsigned int nr;
+
+	radix_tree_init(&tree);
+	/* Every third key, across a few leaves */
+	for (unsigned long i = 0; i < 300; i += 3)
+		KT_ASSERT(!radix_insert(&tree, i, key_item(i), NULL));
+	nr = radix_gang_lookup(&tree, items, idx, 0, 16);
+	KT_ASSERT(nr == 16);
+	for (int i = 0; i < nr; i++) {
+		KT_ASSERT(idx[i] == i * 3);
+		KT_ASSERT(items[i] == key_item(i * 3));
+	}
+	/* Starting between items, and crossing a leaf */
+	nr = radix_gang_lookup(&tree, items, idx, 61, 4);
+	KT_ASSERT(nr == 4);
+	KT_ASSERT(idx[0] == 63 && idx[1] == 66 && idx[3] == 72);
+	/* Near the end */
+	nr = radix_gang_lookup(&tree, NULL, idx, 290, 16);
+	KT_ASSERT(nr == 3);
+	KT_ASSERT(idx[2] == 297);
+	KT_ASSERT(!radix_gang_lookup(&tree, items, idx, 298, 16));
+	KT_ASSERT(!radix_gang_lookup(&tree, items, idx, 1UL << 20, 16));
+	for (unsigned long i = 0; i < 300; i += 3)
+		radix_delete(&tree, i);
+	radix_tree_destroy(&tree);
+	return true;
+}
+
+static bool test_tag_gang_lookup(void)
+{
+	struct radix_tree tree;
+	unsigned long idx[16];
+	unsigned int nr;
+
+	radix_tree_init(&tree);
+	for (unsigned long i = 0; i < 10000; i++)
+		KT_ASSERT(!radix_insert(&tree, i, key_item(i), NULL));
+	KT_ASSERT(!radix_tree_tagged(&tree, 0));
+	radix_tag_set(&tree, 5, 0);
+	radix_tag_set(&tree, 4097, 0);
+	radix_tag_set(&tree, 9999, 0);
+	radix_tag_set(&tree, 4097, 1);
+	KT_ASSERT(radix_tree_tagged(&tree, 0));
+	KT_ASSERT(radix_tag_get(&tree, 4097, 0));
+	KT_ASSERT(!radix_tag_get(&tree, 4096, 0));
+	nr = radix_tag_gang_lookup(&tree, NULL, idx, 0, 16, 0);
+	KT_ASSERT(nr == 3);
+	KT_ASSERT(idx[0] == 5 && idx[1] == 4097 && idx[2] == 9999);
+	nr = radix_tag_gang_lookup(&tree, NULL, idx, 6, 16, 1);
+	KT_ASSERT(nr == 1 && idx[0] == 4097);
+	radix_tag_clear(&tree, 4097, 0);
+	nr = radix_tag_gang_lookup(&tree, NULL, idx, 0, 16, 0);
+	KT_ASSERT(nr == 2 && idx[1] == 9999);
+	/* Deleting a tagged item clears its tags */
+	radix_delete(&tree, 9999);
+	radix_delete(&tree, 5);
+	KT_ASSERT(!radix_tree_tagged(&tree, 0));
+	for (unsigned long i = 0; i < 9999; i++) {
+		if (i != 5)
+			radix_delete(&tree, i);
+	}
+	radix_tree_destroy(&tree);
+	return true;
+}
+
+static bool count_cb(void **slot, unsigned long tree_idx, void *arg)
+{
+	unsigned long *count = arg;
+
+	(*count)++;
+	return false;
+}
+
+static bool test_multi_order(void)
+{
+	struct radix_tree tree;
+	void *item = key_item(512);
+	void *items[4];
+	unsigned long idx[4];
+	unsigned long count = 0;
+	unsigned int nr;
+
+	radix_tree_init(&tree);
+	KT_ASSERT(!radix_insert(&tree, 3, key_item(3), NULL));
+	/* A 2MB range of 4K pages: 512 keys */
+	KT_ASSERT(radix_insert_order(&tree, 500, 9, item, NULL) == -EINVAL);
+	KT_ASSERT(!radix_insert_order(&tree, 512, 9, item, NULL));
+	KT_ASSERT(!radix_insert(&tree, 1024, key_item(1024), NULL));
+	KT_ASSERT(radix_lookup(&tree, 512) == item);
+	KT_ASSERT(radix_lookup(&tree, 777) == item);
+	KT_ASSERT(radix_lookup(&tree, 1023) == item);
+	KT_ASSERT(radix_lookup(&tree, 1024) == key_item(1024));
+	KT_ASSERT(radix_lookup_slot(&tree, 1000) ==
+		  radix_lookup_slot(&tree, 512));
+	KT_ASSERT(radix_insert(&tree, 700, key_item(700), NULL) == -EEXIST);
+	KT_ASSERT(radix_insert_order(&tree, 0, 10, item, NULL) == -EEXIST);
+	/* A gang lookup inside the range finds the entry once */
+	nr = radix_gang_lookup(&tree, items, idx, 600, 4);
+	KT_ASSERT(nr == 2);
+	KT_ASSERT(idx[0] == 512 && items[0] == item);
+	KT_ASSERT(idx[1] == 1024);
+	radix_for_each_slot(&tree, count_cb, &count);
+	KT_ASSERT(count == 3);
+	/* Tags are per entry */
+	radix_tag_set(&tree, 900, 0);
+	KT_ASSERT(radix_tag_get(&tree, 512, 0));
+	nr = radix_tag_gang_lookup(&tree, NULL, idx, 0, 4, 0);
+	KT_ASSERT(nr == 1 && idx[0] == 512);
+	/* Deleting by any key removes the whole entry */
+	KT_ASSERT(radix_delete(&tree, 800) == item);
+	KT_ASSERT(!radix_lookup(&tree, 512));
+	KT_ASSERT(!radix_lookup(&tree, 1023));
+	KT_ASSERT(!radix_tree_tagged(&tree, 0));
+	KT_ASSERT(!radix_insert(&tree, 700, key_item(700), NULL));
+	radix_delete(&tree, 700);
+	radix_delete(&tree, 3);
+	radix_delete(&tree, 1024);
+	radix_tree_destroy(&tree);
+	return true;
+}
+
+static bool test_preload(void)
+{
+	struct radix_tree tree;
+
+	radix_tree_init(&tree);
+	KT_ASSERT(!radix_preload(&tree, MEM_WAIT));
+	KT_ASSERT(tree.nr_preload == 1);
+	KT_ASSERT(!radix_insert(&tree, 0, key_item(0), NULL));
+	KT_ASSERT(tree.nr_preload == 0);
+	KT_ASSERT(!radix_preload(&tree, MEM_WAIT));
+	/* Growing a level and adding a leaf */
+	KT_ASSERT(tree.nr_preload == 2);
+	KT_ASSERT(!radix_insert(&tree, 100, key_item(100), NULL));
+	KT_ASSERT(tree.nr_preload == 0);
+	KT_ASSERT(!radix_preload(&tree, MEM_WAIT));
+	radix_delete(&tree, 0);
+	radix_delete(&tree, 100);
+	radix_tree_destroy(&tree);
+	KT_ASSERT(tree.nr_preload == 0);
+	return true;
+}
+
+#define BENCH_NR_KEYS (1 << 20)
+#define BENCH_GANG 64
+
+/* Not much of a test: it prints how long lookups take in a 1M item tree, one
+ * key at a time vs. with gang lookups. */
+static bool test_bench(void)
+{
+	struct radix_tree tree;
+	void *items[BENCH_GANG];
+	unsigned long idx[BENCH_GANG];
+	unsigned long next, count;
+	uint64_t t0, t_insert, t_lookup, t_gang, t_tag_lookup, t_tag_gang;
+	unsigned int nr;
+
+	radix_tree_init(&tree);
+	t0 = read_tsc();
+	for (unsigned long i = 0; i < BENCH_NR_KEYS; i++) {
+		radix_preload(&tree, MEM_WAIT);
+		KT_ASSERT(!radix_insert(&tree, i, key_item(i), NULL));
+	}
+	t_insert = read_tsc() - t0;
+	/* Tag every 64th item, like a mostly-clean page cache */
+	for (unsigned long i = 0; i < BENCH_NR_KEYS; i += 64)
+		radix_tag_set(&tree, i, 0);
+
+	t0 = read_tsc();
+	count = 0;
+	for (unsigned long i = 0; i < BENCH_NR_KEYS; i++) {
+		if (radix_lookup(&tree, i))
+			count++;
+	}
+	t_lookup = read_tsc() - t0;
+	KT_ASSERT(count == BENCH_NR_KEYS);
+
+	t0 = read_tsc();
+	count = 0;
+	next = 0;
+	while ((nr = radix_gang_lookup(&tree, items, idx, next, BENCH_GANG))) {
+		count += nr;
+		next = idx[nr - 1] + 1;
+	}
+	t_gang = read_tsc() - t0;
+	KT_ASSERT(count == BENCH_NR_KEYS);
+
+	t0 = read_tsc();
+	count = 0;
+	for (unsigned long i = 0; i < BENCH_NR_KEYS; i++) {
+		if (radix_tag_get(&tree, i, 0))
+			count++;
+	}
+	t_tag_lookup = read_tsc() - t0;
+	KT_ASSERT(count == BENCH_NR_KEYS / 64);
+
+	t0 = read_tsc();
+	count = 0;
+	next = 0;
+	while ((nr = radix_tag_gang_lookup(&tree, NULL, idx, next, BENCH_GANG,
+					   0))) {
+		count += nr;
+		next = idx[nr - 1] + 1;
+	}
+	t_tag_gang = read_tsc() - t0;
+	KT_ASSERT(count == BENCH_NR_KEYS / 64);
+
+	printk("radix bench, %d items, usec:\n", BENCH_NR_KEYS);
+	printk("\tinsert (preloaded) %llu\n", tsc2usec(t_insert));
+	printk("\tlookup each        %llu\n", tsc2usec(t_lookup));
+	printk("\tgang lookup (%d)   %llu\n", BENCH_GANG, tsc2usec(t_gang));
+	printk("\ttag_get each       %llu\n", tsc2usec(t_tag_lookup));
+	printk("\ttag gang lookup    %llu\n", tsc2usec(t_tag_gang));
+
+	for (unsigned long i = 0; i < BENCH_NR_KEYS; i++)
+		radix_delete(&tree, i);
+	radix_tree_destroy(&tree);
+	return true;
+}
+
+static struct ktest ktests[] = {
+	KTEST_REG(insert_lookup,	CONFIG_KTEST_RADIX),
+	KTEST_REG(gang_lookup,		CONFIG_KTEST_RADIX),
+	KTEST_REG(tag_gang_lookup,	CONFIG_KTEST_RADIX),
+	KTEST_REG(multi_order,		CONFIG_KTEST_RADIX),
+	KTEST_REG(preload,		CONFIG_KTEST_RADIX),
+	KTEST_REG(bench,		CONFIG_KTEST_RADIX),
+};
+
+static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
+
+static void __init register_radix_ktests(void)
+{
+	REGISTER_KTESTS(ktests, num_ktests);
+}
+init_func_1(register_radix_ktests);
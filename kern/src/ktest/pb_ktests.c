@@ -47,6 +47,8 @@
 #include <rendez.h>
 #include <ktest.h>
 #include <smallidpool.h>
+#include <ns.h>
+#include <net/ip.h>
 #include <linker_func.h>
 
 KTEST_SUITE("POSTBOOT")
@@ -2059,6 +2061,205 @@ static bool test_percpu_increment(void)
 	return true;
 }
 
+/* Called with IRQs off, so nothing else on this core can grab our block.  The
+ * asserts can return early, so our caller turns IRQs back on. */
+static bool __test_block_pool_recycle(void)
+{
+	struct block *b, *old_b;
+	struct block *bps[4];
+
+	b = block_alloc(1500, MEM_ATOMIC);
+	KT_ASSERT(b && b->pool);
+	KT_ASSERT(b->lim - b->rp >= 1500);
+	old_b = b;
+	freeb(b);
+	b = block_alloc(1000, MEM_ATOMIC);
+	KT_ASSERT_M("Didn't recycle the block", b == old_b);
+	KT_ASSERT(BHLEN(b) == 0 && !b->extra_len && !b->next);
+
+	/* Someone else holds a ref, so it must not go back to the pool */
+	kmalloc_incref(b);
+	freeb(b);
+	b = block_alloc(1000, MEM_ATOMIC);
+	KT_ASSERT_M("Recycled a shared block", b != old_b);
+	kfree(old_b);
+	freeb(b);
+
+	KT_ASSERT(block_alloc_bulk(bps, ARRAY_SIZE(bps), 1500, MEM_ATOMIC) ==
+		  ARRAY_SIZE(bps));
+	KT_ASSERT(bps[0] == b);
+	for (int i = 0; i < ARRAY_SIZE(bps); i++)
+		freeb(bps[i]);
+	return true;
+}
+
+static bool test_block_pool(void)
+{
+	struct block *b;
+	bool ok;
+
+	disable_irq();
+	ok = __test_block_pool_recycle();
+	enable_irq();
+	if (!ok)
+		return false;
+
+	/* Small blocks don't use the pools */
+	b = block_alloc(64, MEM_WAIT);
+	KT_ASSERT(!b->pool);
+	freeb(b);
+	return true;
+}
+
+/* Network order ones' complement sum, a halfword at a time */
+static uint16_t ref_bsum(uint8_t *p, int len)
+{
+	uint32_t sum = 0;
+
+	for (int i = 0; i + 1 < len; i += 2)
+		sum += p[i] << 8 | p[i + 1];
+	if (len & 1)
+		sum += p[len - 1] << 8;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+static uint64_t csum_bench_mbps(size_t bytes, uint64_t t0)
+{
+	return bytes / MAX(tsc2usec(read_tsc() - t0), 1);
+}
+
+/* Checks one checksum kernel on every short length from every offset, on big
+ * buffers, and on all ones. */
+static bool __check_bsum_kernel(struct ptclbsum_kernel *k, uint8_t *src,
+				const int *sizes, int nr_sizes)
+{
+	for (int off = 0; off < 8; off++) {
+		for (int len = 0; len < 300; len++)
+			KT_ASSERT_M("checksum kernel is wrong",
+				    k->bsum(src + off, len) ==
+				    ref_bsum(src + off, len));
+		for (int i = 0; i < nr_sizes; i++)
+			KT_ASSERT_M("checksum kernel is wrong on big buffers",
+				    k->bsum(src + off, sizes[i]) ==
+				    ref_bsum(src + off, sizes[i]));
+	}
+	KT_ASSERT_M("checksum kernel is wrong on all ones",
+		    k->bsum(src + 4096, 4096) == 0xffff);
+	return true;
+}
+
+static bool test_ptclbsum(void)
+{
+	static const int sizes[] = {64, 576, 1500, 9000, 65536};
+	const size_t max = 65536 + 64;
+	const size_t bench_bytes = 8 << 20;
+	uint8_t *src = kmalloc(max, MEM_WAIT);
+	uint8_t *dst = kmalloc(max, MEM_WAIT);
+	uint8_t *ebuf;
+	struct block *b;
+	uint16_t sum;
+	uint64_t t0, rate[4];
+	int nr;
+
+	for (int i = 0; i < max; i++)
+		src[i] = read_tsc() * 2654435761U >> 13;
+	/* All ones words end adc chains with a carry out */
+	memset(src + 4096, 0xff, 4096);
+
+	for (int i = 0; i < nr_ptclbsum_kernels; i++) {
+		if (!ptclbsum_kernels[i].usable) {
+			printk("ptclbsum: skipping %s, not supported\n",
+			       ptclbsum_kernels[i].name);
+			continue;
+		}
+		if (!__check_bsum_kernel(&ptclbsum_kernels[i], src, sizes,
+					 ARRAY_SIZE(sizes)))
+			return false;
+	}
+	for (int off = 0; off < 8; off++) {
+		for (int len = 0; len < 300; len++) {
+			KT_ASSERT_M("ptclbsum is wrong",
+				    ptclbsum(src + off, len) ==
+				    ref_bsum(src + off, len));
+			memset(dst, 0, len + 8);
+			sum = ptclbcopysum(dst + off, src + off, len);
+			KT_ASSERT_M("ptclbcopysum sum is wrong",
+				    sum == ref_bsum(src + off, len));
+			KT_ASSERT_M("ptclbcopysum copy is wrong",
+				    !memcmp(dst + off, src + off, len));
+			KT_ASSERT_M("ptclbcopysum wrote too much",
+				    !dst[off + len]);
+		}
+		for (int i = 0; i < ARRAY_SIZE(sizes); i++)
+			KT_ASSERT_M("ptclbsum is wrong on big buffers",
+				    ptclbsum(src + off, sizes[i]) ==
+				    ref_bsum(src + off, sizes[i]));
+	}
+	KT_ASSERT(ptclbsum(src + 4096, 4096) == 0xffff);
+
+	/* Extra data with and without a saved sum, from every offset */
+	b = block_alloc(64, MEM_WAIT);
+	memcpy(b->wp, src, 20);
+	b->wp += 20;
+	ebuf = kmalloc(1000, MEM_WAIT);
+	block_append_extra(b, (uintptr_t)ebuf, 0, 1000, MEM_WAIT);
+	b->extra_data[0].csum = ptclbcopysum(ebuf, src + 20, 1000);
+	b->extra_data[0].csum_len = 1000;
+	ebuf = kmalloc(501, MEM_WAIT);
+	memcpy(ebuf, src + 1020, 501);
+	block_append_extra(b, (uintptr_t)ebuf, 0, 501, MEM_WAIT);
+	for (int off = 0; off < BLEN(b); off += 7)
+		KT_ASSERT_M("ptclcsum is wrong on extra data",
+			    ptclcsum(b, off, BLEN(b) - off) ==
+			    (~ref_bsum(src + off, BLEN(b) - off) & 0xffff));
+	freeb(b);
+
+	printk("ptclbsum MB/s: size, bytewise, ptclbsum, memcpy+ptclbsum, ptclbcopysum");
+	for (int k = 0; k < nr_ptclbsum_kernels; k++) {
+		if (ptclbsum_kernels[k].usable)
+			printk(", %s", ptclbsum_kernels[k].name);
+	}
+	printk("\n");
+	for (int i = 0; i < ARRAY_SIZE(sizes); i++) {
+		nr = MAX(bench_bytes / sizes[i], 1);
+		t0 = read_tsc();
+		for (int j = 0; j < nr; j++)
+			ref_bsum(src, sizes[i]);
+		rate[0] = csum_bench_mbps((size_t)nr * sizes[i], t0);
+		t0 = read_tsc();
+		for (int j = 0; j < nr; j++)
+			ptclbsum(src, sizes[i]);
+		rate[1] = csum_bench_mbps((size_t)nr * sizes[i], t0);
+		t0 = read_tsc();
+		for (int j = 0; j < nr; j++) {
+			memcpy(dst, src, sizes[i]);
+			ptclbsum(dst, sizes[i]);
+		}
+		rate[2] = csum_bench_mbps((size_t)nr * sizes[i], t0);
+		t0 = read_tsc();
+		for (int j = 0; j < nr; j++)
+			ptclbcopysum(dst, src, sizes[i]);
+		rate[3] = csum_bench_mbps((size_t)nr * sizes[i], t0);
+		printk("\t%6d %8llu %8llu %8llu %8llu", sizes[i], rate[0],
+		       rate[1], rate[2], rate[3]);
+		for (int k = 0; k < nr_ptclbsum_kernels; k++) {
+			if (!ptclbsum_kernels[k].usable)
+				continue;
+			t0 = read_tsc();
+			for (int j = 0; j < nr; j++)
+				ptclbsum_kernels[k].bsum(src, sizes[i]);
+			printk(" %8llu",
+			       csum_bench_mbps((size_t)nr * sizes[i], t0));
+		}
+		printk("\n");
+	}
+	kfree(src);
+	kfree(dst);
+	return true;
+}
+
 static struct ktest ktests[] = {
 #ifdef CONFIG_X86
 	KTEST_REG(ipi_sending,        CONFIG_TEST_ipi_sending),
@@ -2095,6 +2296,8 @@ static struct ktest ktests[] = {
 	KTEST_REG(cmdline_parse,      CONFIG_TEST_cmdline_parse),
 	KTEST_REG(percpu_zalloc,      CONFIG_TEST_percpu_zalloc),
 	KTEST_REG(percpu_increment,   CONFIG_TEST_percpu_increment),
+	KTEST_REG(block_pool,         CONFIG_TEST_block_pool),
+	KTEST_REG(ptclbsum,           CONFIG_TEST_ptclbsum),
 };
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
 
@@ -28,8 +28,16 @@
 #include <tree_file.h>
 
 /* These are the only mmap flags that are saved in the VMR.  If we implement
- * more of the mmap interface, we may need to grow this. */
-#define MAP_PERSIST_FLAGS	(MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS)
+ * more of the mmap interface, we may need to grow this.  fork() needs to know
+ * which VMRs are locked or populated. */
+#define MAP_PERSIST_FLAGS	(MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS | \
+				 MAP_LOCKED | MAP_POPULATE)
+
+/* On a file-backed PF, we'll also map any cached pages in this (aligned) window
+ * around the faulting address. */
+#define FAULT_AROUND_NR_PGS	16
+/* Max pages populate_{pm,anon}_va() handle per batch. */
+#define POPULATE_BATCH_NR_PGS	32
 
 struct kmem_cache *vmr_kcache;
 
@@ -37,6 +45,7 @@ static int __vmr_free_pgs(struct proc *p, pte_t pte, void *va, void *arg);
 static int populate_pm_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
                           int pte_prot, struct page_map *pm, size_t offset,
                           int flags, bool exec);
+static bool prot_has_access(int prot);
 
 static struct page_map *foc_to_pm(struct file_or_chan *foc)
 {
@@ -492,9 +501,9 @@ void unmap_and_destroy_vmrs(struct proc *p)
 	spin_unlock(&p->vmr_lock);
 }
 
-/* Helper: copies the contents of pages from p to new p.  For pages that aren't
- * present, once we support swapping or CoW, we can do something more
- * intelligent.  0 on success, -ERROR on failure.  Can't handle jumbos. */
+/* Helper: copies the contents of pages from p to new p, for memory we can't
+ * share copy-on-write (see fill_vmr()).  0 on success, -ERROR on failure.
+ * Can't handle jumbos. */
 static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
                       uintptr_t va_end)
 {
@@ -547,6 +556,86 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 	return ret;
 }
 
+/* Helper: shares the pages of p with new_p, copy-on-write.  Both processes
+ * map the same physical page read-only and each holds a reference on it.  The
+ * first write from either side faults, and __hpf_cow() gives the writer its own
+ * copy (or just the write permission, if it was the last user).  This makes
+ * fork's cost proportional to the page tables, not to the resident memory.
+ *
+ * Only works for private VMRs: anonymous memory, the private copies of file
+ * pages, and read-only page cache pages.  0 on success, -ERROR on failure.  Can't handle jumbos. */
+static int cow_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
+                     uintptr_t va_end)
+{
+	int ret;
+	bool shootdown_needed = FALSE;
+
+	/* Sanity checks.  If these fail, we had a screwed up VMR.
+	 * Check for: alignment, wraparound, or userspace addresses */
+	if ((PGOFF(va_start)) ||
+	    (PGOFF(va_end)) ||
+	    (va_end < va_start) ||/* now, start > UMAPTOP -> end > UMAPTOP */
+	    (va_end > UMAPTOP)) {
+		warn("VMR mapping is probably screwed up (%p - %p)", va_start,
+		     va_end);
+		return -EINVAL;
+	}
+	int cow_page(struct proc *p, pte_t pte, void *va, void *arg) {
+		struct proc *new_p = (struct proc*)arg;
+		struct page *pp;
+
+		if (pte_is_unmapped(pte))
+			return 0;
+		/* pages could be !P, but right now that's only for file backed
+		 * VMRs undergoing page removal, which isn't the caller of
+		 * cow_pages, or for PROT_NONE pages, which we share like any
+		 * other. */
+		if (pte_is_mapped(pte)) {
+			/* TODO: check for jumbos */
+			pp = pa2page(pte_get_paddr(pte));
+			/* Page cache pages from fault around are already
+			 * read-only, and the child's VMR keeps them in the PM,
+			 * like the parent's.  The PTE takes no ref. */
+			if (page_is_pagemap(pp)) {
+				if (page_insert(new_p->env_pgdir, pp, va,
+						pte_get_settings(pte)))
+					return -ENOMEM;
+				return 0;
+			}
+			/* Write-protect the parent first.  Whoever writes
+			 * first will get a copy in __hpf_cow(). */
+			if (pte_has_perm_urw(pte)) {
+				pte_replace_perm(pte, PTE_USER_RO);
+				shootdown_needed = TRUE;
+			}
+			page_incref(pp);
+			if (page_insert(new_p->env_pgdir, pp, va,
+					pte_get_settings(pte))) {
+				page_decref(pp);
+				return -ENOMEM;
+			}
+		} else if (pte_is_paged_out(pte)) {
+			/* TODO: (SWAP) will need to either make a copy or
+			 * CoW/refcnt the backend store.  For now, this PTE will
+			 * be the same as the original PTE */
+			panic("Swapping not supported!");
+		} else {
+			panic("Weird PTE %p in %s!", pte_print(pte),
+			      __FUNCTION__);
+		}
+		return 0;
+	}
+	spin_lock(&p->pte_lock);	/* walking and changing PTEs */
+	ret = env_user_mem_walk(p, (void*)va_start, va_end - va_start,
+				&cow_page, new_p);
+	spin_unlock(&p->pte_lock);
+	/* Even on failure, we might have write-protected some of the parent's
+	 * pages.  That's fine, they'll fault and get the W back. */
+	if (shootdown_needed)
+		proc_tlbshootdown(p, va_start, va_end);
+	return ret;
+}
+
 static int fill_vmr(struct proc *p, struct proc *new_p, struct vm_region *vmr)
 {
 	int ret = 0;
@@ -554,23 +643,40 @@ static int fill_vmr(struct proc *p, struct proc *new_p, struct vm_region *vmr)
 	if (!vmr_has_file(vmr) || (vmr->vm_flags & MAP_PRIVATE)) {
 		/* We don't support ANON + SHARED yet */
 		assert(!(vmr->vm_flags & MAP_SHARED));
-		ret = copy_pages(p, new_p, vmr->vm_base, vmr->vm_end);
+		/* The kernel writes to locked and populated memory, e.g. UCQs
+		 * and event queues, from IRQ context or holding locks, where it
+		 * can't take a CoW fault.  Those get their copies now. */
+		if (vmr->vm_flags & (MAP_LOCKED | MAP_POPULATE))
+			ret = copy_pages(p, new_p, vmr->vm_base, vmr->vm_end);
+		else
+			ret = cow_pages(p, new_p, vmr->vm_base, vmr->vm_end);
 	} else {
 		/* non-private file, i.e. page cacheable.  we have to honor
 		 * MAP_LOCKED, (but we might be able to ignore MAP_POPULATE). */
-		if (vmr->vm_flags & MAP_LOCKED) {
+		if (vmr->vm_flags & MAP_LOCKED &&
+		    prot_has_access(vmr->vm_prot)) {
+			int pte_prot = (vmr->vm_prot & PROT_WRITE) ?
+				       PTE_USER_RW : PTE_USER_RO;
+
 			/* need to keep the file alive in case we unlock/block
 			 */
 			foc_incref(vmr->__vm_foc);
 			/* math is a bit nasty if vm_base isn't page aligned */
 			assert(!PGOFF(vmr->vm_base));
+			/* populate_pm_va() drops and retakes the vmr lock */
+			spin_lock(&new_p->vmr_lock);
 			ret = populate_pm_va(new_p, vmr->vm_base,
 					     (vmr->vm_end - vmr->vm_base) >>
 					     			       PGSHIFT,
-			                     vmr->vm_prot, vmr_to_pm(vmr),
+			                     pte_prot, vmr_to_pm(vmr),
 			                     vmr->vm_foff, vmr->vm_flags,
 			                     vmr->vm_prot & PROT_EXEC);
+			spin_unlock(&new_p->vmr_lock);
 			foc_decref(vmr->__vm_foc);
+			/* Like mmap(), a VMR past the end of the file just
+			 * faults its pages in later. */
+			if (ret == -ESPIPE)
+				ret = 0;
 		}
 	}
 	if (ret < 0) {
@@ -586,10 +692,10 @@ static int fill_vmr(struct proc *p, struct proc *new_p, struct vm_region *vmr)
 }
 
 /* This will make new_p have the same VMRs as p, and it will make sure all
- * physical pages are copied over, with the exception of MAP_SHARED files.
- * MAP_SHARED files that are also MAP_LOCKED will be attached to the process -
- * presumably they are in the page cache since the parent locked them.  This is
- * all pretty nasty.
+ * private physical pages are shared copy-on-write, except for locked or
+ * populated memory, which is copied, and MAP_SHARED files.  MAP_SHARED files that are also MAP_LOCKED will be attached to the
+ * process - presumably they are in the page cache since the parent locked them.
+ * This is all pretty nasty.
  *
  * This is used by fork().
  *
@@ -809,26 +915,72 @@ static int __copy_and_swap_pmpg(struct proc *p, struct page **pp)
 	return 0;
 }
 
+/* Helper: maps a batch of fresh anonymous pages, starting at va, with one hold
+ * of the pte_lock.  Consumes the refs on all of the pages, including the ones
+ * we don't map. */
+static int __map_anon_batch(struct proc *p, struct page **pages,
+                            unsigned long nr_pgs, uintptr_t va, int pte_prot)
+{
+	unsigned long i;
+	pte_t pte;
+	int ret = 0;
+
+	spin_lock(&p->pte_lock);
+	for (i = 0; i < nr_pgs; i++, va += PGSIZE) {
+		pte = pgdir_walk(p->env_pgdir, (void*)va, TRUE);
+		if (!pte_walk_okay(pte)) {
+			ret = -ENOMEM;
+			break;
+		}
+		/* Someone else (e.g. a racing fault) already filled it */
+		if (pte_is_present(pte)) {
+			page_decref(pages[i]);
+			continue;
+		}
+		assert(!pte_is_mapped(pte));
+		pte_write(pte, page2pa(pages[i]),
+			  pte_prot | (pte_is_dirty(pte) ? PTE_D : 0));
+	}
+	spin_unlock(&p->pte_lock);
+	for (; i < nr_pgs; i++)
+		page_decref(pages[i]);
+	return ret;
+}
+
 /* Hold the VMR lock when you call this - it'll assume the entire VA range is
- * mappable, which isn't true if there are concurrent changes to the VMRs. */
+ * mappable, which isn't true if there are concurrent changes to the VMRs.
+ *
+ * Populates in batches: we allocate and zero a batch of pages without any
+ * locks, then map them all with one pte_lock hold.  This is the path for
+ * MAP_POPULATE, e.g. a VMM prefaulting all of guest memory, so it's worth not
+ * bouncing the lock for every page. */
 static int populate_anon_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
                             int pte_prot)
 {
-	struct page *page;
+	struct page *pages[POPULATE_BATCH_NR_PGS];
+	unsigned long batch;
 	int ret;
 
-	for (long i = 0; i < nr_pgs; i++) {
-		if (upage_alloc(p, &page, TRUE))
-			return -ENOMEM;
-		/* could imagine doing a memwalk instead of a for loop */
-		ret = map_page_at_addr(p, page, va + i * PGSIZE, pte_prot);
+	for (unsigned long i = 0; i < nr_pgs; i += batch) {
+		batch = MIN(nr_pgs - i, POPULATE_BATCH_NR_PGS);
+		for (unsigned long j = 0; j < batch; j++) {
+			if (upage_alloc(p, &pages[j], TRUE)) {
+				while (j--)
+					page_decref(pages[j]);
+				return -ENOMEM;
+			}
+		}
+		ret = __map_anon_batch(p, pages, batch, va + i * PGSIZE,
+				       pte_prot);
 		if (ret)
 			return ret;
 	}
 	return 0;
 }
 
-/* This will periodically unlock the vmr lock. */
+/* This will periodically unlock the vmr lock.  We look up pages in batches:
+ * grab whatever is already in the page cache, then unlock once to load all of
+ * the batch's missing pages, instead of unlocking and relocking per page. */
 static int populate_pm_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
                           int pte_prot, struct page_map *pm, size_t offset,
                           int flags, bool exec)
@@ -836,6 +988,8 @@ static int populate_pm_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
 	int ret = 0;
 	unsigned long pm_idx0 = offset >> PGSHIFT;
 	int vmr_history = ACCESS_ONCE(p->vmr_history);
+	struct page *pages[POPULATE_BATCH_NR_PGS];
+	unsigned long batch, nr_missing;
 	struct page *page;
 
 	/* This is a racy check - see the comments in fs_file.c.  Also, we're
@@ -845,45 +999,76 @@ static int populate_pm_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
 		return -ESPIPE;
 	/* locking rules: start the loop holding the vmr lock, enter and exit
 	 * the entire func holding the lock. */
-	for (long i = 0; i < nr_pgs; i++) {
-		ret = pm_load_page_nowait(pm, pm_idx0 + i, &page);
-		if (ret) {
-			if (ret != -EAGAIN)
-				break;
+	for (unsigned long i = 0; i < nr_pgs; i += batch) {
+		batch = MIN(nr_pgs - i, POPULATE_BATCH_NR_PGS);
+		memset(pages, 0, sizeof(pages));
+		nr_missing = 0;
+		for (unsigned long j = 0; j < batch; j++) {
+			ret = pm_load_page_nowait(pm, pm_idx0 + i + j,
+						  &pages[j]);
+			if (ret) {
+				if (ret != -EAGAIN)
+					goto out_put_batch;
+				nr_missing++;
+			}
+		}
+		ret = 0;
+		if (nr_missing) {
 			spin_unlock(&p->vmr_lock);
 			/* might block here, can't hold the spinlock */
-			ret = pm_load_page(pm, pm_idx0 + i, &page);
+			for (unsigned long j = 0; j < batch; j++) {
+				if (pages[j])
+					continue;
+				ret = pm_load_page(pm, pm_idx0 + i + j,
+						   &pages[j]);
+				if (ret) {
+					pages[j] = NULL;
+					break;
+				}
+			}
 			spin_lock(&p->vmr_lock);
 			if (ret)
-				break;
+				goto out_put_batch;
 			/* while we were sleeping, the VMRs could have changed
 			 * on us. */
 			if (vmr_history != ACCESS_ONCE(p->vmr_history)) {
-				pm_put_page(page);
 				printk("[kernel] "
 				       "FYI: VMR changed during populate\n");
-				break;
+				goto out_put_batch;
 			}
 		}
-		if (flags & MAP_PRIVATE) {
-			ret = __copy_and_swap_pmpg(p, &page);
-			if (ret) {
-				pm_put_page(page);
-				break;
+		for (unsigned long j = 0; j < batch; j++) {
+			page = pages[j];
+			pages[j] = NULL;
+			if (flags & MAP_PRIVATE) {
+				ret = __copy_and_swap_pmpg(p, &page);
+				if (ret) {
+					pm_put_page(page);
+					goto out_put_batch;
+				}
 			}
+			/* if this is an executable page, we might have to flush
+			 * the instruction cache if our HW requires it.
+			 * TODO: is this still needed?  andrew put this in a
+			 * while ago */
+			if (exec)
+				icache_flush_page(0, page2kva(page));
+			/* The page could be either in the PM, or a private,
+			 * now-anon page. */
+			ret = map_page_at_addr(p, page, va + (i + j) * PGSIZE,
+					       pte_prot);
+			if (page_is_pagemap(page))
+				pm_put_page(page);
+			if (ret)
+				goto out_put_batch;
 		}
-		/* if this is an executable page, we might have to flush the
-		 * instruction cache if our HW requires it.
-		 * TODO: is this still needed?  andrew put this in a while ago*/
-		if (exec)
-			icache_flush_page(0, page2kva(page));
-		/* The page could be either in the PM, or a private, now-anon
-		 * page. */
-		ret = map_page_at_addr(p, page, va + i * PGSIZE, pte_prot);
-		if (page_is_pagemap(page))
-			pm_put_page(page);
-		if (ret)
-			break;
+	}
+	return 0;
+
+out_put_batch:
+	for (unsigned long j = 0; j < batch; j++) {
+		if (pages[j])
+			pm_put_page(pages[j]);
 	}
 	return ret;
 }
@@ -1030,6 +1215,23 @@ int mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 	return ret;
 }
 
+/* Helper: pages shared copy-on-write must stay read-only, even if the VMR
+ * becomes writable.  So must page cache pages in private VMRs.  The write
+ * fault will unshare them. */
+static int __cow_pte_prot(struct vm_region *vmr, pte_t pte, int pte_prot)
+{
+	struct page *page;
+
+	if (pte_prot != PTE_USER_RW)
+		return pte_prot;
+	page = pa2page(pte_get_paddr(pte));
+	if (page_is_pagemap(page))
+		return vmr->vm_flags & MAP_PRIVATE ? PTE_USER_RO : pte_prot;
+	if (page_is_shared(page))
+		return PTE_USER_RO;
+	return pte_prot;
+}
+
 /* This does not care if the region is not mapped.  POSIX says you should return
  * ENOMEM if any part of it is unmapped.  Can do this later if we care, based on
  * the VMRs, not the actual page residency. */
@@ -1068,7 +1270,9 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 		     va += PGSIZE) {
 			pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
 			if (pte_walk_okay(pte) && pte_is_mapped(pte)) {
-				pte_replace_perm(pte, pte_prot);
+				pte_replace_perm(pte,
+						 __cow_pte_prot(vmr, pte,
+								pte_prot));
 				shootdown_needed = TRUE;
 			}
 		}
@@ -1126,7 +1330,10 @@ static int __munmap_pte(struct proc *p, pte_t pte, void *va, void *arg)
 		return 0;
 	if (pte_is_dirty(pte)) {
 		page = pa2page(pte_get_paddr(pte));
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		if (page_is_pagemap(page))
+			pm_set_page_dirty(page);
+		else
+			atomic_or(&page->pg_flags, PG_DIRTY);
 	}
 	pte_clear_present(pte);
 	*shootdown_needed = TRUE;
@@ -1264,6 +1471,104 @@ static int __hpf_load_page(struct proc *p, struct page_map *pm,
 	return 0;
 }
 
+/* Helper: maps the neighbors of a file-backed fault at va, but only the ones
+ * that are already in the page cache and up to date.  We never block or do IO
+ * here; this is just to save the faults on pages someone else already loaded.
+ * The window is naturally aligned, so a sequential scan faults once per window.
+ *
+ * Private mappings get the page cache pages themselves, read-only, instead of
+ * copies.  A later write takes the CoW path in __hpf_cow().
+ *
+ * Hold the vmr lock.  The VMR's file is kept alive by the vmr. */
+static void __hpf_fault_around(struct proc *p, struct vm_region *vmr,
+                               uintptr_t va, int pte_prot)
+{
+	struct file_or_chan *file = vmr->__vm_foc;
+	struct page_map *pm = foc_to_pm(file);
+	unsigned long nr_file_pgs = nr_pages(foc_get_len(file));
+	uintptr_t start, end;
+	unsigned long f_idx;
+	struct page *page;
+	pte_t pte;
+	bool skip;
+
+	if ((vmr->vm_flags & MAP_PRIVATE) && pte_prot == PTE_USER_RW)
+		pte_prot = PTE_USER_RO;
+	start = ROUNDDOWN(va, FAULT_AROUND_NR_PGS * PGSIZE);
+	end = start + FAULT_AROUND_NR_PGS * PGSIZE;
+	start = MAX(start, vmr->vm_base);
+	end = MIN(end, vmr->vm_end);
+	for (uintptr_t va_i = start; va_i < end; va_i += PGSIZE) {
+		if (va_i == va)
+			continue;
+		f_idx = (va_i - vmr->vm_base + vmr->vm_foff) >> PGSHIFT;
+		if (f_idx >= nr_file_pgs)
+			break;
+		/* Only fill holes.  Mapped but !P PTEs are being removed. */
+		spin_lock(&p->pte_lock);
+		pte = pgdir_walk(p->env_pgdir, (void*)va_i, FALSE);
+		skip = pte_walk_okay(pte) && !pte_is_unmapped(pte);
+		spin_unlock(&p->pte_lock);
+		if (skip)
+			continue;
+		if (pm_load_page_nowait(pm, f_idx, &page))
+			continue;
+		if (vmr->vm_prot & PROT_EXEC)
+			icache_flush_page((void*)va_i, page2kva(page));
+		if (map_page_at_addr(p, page, va_i, pte_prot)) {
+			pm_put_page(page);
+			break;
+		}
+		pm_put_page(page);
+	}
+}
+
+/* Helper: resolves a write fault on a page we share copy-on-write (see
+ * cow_pages()).  If we're the last user of the page, we just get the write
+ * permission back.  Otherwise we copy the page and drop our ref on the old one.
+ * Page cache pages that fault around mapped into a private VMR are always
+ * copied; the PTE has no ref on them.
+ *
+ * Returns 0 if we resolved the fault, -ENOENT if va isn't a CoW page (let the
+ * normal fault path handle it), or some other -error.  Hold the vmr lock. */
+static int __hpf_cow(struct proc *p, uintptr_t va)
+{
+	pte_t pte;
+	struct page *old_page, *new_page = NULL;
+	bool old_is_pm;
+
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk(p->env_pgdir, (void*)va, FALSE);
+	if (!pte_walk_okay(pte) || !pte_is_present(pte) ||
+	    pte_has_perm_urw(pte)) {
+		spin_unlock(&p->pte_lock);
+		return -ENOENT;
+	}
+	old_page = pa2page(pte_get_paddr(pte));
+	old_is_pm = page_is_pagemap(old_page);
+	if (old_is_pm || page_is_shared(old_page)) {
+		if (upage_alloc(p, &new_page, FALSE)) {
+			spin_unlock(&p->pte_lock);
+			return -ENOMEM;
+		}
+		memcpy(page2kva(new_page), page2kva(old_page), PGSIZE);
+		pte_write(pte, page2pa(new_page), PTE_USER_RW);
+	} else {
+		/* No one else has it: whoever shared it with us is gone. */
+		pte_replace_perm(pte, PTE_USER_RW);
+	}
+	spin_unlock(&p->pte_lock);
+	if (new_page) {
+		/* Other cores could still have the old page in their TLB.
+		 * For the perm-only change, stale entries just cause a
+		 * spurious fault. */
+		proc_tlbshootdown(p, va, va + PGSIZE);
+		if (!old_is_pm)
+			page_decref(old_page);
+	}
+	return 0;
+}
+
 /* Returns 0 on success, or an appropriate -error code.
  *
  * Notes: if your TLB caches negative results, you'll need to flush the
@@ -1296,6 +1601,15 @@ refault:
 		ret = -EPERM;
 		goto out;
 	}
+	/* Writes to private memory could be to a page we share from a fork.
+	 * This doesn't need the file, so even the kernel can break CoW. */
+	if ((prot & PROT_WRITE) &&
+	    (!vmr_has_file(vmr) || (vmr->vm_flags & MAP_PRIVATE))) {
+		ret = __hpf_cow(p, va);
+		if (ret != -ENOENT)
+			goto out;
+		ret = 0;
+	}
 	if (!vmr_has_file(vmr)) {
 		/* No file - just want anonymous memory */
 		if (upage_alloc(p, &a_page, TRUE)) {
@@ -1361,6 +1675,8 @@ refault:
 	int pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
 	               (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 	ret = map_page_at_addr(p, a_page, va, pte_prot);
+	if (!ret && vmr_has_file(vmr))
+		__hpf_fault_around(p, vmr, va, pte_prot);
 	/* fall through, even for errors */
 out_put_pg:
 	/* the VMR's existence in the PM (via the mmap) allows us to have PTE
@@ -37,6 +37,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <net/ip.h>
+#include <event.h>
 
 struct dev ipdevtab;
 
@@ -494,14 +495,7 @@ static struct chan *ipopen(struct chan *c, int omode)
 		break;
 	case Qclone:
 		p = f->p[PROTO(c->qid)];
-		qlock(&p->qlock);
-		if (waserror()) {
-			qunlock(&p->qlock);
-			nexterror();
-		}
 		cv = Fsprotoclone(p, ATTACHER(c));
-		qunlock(&p->qlock);
-		poperror();
 		if (cv == NULL) {
 			error(ENODEV, "Null conversation from Fsprotoclone");
 			break;
@@ -601,6 +595,7 @@ static struct chan *ipopen(struct chan *c, int omode)
 			nc = cv->incall;
 			if (nc != NULL) {
 				cv->incall = nc->next;
+				cv->nincall--;
 				mkqid(&c->qid, QID(PROTO(c->qid), nc->x, Qctl),
 				      0, QTFILE);
 				kstrdup(&cv->owner, ATTACHER(c));
@@ -713,6 +708,46 @@ static char *ipchaninfo(struct chan *ch, char *ret, size_t ret_l)
 	return ret;
 }
 
+/* Puts a closed conv on its proto's free list, for Fsprotoclone to reuse once
+ * the protocol is done with it too.  It may already be there. */
+static void free_conv_put(struct conv *cv)
+{
+	struct Proto *p = cv->p;
+
+	spin_lock(&p->free_lock);
+	if (!cv->on_free_list) {
+		TAILQ_INSERT_TAIL(&p->free_convs, cv, free_link);
+		cv->on_free_list = TRUE;
+	}
+	spin_unlock(&p->free_lock);
+}
+
+static struct conv *free_conv_get(struct Proto *p)
+{
+	struct conv *cv;
+
+	spin_lock(&p->free_lock);
+	cv = TAILQ_FIRST(&p->free_convs);
+	if (cv) {
+		TAILQ_REMOVE(&p->free_convs, cv, free_link);
+		cv->on_free_list = FALSE;
+	}
+	spin_unlock(&p->free_lock);
+	return cv;
+}
+
+static void free_conv_remove(struct conv *cv)
+{
+	struct Proto *p = cv->p;
+
+	spin_lock(&p->free_lock);
+	if (cv->on_free_list) {
+		TAILQ_REMOVE(&p->free_convs, cv, free_link);
+		cv->on_free_list = FALSE;
+	}
+	spin_unlock(&p->free_lock);
+}
+
 static void closeconv(struct conv *cv)
 {
 	ERRSTACK(1);
@@ -735,6 +770,7 @@ static void closeconv(struct conv *cv)
 		closeconv(nc);
 	}
 	cv->incall = NULL;
+	cv->nincall = 0;
 
 	kstrdup(&cv->owner, network);
 	cv->perm = 0660;
@@ -750,6 +786,7 @@ static void closeconv(struct conv *cv)
 	cv->state = Idle;
 	qunlock(&cv->qlock);
 	poperror();
+	free_conv_put(cv);
 }
 
 static void ipclose(struct chan *c)
@@ -917,6 +954,49 @@ static void setladdr(struct conv *c)
 	findlocalip(c->p->f, c->laddr, c->raddr);
 }
 
+/*
+ *  each proto counts the convs on each local port, so that picking a port
+ *  doesn't scan every conversation.
+ */
+static uint32_t *proto_port_refs(struct Proto *p)
+{
+	uint32_t *refs;
+
+	if (p->port_refs)
+		return p->port_refs;
+	refs = kzmalloc(sizeof(uint32_t) * (1 << 16), MEM_WAIT);
+	if (!atomic_cas_ptr((void**)&p->port_refs, NULL, refs))
+		kfree(refs);
+	return p->port_refs;
+}
+
+/* Call with p->port_lock held */
+static void __conv_set_lport(struct conv *c, uint32_t *refs, uint16_t lport)
+{
+	if (c->lport)
+		refs[c->lport]--;
+	if (lport)
+		refs[lport]++;
+	c->lport = lport;
+}
+
+/*
+ *  change a conversation's local port.  every change to c->lport goes
+ *  through here.
+ */
+void Fsconvlport(struct conv *c, uint16_t lport)
+{
+	struct Proto *p = c->p;
+	uint32_t *refs;
+
+	if (c->lport == lport)
+		return;
+	refs = proto_port_refs(p);
+	spin_lock(&p->port_lock);
+	__conv_set_lport(c, refs, lport);
+	spin_unlock(&p->port_lock);
+}
+
 /*
  *  set a local port making sure the quad of raddr,rport,laddr,lport is unique
  */
@@ -924,10 +1004,21 @@ static void setluniqueport(struct conv *c, int lport)
 {
 	struct Proto *p;
 	struct conv *xp;
+	uint32_t *refs;
 	int x;
 
 	p = c->p;
 
+	/* no one else is on the port, so the quad is unique */
+	refs = proto_port_refs(p);
+	spin_lock(&p->port_lock);
+	if (!lport || !refs[lport]) {
+		__conv_set_lport(c, refs, lport);
+		spin_unlock(&p->port_lock);
+		return;
+	}
+	spin_unlock(&p->port_lock);
+
 	qlock(&p->qlock);
 	for (x = 0; x < p->nc; x++) {
 		xp = p->conv[x];
@@ -935,6 +1026,10 @@ static void setluniqueport(struct conv *c, int lport)
 			break;
 		if (xp == c)
 			continue;
+		/* listeners can share a port if they all asked to */
+		if (c->reuseport && xp->reuseport && xp->state == Announced
+		    && strcmp(xp->owner, c->owner) == 0)
+			continue;
 		if ((xp->state == Connected || xp->state == Announced
 		                            || xp->state == Bypass)
 			&& xp->lport == lport
@@ -945,7 +1040,7 @@ static void setluniqueport(struct conv *c, int lport)
 			error(EFAIL, "address in use");
 		}
 	}
-	c->lport = lport;
+	Fsconvlport(c, lport);
 	qunlock(&p->qlock);
 }
 
@@ -956,14 +1051,23 @@ static void setlport(struct conv *c)
 {
 	struct Proto *p;
 	uint16_t *pp;
-	int x, found;
+	uint16_t start = 5000;
+	uint32_t *refs;
 
 	p = c->p;
 	if (c->restricted)
 		pp = &p->nextrport;
 	else
 		pp = &p->nextport;
-	qlock(&p->qlock);
+	/* we can't read urandom under the spinlock.  if we wrap while
+	 * searching, we start over at 5000. */
+	if (!c->restricted && p->nextport < 5000) {
+		do {
+			urandom_read(&start, sizeof(start));
+		} while (start < 5000);
+	}
+	refs = proto_port_refs(p);
+	spin_lock(&p->port_lock);
 	for (;; (*pp)++) {
 		/*
 		 * Fsproto initialises p->nextport to 0 and the restricted
@@ -976,24 +1080,15 @@ static void setlport(struct conv *c)
 		if (c->restricted) {
 			if (*pp >= 1024)
 				*pp = 600;
-		} else
-			while (*pp < 5000)
-				urandom_read(pp, sizeof(*pp));
-
-		found = 0;
-		for (x = 0; x < p->nc; x++) {
-			if (p->conv[x] == NULL)
-				break;
-			if (p->conv[x]->lport == *pp) {
-				found = 1;
-				break;
-			}
+		} else if (*pp < 5000) {
+			*pp = start;
+			start = 5000;
 		}
-		if (!found)
+		if (!refs[*pp])
 			break;
 	}
-	c->lport = (*pp)++;
-	qunlock(&p->qlock);
+	__conv_set_lport(c, refs, (*pp)++);
+	spin_unlock(&p->port_lock);
 }
 
 /*
@@ -1017,7 +1112,7 @@ static void setladdrport(struct conv *c, char *str, int announcing)
 			p = NULL;
 	}
 
-	c->lport = 0;
+	Fsconvlport(c, 0);
 	if (p == NULL) {
 		if (announcing)
 			ipmove(c->laddr, IPnoaddr);
@@ -1394,6 +1489,26 @@ static void ttlctlmsg(struct conv *c, struct cmdbuf *cb)
 		c->ttl = atoi(cb->f[1]);
 }
 
+/* "zerocopy [min]" sends writes of at least min bytes from the user's pages.
+ * "zerocopy off" turns it off. */
+static void zcopyctlmsg(struct conv *c, struct cmdbuf *cb)
+{
+	if (cb->nf < 2)
+		c->zcopy_min = Zcopymin;
+	else if (strcmp(cb->f[1], "off") == 0)
+		c->zcopy_min = 0;
+	else
+		c->zcopy_min = MAX(atoi(cb->f[1]), PGSIZE);
+}
+
+static void backlogctlmsg(struct conv *c, struct cmdbuf *cb)
+{
+	if (cb->nf < 2)
+		c->backlog = Maxincall;
+	else
+		c->backlog = MIN(MAX(atoi(cb->f[1]), 1), Maxbacklog);
+}
+
 /* Binds a conversation, as if the user wrote "bind *" into ctl. */
 static void autobind(struct conv *cv)
 {
@@ -1434,6 +1549,8 @@ static size_t ipwrite(struct chan *ch, void *v, size_t n, off64_t off)
 		 * binding. */
 		if (c->lport == 0)
 			autobind(c);
+		if (c->zcopy_min && n >= c->zcopy_min)
+			return ipzcwrite(c, a, n, ch->flag & O_NONBLOCK);
 		if (ch->flag & O_NONBLOCK)
 			qwrite_nonblock(c->wq, a, n);
 		else
@@ -1477,6 +1594,12 @@ static size_t ipwrite(struct chan *ch, void *v, size_t n, off64_t off)
 			tosctlmsg(c, cb);
 		else if (strcmp(cb->f[0], "ignoreadvice") == 0)
 			c->ignoreadvice = 1;
+		else if (strcmp(cb->f[0], "backlog") == 0)
+			backlogctlmsg(c, cb);
+		else if (strcmp(cb->f[0], "reuseport") == 0)
+			c->reuseport = TRUE;
+		else if (strcmp(cb->f[0], "zerocopy") == 0)
+			zcopyctlmsg(c, cb);
 		else if (strcmp(cb->f[0], "addmulti") == 0) {
 			if (cb->nf < 2)
 				error(EFAIL,
@@ -1555,10 +1678,12 @@ static void fire_data_taps(struct conv *conv, int filter)
 	 * - if fire_tap takes a while, holding the lock only slows down other
 	 * events on this *same* conversation, or other tap registration.  not a
 	 * huge deal. */
+	event_batch_start();
 	spin_lock(&conv->tap_lock);
 	SLIST_FOREACH(tap_i, &conv->data_taps, link)
 		fire_tap(tap_i, filter);
 	spin_unlock(&conv->tap_lock);
+	event_batch_end();
 }
 
 static void ip_wake_cb(struct queue *q, void *data, int filter)
@@ -1584,7 +1709,7 @@ int iptapfd(struct chan *chan, struct fd_tap *tap, int cmd)
 
 #define DEVIP_LEGAL_DATA_TAPS (FDTAP_FILT_READABLE | FDTAP_FILT_WRITABLE |     \
                                FDTAP_FILT_HANGUP | FDTAP_FILT_PRIORITY |       \
-                               FDTAP_FILT_ERROR)
+                               FDTAP_FILT_ERROR | FDTAP_FILT_ZCOPY)
 #define DEVIP_LEGAL_LISTEN_TAPS (FDTAP_FILT_READABLE | FDTAP_FILT_HANGUP)
 
 	switch (TYPE(chan->qid)) {
@@ -1698,6 +1823,10 @@ int Fsproto(struct Fs *f, struct Proto *p)
 		return -1;
 
 	qlock_init(&p->qlock);
+	qlock_init(&p->clone_qlock);
+	spinlock_init(&p->free_lock);
+	TAILQ_INIT(&p->free_convs);
+	spinlock_init(&p->port_lock);
 	p->f = f;
 
 	if (p->ipproto > 0) {
@@ -1729,69 +1858,112 @@ int Fsbuiltinproto(struct Fs *f, uint8_t proto)
 	return f->t2p[proto] != NULL;
 }
 
+/* Closed convs we try off the free list before adding a new one */
+#define CLONE_FREE_TRIES 4
+
 /*
- *  called with protocol locked
+ *  returns true, with c locked, if neither processes nor the protocol
+ *  are using c.
+ */
+static bool conv_reusable(struct Proto *p, struct conv *c)
+{
+	if (!canqlock(&c->qlock))
+		return FALSE;
+	if (c->inuse == 0 && (p->inuse == NULL || (*p->inuse)(c) == 0))
+		return TRUE;
+	qunlock(&c->qlock);
+	return FALSE;
+}
+
+/*
+ *  add a conversation in the next free slot.  called with p->clone_qlock
+ *  held.  returns it locked.
+ */
+static struct conv *newconv(struct Proto *p)
+{
+	struct conv *c;
+
+	c = kzmalloc(sizeof(struct conv), 0);
+	if (c == NULL)
+		error(ENOMEM, "conv kzmalloc(%d, 0) failed in Fsprotoclone",
+		      sizeof(struct conv));
+	qlock_init(&c->qlock);
+	qlock_init(&c->listenq);
+	rendez_init(&c->cr);
+	rendez_init(&c->listenr);
+	/* already = 0; set to be futureproof */
+	SLIST_INIT(&c->data_taps);
+	SLIST_INIT(&c->listen_taps);
+	spinlock_init(&c->tap_lock);
+	qlock(&c->qlock);
+	c->p = p;
+	c->x = p->ac;
+	if (p->ptclsize != 0) {
+		c->ptcl = kzmalloc(p->ptclsize, 0);
+		if (c->ptcl == NULL) {
+			kfree(c);
+			error(ENOMEM, "ptcl kzmalloc(%d, 0) failed in Fsprotoclone",
+			      p->ptclsize);
+		}
+	}
+	p->conv[p->ac] = c;
+	p->ac++;
+	c->eq = qopen(1024, Qmsg, 0, 0);
+	(*p->create) (c);
+	assert(c->rq && c->wq);
+	return c;
+}
+
+/*
+ *  find a free conversation: a closed one off the free list, else a new
+ *  one, else any reusable one.  conv[] fills in order and convs are never
+ *  freed, so p->ac is the next free slot.  doesn't need the protocol lock;
+ *  only adding convs and the full scan serialize, on p->clone_qlock.
  */
 struct conv *Fsprotoclone(struct Proto *p, char *user)
 {
+	ERRSTACK(1);
 	struct conv *c, **pp, **ep;
+	int i;
 
-retry:
-	c = NULL;
-	ep = &p->conv[p->nc];
-	for (pp = p->conv; pp < ep; pp++) {
-		c = *pp;
-		if (c == NULL) {
-			c = kzmalloc(sizeof(struct conv), 0);
-			if (c == NULL)
-				error(ENOMEM,
-				      "conv kzmalloc(%d, 0) failed in Fsprotoclone",
-				      sizeof(struct conv));
-			qlock_init(&c->qlock);
-			qlock_init(&c->listenq);
-			rendez_init(&c->cr);
-			rendez_init(&c->listenr);
-			/* already = 0; set to be futureproof */
-			SLIST_INIT(&c->data_taps);
-			SLIST_INIT(&c->listen_taps);
-			spinlock_init(&c->tap_lock);
-			qlock(&c->qlock);
-			c->p = p;
-			c->x = pp - p->conv;
-			if (p->ptclsize != 0) {
-				c->ptcl = kzmalloc(p->ptclsize, 0);
-				if (c->ptcl == NULL) {
-					kfree(c);
-					error(ENOMEM,
-					      "ptcl kzmalloc(%d, 0) failed in Fsprotoclone",
-					      p->ptclsize);
-				}
-			}
-			*pp = c;
-			p->ac++;
-			c->eq = qopen(1024, Qmsg, 0, 0);
-			(*p->create) (c);
-			assert(c->rq && c->wq);
+	for (i = 0; i < CLONE_FREE_TRIES; i++) {
+		c = free_conv_get(p);
+		if (c == NULL)
 			break;
-		}
-		if (canqlock(&c->qlock)) {
-			/*
-			 *  make sure both processes and protocol
-			 *  are done with this Conv
-			 */
-			if (c->inuse == 0 && (p->inuse == NULL ||
-					      (*p->inuse)(c) == 0))
-				break;
+		if (conv_reusable(p, c))
+			goto found;
+		/* the protocol still has it, e.g. TCP's Time_wait */
+		free_conv_put(c);
+	}
 
-			qunlock(&c->qlock);
-		}
+	qlock(&p->clone_qlock);
+	if (waserror()) {
+		qunlock(&p->clone_qlock);
+		nexterror();
 	}
-	if (pp >= ep) {
-		if (p->gc != NULL && (*p->gc) (p))
-			goto retry;
-		return NULL;
+retry:
+	if (p->ac < p->nc) {
+		c = newconv(p);
+	} else {
+		ep = &p->conv[p->nc];
+		for (pp = p->conv; pp < ep; pp++) {
+			if (conv_reusable(p, *pp))
+				break;
+		}
+		if (pp >= ep) {
+			if (p->gc != NULL && (*p->gc) (p))
+				goto retry;
+			qunlock(&p->clone_qlock);
+			poperror();
+			return NULL;
+		}
+		c = *pp;
+		free_conv_remove(c);
 	}
+	qunlock(&p->clone_qlock);
+	poperror();
 
+found:
 	c->inuse = 1;
 	kstrdup(&c->owner, user);
 	c->perm = 0660;
@@ -1800,9 +1972,13 @@ retry:
 	ipmove(c->raddr, IPnoaddr);
 	c->r = NULL;
 	c->rgen = 0;
-	c->lport = 0;
+	Fsconvlport(c, 0);
 	c->rport = 0;
 	c->restricted = 0;
+	c->backlog = Maxincall;
+	c->reuseport = FALSE;
+	c->zcopy_min = 0;
+	c->zcopy_id = 0;
 	c->ttl = MAXTTL;
 	c->tos = DFLTTOS;
 	qreopen(c->rq);
@@ -1852,10 +2028,12 @@ static void fire_listener_taps(struct conv *conv)
 	struct fd_tap *tap_i;
 	if (SLIST_EMPTY(&conv->listen_taps))
 		return;
+	event_batch_start();
 	spin_lock(&conv->tap_lock);
 	SLIST_FOREACH(tap_i, &conv->listen_taps, link)
 		fire_tap(tap_i, FDTAP_FILT_READABLE);
 	spin_unlock(&conv->tap_lock);
+	event_batch_end();
 }
 
 /*
@@ -1865,14 +2043,9 @@ struct conv *Fsnewcall(struct conv *c, uint8_t *raddr, uint16_t rport,
 		       uint8_t *laddr, uint16_t lport, uint8_t version)
 {
 	struct conv *nc;
-	struct conv **l;
-	int i;
 
 	qlock(&c->qlock);
-	i = 0;
-	for (l = &c->incall; *l; l = &(*l)->next)
-		i++;
-	if (i >= Maxincall) {
+	if (c->nincall >= c->backlog) {
 		qunlock(&c->qlock);
 		return NULL;
 	}
@@ -1886,9 +2059,14 @@ struct conv *Fsnewcall(struct conv *c, uint8_t *raddr, uint16_t rport,
 	ipmove(nc->raddr, raddr);
 	nc->rport = rport;
 	ipmove(nc->laddr, laddr);
-	nc->lport = lport;
+	Fsconvlport(nc, lport);
 	nc->next = NULL;
-	*l = nc;
+	if (c->incall)
+		c->incall_tail->next = nc;
+	else
+		c->incall = nc;
+	c->incall_tail = nc;
+	c->nincall++;
 	nc->state = Connected;
 	nc->ipversion = version;
 
@@ -37,6 +37,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <net/ip.h>
+#include <event.h>
 
 typedef struct Etherhdr Etherhdr;
 struct Etherhdr {
@@ -444,7 +445,11 @@ static void etherread4(void *a)
 			freeb(bp);
 			continue;
 		}
+		/* One packet can wake up several queues, e.g. a TCP segment
+		 * with data and an ACK.  Their taps' events go out together. */
+		event_batch_start();
 		if (waserror()) {
+			event_batch_end();
 			runlock(&ifc->rwlock);
 			nexterror();
 		}
@@ -456,6 +461,7 @@ static void etherread4(void *a)
 			ipifc_trace_block(ifc, bp);
 			ipiput4(er->f, ifc, bp);
 		}
+		event_batch_end();
 		runlock(&ifc->rwlock);
 		poperror();
 	}
@@ -487,7 +493,11 @@ static void etherread6(void *a)
 			freeb(bp);
 			continue;
 		}
+		/* One packet can wake up several queues, e.g. a TCP segment
+		 * with data and an ACK.  Their taps' events go out together. */
+		event_batch_start();
 		if (waserror()) {
+			event_batch_end();
 			runlock(&ifc->rwlock);
 			nexterror();
 		}
@@ -499,6 +509,7 @@ static void etherread6(void *a)
 			ipifc_trace_block(ifc, bp);
 			ipiput6(er->f, ifc, bp);
 		}
+		event_batch_end();
 		runlock(&ifc->rwlock);
 		poperror();
 	}
@@ -174,7 +174,7 @@ extern void icmpclose(struct conv *c)
 	qclose(c->wq);
 	ipmove(c->laddr, IPnoaddr);
 	ipmove(c->raddr, IPnoaddr);
-	c->lport = 0;
+	Fsconvlport(c, 0);
 }
 
 static void icmpkick(void *x, struct block *bp)
@@ -320,7 +320,7 @@ int ipoput4(struct Fs *f, struct block *bp, int gating, int ttl, int tos, struct
 		eh->cksum[0] = 0;
 		eh->cksum[1] = 0;
 		hnputs(eh->cksum, ipcsum(&eh->vihl));
-		ifc->m->bwrite(ifc, bp, V4, gate);
+		ipifcbwrite(ifc, bp, V4, gate, c);
 		runlock(&ifc->rwlock);
 		poperror();
 		return 0;
@@ -388,7 +388,7 @@ int ipoput4(struct Fs *f, struct block *bp, int gating, int ttl, int tos, struct
 		feh->cksum[0] = 0;
 		feh->cksum[1] = 0;
 		hnputs(feh->cksum, ipcsum(&feh->vihl));
-		ifc->m->bwrite(ifc, nb, V4, gate);
+		ipifcbwrite(ifc, nb, V4, gate, c);
 		ip->stats[FragCreates]++;
 	}
 	ip->stats[FragOKs]++;
@@ -782,42 +782,10 @@ struct fragment4 *ipfragallo4(struct IP *ip)
  */
 uint16_t ipchecksum(uint8_t *addr, int len)
 {
-	uint16_t sum = 0;
-
-	while (len > 0) {
-		sum += addr[0] << 8 | addr[1];
-		len -= 2;
-		addr += 2;
-	}
-
-	sum = (sum & 0xffff) + (sum >> 16);
-	sum = (sum & 0xffff) + (sum >> 16);
-
-	return (sum ^ 0xffff);
-
+	return ptclbsum(addr, len) ^ 0xffff;
 }
 
-/* change this to call ipchecksum later.
- * but we have to be sure we're not doing something bad
- * that violates some ip stack assumption (such as
- * boundaries etc.)
- */
 uint16_t ipcsum(uint8_t * addr)
 {
-	int len;
-	uint32_t sum;
-
-	sum = 0;
-	len = (addr[0] & 0xf) << 2;
-
-	while (len > 0) {
-		sum += addr[0] << 8 | addr[1];
-		len -= 2;
-		addr += 2;
-	}
-
-	sum = (sum & 0xffff) + (sum >> 16);
-	sum = (sum & 0xffff) + (sum >> 16);
-
-	return (sum ^ 0xffff);
+	return ipchecksum(addr, (addr[0] & 0xf) << 2);
 }
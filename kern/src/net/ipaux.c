@@ -38,6 +38,7 @@
 #include <smp.h>
 #include <net/ip.h>
 #include <endian.h>
+#include <hash.h>
 
 /*
  *  well known IP addresses
@@ -286,11 +287,17 @@ uint16_t ptclcsum_one(struct block *bp, int offset, int len)
 				continue;
 		}
 		x = MIN(len, ebd->len - boff);
-		addr = (void *)(ebd->base + ebd->off);
+		addr = (void *)(ebd->base + ebd->off + boff);
+		/* Data written through a Qcsum queue was summed when it was
+		 * copied in. */
+		if (x == ebd->len && ebd_has_csum(ebd))
+			csum = ebd->csum;
+		else
+			csum = ptclbsum(addr, x);
 		if (odd)
-			hisum += ptclbsum(addr, x);
+			hisum += csum;
 		else
-			losum += ptclbsum(addr, x);
+			losum += csum;
 		odd = (odd + x) & 1;
 		len -= x;
 	}
@@ -653,6 +660,30 @@ void iphtrem(struct Ipht *ht, struct conv *c)
 	spin_unlock(&ht->lock);
 }
 
+/* Of the reuseport listeners in h's chain with c's local address and port,
+ * picks one by the remote address and port, so each call sticks to one
+ * listener.  h is c's entry.  Called with the ht lock held. */
+static struct conv *iphtshard(struct Iphash *h, uint8_t *sa, uint16_t sp)
+{
+	struct conv *c = h->c;
+	struct Iphash *i;
+	unsigned int nr = 0, pick;
+
+	for (i = h; i != NULL; i = i->next) {
+		if (i->match == h->match && i->c->reuseport
+		    && i->c->lport == c->lport && ipcmp(i->c->laddr, c->laddr) == 0)
+			nr++;
+	}
+	pick = hash_32(nhgetl(sa + IPaddrlen - 4) ^ (sp << 16 | sp), 32) % nr;
+	for (i = h; i != NULL; i = i->next) {
+		if (i->match == h->match && i->c->reuseport
+		    && i->c->lport == c->lport && ipcmp(i->c->laddr, c->laddr) == 0
+		    && pick-- == 0)
+			return i->c;
+	}
+	return c;
+}
+
 /* look for a matching conversation with the following precedence
  *	connected && raddr,rport,laddr,lport
  *	announced && laddr,lport
@@ -688,6 +719,8 @@ struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 			continue;
 		c = h->c;
 		if (dp == c->lport && ipcmp(da, c->laddr) == 0) {
+			if (c->reuseport)
+				c = iphtshard(h, sa, sp);
 			spin_unlock(&ht->lock);
 			return c;
 		}
@@ -700,6 +733,8 @@ struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 			continue;
 		c = h->c;
 		if (dp == c->lport) {
+			if (c->reuseport)
+				c = iphtshard(h, sa, sp);
 			spin_unlock(&ht->lock);
 			return c;
 		}
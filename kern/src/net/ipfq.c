@@ -0,0 +1,305 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Fair queueing in front of an interface's medium.  With 'fq' on, IP output
+ * for an ifc goes through here instead of straight to m->bwrite().
+ *
+ * Whoever finds the fq idle sends their packet directly and then becomes the
+ * drainer: anything other senders queue while the drainer is in m->bwrite()
+ * (e.g. blocked on a full device queue) goes out in deficit round robin over
+ * the flows.  A flow is a conversation, or an address pair for packets without
+ * one (forwarding).  When the fq is idle, the only cost is a lock round trip.
+ *
+ * Packets over a flow's limit or the total limit are dropped on enqueue.
+ *
+ * The fq is set up and torn down with the ifc wlocked, and everyone sending
+ * holds the rlock, so ifc->fq and ifc->m are stable while we're in here. */
+
+#include <slab.h>
+#include <kmalloc.h>
+#include <kref.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <cpio.h>
+#include <pmap.h>
+#include <smp.h>
+#include <net/ip.h>
+#include <hash.h>
+
+enum {
+	IPFQ_NR_FLOWS = 1024,		/* power of 2 */
+	IPFQ_FLOW_LIMIT = 128,		/* default packets per flow */
+	IPFQ_LIMIT = 8192,		/* default packets in all flows */
+};
+
+struct ipfq_pkt {
+	struct ipfq_pkt			*next;
+	struct block			*bp;
+	uint64_t			enq_tsc;
+	int				version;
+	uint8_t				gate[IPaddrlen];
+};
+
+struct ipfq_flow {
+	struct ipfq_pkt			*head;
+	struct ipfq_pkt			*tail;
+	unsigned int			qlen;
+	int				deficit;
+	bool				active;
+	TAILQ_ENTRY(ipfq_flow)		link;
+};
+TAILQ_HEAD(ipfq_flow_tailq, ipfq_flow);
+
+struct ipfq {
+	spinlock_t			lock;
+	bool				draining;
+	unsigned int			qlen;
+	unsigned int			limit;
+	unsigned int			flow_limit;
+	struct ipfq_flow_tailq		active;
+
+	uint64_t			direct;	/* sent without queueing */
+	uint64_t			queued;
+	uint64_t			dequeued;
+	uint64_t			drops;
+	uint64_t			lat_sum_us;
+	uint64_t			lat_max_us;
+
+	struct ipfq_flow		flows[IPFQ_NR_FLOWS];
+};
+
+static struct kmem_cache *ipfq_pkt_kcache;
+
+static void __init ipfq_init(void)
+{
+	ipfq_pkt_kcache = kmem_cache_create("ipfq_pkt",
+					    sizeof(struct ipfq_pkt),
+					    __alignof__(struct ipfq_pkt), 0,
+					    NULL, 0, 0, NULL);
+}
+init_func_2(ipfq_init);
+
+static struct ipfq_flow *ipfq_flow(struct ipfq *fq, struct block *bp,
+				   int version, struct conv *c)
+{
+	uint32_t h;
+
+	if (c) {
+		h = hash_ptr(c, 32);
+	} else if (version == V4) {
+		struct Ip4hdr *eh = (struct Ip4hdr *)bp->rp;
+
+		h = hash_32(nhgetl(eh->src) ^ nhgetl(eh->dst), 32);
+	} else {
+		struct ip6hdr *eh = (struct ip6hdr *)bp->rp;
+
+		h = hash_32(nhgetl(eh->src + 12) ^ nhgetl(eh->dst + 12), 32);
+	}
+	return &fq->flows[h & (IPFQ_NR_FLOWS - 1)];
+}
+
+/* Called with the fq locked.  Consumes bp. */
+static void ipfq_enqueue(struct Ipifc *ifc, struct ipfq *fq, struct block *bp,
+			 int version, uint8_t *gate, struct conv *c)
+{
+	struct ipfq_flow *flow = ipfq_flow(fq, bp, version, c);
+	struct ipfq_pkt *pkt;
+
+	if (flow->qlen >= fq->flow_limit || fq->qlen >= fq->limit)
+		goto drop;
+	pkt = kmem_cache_alloc(ipfq_pkt_kcache, MEM_ATOMIC);
+	if (!pkt)
+		goto drop;
+	pkt->next = NULL;
+	pkt->bp = bp;
+	pkt->enq_tsc = read_tsc();
+	pkt->version = version;
+	memmove(pkt->gate, gate, version == V4 ? IPv4addrlen : IPaddrlen);
+	if (flow->tail)
+		flow->tail->next = pkt;
+	else
+		flow->head = pkt;
+	flow->tail = pkt;
+	flow->qlen++;
+	fq->qlen++;
+	fq->queued++;
+	if (!flow->active) {
+		flow->active = TRUE;
+		flow->deficit = ifc->maxtu;
+		TAILQ_INSERT_TAIL(&fq->active, flow, link);
+	}
+	return;
+drop:
+	fq->drops++;
+	ifc->outerr++;
+	freeblist(bp);
+}
+
+/* Deficit round robin: each active flow may send maxtu bytes per round.
+ * Called with the fq locked. */
+static struct ipfq_pkt *ipfq_dequeue(struct Ipifc *ifc, struct ipfq *fq)
+{
+	struct ipfq_flow *flow;
+	struct ipfq_pkt *pkt;
+	uint64_t lat;
+
+	while ((flow = TAILQ_FIRST(&fq->active))) {
+		if (flow->deficit <= 0) {
+			flow->deficit += ifc->maxtu;
+			TAILQ_REMOVE(&fq->active, flow, link);
+			TAILQ_INSERT_TAIL(&fq->active, flow, link);
+			continue;
+		}
+		pkt = flow->head;
+		flow->head = pkt->next;
+		if (!flow->head)
+			flow->tail = NULL;
+		flow->qlen--;
+		fq->qlen--;
+		flow->deficit -= blocklen(pkt->bp);
+		if (!flow->qlen) {
+			flow->active = FALSE;
+			TAILQ_REMOVE(&fq->active, flow, link);
+		}
+		fq->dequeued++;
+		lat = tsc2usec(read_tsc() - pkt->enq_tsc);
+		fq->lat_sum_us += lat;
+		fq->lat_max_us = MAX(fq->lat_max_us, lat);
+		return pkt;
+	}
+	return NULL;
+}
+
+static void ipfq_drain(struct Ipifc *ifc, struct ipfq *fq)
+{
+	ERRSTACK(1);
+	struct ipfq_pkt *pkt;
+
+	for (;;) {
+		spin_lock(&fq->lock);
+		pkt = ipfq_dequeue(ifc, fq);
+		if (!pkt) {
+			fq->draining = FALSE;
+			spin_unlock(&fq->lock);
+			return;
+		}
+		spin_unlock(&fq->lock);
+		/* discard error style; it's someone else's packet */
+		if (!waserror())
+			ifc->m->bwrite(ifc, pkt->bp, pkt->version, pkt->gate);
+		poperror();
+		kmem_cache_free(ipfq_pkt_kcache, pkt);
+	}
+}
+
+/* Sends bp out ifc through the fq.  Called with ifc rlocked. */
+void ipfqbwrite(struct Ipifc *ifc, struct block *bp, int version,
+		uint8_t *gate, struct conv *c)
+{
+	ERRSTACK(1);
+	struct ipfq *fq = ifc->fq;
+
+	spin_lock(&fq->lock);
+	if (fq->draining) {
+		ipfq_enqueue(ifc, fq, bp, version, gate, c);
+		spin_unlock(&fq->lock);
+		return;
+	}
+	fq->draining = TRUE;
+	fq->direct++;
+	spin_unlock(&fq->lock);
+	if (waserror()) {
+		ipfq_drain(ifc, fq);
+		nexterror();
+	}
+	ifc->m->bwrite(ifc, bp, version, gate);
+	poperror();
+	ipfq_drain(ifc, fq);
+}
+
+/* Drops everything queued.  Called with ifc wlocked. */
+void ipfqflush(struct Ipifc *ifc)
+{
+	struct ipfq *fq = ifc->fq;
+	struct ipfq_flow *flow;
+	struct ipfq_pkt *pkt;
+
+	if (!fq)
+		return;
+	while ((flow = TAILQ_FIRST(&fq->active))) {
+		while ((pkt = flow->head)) {
+			flow->head = pkt->next;
+			freeblist(pkt->bp);
+			kmem_cache_free(ipfq_pkt_kcache, pkt);
+			fq->drops++;
+		}
+		flow->tail = NULL;
+		flow->qlen = 0;
+		flow->active = FALSE;
+		TAILQ_REMOVE(&fq->active, flow, link);
+	}
+	fq->qlen = 0;
+}
+
+/* "fq [flowlimit [limit]]" turns on fair queueing or changes its limits.
+ * "fq off" turns it off.  Called with the ifc's conv locked. */
+void ipfqctl(struct Ipifc *ifc, char **argv, int argc)
+{
+	struct ipfq *fq;
+	long flow_limit = IPFQ_FLOW_LIMIT;
+	long limit = IPFQ_LIMIT;
+
+	if (argc == 2 && strcmp(argv[1], "off") == 0) {
+		wlock(&ifc->rwlock);
+		ipfqflush(ifc);
+		fq = ifc->fq;
+		ifc->fq = NULL;
+		wunlock(&ifc->rwlock);
+		kfree(fq);
+		return;
+	}
+	if (argc > 3)
+		error(EINVAL, "usage: fq [flowlimit [limit]] | fq off");
+	if (argc > 1)
+		flow_limit = strtol(argv[1], 0, 0);
+	if (argc > 2)
+		limit = strtol(argv[2], 0, 0);
+	if (flow_limit < 1 || limit < flow_limit)
+		error(EINVAL, "bad fq limits %ld %ld", flow_limit, limit);
+
+	fq = kzmalloc(sizeof(struct ipfq), MEM_WAIT);
+	spinlock_init(&fq->lock);
+	TAILQ_INIT(&fq->active);
+	wlock(&ifc->rwlock);
+	if (ifc->fq) {
+		ifc->fq->flow_limit = flow_limit;
+		ifc->fq->limit = limit;
+		wunlock(&ifc->rwlock);
+		kfree(fq);
+		return;
+	}
+	fq->flow_limit = flow_limit;
+	fq->limit = limit;
+	ifc->fq = fq;
+	wunlock(&ifc->rwlock);
+}
+
+/* Appends the fq's stats to an ifc's status line, as key-value pairs.  Called
+ * with ifc rlocked. */
+int ipfqstate(struct Ipifc *ifc, char *state, int n)
+{
+	struct ipfq *fq = ifc->fq;
+
+	if (!fq)
+		return snprintf(state, n, " fq 0");
+	spin_lock(&fq->lock);
+	n = snprintf(state, n,
+		     " fq 1 fqlen %u fqdirect %llu fqqueued %llu fqdrops %llu fqavglat %llu fqmaxlat %llu",
+		     fq->qlen, fq->direct, fq->queued, fq->drops,
+		     fq->dequeued ? fq->lat_sum_us / fq->dequeued : 0,
+		     fq->lat_max_us);
+	spin_unlock(&fq->lock);
+	return n;
+}
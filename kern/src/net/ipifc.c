@@ -219,6 +219,7 @@ static void ipifcunbind(struct Ipifc *ifc)
 	memset(ifc->dev, 0, sizeof(ifc->dev));
 	ifc->arg = NULL;
 	ifc->reassemble = 0;
+	ipfqflush(ifc);
 
 	/* close queues to stop queuing of packets */
 	qclose(ifc->conv->rq);
@@ -235,7 +236,7 @@ static void ipifcunbind(struct Ipifc *ifc)
 }
 
 char sfixedformat[] =
-	"device %s maxtu %d sendra %d recvra %d mflag %d oflag %d maxraint %d minraint %d linkmtu %d reachtime %d rxmitra %d ttl %d routerlt %d pktin %lu pktout %lu errin %lu errout %lu tracedrop %lu\n";
+	"device %s maxtu %d sendra %d recvra %d mflag %d oflag %d maxraint %d minraint %d linkmtu %d reachtime %d rxmitra %d ttl %d routerlt %d pktin %lu pktout %lu errin %lu errout %lu tracedrop %lu";
 
 char slineformat[] = "	%-40I %-10M %-40I %-12lu %-12lu\n";
 
@@ -255,6 +256,10 @@ static int ipifcstate(struct conv *c, char *state, int n)
 		     ifc->outerr, ifc->tracedrop);
 
 	rlock(&ifc->rwlock);
+	if (n > m)
+		m += ipfqstate(ifc, state + m, n - m);
+	if (n > m)
+		m += snprintf(state + m, n - m, "\n");
 	for (lifc = ifc->lifc; lifc && n > m; lifc = lifc->next)
 		m += snprintf(state + m, n - m, slineformat, lifc->local,
 			      lifc->mask, lifc->remote, lifc->validlt,
@@ -829,6 +834,8 @@ static void ipifcctl(struct conv *c, char **argv, int argc)
 		ipifcsetmtu(ifc, argv, argc);
 	else if (strcmp(argv[0], "reassemble") == 0)
 		ifc->reassemble = 1;
+	else if (strcmp(argv[0], "fq") == 0)
+		ipfqctl(ifc, argv, argc);
 	else if (strcmp(argv[0], "iprouting") == 0)
 		ipifc_iprouting(c->p->f, argv, argc);
 	else if (strcmp(argv[0], "addpref6") == 0)
@@ -242,7 +242,7 @@ int ipoput6(struct Fs *f, struct block *bp,
 	medialen = ifc->maxtu - ifc->m->hsize;
 	if (len <= medialen) {
 		hnputs(eh->ploadlen, len - IPV6HDR_LEN);
-		ifc->m->bwrite(ifc, bp, V6, gate);
+		ipifcbwrite(ifc, bp, V6, gate, c);
 		runlock(&ifc->rwlock);
 		poperror();
 		return 0;
@@ -335,7 +335,7 @@ int ipoput6(struct Fs *f, struct block *bp,
 				xp = xp->next;
 		}
 
-		ifc->m->bwrite(ifc, nb, V6, gate);
+		ipifcbwrite(ifc, nb, V6, gate, c);
 		ip->stats[FragCreates]++;
 	}
 	ip->stats[FragOKs]++;
@@ -0,0 +1,208 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Zero-copy writes to conversations.  With "zerocopy" on, a big enough write
+ * to the data file pins the user's pages and sends blocks whose extra_data
+ * point straight at them, instead of copying into kernel buffers.
+ *
+ * The user must not change the buffer until the write is done: every block and
+ * clone pointing at it (e.g. TCP's retransmit queue, the NIC's TX ring) has been
+ * freed.  Each zero-copy write on a conversation gets the next id, starting
+ * from 0 when the conversation is cloned.  When a write is done, data taps with
+ * FDTAP_FILT_ZCOPY get an event with ev_arg2 = FDTAP_FILT_ZCOPY, ev_arg3 = the
+ * tap's data and ev_arg4 = the write's id.  ev_arg1 is 1 if the kernel copied
+ * the data after all (e.g. the pages weren't faulted in), in which case the
+ * event doesn't wait for the data to be sent.
+ *
+ * Each ebd holds a ref on the ipzc, which unpins the pages and sends the event
+ * when the last one is gone.  That can happen in IRQ context, so the work is
+ * done in a routine kernel message. */
+
+#include <slab.h>
+#include <kmalloc.h>
+#include <kref.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <pmap.h>
+#include <smp.h>
+#include <umem.h>
+#include <event.h>
+#include <fdtap.h>
+#include <process.h>
+#include <trap.h>
+#include <net/ip.h>
+
+enum {
+	IPZC_BLOCK_MAX = 64 * 1024,	/* most data per block, as in __qwrite */
+};
+
+struct ipzc {
+	struct kref			kref;
+	struct proc			*proc;
+	struct event_queue		*ev_q;	/* 0 if no tap wants events */
+	int				ev_id;
+	void				*ev_data;
+	uint64_t			id;
+	bool				copied;
+	unsigned int			nr_pages;
+	struct page			*pages[];
+};
+
+static void __ipzc_done(uint32_t srcid, long a0, long a1, long a2)
+{
+	ERRSTACK(1);
+	struct ipzc *zc = (struct ipzc*)a0;
+	struct event_msg ev_msg = {0};
+
+	for (int i = 0; i < zc->nr_pages; i++)
+		page_decref(zc->pages[i]);
+	if (zc->ev_q) {
+		ev_msg.ev_type = zc->ev_id;
+		ev_msg.ev_arg1 = zc->copied;
+		ev_msg.ev_arg2 = FDTAP_FILT_ZCOPY;
+		ev_msg.ev_arg3 = zc->ev_data;
+		ev_msg.ev_arg4 = zc->id;
+		/* Like fire_tap(), the process could trigger a kernel PF */
+		if (!waserror())
+			send_event(zc->proc, zc->ev_q, &ev_msg, 0);
+		poperror();
+	}
+	proc_decref(zc->proc);
+	kfree(zc);
+}
+
+static void ipzc_release(struct kref *kref)
+{
+	struct ipzc *zc = container_of(kref, struct ipzc, kref);
+
+	send_kernel_message(core_id(), __ipzc_done, (long)zc, 0, 0,
+	                    KMSG_ROUTINE);
+}
+
+/* Pins zc's nr_pages user pages, starting with va's.  Returns FALSE if any of
+ * them can't be used, e.g. they aren't faulted in or are file-backed. */
+static bool ipzc_pin(struct ipzc *zc, struct proc *p, void *va)
+{
+	struct page *page;
+	uintptr_t uva = ROUNDDOWN((uintptr_t)va, PGSIZE);
+
+	spin_lock(&p->pte_lock);
+	for (int i = 0; i < zc->nr_pages; i++, uva += PGSIZE) {
+		page = page_lookup(p->env_pgdir, (void*)uva, NULL);
+		if (!page || page_is_pagemap(page)) {
+			spin_unlock(&p->pte_lock);
+			for (int j = 0; j < i; j++)
+				page_decref(zc->pages[j]);
+			return FALSE;
+		}
+		page_incref(page);
+		zc->pages[i] = page;
+	}
+	spin_unlock(&p->pte_lock);
+	return TRUE;
+}
+
+/* Copies the tap that wants completions, if any, and picks the write's id. */
+static void ipzc_setup_event(struct ipzc *zc, struct conv *c)
+{
+	struct fd_tap *tap_i;
+
+	spin_lock(&c->tap_lock);
+	zc->id = c->zcopy_id++;
+	SLIST_FOREACH(tap_i, &c->data_taps, link) {
+		if (tap_i->filter & FDTAP_FILT_ZCOPY) {
+			zc->ev_q = tap_i->ev_q;
+			zc->ev_id = tap_i->ev_id;
+			zc->ev_data = tap_i->data;
+			break;
+		}
+	}
+	spin_unlock(&c->tap_lock);
+}
+
+/* Builds a block pointing at the pinned pages for [va, va + len), which is in
+ * page page_idx. */
+static struct block *ipzc_build_block(struct ipzc *zc, uint8_t *va, size_t len,
+                                      unsigned int page_idx)
+{
+	struct block *b = block_alloc(64, MEM_WAIT);
+	struct extra_bdata *ebd;
+	size_t amt;
+	unsigned int nr = (PGOFF(va) + len + PGSIZE - 1) >> PGSHIFT;
+
+	block_add_extd(b, nr, MEM_WAIT);
+	for (int i = 0; i < nr; i++) {
+		amt = MIN(len, PGSIZE - PGOFF(va));
+		ebd = &b->extra_data[i];
+		ebd->base = (uintptr_t)page2kva(zc->pages[page_idx + i]);
+		ebd->off = PGOFF(va);
+		ebd->len = amt;
+		ebd->ext_ref = kref_get(&zc->kref, 1);
+		b->extra_len += amt;
+		va += amt;
+		len -= amt;
+	}
+	return b;
+}
+
+/* Writes [va, va + n) to c's wq without copying it, if we can.  Blocks are cut
+ * like __qwrite() does, so datagrams come out the same as with a copy.  Returns
+ * the amount written, like qwrite(). */
+size_t ipzcwrite(struct conv *c, void *va, size_t n, bool nonblock)
+{
+	ERRSTACK(1);
+	struct proc *p = current;
+	uint8_t *uva = va;
+	struct ipzc *zc;
+	struct block *b;
+	unsigned int nr_pages;
+	volatile size_t sofar = 0;	/* volatile for the waserror */
+	size_t amt;
+
+	/* Writes from the kernel get copied */
+	if (!p || !is_user_raddr(va, n))
+		goto copy;
+	nr_pages = (PGOFF(va) + n + PGSIZE - 1) >> PGSHIFT;
+	zc = kzmalloc(sizeof(struct ipzc) + nr_pages * sizeof(struct page*),
+		      MEM_WAIT);
+	kref_init(&zc->kref, ipzc_release, 1);
+	proc_incref(p, 1);
+	zc->proc = p;
+	zc->nr_pages = nr_pages;
+	ipzc_setup_event(zc, c);
+	if (!ipzc_pin(zc, p, va)) {
+		zc->nr_pages = 0;
+		zc->copied = TRUE;
+		kref_put(&zc->kref);
+		goto copy;
+	}
+
+	if (waserror()) {
+		/* Like __qwrite, an error after some data is a short write */
+		if (sofar)
+			goto out_ok;
+		kref_put(&zc->kref);
+		nexterror();
+	}
+	do {
+		amt = MIN(n - sofar, IPZC_BLOCK_MAX);
+		b = ipzc_build_block(zc, uva + sofar, amt,
+				     (PGOFF(uva) + sofar) >> PGSHIFT);
+		if (nonblock)
+			qbwrite_nonblock(c->wq, b);
+		else
+			qbwrite(c->wq, b);
+		sofar += amt;
+	} while (sofar < n && !(qstate(c->wq) & Qmsg));
+out_ok:
+	poperror();
+	kref_put(&zc->kref);
+	return sofar;
+
+copy:
+	if (nonblock)
+		return qwrite_nonblock(c->wq, va, n);
+	return qwrite(c->wq, va, n);
+}
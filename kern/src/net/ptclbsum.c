@@ -38,184 +38,206 @@
 #include <smp.h>
 #include <net/ip.h>
 #include <endian.h>
-
-static short endian = 1;
-static uint8_t *aendian = (uint8_t *) & endian;
-#define	LITTLE	*aendian
-
+#include <cpu_feat.h>
 
 #ifdef CONFIG_X86
 
-/* $NetBSD: in_cksum.c,v 1.7 1997/09/02 13:18:15 thorpej Exp $ */
-
-/*-
- * Copyright (c) 1988, 1992, 1993
- *	The Regents of the University of California.  All rights reserved.
- * Copyright (c) 1996
- *	Matt Thomas <matt@3am-software.com>
- *
- * Redistribution and use in source and binary forms, with or without
- * modification, are permitted provided that the following conditions
- * are met:
- * 1. Redistributions of source code must retain the above copyright
- *    notice, this list of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce the above copyright
- *    notice, this list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the distribution.
- * 3. All advertising materials mentioning features or use of this software
- *    must display the following acknowledgement:
- *	This product includes software developed by the University of
- *	California, Berkeley and its contributors.
- * 4. Neither the name of the University nor the names of its contributors
- *    may be used to endorse or promote products derived from this software
- *    without specific prior written permission.
+/* x86 checksums: we sum 64 bits at a time with add-with-carry.  The ones'
+ * complement sum of the little-endian words at addr folds down to the sum of
+ * the little-endian halfwords, which is the byte-swapped network order sum.
+ * Since we index from addr (unaligned loads are fine), odd addresses need no
+ * fixup.
  *
- * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
- * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
- * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
- * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
- * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
- * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
- * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
- * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
- * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
- * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
- * SUCH DAMAGE.
- *
- *	@(#)in_cksum.c	8.1 (Berkeley) 6/10/93
- */
+ * Every chain of adcs ends with two adc $0s: if the last adc left all ones
+ * with a carry out, the first wraps to zero and carries again. */
 
-/*
- * Checksum routine for Internet Protocol family headers
- *    (Portable Alpha version).
- *
- * This routine is very heavily used in the network
- * code and should be modified for each CPU to be as fast as possible.
- */
+static inline uint64_t load64(const uint8_t *p)
+{
+	uint64_t x;
 
-#define ADDCARRY(x)  (x > 65535 ? x -= 65535 : x)
-#define REDUCE32							  \
-    {									  \
-	q_util.q = sum;							  \
-	sum = q_util.s[0] + q_util.s[1] + q_util.s[2] + q_util.s[3];	  \
-    }
-#define REDUCE16							  \
-    {									  \
-	q_util.q = sum;							  \
-	l_util.l = q_util.s[0] + q_util.s[1] + q_util.s[2] + q_util.s[3]; \
-	sum = l_util.s[0] + l_util.s[1];				  \
-	ADDCARRY(sum);							  \
-    }
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
 
-static const uint32_t in_masks[] = {
-	/*0 bytes*/ /*1 byte*/	/*2 bytes*/ /*3 bytes*/
-	0x00000000, 0x000000FF, 0x0000FFFF, 0x00FFFFFF,	/* offset 0 */
-	0x00000000, 0x0000FF00, 0x00FFFF00, 0xFFFFFF00,	/* offset 1 */
-	0x00000000, 0x00FF0000, 0xFFFF0000, 0xFFFF0000,	/* offset 2 */
-	0x00000000, 0xFF000000, 0xFF000000, 0xFF000000,	/* offset 3 */
-};
+static inline uint64_t csum_add64(uint64_t sum, uint64_t x)
+{
+	asm("addq %1, %0; adcq $0, %0" : "+r"(sum) : "r"(x) : "cc");
+	return sum;
+}
 
-union l_util {
-	uint16_t s[2];
-	uint32_t l;
-};
-union q_util {
-	uint16_t s[4];
-	uint32_t l[2];
-	uint64_t q;
-};
+/* Sums the remaining 0-7 bytes at p, as if padded with zeros */
+static inline uint64_t csum_tail(uint64_t sum, const uint8_t *p, size_t len)
+{
+	uint64_t x = 0;
+
+	memcpy(&x, p, len);
+	return csum_add64(sum, x);
+}
 
-static uint64_t
-in_cksumdata(const void *buf, int len)
+static inline uint16_t csum_fold(uint64_t sum)
 {
-	const uint32_t *lw = (const uint32_t *) buf;
-	uint64_t sum = 0;
-	uint64_t prefilled;
-	int offset;
-	union q_util q_util;
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
 
-	if ((3 & (long) lw) == 0 && len == 20) {
-	     sum = (uint64_t) lw[0] + lw[1] + lw[2] + lw[3] + lw[4];
-	     REDUCE32;
-	     return sum;
+/* One carry chain, 64 bytes per trip */
+static uint64_t csum_adc(uint64_t sum, const uint8_t *p, size_t len)
+{
+	while (len >= 64) {
+		asm("addq 0(%[p]), %[s]\n\t"
+		    "adcq 8(%[p]), %[s]\n\t"
+		    "adcq 16(%[p]), %[s]\n\t"
+		    "adcq 24(%[p]), %[s]\n\t"
+		    "adcq 32(%[p]), %[s]\n\t"
+		    "adcq 40(%[p]), %[s]\n\t"
+		    "adcq 48(%[p]), %[s]\n\t"
+		    "adcq 56(%[p]), %[s]\n\t"
+		    "adcq $0, %[s]\n\t"
+		    "adcq $0, %[s]"
+		    : [s] "+r"(sum)
+		    : [p] "r"(p), "m"(*(const uint8_t (*)[64])p)
+		    : "cc");
+		p += 64;
+		len -= 64;
 	}
-
-	if ((offset = 3 & (long) lw) != 0) {
-		const uint32_t *masks = in_masks + (offset << 2);
-		lw = (uint32_t *) (((long) lw) - offset);
-		sum = *lw++ & masks[len >= 3 ? 3 : len];
-		len -= 4 - offset;
-		if (len <= 0) {
-			REDUCE32;
-			return sum;
-		}
+	while (len >= 8) {
+		sum = csum_add64(sum, load64(p));
+		p += 8;
+		len -= 8;
 	}
-#if 0
-	/*
-	 * Force to cache line boundary.
-	 */
-	offset = 32 - (0x1f & (long) lw);
-	if (offset < 32 && len > offset) {
-		len -= offset;
-		if (4 & offset) {
-			sum += (uint64_t) lw[0];
-			lw += 1;
-		}
-		if (8 & offset) {
-			sum += (uint64_t) lw[0] + lw[1];
-			lw += 2;
-		}
-		if (16 & offset) {
-			sum += (uint64_t) lw[0] + lw[1] + lw[2] + lw[3];
-			lw += 4;
-		}
+	return csum_tail(sum, p, len);
+}
+
+/* Two carry chains (ADX): adcx only uses CF and adox only uses OF, so the
+ * halves of each trip don't wait on each other's carries. */
+static uint64_t csum_adx(uint64_t sum, const uint8_t *p, size_t len)
+{
+	uint64_t sum2 = 0;
+	uint64_t zero;
+
+	while (len >= 64) {
+		/* the xor zeroes CF and OF, as well as 'zero' */
+		asm("xorl %k[z], %k[z]\n\t"
+		    "adcxq 0(%[p]), %[s]\n\t"
+		    "adoxq 8(%[p]), %[s2]\n\t"
+		    "adcxq 16(%[p]), %[s]\n\t"
+		    "adoxq 24(%[p]), %[s2]\n\t"
+		    "adcxq 32(%[p]), %[s]\n\t"
+		    "adoxq 40(%[p]), %[s2]\n\t"
+		    "adcxq 48(%[p]), %[s]\n\t"
+		    "adoxq 56(%[p]), %[s2]\n\t"
+		    "adcxq %[z], %[s]\n\t"
+		    "adoxq %[z], %[s2]\n\t"
+		    "adcxq %[z], %[s]\n\t"
+		    "adoxq %[z], %[s2]"
+		    : [s] "+r"(sum), [s2] "+r"(sum2), [z] "=&r"(zero)
+		    : [p] "r"(p), "m"(*(const uint8_t (*)[64])p)
+		    : "cc");
+		p += 64;
+		len -= 64;
 	}
-#endif
-	/*
-	 * access prefilling to start load of next cache line.
-	 * then add current cache line
-	 * save result of prefilling for loop iteration.
-	 */
-	prefilled = lw[0];
-	while ((len -= 32) >= 4) {
-		uint64_t prefilling = lw[8];
-		sum += prefilled + lw[1] + lw[2] + lw[3]
-			+ lw[4] + lw[5] + lw[6] + lw[7];
-		lw += 8;
-		prefilled = prefilling;
+	sum = csum_add64(sum, sum2);
+	while (len >= 8) {
+		sum = csum_add64(sum, load64(p));
+		p += 8;
+		len -= 8;
 	}
-	if (len >= 0) {
-		sum += prefilled + lw[1] + lw[2] + lw[3]
-			+ lw[4] + lw[5] + lw[6] + lw[7];
-		lw += 8;
-	} else {
-		len += 32;
+	return csum_tail(sum, p, len);
+}
+
+/* Copies len bytes from src to dst and sums them, 32 bytes per trip.  The
+ * data goes through registers once, instead of being read again after a
+ * memcpy. */
+static uint64_t csum_copy_adc(uint64_t sum, uint8_t *dst, const uint8_t *src,
+                              size_t len)
+{
+	uint64_t t0, t1, t2, t3;
+
+	while (len >= 32) {
+		asm("movq 0(%[src]), %[t0]\n\t"
+		    "movq 8(%[src]), %[t1]\n\t"
+		    "movq 16(%[src]), %[t2]\n\t"
+		    "movq 24(%[src]), %[t3]\n\t"
+		    "addq %[t0], %[s]\n\t"
+		    "adcq %[t1], %[s]\n\t"
+		    "adcq %[t2], %[s]\n\t"
+		    "adcq %[t3], %[s]\n\t"
+		    "adcq $0, %[s]\n\t"
+		    "adcq $0, %[s]\n\t"
+		    "movq %[t0], 0(%[dst])\n\t"
+		    "movq %[t1], 8(%[dst])\n\t"
+		    "movq %[t2], 16(%[dst])\n\t"
+		    "movq %[t3], 24(%[dst])"
+		    : [s] "+r"(sum), [t0] "=&r"(t0), [t1] "=&r"(t1),
+		      [t2] "=&r"(t2), [t3] "=&r"(t3),
+		      "=m"(*(uint8_t (*)[32])dst)
+		    : [src] "r"(src), [dst] "r"(dst),
+		      "m"(*(const uint8_t (*)[32])src)
+		    : "cc");
+		src += 32;
+		dst += 32;
+		len -= 32;
 	}
-	while ((len -= 16) >= 0) {
-		sum += (uint64_t) lw[0] + lw[1] + lw[2] + lw[3];
-		lw += 4;
+	while (len >= 8) {
+		t0 = load64(src);
+		memcpy(dst, &t0, sizeof(t0));
+		sum = csum_add64(sum, t0);
+		src += 8;
+		dst += 8;
+		len -= 8;
 	}
-	len += 16;
-	while ((len -= 4) >= 0) {
-		sum += (uint64_t) *lw++;
+	t0 = 0;
+	memcpy(&t0, src, len);
+	memcpy(dst, &t0, len);
+	return csum_add64(sum, t0);
+}
+
+static uint64_t (*csum_partial)(uint64_t sum, const uint8_t *p, size_t len) =
+	csum_adc;
+
+static uint16_t ptclbsum_adc(uint8_t *addr, int len)
+{
+	return cpu_to_be16(csum_fold(csum_adc(0, addr, len)));
+}
+
+static uint16_t ptclbsum_adx(uint8_t *addr, int len)
+{
+	return cpu_to_be16(csum_fold(csum_adx(0, addr, len)));
+}
+
+struct ptclbsum_kernel ptclbsum_kernels[] = {
+	{"adc", ptclbsum_adc, TRUE},
+	{"adx", ptclbsum_adx, FALSE},
+};
+int nr_ptclbsum_kernels = ARRAY_SIZE(ptclbsum_kernels);
+
+static void __init ptclbsum_init(void)
+{
+	if (cpu_has_feat(CPU_FEAT_X86_ADX)) {
+		csum_partial = csum_adx;
+		ptclbsum_kernels[1].usable = TRUE;
 	}
-	len += 4;
-	if (len > 0)
-		sum += (uint64_t) (in_masks[len] & *lw);
-	REDUCE32;
-	return sum;
 }
-uint16_t ptclbsum(uint8_t * addr, int len)
+init_func_2(ptclbsum_init);
+
+uint16_t ptclbsum(uint8_t *addr, int len)
+{
+	return cpu_to_be16(csum_fold(csum_partial(0, addr, len)));
+}
+
+uint16_t ptclbcopysum(uint8_t *dst, uint8_t *src, int len)
 {
-	uint64_t sum = in_cksumdata(addr, len);
-	union q_util q_util;
-	union l_util l_util;
-	if ((uintptr_t)addr & 1)
-		sum <<= 8;
-	REDUCE16;
-	return cpu_to_be16(sum);
+	return cpu_to_be16(csum_fold(csum_copy_adc(0, dst, src, len)));
 }
 #else
+
+static short endian = 1;
+static uint8_t *aendian = (uint8_t *) & endian;
+#define	LITTLE	*aendian
+
 uint16_t ptclbsum(uint8_t * addr, int len)
 {
 	uint32_t losum, hisum, mdsum, x;
@@ -282,4 +304,15 @@ uint16_t ptclbsum(uint8_t * addr, int len)
 
 	return losum & 0xffff;
 }
+
+uint16_t ptclbcopysum(uint8_t *dst, uint8_t *src, int len)
+{
+	memcpy(dst, src, len);
+	return ptclbsum(src, len);
+}
+
+struct ptclbsum_kernel ptclbsum_kernels[] = {
+	{"generic", ptclbsum, TRUE},
+};
+int nr_ptclbsum_kernels = ARRAY_SIZE(ptclbsum_kernels);
 #endif
@@ -38,6 +38,7 @@
 #include <smp.h>
 #include <net/ip.h>
 #include <net/tcp.h>
+#include <hash.h>
 
 /* Must correspond to the enumeration in tcp.h */
 static char *tcpstates[] = {
@@ -66,6 +67,9 @@ static char *statnames[] = {
 	[HlenErrs] "HlenErrs",
 	[LenErrs] "LenErrs",
 	[OutOfOrder] "OutOfOrder",
+	[SynCookiesSent] "SynCookiesSent",
+	[SynCookiesRecv] "SynCookiesRecv",
+	[SynCookiesFailed] "SynCookiesFailed",
 };
 
 /*
@@ -101,6 +105,8 @@ static void tcpsetscale(struct conv *, Tcpctl *, uint16_t, uint16_t);
 static void tcp_loss_event(struct conv *s, Tcpctl *tcb);
 static uint16_t derive_payload_mss(Tcpctl *tcb);
 static void set_in_flight(Tcpctl *tcb);
+static uint64_t tcp_pace_rate(Tcpctl *tcb);
+static void tcppaceproc(void *a);
 
 static void limborexmit(struct Proto *);
 static void limbo(struct conv *, uint8_t *unused_uint8_p_t, uint8_t *, Tcp *,
@@ -161,14 +167,16 @@ static int tcpstate(struct conv *c, char *state, int n)
 	s = (Tcpctl *) (c->ptcl);
 
 	return snprintf(state, n,
-			"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %d\n",
+			"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %d hp_acks %llu hp_data %llu hp_misses %llu ackbatch %d pacing %d pacerate %llu maxrate %llu srtt_us %llu\n",
 			tcpstates[s->state],
 			c->rq ? qlen(c->rq) : 0,
 			c->wq ? qlen(c->wq) : 0,
 			s->srtt, s->mdev,
 			s->cwind, s->snd.wnd, s->rcv.scale, s->rcv.wnd,
 			s->snd.scale, s->timer.start, s->timer.count, s->rerecv,
-			s->katimer.start, s->katimer.count);
+			s->katimer.start, s->katimer.count, s->hp_acks,
+			s->hp_data, s->hp_misses, s->ack_batch, s->pacing,
+			tcp_pace_rate(s), s->max_rate, s->srtt_us);
 }
 
 static int tcpinuse(struct conv *c)
@@ -345,7 +353,7 @@ static void tcpcreate(struct conv *c)
 	 * own.  We only use qpassnolim().  Note for qio that 0 doesn't mean no
 	 * limit. */
 	c->rq = qopen(0, Qcoalesce, 0, 0);
-	c->wq = qopen(8 * QMAX, Qkick, tcpkick, c);
+	c->wq = qopen(8 * QMAX, Qkick | Qcsum, tcpkick, c);
 }
 
 static void timerstate(struct tcppriv *priv, Tcptimer *t, int newstate)
@@ -448,6 +456,179 @@ static void tcphalt(struct tcppriv *priv, Tcptimer *t)
 	qunlock(&priv->tl);
 }
 
+/* Bytes per second we pace tcb at, 0 for no pacing.  Like Linux, we pace at
+ * twice cwind per RTT in slow start and 1.2x after, so that pacing doesn't
+ * hold back cwind growth.  Until we have an RTT sample, only max_rate
+ * applies. */
+static uint64_t tcp_pace_rate(Tcpctl *tcb)
+{
+	uint64_t rate = 0;
+
+	if (tcb->pacing && tcb->srtt_us) {
+		rate = (uint64_t)tcb->cwind * 1000000 / tcb->srtt_us;
+		if (tcb->cwind < tcb->ssthresh)
+			rate *= 2;
+		else
+			rate = rate * 6 / 5;
+	}
+	if (tcb->max_rate && (!rate || rate > tcb->max_rate))
+		rate = tcb->max_rate;
+	return rate;
+}
+
+/* Puts tcb on the pace list, so the pacer runs tcpoutput() once tcb's
+ * pace_next has passed.  Called with s qlocked. */
+static void tcp_pace_queue(struct conv *s, Tcpctl *tcb)
+{
+	struct tcppriv *tpriv = s->p->priv;
+	Tcpctl *pos;
+	bool kick = FALSE;
+
+	spin_lock(&tpriv->pace_lock);
+	if (!tcb->pace_queued) {
+		/* New entries usually go at or near the end */
+		TAILQ_FOREACH_REVERSE(pos, &tpriv->pace_list, tcpctl_tailq,
+				      pace_link) {
+			if (pos->pace_next <= tcb->pace_next)
+				break;
+		}
+		if (pos) {
+			TAILQ_INSERT_AFTER(&tpriv->pace_list, pos, tcb,
+					   pace_link);
+		} else {
+			TAILQ_INSERT_HEAD(&tpriv->pace_list, tcb, pace_link);
+			tpriv->pace_kick = TRUE;
+			kick = TRUE;
+		}
+		tcb->pace_queued = TRUE;
+	}
+	spin_unlock(&tpriv->pace_lock);
+	if (kick)
+		rendez_wakeup(&tpriv->pace_rv);
+}
+
+static void tcp_pace_dequeue(struct tcppriv *tpriv, Tcpctl *tcb)
+{
+	spin_lock(&tpriv->pace_lock);
+	if (tcb->pace_queued) {
+		TAILQ_REMOVE(&tpriv->pace_list, tcb, pace_link);
+		tcb->pace_queued = FALSE;
+	}
+	spin_unlock(&tpriv->pace_lock);
+}
+
+/* Returns TRUE if pacing holds back tcb's data for now.  The pacer will call
+ * tcpoutput() when it's due.  O/w, clamps ssize to about a millisecond's worth
+ * of data, so that one big TSO segment doesn't undo the pacing. */
+static bool tcp_pace_hold(struct conv *s, Tcpctl *tcb, uint32_t *ssize)
+{
+	uint64_t rate = tcp_pace_rate(tcb);
+
+	if (!rate)
+		return FALSE;
+	if (read_tsc() < tcb->pace_next) {
+		tcp_pace_queue(s, tcb);
+		return TRUE;
+	}
+	*ssize = MIN(*ssize, MAX(rate / 1000, 2 * tcb->typical_mss));
+	return FALSE;
+}
+
+/* Called after sending ssize bytes from from_seq.  Pushes out pace_next, and
+ * starts a usec RTT sample if we don't have one going.  The ms RTT from the
+ * timestamps is too coarse to pace a fast, local network. */
+static void tcp_pace_sent(Tcpctl *tcb, uint32_t from_seq, uint32_t ssize)
+{
+	uint64_t now = read_tsc();
+	uint64_t rate;
+
+	if (tcb->pacing && !tcb->rtt_us_start && !tcb->snd.recovery) {
+		tcb->rtt_us_start = now;
+		tcb->rtt_us_seq = from_seq + ssize;
+	}
+	rate = tcp_pace_rate(tcb);
+	if (rate)
+		tcb->pace_next = MAX(tcb->pace_next, now) +
+				 nsec2tsc(ssize * NSEC_PER_SEC / rate);
+}
+
+/* Finishes the usec RTT sample if ack covers it.  Like Karn, we don't trust
+ * samples taken during loss recovery. */
+static void tcp_pace_acked(Tcpctl *tcb, uint32_t ack)
+{
+	uint64_t rtt;
+
+	if (!tcb->rtt_us_start || !seq_ge(ack, tcb->rtt_us_seq))
+		return;
+	if (!tcb->snd.recovery) {
+		rtt = MAX(tsc2usec(read_tsc() - tcb->rtt_us_start), 1);
+		if (tcb->srtt_us)
+			tcb->srtt_us = (tcb->srtt_us * 7 + rtt) / 8;
+		else
+			tcb->srtt_us = rtt;
+	}
+	tcb->rtt_us_start = 0;
+}
+
+static void tcp_pace_output(struct conv *s)
+{
+	ERRSTACK(1);
+
+	qlock(&s->qlock);
+	/* discard error style */
+	if (!waserror())
+		tcpoutput(s);
+	poperror();
+	qunlock(&s->qlock);
+}
+
+static int tcp_pace_kicked(void *arg)
+{
+	struct tcppriv *tpriv = arg;
+
+	return tpriv->pace_kick;
+}
+
+/* Sends for paced convs once they are due.  Sleeps on a usec alarm until the
+ * earliest one, or until someone queues an earlier one. */
+static void tcppaceproc(void *a)
+{
+	struct Proto *tcp = a;
+	struct tcppriv *tpriv = tcp->priv;
+	struct conv *due[TCP_PACE_BATCH];
+	Tcpctl *tcb;
+	uint64_t now, next;
+	int nr;
+
+	for (;;) {
+		now = read_tsc();
+		next = 0;
+		nr = 0;
+		spin_lock(&tpriv->pace_lock);
+		tpriv->pace_kick = FALSE;
+		while ((tcb = TAILQ_FIRST(&tpriv->pace_list))) {
+			if (tcb->pace_next > now || nr == TCP_PACE_BATCH) {
+				next = tcb->pace_next;
+				break;
+			}
+			TAILQ_REMOVE(&tpriv->pace_list, tcb, pace_link);
+			tcb->pace_queued = FALSE;
+			due[nr++] = tcb->conv;
+		}
+		spin_unlock(&tpriv->pace_lock);
+
+		for (int i = 0; i < nr; i++)
+			tcp_pace_output(due[i]);
+		if (nr == TCP_PACE_BATCH)
+			continue;
+		if (next)
+			rendez_sleep_timeout(&tpriv->pace_rv, tcp_pace_kicked,
+					     tpriv, MAX(tsc2usec(next - now), 1));
+		else
+			rendez_sleep(&tpriv->pace_rv, tcp_pace_kicked, tpriv);
+	}
+}
+
 static int backoff(int n)
 {
 	return 1 << n;
@@ -465,6 +646,7 @@ static void localclose(struct conv *s, char *reason)
 
 	iphtrem(&tpriv->ht, s);
 
+	tcp_pace_dequeue(tpriv, tcb);
 	tcphalt(tpriv, &tcb->timer);
 	tcphalt(tpriv, &tcb->rtt_timer);
 	tcphalt(tpriv, &tcb->acktimer);
@@ -536,11 +718,14 @@ static void inittcpctl(struct conv *s, int mode)
 
 	tcb = (Tcpctl *) s->ptcl;
 
+	tcp_pace_dequeue(s->p->priv, tcb);
 	memset(tcb, 0, sizeof(Tcpctl));
+	tcb->conv = s;
 
 	tcb->ssthresh = UINT32_MAX;
 	tcb->srtt = tcp_irtt;
 	tcb->mdev = 0;
+	tcb->ack_batch = TCP_ACK_BATCH;
 
 	/* setup timers */
 	tcb->timer.start = tcp_irtt / MSPTICK;
@@ -617,6 +802,9 @@ static void tcpstart(struct conv *s, int mode)
 			kpname = kmalloc(KNAMELEN, MEM_WAIT);
 			snprintf(kpname, KNAMELEN, "#I%dtcpack", s->p->f->dev);
 			ktask(kpname, tcpackproc, s->p);
+			kpname = kmalloc(KNAMELEN, MEM_WAIT);
+			snprintf(kpname, KNAMELEN, "#I%dtcppace", s->p->f->dev);
+			ktask(kpname, tcppaceproc, s->p);
 			tpriv->ackprocstarted = 1;
 		}
 		qunlock(&tpriv->apl);
@@ -1253,6 +1441,105 @@ static int sndsynack(struct Proto *tcp, Limbo *lp)
 
 #define hashipa(a, p) ( ( (a)[IPaddrlen-2] + (a)[IPaddrlen-1] + p )&LHTMASK )
 
+/* The MSSs a syncookie can say the other end asked for */
+static const uint16_t syncookie_mss[] = {536, 1220, 1440, 1460, 4312, 8960};
+
+/* Mixes a call's addresses, ports, and initial sequence with our secret.  Not
+ * a real MAC, but without the secret, no one can forge the low 24 bits. */
+static uint64_t syncookie_hash(struct tcppriv *tpriv, Limbo *lp,
+                               uint32_t count)
+{
+	uint64_t w[5];
+	uint64_t h = tpriv->syncookie_secret[0];
+
+	memcpy(&w[0], lp->laddr, IPaddrlen);
+	memcpy(&w[2], lp->raddr, IPaddrlen);
+	w[4] = ((uint64_t)lp->lport << 48) | ((uint64_t)lp->rport << 32) |
+	       lp->irs;
+	for (int i = 0; i < ARRAY_SIZE(w); i++) {
+		h = (h ^ w[i]) * GOLDEN_RATIO_64;
+		h ^= h >> 32;
+	}
+	h = (h ^ (tpriv->syncookie_secret[1] + count)) * GOLDEN_RATIO_64;
+	return h ^ (h >> 29);
+}
+
+/* A syncookie is our ISS: 5 bits of the time, in SYNCOOKIE_PERIODs, 3 bits of
+ * MSS, and 24 bits of hash.  Rounds lp->mss down to what we can encode. */
+static uint32_t syncookie_make(struct tcppriv *tpriv, Limbo *lp)
+{
+	uint32_t count = NOW / SYNCOOKIE_PERIOD;
+	int mssi;
+
+	for (mssi = ARRAY_SIZE(syncookie_mss) - 1; mssi > 0; mssi--) {
+		if (syncookie_mss[mssi] <= lp->mss)
+			break;
+	}
+	lp->mss = syncookie_mss[mssi];
+	return ((count & 0x1f) << 27) | (mssi << 24) |
+	       (syncookie_hash(tpriv, lp, count) & 0xffffff);
+}
+
+/* Checks the cookie in lp->iss, from this period or the last, and recovers the
+ * MSS from it. */
+static bool syncookie_check(struct tcppriv *tpriv, Limbo *lp)
+{
+	uint32_t count = NOW / SYNCOOKIE_PERIOD;
+	unsigned int mssi = (lp->iss >> 24) & 0x7;
+
+	if (mssi >= ARRAY_SIZE(syncookie_mss))
+		return FALSE;
+	for (int age = 0; age < 2; age++, count--) {
+		if ((count & 0x1f) != lp->iss >> 27)
+			continue;
+		if ((syncookie_hash(tpriv, lp, count) & 0xffffff) !=
+		    (lp->iss & 0xffffff))
+			return FALSE;
+		lp->mss = syncookie_mss[mssi];
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ *  limbo is full, so answer with a syncookie and forget about the call.
+ *
+ *  called with proto locked
+ */
+static void limbo_syncookie(struct conv *s, uint8_t *source, uint8_t *dest,
+                            Tcp *seg, int version)
+{
+	struct tcppriv *tpriv = s->p->priv;
+	Limbo lp;
+
+	memset(&lp, 0, sizeof(lp));
+	lp.version = version;
+	ipmove(lp.laddr, dest);
+	ipmove(lp.raddr, source);
+	lp.lport = seg->dest;
+	lp.rport = seg->source;
+	lp.mss = seg->mss;
+	lp.irs = seg->seq;
+	lp.ts_val = seg->ts_val;
+	/* no room in the cookie for window scaling or SACK */
+	lp.iss = syncookie_make(tpriv, &lp);
+	tpriv->last_syncookie = NOW;
+	tpriv->stats[SynCookiesSent]++;
+	sndsynack(s->p, &lp);
+}
+
+/* When lp's next SYN ACK is due */
+static uint64_t limbo_due(Limbo *lp)
+{
+	return lp->lastsend + (lp->rexmits + 1) * SYNACK_RXTIMER;
+}
+
+static void limbo_due_min(uint64_t *due, Limbo *lp)
+{
+	if (!*due || limbo_due(lp) < *due)
+		*due = limbo_due(lp);
+}
+
 /*
  *  put a call into limbo and respond with a SYN ACK
  *
@@ -1284,16 +1571,14 @@ static void limbo(struct conv *s, uint8_t *source, uint8_t *dest, Tcp *seg,
 	}
 	lp = *l;
 	if (lp == NULL) {
-		if (tpriv->nlimbo >= Maxlimbo && tpriv->lht[h]) {
-			lp = tpriv->lht[h];
-			tpriv->lht[h] = lp->next;
-			lp->next = NULL;
-		} else {
-			lp = kzmalloc(sizeof(*lp), 0);
-			if (lp == NULL)
-				return;
-			tpriv->nlimbo++;
+		if (tpriv->nlimbo >= Maxlimbo) {
+			limbo_syncookie(s, source, dest, seg, version);
+			return;
 		}
+		lp = kzmalloc(sizeof(*lp), 0);
+		if (lp == NULL)
+			return;
+		tpriv->nlimbo++;
 		*l = lp;
 		lp->version = version;
 		ipmove(lp->laddr, dest);
@@ -1312,33 +1597,38 @@ static void limbo(struct conv *s, uint8_t *source, uint8_t *dest, Tcp *seg,
 		*l = lp->next;
 		tpriv->nlimbo--;
 		kfree(lp);
+		return;
 	}
+	limbo_due_min(&tpriv->lht_due[h], lp);
 }
 
 /*
- *  resend SYN ACK's once every SYNACK_RXTIMER ms.
+ *  resend SYN ACK's once every SYNACK_RXTIMER ms.  only walks the buckets
+ *  with something due.
  */
 static void limborexmit(struct Proto *tcp)
 {
 	struct tcppriv *tpriv;
 	Limbo **l, *lp;
 	int h;
-	int seen;
-	uint64_t now;
+	uint64_t now, due;
 
 	tpriv = tcp->priv;
 
 	if (!canqlock(&tcp->qlock))
 		return;
-	seen = 0;
 	now = NOW;
-	for (h = 0; h < NLHT && seen < tpriv->nlimbo; h++) {
-		for (l = &tpriv->lht[h]; *l != NULL && seen < tpriv->nlimbo;) {
+	for (h = 0; h < NLHT; h++) {
+		if (!tpriv->lht_due[h] || tpriv->lht_due[h] > now)
+			continue;
+		due = 0;
+		for (l = &tpriv->lht[h]; *l != NULL;) {
 			lp = *l;
-			seen++;
-			if (now - lp->lastsend <
-			    (lp->rexmits + 1) * SYNACK_RXTIMER)
+			if (now < limbo_due(lp)) {
+				limbo_due_min(&due, lp);
+				l = &lp->next;
 				continue;
+			}
 
 			/* time it out after 1 second */
 			if (++(lp->rexmits) > 5) {
@@ -1350,18 +1640,17 @@ static void limborexmit(struct Proto *tcp)
 
 			/* if we're being attacked, don't bother resending SYN
 			 * ACK's */
-			if (tpriv->nlimbo > 100)
-				continue;
-
-			if (sndsynack(tcp, lp) < 0) {
+			if (tpriv->nlimbo <= 100 && sndsynack(tcp, lp) < 0) {
 				tpriv->nlimbo--;
 				*l = lp->next;
 				kfree(lp);
 				continue;
 			}
 
+			limbo_due_min(&due, lp);
 			l = &lp->next;
 		}
+		tpriv->lht_due[h] = due;
 	}
 	qunlock(&tcp->qlock);
 }
@@ -1431,6 +1720,7 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 	Tcp4hdr *h4;
 	Tcp6hdr *h6;
 	Limbo *lp, **l;
+	Limbo cookie_lp;
 	int h;
 
 	/* unless it's just an ack, it can't be someone coming out of limbo */
@@ -1468,16 +1758,41 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 		}
 		break;
 	}
-	if (lp == NULL)
-		return NULL;
+	if (lp == NULL) {
+		/* maybe it's answering one of our syncookies */
+		if (!tpriv->last_syncookie ||
+		    NOW - tpriv->last_syncookie > 2 * SYNCOOKIE_PERIOD)
+			return NULL;
+		lp = &cookie_lp;
+		memset(lp, 0, sizeof(Limbo));
+		lp->version = version;
+		ipmove(lp->laddr, dst);
+		ipmove(lp->raddr, src);
+		lp->lport = segp->dest;
+		lp->rport = segp->source;
+		lp->irs = segp->seq - 1;
+		lp->iss = segp->ack - 1;
+		if (!syncookie_check(tpriv, lp)) {
+			tpriv->stats[SynCookiesFailed]++;
+			return NULL;
+		}
+		tpriv->stats[SynCookiesRecv]++;
+		lp->ifc = findipifc(s->p->f, dst, 0);
+	}
 
 	new = Fsnewcall(s, src, segp->source, dst, segp->dest, version);
-	if (new == NULL)
+	if (new == NULL) {
+		if (lp != &cookie_lp)
+			kfree(lp);
 		return NULL;
+	}
 
+	tcp_pace_dequeue(tpriv, (Tcpctl *) new->ptcl);
 	memmove(new->ptcl, s->ptcl, sizeof(Tcpctl));
 	tcb = (Tcpctl *) new->ptcl;
 	tcb->flags &= ~CLONE;
+	tcb->conv = new;
+	tcb->pace_queued = FALSE;
 	tcb->timer.arg = new;
 	tcb->timer.state = TcptimerOFF;
 	tcb->acktimer.arg = new;
@@ -1521,11 +1836,13 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 	tcb->snd.wnd = segp->wnd;
 	tcb->cwind = tcb->typical_mss * CWIND_SCALE;
 
-	/* set initial round trip time */
-	tcb->sndsyntime = lp->lastsend + lp->rexmits * SYNACK_RXTIMER;
-	tcpsynackrtt(new);
-
-	kfree(lp);
+	/* set initial round trip time.  we didn't keep track of a syncookie's
+	 * SYN ACK, so those start with the default. */
+	if (lp != &cookie_lp) {
+		tcb->sndsyntime = lp->lastsend + lp->rexmits * SYNACK_RXTIMER;
+		tcpsynackrtt(new);
+		kfree(lp);
+	}
 
 	/* set up proto header */
 	switch (version) {
@@ -1988,6 +2305,7 @@ static void update(struct conv *s, Tcp *seg)
 	tcb->snd.una = seg->ack;
 	if (seq_gt(seg->ack, tcb->snd.rtx))
 		tcb->snd.rtx = seg->ack;
+	tcp_pace_acked(tcb, seg->ack);
 
 	update_sacks(s, tcb, seg);
 	set_in_flight(tcb);
@@ -2209,6 +2527,74 @@ static void drop_old_rcv_sacks(Tcpctl *tcb)
 	}
 }
 
+/* Van Jacobson's header prediction.  On an established connection, most
+ * segments are either the next in-order data with nothing new acked, or a pure
+ * ack for more of our data.  Neither needs the state machine, trimming, or the
+ * resequence queue, so we handle them here.  Anything with flags other than
+ * ACK/PSH, SACKs, a window change, or loss recovery in progress takes the slow
+ * path.
+ *
+ * Returns TRUE if it handled (and consumed) the segment.  Called with s->qlock
+ * held, after the timestamp and keepalive bookkeeping. */
+static bool tcp_fastpath(struct conv *s, Tcpctl *tcb, Tcp *seg,
+			 struct block *bp, uint16_t length)
+{
+	struct tcppriv *tpriv = s->p->priv;
+
+	if (tcb->state != Established)
+		return FALSE;
+	if ((seg->flags & ~PSH) != ACK || seg->seq != tcb->rcv.nxt ||
+	    seg->wnd != tcb->snd.wnd || seg->nr_sacks || tcb->snd.recovery ||
+	    !(tcb->flags & SYNACK))
+		goto miss;
+
+	if (length == 0) {
+		/* Pure ack for new data.  update() does the cwnd, RTT, and
+		 * timer work; the ack may have opened room to send more. */
+		if (seg->ack == tcb->snd.una ||
+		    !seq_within(seg->ack, tcb->snd.una, tcb->snd.nxt) ||
+		    tcb->snd.nr_sacks)
+			goto miss;
+		tcb->hp_acks++;
+		update(s, seg);
+		if (seq_gt(tcb->rcv.nxt, tcb->rcv.urg))
+			tcb->rcv.urg = tcb->rcv.nxt;
+		freeblist(bp);
+		tcpoutput(s);
+		return TRUE;
+	}
+
+	/* In-order data that acks nothing new and fits in the window: update()
+	 * would be a no-op, and tcptrim() would keep all of it. */
+	if (seg->ack != tcb->snd.una || tcb->reseq || tcb->rcv.nr_sacks ||
+	    length > tcb->rcv.wnd || !bp)
+		goto miss;
+	tcb->hp_data++;
+	if (seq_gt(seg->ack, tcb->snd.wl2))
+		tcb->snd.wl2 = seg->ack;
+	if (seq_gt(tcb->rcv.nxt, tcb->rcv.urg))
+		tcb->rcv.urg = tcb->rcv.nxt;
+	bp = packblock(bp);
+	if (bp == NULL)
+		panic("tcp packblock");
+	qpassnolim(s->rq, bp);
+	tcb->rcv.nxt += length;
+	tcprcvwin(s);
+	/* Acks go out every ack_batch segments.  The acktimer covers the tail
+	 * of a burst. */
+	if (++(tcb->rcv.una) >= tcb->ack_batch)
+		tcb->flags |= FORCE;
+	if (tcb->acktimer.state != TcptimerON)
+		tcpgo(tpriv, &tcb->acktimer);
+	if ((tcb->flags & FORCE) || qlen(s->wq))
+		tcpoutput(s);
+	return TRUE;
+
+miss:
+	tcb->hp_misses++;
+	return FALSE;
+}
+
 static void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 {
 	ERRSTACK(1);
@@ -2389,6 +2775,12 @@ reset:
 	/* every input packet in puts off the keep alive time out */
 	tcpsetkacounter(tcb);
 
+	if (tcp_fastpath(s, tcb, &seg, bp, length)) {
+		qunlock(&s->qlock);
+		poperror();
+		return;
+	}
+
 	switch (tcb->state) {
 	case Closed:
 		sndrst(tcp, source, dest, length, &seg, version,
@@ -2596,18 +2988,14 @@ reset:
 					bp = NULL;
 
 					/*
-					 * Force an ack every 2 data messages.
-					 * This is a hack for rob to make his
-					 * home system run faster.
-					 *
-					 * this also keeps the standard TCP
-					 * congestion control working since it
-					 * needs an ack every 2 max segs worth.
-					 * This is not quite that, but under a
-					 * real stream is equivalent since every
-					 * packet has a max seg in it.
+					 * Force an ack every ack_batch data
+					 * messages (2 by default, which keeps
+					 * standard congestion control working,
+					 * since it needs an ack every 2 max
+					 * segs worth).  The acktimer covers the
+					 * tail of a burst.
 					 */
-					if (++(tcb->rcv.una) >= 2)
+					if (++(tcb->rcv.una) >= tcb->ack_batch)
 						tcb->flags |= FORCE;
 				}
 				tcb->rcv.nxt += length;
@@ -2797,6 +3185,11 @@ static bool throttle_ssize(struct conv *s, Tcpctl *tcb, uint32_t *ssize_p,
 		       tcb->snd.wnd, tcb->cwind);
 	if (usable < ssize)
 		ssize = usable;
+	/* Paced out for now.  We can still send an ack. */
+	if (ssize && tcp_pace_hold(s, tcb, &ssize)) {
+		*ssize_p = 0;
+		return TRUE;
+	}
 
 	ssize = throttle_for_mss(tcb, ssize, payload_mss, retrans);
 
@@ -3129,6 +3522,7 @@ static void tcpoutput(struct conv *s)
 			panic("tcpoutput2: version %d", version);
 		}
 		if (ssize) {
+			tcp_pace_sent(tcb, from_seq, ssize);
 			/* The outer loop thinks we sent one packet.  If we used
 			 * TSO, we might have sent several.  Minus one for the
 			 * loop increment. */
@@ -3273,6 +3667,44 @@ static void tcpsetchecksum(struct conv *s, char **f, int unused)
 	tcb->nochecksum = !atoi(f[1]);
 }
 
+static void tcpsetackbatch(struct conv *s, char **f, int n)
+{
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+	int batch;
+
+	if (n != 2)
+		error(EINVAL, "usage: ackbatch NR_SEGS");
+	batch = atoi(f[1]);
+	if (batch < 1 || batch > TCP_MAX_ACK_BATCH)
+		error(EINVAL, "ackbatch %d out of range [1, %d]", batch,
+		      TCP_MAX_ACK_BATCH);
+	tcb->ack_batch = batch;
+}
+
+static void tcpsetpacing(struct conv *s, char **f, int n)
+{
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+
+	if (n != 2)
+		error(EINVAL, "usage: pacing on|off");
+	if (strcmp(f[1], "on") == 0)
+		tcb->pacing = TRUE;
+	else if (strcmp(f[1], "off") == 0)
+		tcb->pacing = FALSE;
+	else
+		error(EINVAL, "usage: pacing on|off");
+}
+
+/* Bytes per second, 0 for no cap.  Paces the conv even if pacing is off. */
+static void tcpsetmaxrate(struct conv *s, char **f, int n)
+{
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+
+	if (n != 2)
+		error(EINVAL, "usage: maxrate BYTES_PER_SEC");
+	tcb->max_rate = strtoul(f[1], 0, 0);
+}
+
 static void tcp_loss_event(struct conv *s, Tcpctl *tcb)
 {
 	uint32_t old_cwnd = tcb->cwind;
@@ -3639,6 +4071,12 @@ static void tcpctl(struct conv *c, char **f, int n)
 		tcpstartka(c, f, n);
 	else if (n >= 1 && strcmp(f[0], "checksum") == 0)
 		tcpsetchecksum(c, f, n);
+	else if (n >= 1 && strcmp(f[0], "ackbatch") == 0)
+		tcpsetackbatch(c, f, n);
+	else if (n >= 1 && strcmp(f[0], "pacing") == 0)
+		tcpsetpacing(c, f, n);
+	else if (n >= 1 && strcmp(f[0], "maxrate") == 0)
+		tcpsetmaxrate(c, f, n);
 	else if (n >= 1 && strcmp(f[0], "tcpporthogdefense") == 0)
 		tcpporthogdefensectl(f[1]);
 	else
@@ -3732,6 +4170,10 @@ void tcpinit(struct Fs *fs)
 	debug_priv = tpriv;
 	qlock_init(&tpriv->tl);
 	qlock_init(&tpriv->apl);
+	spinlock_init(&tpriv->pace_lock);
+	TAILQ_INIT(&tpriv->pace_list);
+	rendez_init(&tpriv->pace_rv);
+	urandom_read(tpriv->syncookie_secret, sizeof(tpriv->syncookie_secret));
 	tcp->name = "tcp";
 	tcp->connect = tcpconnect;
 	tcp->announce = tcpannounce;
@@ -66,6 +66,8 @@ enum {
 	IP_UDPPROTO = 17,
 	UDP_USEAD7 = 52,
 	UDP_USEAD6 = 36,
+	UDP_RECHDR_SZ = 4,	/* len[2] segsize[2] of a batch record */
+	UDP_RECMAX = 0xffff,	/* most a record's len can say */
 
 	Udprxms = 200,
 	Udptickms = 100,
@@ -135,10 +137,26 @@ void udpkick(void *x, struct block *bp);
 
 /*
  *  protocol specific part of Conv
+ *
+ *  With "batch", the data file is a series of records, so one read or write
+ *  can carry many datagrams.  Each record is len[2] segsize[2], followed by len
+ *  bytes: the user's Udphdr, if headers are on, and then the data.  On writes,
+ *  a segsize other than 0 splits the data into segsize-byte datagrams, all to
+ *  the same address (segmentation offload), and reads return as many whole
+ *  records as fit.  A record must fit in one write of at most 64K.
+ *
+ *  "segment n" does the same split for every plain write.
+ *
+ *  "gro" turns on batch and merges datagrams from the same flow into the last
+ *  unread record, which then has the segsize of the datagrams.  Every datagram
+ *  but the last in a record is segsize long.
  */
 typedef struct Udpcb Udpcb;
 struct Udpcb {
 	uint8_t headers;
+	bool batch;
+	bool gro;
+	uint16_t segsize;
 };
 
 static void udpconnect(struct conv *c, char **argv, int argc)
@@ -190,6 +208,7 @@ static void udpcreate(struct conv *c)
 {
 	c->rq = qopen(128 * 1024, Qmsg, 0, 0);
 	c->wq = qbypass(udpkick, c);
+	q_toggle_qcsum(c->wq, TRUE);
 }
 
 static void udpclose(struct conv *c)
@@ -206,90 +225,32 @@ static void udpclose(struct conv *c)
 	qclose(c->eq);
 	ipmove(c->laddr, IPnoaddr);
 	ipmove(c->raddr, IPnoaddr);
-	c->lport = 0;
+	Fsconvlport(c, 0);
 	c->rport = 0;
 
 	ucb = (Udpcb *) c->ptcl;
 	ucb->headers = 0;
+	ucb->batch = FALSE;
+	ucb->gro = FALSE;
+	ucb->segsize = 0;
+	q_toggle_qbatch(c->rq, FALSE);
 
 	qunlock(&c->qlock);
 }
 
-void udpkick(void *x, struct block *bp)
+/* Sends one datagram of bp to raddr!rport from laddr, or to the conv's
+ * addresses if the user didn't give headers. */
+static void udpoput(struct conv *c, struct block *bp, int version,
+		    uint8_t *raddr, uint16_t rport, uint8_t *laddr)
 {
-	struct conv *c = x;
 	Udp4hdr *uh4;
 	Udp6hdr *uh6;
-	uint16_t rport;
-	uint8_t laddr[IPaddrlen], raddr[IPaddrlen];
-	Udpcb *ucb;
+	Udpcb *ucb = (Udpcb *) c->ptcl;
 	int dlen, ptcllen;
-	Udppriv *upriv;
-	struct Fs *f;
-	int version;
+	Udppriv *upriv = c->p->priv;
+	struct Fs *f = c->p->f;
 	struct conv *rc;
 
-	upriv = c->p->priv;
-	assert(upriv);
-	f = c->p->f;
-
-	netlog(c->p->f, Logudp, "udp: kick\n");
-	if (bp == NULL)
-		return;
-
-	ucb = (Udpcb *) c->ptcl;
-	switch (ucb->headers) {
-	case 7:
-		/* get user specified addresses */
-		bp = pullupblock(bp, UDP_USEAD7);
-		if (bp == NULL)
-			return;
-		ipmove(raddr, bp->rp);
-		bp->rp += IPaddrlen;
-		ipmove(laddr, bp->rp);
-		bp->rp += IPaddrlen;
-		/* pick interface closest to dest */
-		if (ipforme(f, laddr) != Runi)
-			findlocalip(f, laddr, raddr);
-		bp->rp += IPaddrlen;	/* Ignore ifc address */
-		rport = nhgets(bp->rp);
-		bp->rp += 2 + 2;	/* Ignore local port */
-		break;
-	case 6:
-		/* get user specified addresses */
-		bp = pullupblock(bp, UDP_USEAD6);
-		if (bp == NULL)
-			return;
-		ipmove(raddr, bp->rp);
-		bp->rp += IPaddrlen;
-		ipmove(laddr, bp->rp);
-		bp->rp += IPaddrlen;
-		/* pick interface closest to dest */
-		if (ipforme(f, laddr) != Runi)
-			findlocalip(f, laddr, raddr);
-		rport = nhgets(bp->rp);
-		bp->rp += 2 + 2;	/* Ignore local port */
-		break;
-	default:
-		rport = 0;
-		break;
-	}
-
-	if (ucb->headers) {
-		if (memcmp(laddr, v4prefix, IPv4off) == 0 ||
-			ipcmp(laddr, IPnoaddr) == 0)
-			version = V4;
-		else
-			version = V6;
-	} else {
-		if ((memcmp(c->raddr, v4prefix, IPv4off) == 0 &&
-			 memcmp(c->laddr, v4prefix, IPv4off) == 0)
-			|| ipcmp(c->raddr, IPnoaddr) == 0)
-			version = V4;
-		else
-			version = V6;
-	}
-
 	dlen = blocklen(bp);
 
 	/* fill in pseudo header and compute checksum */
@@ -376,11 +337,164 @@ void udpkick(void *x, struct block *bp)
 		break;
 
 	default:
-		panic("udpkick: version %d", version);
+		panic("udpoput: version %d", version);
 	}
 	upriv->ustats.udpOutDatagrams++;
 }
 
+/* Sends the user's bp, which starts with their Udphdr if headers are on.  If
+ * segsize is set, the data goes out in segsize-byte datagrams, each pointing
+ * into bp instead of copying it. */
+static void udpsend(struct conv *c, struct block *bp, unsigned int segsize)
+{
+	uint16_t rport;
+	uint8_t laddr[IPaddrlen], raddr[IPaddrlen];
+	Udpcb *ucb;
+	struct Fs *f;
+	int version;
+	size_t dlen;
+
+	f = c->p->f;
+	ucb = (Udpcb *) c->ptcl;
+	switch (ucb->headers) {
+	case 7:
+		/* get user specified addresses */
+		bp = pullupblock(bp, UDP_USEAD7);
+		if (bp == NULL)
+			return;
+		ipmove(raddr, bp->rp);
+		bp->rp += IPaddrlen;
+		ipmove(laddr, bp->rp);
+		bp->rp += IPaddrlen;
+		/* pick interface closest to dest */
+		if (ipforme(f, laddr) != Runi)
+			findlocalip(f, laddr, raddr);
+		bp->rp += IPaddrlen;	/* Ignore ifc address */
+		rport = nhgets(bp->rp);
+		bp->rp += 2 + 2;	/* Ignore local port */
+		break;
+	case 6:
+		/* get user specified addresses */
+		bp = pullupblock(bp, UDP_USEAD6);
+		if (bp == NULL)
+			return;
+		ipmove(raddr, bp->rp);
+		bp->rp += IPaddrlen;
+		ipmove(laddr, bp->rp);
+		bp->rp += IPaddrlen;
+		/* pick interface closest to dest */
+		if (ipforme(f, laddr) != Runi)
+			findlocalip(f, laddr, raddr);
+		rport = nhgets(bp->rp);
+		bp->rp += 2 + 2;	/* Ignore local port */
+		break;
+	default:
+		rport = 0;
+		break;
+	}
+
+	if (ucb->headers) {
+		if (memcmp(laddr, v4prefix, IPv4off) == 0 ||
+			ipcmp(laddr, IPnoaddr) == 0)
+			version = V4;
+		else
+			version = V6;
+	} else {
+		if ((memcmp(c->raddr, v4prefix, IPv4off) == 0 &&
+			 memcmp(c->laddr, v4prefix, IPv4off) == 0)
+			|| ipcmp(c->raddr, IPnoaddr) == 0)
+			version = V4;
+		else
+			version = V6;
+	}
+
+	dlen = blocklen(bp);
+	if (!segsize || dlen <= segsize) {
+		udpoput(c, bp, version, raddr, rport, laddr);
+		return;
+	}
+	for (size_t off = 0; off < dlen; off += segsize)
+		udpoput(c, blist_clone(bp, 0, MIN(segsize, dlen - off), off),
+			version, raddr, rport, laddr);
+	freeblist(bp);
+}
+
+/* Sends each record of a batch write.  A record that runs past the end of the
+ * write is dropped, along with anything after it. */
+static void udpkick_batch(struct conv *c, struct block *bp)
+{
+	Udppriv *upriv = c->p->priv;
+	struct block *nbp;
+	unsigned int len, segsize;
+
+	while (bp && blocklen(bp)) {
+		nbp = pullupblock(bp, UDP_RECHDR_SZ);
+		if (nbp)
+			bp = nbp;
+		if (nbp == NULL ||
+		    blocklen(bp) < UDP_RECHDR_SZ + nhgets(bp->rp)) {
+			netlog(c->p->f, Logudp, "udp: short batch record\n");
+			upriv->lenerr++;
+			break;
+		}
+		len = nhgets(bp->rp);
+		segsize = nhgets(bp->rp + 2);
+		udpsend(c, blist_clone(bp, 0, len, UDP_RECHDR_SZ), segsize);
+		pullblock(&bp, UDP_RECHDR_SZ + len);
+	}
+	freeblist(bp);
+}
+
+void udpkick(void *x, struct block *bp)
+{
+	struct conv *c = x;
+	Udpcb *ucb;
+
+	assert(c->p->priv);
+	netlog(c->p->f, Logudp, "udp: kick\n");
+	if (bp == NULL)
+		return;
+
+	ucb = (Udpcb *) c->ptcl;
+	if (ucb->batch)
+		udpkick_batch(c, bp);
+	else
+		udpsend(c, bp, ucb->segsize);
+}
+
+/* qpass_merge() callback for "gro": appends bp's data to the last record in rq
+ * if it's from the same flow and bp continues its run of segsize datagrams.
+ * arg is the length of the user's Udphdr. */
+static bool udpmerge(struct block *last, struct block *bp, void *arg)
+{
+	unsigned int hdrlen = UDP_RECHDR_SZ + (uintptr_t)arg;
+	unsigned int len, dlen, segsize, n;
+
+	if (BHLEN(last) < hdrlen)
+		return FALSE;
+	len = nhgets(last->rp);
+	dlen = len + UDP_RECHDR_SZ - hdrlen;
+	segsize = nhgets(last->rp + 2);
+	if (!segsize)
+		segsize = dlen;
+	n = BLEN(bp) - hdrlen;
+	/* A short datagram ends the run */
+	if (!n || !dlen || n > segsize || dlen % segsize ||
+	    len + n > UDP_RECMAX)
+		return FALSE;
+	if (memcmp(last->rp + UDP_RECHDR_SZ, bp->rp + UDP_RECHDR_SZ,
+		   hdrlen - UDP_RECHDR_SZ))
+		return FALSE;
+	bp->rp += hdrlen;
+	if (block_append_block(last, bp, MEM_ATOMIC)) {
+		bp->rp -= hdrlen;
+		return FALSE;
+	}
+	hnputs(last->rp, len + n);
+	hnputs(last->rp + 2, segsize);
+	return TRUE;
+}
+
 void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 {
 	int len;
@@ -395,6 +509,7 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 	int version;
 	int ottl, oviclfl, olen;
 	uint8_t *p;
+	uintptr_t hdrlen = 0;
 
 	upriv = udp->priv;
 	f = udp->f;
@@ -514,6 +629,10 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 				freeblist(bp);
 				return;
 			}
+			/* The new call gets the announcer's batch settings */
+			if (ucb->batch)
+				q_toggle_qbatch(c->rq, TRUE);
+			*(Udpcb *) c->ptcl = *ucb;
 			iphtadd(&upriv->ht, c);
 			ucb = (Udpcb *) c->ptcl;
 		}
@@ -561,6 +680,7 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 		hnputs(p, rport);
 		p += 2;
 		hnputs(p, lport);
+		hdrlen = UDP_USEAD7;
 		break;
 	case 6:
 		/* pass the src address */
@@ -573,12 +693,25 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 		hnputs(p, rport);
 		p += 2;
 		hnputs(p, lport);
+		hdrlen = UDP_USEAD6;
 		break;
 	}
 
 	if (bp->next)
 		bp = concatblock(bp);
 
+	if (ucb->batch) {
+		if (BLEN(bp) > UDP_RECMAX) {
+			qunlock(&c->qlock);
+			upriv->lenerr++;
+			freeblist(bp);
+			return;
+		}
+		bp = padblock(bp, UDP_RECHDR_SZ);
+		hnputs(bp->rp, BLEN(bp) - UDP_RECHDR_SZ);
+		hnputs(bp->rp + 2, 0);
+	}
+
 	if (qfull(c->rq)) {
 		qunlock(&c->qlock);
 		netlog(f, Logudp, "udp: qfull %I.%d -> %I.%d\n", raddr, rport,
@@ -587,7 +720,10 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 		return;
 	}
 
-	qpass(c->rq, bp);
+	if (ucb->gro)
+		qpass_merge(c->rq, bp, udpmerge, (void*)hdrlen);
+	else
+		qpass(c->rq, bp);
 	qunlock(&c->qlock);
 
 }
@@ -595,12 +731,25 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 static void udpctl(struct conv *c, char **f, int n)
 {
 	Udpcb *ucb = (Udpcb*)c->ptcl;
+	unsigned long segsize;
 
 	if ((n == 1) && strcmp(f[0], "oldheaders") == 0)
 		ucb->headers = 6;
 	else if ((n == 1) && strcmp(f[0], "headers") == 0)
 		ucb->headers = 7;
-	else
+	else if ((n == 1) && strcmp(f[0], "batch") == 0) {
+		q_toggle_qbatch(c->rq, TRUE);
+		ucb->batch = TRUE;
+	} else if ((n == 1) && strcmp(f[0], "gro") == 0) {
+		q_toggle_qbatch(c->rq, TRUE);
+		ucb->batch = TRUE;
+		ucb->gro = TRUE;
+	} else if ((n == 2) && strcmp(f[0], "segment") == 0) {
+		segsize = strtoul(f[1], 0, 0);
+		if (segsize > UDP_RECMAX)
+			error(EINVAL, "bad segment size %lu", segsize);
+		ucb->segsize = segsize;
+	} else
 		error(EINVAL, "unknown command to %s", __func__);
 }
 
@@ -38,6 +38,7 @@
 #include <smp.h>
 #include <net/ip.h>
 #include <process.h>
+#include <reclaim.h>
 
 /* Note that Hdrspc is only available via padblock (to the 'left' of the rp). */
 enum {
@@ -46,24 +47,49 @@ enum {
 	BLOCKALIGN = 32,	/* was the old BY2V in inferno, which was 8 */
 };
 
-/*
- *  allocate blocks (round data base address to 64 bit boundary).
- *  if mallocz gives us more than we asked for, leave room at the front
- *  for header.
- */
-struct block *block_alloc(size_t size, int mem_flags)
-{
-	struct block *b;
-	uintptr_t addr;
-	int n;
+/* Per-core pools of recycled blocks.
+ *
+ * Most network blocks come in a couple of sizes: about an MTU, for RX rings and
+ * most sends, and 64KB, for TSO.  Those are a kmalloc from the largest slab, or
+ * a kpages allocation, for every packet.  Instead, block_alloc() takes blocks
+ * of those sizes from its core's pool, and freeb() gives them back to the pool
+ * of the core that allocated them.
+ *
+ * Pooled blocks are still kmalloc'd, header and payload together, since
+ * qclone() and friends refcount block memory with kmalloc_incref().  freeb()
+ * only recycles a block if it holds the last reference. */
+struct block_pool_pcpu {
+	spinlock_t			lock;
+	struct block			*free;
+	unsigned int			nr_free;
+	unsigned long			nr_hits;
+	unsigned long			nr_misses;
+	unsigned long			nr_recycled;
+	unsigned long			nr_remote;	/* freed on another core */
+	unsigned long			nr_dropped;	/* full, or still shared */
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct block_pool {
+	const char			*name;
+	size_t				min_size;
+	size_t				size;
+	unsigned int			max_free;	/* per core */
+	struct block_pool_pcpu		*pcpu;
+};
 
-	/* If Hdrspc is not block aligned it will cause issues. */
-	static_assert(Hdrspc % BLOCKALIGN == 0);
+/* The biggest block that still fits in the biggest kmalloc slab */
+#define BLOCK_POOL_MTU_SZ ((KMALLOC_LARGEST) - sizeof(struct kmalloc_tag) - \
+			   sizeof(struct block) - Hdrspc - (BLOCKALIGN - 1))
 
-	b = kmalloc(sizeof(struct block) + size + Hdrspc + (BLOCKALIGN - 1),
-				mem_flags);
-	if (b == NULL)
-		return NULL;
+static struct block_pool block_pools[] = {
+	{.name = "mtu", .min_size = 512, .size = BLOCK_POOL_MTU_SZ,
+	 .max_free = 512},
+	{.name = "64k", .min_size = 32768, .size = 65536, .max_free = 16},
+};
+
+static struct block *block_init(struct block *b, size_t size)
+{
+	uintptr_t addr;
 
 	b->next = NULL;
 	b->list = NULL;
@@ -75,6 +101,7 @@ struct block *block_alloc(size_t size, int mem_flags)
 	b->mss = 0;
 	b->network_offset = 0;
 	b->transport_offset = 0;
+	b->pool = 0;
 
 	addr = (uintptr_t) b;
 	addr = ROUNDUP(addr + sizeof(struct block), BLOCKALIGN);
@@ -107,6 +134,216 @@ struct block *block_alloc(size_t size, int mem_flags)
 	return b;
 }
 
+/*
+ *  allocate blocks (round data base address to 64 bit boundary).
+ *  if mallocz gives us more than we asked for, leave room at the front
+ *  for header.
+ */
+static struct block *__block_kmalloc(size_t size, int mem_flags)
+{
+	struct block *b;
+
+	/* If Hdrspc is not block aligned it will cause issues. */
+	static_assert(Hdrspc % BLOCKALIGN == 0);
+
+	b = kmalloc(sizeof(struct block) + size + Hdrspc + (BLOCKALIGN - 1),
+				mem_flags);
+	if (b == NULL)
+		return NULL;
+	return block_init(b, size);
+}
+
+static struct block_pool *block_pool_for(size_t size)
+{
+	struct block_pool *bp;
+
+	for (int i = 0; i < ARRAY_SIZE(block_pools); i++) {
+		bp = &block_pools[i];
+		if (bp->pcpu && size >= bp->min_size && size <= bp->size)
+			return bp;
+	}
+	return NULL;
+}
+
+static struct block *block_pool_init_one(struct block_pool *bp,
+					 struct block *b)
+{
+	block_init(b, bp->size);
+	b->pool = bp - block_pools + 1;
+	b->pool_core = core_id();
+	return b;
+}
+
+static struct block *block_pool_alloc(struct block_pool *bp, int mem_flags)
+{
+	struct block_pool_pcpu *pc = &bp->pcpu[core_id()];
+	struct block *b;
+
+	spin_lock_irqsave(&pc->lock);
+	b = pc->free;
+	if (b) {
+		pc->free = b->next;
+		pc->nr_free--;
+		pc->nr_hits++;
+	} else {
+		pc->nr_misses++;
+	}
+	spin_unlock_irqsave(&pc->lock);
+	if (!b) {
+		b = __block_kmalloc(bp->size, mem_flags);
+		if (!b)
+			return NULL;
+	}
+	return block_pool_init_one(bp, b);
+}
+
+/* Returns TRUE if b went back to its pool. */
+static bool block_pool_put(struct block *b)
+{
+	struct block_pool *bp = &block_pools[b->pool - 1];
+	struct block_pool_pcpu *pc = &bp->pcpu[b->pool_core];
+	bool ret = FALSE;
+
+	spin_lock_irqsave(&pc->lock);
+	/* Someone still points into our body, e.g. a qclone()'d block */
+	if (kmalloc_refcnt(b) == 1 && pc->nr_free < bp->max_free) {
+		b->next = pc->free;
+		pc->free = b;
+		pc->nr_free++;
+		pc->nr_recycled++;
+		if (b->pool_core != core_id())
+			pc->nr_remote++;
+		ret = TRUE;
+	} else {
+		pc->nr_dropped++;
+	}
+	spin_unlock_irqsave(&pc->lock);
+	return ret;
+}
+
+struct block *block_alloc(size_t size, int mem_flags)
+{
+	struct block_pool *bp = block_pool_for(size);
+
+	if (bp)
+		return block_pool_alloc(bp, mem_flags);
+	return __block_kmalloc(size, mem_flags);
+}
+
+/* For drivers refilling RX rings.  Allocates up to nr blocks of size into bps,
+ * taking as many as it can from this core's pool in one go.  Returns how many
+ * it allocated, which is less than nr only if we ran out of memory. */
+int block_alloc_bulk(struct block **bps, unsigned int nr, size_t size,
+		     int mem_flags)
+{
+	struct block_pool *bp = block_pool_for(size);
+	struct block_pool_pcpu *pc;
+	unsigned int n = 0;
+
+	if (bp) {
+		pc = &bp->pcpu[core_id()];
+		spin_lock_irqsave(&pc->lock);
+		while (n < nr && pc->free) {
+			bps[n++] = pc->free;
+			pc->free = pc->free->next;
+		}
+		pc->nr_free -= n;
+		pc->nr_hits += n;
+		spin_unlock_irqsave(&pc->lock);
+		for (int i = 0; i < n; i++)
+			block_pool_init_one(bp, bps[i]);
+	}
+	for (; n < nr; n++) {
+		bps[n] = block_alloc(size, mem_flags);
+		if (!bps[n])
+			break;
+	}
+	return n;
+}
+
+static size_t block_pool_shrink(struct shrinker *s, size_t goal)
+{
+	struct block_pool *bp;
+	struct block_pool_pcpu *pc;
+	struct block *b, *next;
+	size_t amt = 0;
+
+	for (int i = 0; i < ARRAY_SIZE(block_pools); i++) {
+		bp = &block_pools[i];
+		for (int j = 0; j < num_cores; j++) {
+			pc = &bp->pcpu[j];
+			spin_lock_irqsave(&pc->lock);
+			b = pc->free;
+			pc->free = NULL;
+			pc->nr_free = 0;
+			spin_unlock_irqsave(&pc->lock);
+			for (; b; b = next) {
+				next = b->next;
+				amt += b->lim - (uint8_t*)b;
+				kfree(b);
+			}
+		}
+	}
+	return amt;
+}
+
+/* The pools free to the kmalloc slabs, so run before the slab shrinker */
+static struct shrinker block_pool_shrinker = {
+	.name = "block_pools",
+	.priority = SHRINKER_PRIO_META,
+	.shrink = block_pool_shrink,
+};
+
+static void __init block_pool_init(void)
+{
+	struct block_pool *bp;
+
+	for (int i = 0; i < ARRAY_SIZE(block_pools); i++) {
+		bp = &block_pools[i];
+		bp->pcpu = kzmalloc_align(sizeof(struct block_pool_pcpu) *
+					  num_cores, MEM_WAIT, ARCH_CL_SIZE);
+		for (int j = 0; j < num_cores; j++)
+			spinlock_init_irqsave(&bp->pcpu[j].lock);
+	}
+	register_shrinker(&block_pool_shrinker);
+}
+init_func_2(block_pool_init);
+
+struct sized_alloc *block_pool_build_stats(void)
+{
+	struct sized_alloc *sza;
+	struct block_pool *bp;
+	struct block_pool_pcpu *pc;
+	unsigned long hits, misses;
+
+	sza = sized_kzmalloc(200 + ARRAY_SIZE(block_pools) * (num_cores + 2) *
+			     100, MEM_WAIT);
+	for (int i = 0; i < ARRAY_SIZE(block_pools); i++) {
+		bp = &block_pools[i];
+		hits = misses = 0;
+		for (int j = 0; j < num_cores; j++) {
+			hits += bp->pcpu[j].nr_hits;
+			misses += bp->pcpu[j].nr_misses;
+		}
+		sza_printf(sza, "Pool %s: sizes %lu to %lu, hit rate %lu%%\n",
+			   bp->name, bp->min_size, bp->size,
+			   hits * 100 / MAX(hits + misses, 1));
+		sza_printf(sza, "%5s:%8s:%12s:%12s:%12s:%12s:%12s\n", "Core",
+			   "Free", "Hits", "Misses", "Recycled", "Remote",
+			   "Dropped");
+		for (int j = 0; j < num_cores; j++) {
+			pc = &bp->pcpu[j];
+			if (!pc->nr_hits && !pc->nr_misses && !pc->nr_recycled)
+				continue;
+			sza_printf(sza, "%5d:%8u:%12lu:%12lu:%12lu:%12lu:%12lu\n",
+				   j, pc->nr_free, pc->nr_hits, pc->nr_misses,
+				   pc->nr_recycled, pc->nr_remote,
+				   pc->nr_dropped);
+		}
+	}
+	return sza;
+}
+
 /* Makes sure b has nr_bufs extra_data.  Will grow, but not shrink, an existing
  * extra_data array.  When growing, it'll copy over the old entries.  All new
  * entries will be zeroed.  mem_flags determines if we'll block on kmallocs.
@@ -151,11 +388,10 @@ static struct extra_bdata *next_unused_slot(struct block *b)
 	return ebd;
 }
 
-/* Append an extra data buffer @base with offset @off of length @len to block
- * @b.  Reuse an unused extra data slot if there's any.
+/* Append a copy of @from, including its ref on the buffer, to block @b.
+ * Reuse an unused extra data slot if there's any.
  * Return 0 on success or -1 on error. */
-int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
-                       uint32_t len, int mem_flags)
+int block_append_ebd(struct block *b, struct extra_bdata *from, int mem_flags)
 {
 	unsigned int nr_bufs = b->nr_extra_bufs + 1;
 	struct extra_bdata *ebd;
@@ -167,13 +403,22 @@ int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
 		ebd = next_unused_slot(b);
 		assert(ebd);
 	}
-	ebd->base = base;
-	ebd->off = off;
-	ebd->len = len;
+	*ebd = *from;
 	b->extra_len += ebd->len;
 	return 0;
 }
 
+/* Append an extra data buffer @base with offset @off of length @len to block
+ * @b.  @base is kmalloc'd, and the block takes over the caller's ref.
+ * Return 0 on success or -1 on error. */
+int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
+                       uint32_t len, int mem_flags)
+{
+	struct extra_bdata ebd = {.base = base, .off = off, .len = len};
+
+	return block_append_ebd(b, &ebd, mem_flags);
+}
+
 /* There's metadata in each block related to the data payload.  For instance,
  * the TSO mss, the offsets to various headers, whether csums are needed, etc.
  * When you create a new block, like in copyblock, this will copy those bits
@@ -291,16 +536,32 @@ size_t block_copy_to_body(struct block *to, void *from, size_t copy_amt)
 	return copy_amt;
 }
 
+/* Takes another ref on ebd's buffer, for a second ebd pointing into it. */
+void ebd_incref(struct extra_bdata *ebd)
+{
+	if (ebd->ext_ref)
+		kref_get(ebd->ext_ref, 1);
+	else
+		kmalloc_incref((void*)ebd->base);
+}
+
+/* Drops ebd's ref on its buffer.  The caller clears the ebd. */
+void ebd_decref(struct extra_bdata *ebd)
+{
+	if (ebd->ext_ref)
+		kref_put(ebd->ext_ref);
+	else
+		kfree((void*)ebd->base);
+}
+
 void free_block_extra(struct block *b)
 {
 	struct extra_bdata *ebd;
 
-	/* assuming our release method is kfree, which will change when we
-	 * support user buffers */
 	for (int i = 0; i < b->nr_extra_bufs; i++) {
 		ebd = &b->extra_data[i];
 		if (ebd->base)
-			kfree((void*)ebd->base);
+			ebd_decref(ebd);
 	}
 	b->extra_len = 0;
 	b->nr_extra_bufs = 0;
@@ -327,6 +588,8 @@ size_t freeb(struct block *b)
 		return ret;
 	}
 	warn_on(b->next);
+	if (b->pool && block_pool_put(b))
+		return ret;
 	/* poison the block in case someone is still holding onto it */
 	b->next = dead;
 	b->rp = dead;
@@ -386,7 +649,8 @@ void checkb(struct block *b, char *msg)
 			panic("checkb %s: ebd %d has no base, but has off %d and len %d",
 			      msg, i, ebd->off, ebd->len);
 		if (ebd->base) {
-			if (!kmalloc_refcnt((void*)ebd->base))
+			if (ebd->ext_ref ? !kref_refcnt(ebd->ext_ref)
+					 : !kmalloc_refcnt((void*)ebd->base))
 				panic("checkb %s: buf %d, base %p has no refcnt!\n",
 				      msg, i, ebd->base);
 			extra_len += ebd->len;
@@ -302,7 +302,7 @@ static void fs_file_punch_hole(struct fs_file *f, off64_t begin, off64_t end)
 			error(-error, "punch_hole pm_load_page failed");
 		zero_amt = MIN(PGSIZE - PGOFF(begin), end - begin);
 		memset(page2kva(page) + PGOFF(begin), 0, zero_amt);
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		pm_set_page_dirty(page);
 		pm_put_page(page);
 		first_pg_idx++;
 		nr_pages--;
@@ -316,7 +316,7 @@ static void fs_file_punch_hole(struct fs_file *f, off64_t begin, off64_t end)
 		if (error)
 			error(-error, "punch_hole pm_load_page failed");
 		memset(page2kva(page), 0, PGOFF(end));
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		pm_set_page_dirty(page);
 		pm_put_page(page);
 		last_pg_idx--;
 		nr_pages--;
@@ -421,6 +421,7 @@ size_t fs_file_write(struct fs_file *f, const uint8_t *buf, size_t count,
 		if (so_far) {
 			write_metadata(f, offset + so_far, false);
 			poperror();
+			pm_balance_dirty();
 			return so_far;
 		}
 		nexterror();
@@ -453,7 +454,7 @@ size_t fs_file_write(struct fs_file *f, const uint8_t *buf, size_t count,
 			memset(page2kva(page) + pg_off, 0, copy_amt);
 		buf += copy_amt;
 		so_far += copy_amt;
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		pm_set_page_dirty(page);
 		pm_put_page(page);
 	}
 	assert(buf == buf_end);
@@ -464,6 +465,9 @@ size_t fs_file_write(struct fs_file *f, const uint8_t *buf, size_t count,
 	 * instead of what we added. */
 	write_metadata(f, offset + so_far, false);
 	poperror();
+	/* Throttle once per write, not per page, so a big write waits at most
+	 * one pm_balance_dirty(). */
+	pm_balance_dirty();
 	return so_far;
 }
 
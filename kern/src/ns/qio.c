@@ -286,7 +286,7 @@ static void block_consume_ebd_bytes(struct block *b, struct extra_bdata *ebd,
 	if (!ebd->len) {
 		/* we don't actually have to decref here.  it's also
 		 * done in freeb().  this is the earliest we can free. */
-		kfree((void*)ebd->base);
+		ebd_decref(ebd);
 		ebd->base = ebd->off = 0;
 	}
 }
@@ -412,7 +412,7 @@ static int pullext(struct block *bp, int count)
 		ed->off += rem;
 		ed->len -= rem;
 		if (ed->len == 0) {
-			kfree((void *)ed->base);
+			ebd_decref(ed);
 			ed->base = 0;
 			ed->off = 0;
 		}
@@ -438,7 +438,7 @@ static int dropext(struct block *bp, int count)
 		bytes += rem;
 		ed->len -= rem;
 		if (ed->len == 0) {
-			kfree((void *)ed->base);
+			ebd_decref(ed);
 			ed->base = 0;
 			ed->off = 0;
 		}
@@ -588,7 +588,7 @@ struct block *adjustblock(struct block *bp, int len)
 	for (; i < bp->nr_extra_bufs; i++) {
 		ebd = &bp->extra_data[i];
 		if (ebd->base)
-			kfree((void*)ebd->base);
+			ebd_decref(ebd);
 		ebd->base = ebd->off = ebd->len = 0;
 	}
 	QDEBUG checkb(bp, "adjustblock 4");
@@ -624,7 +624,7 @@ static size_t move_ebd(struct extra_bdata *ebd, struct block *to,
 {
 	size_t ret = ebd->len;
 
-	if (block_append_extra(to, ebd->base, ebd->off, ebd->len, MEM_ATOMIC))
+	if (block_append_ebd(to, ebd, MEM_ATOMIC))
 		return 0;
 	block_and_q_lost_extra(from, from_q, ebd->len);
 	ebd->base = ebd->len = ebd->off = 0;
@@ -755,6 +755,16 @@ static int __try_qbread(struct queue *q, size_t len, int qio_flags,
 	 * SOCK_DGRAM. */
 	if (q->state & Qmsg) {
 		ret = pop_first_block(q);
+		/* Qbatch: also take as many whole messages as fit in len */
+		if ((q->state & Qbatch) && !(qio_flags & QIO_JUST_ONE_BLOCK)) {
+			len -= MIN(len, blen);
+			ret_last = ret;
+			while (q->bfirst && (BLEN(q->bfirst) <= len)) {
+				len -= BLEN(q->bfirst);
+				ret_last->next = pop_first_block(q);
+				ret_last = ret_last->next;
+			}
+		}
 		goto out_ok;
 	}
 	/* Let's get at least something first - makes the code easier.  This
@@ -922,6 +932,35 @@ ssize_t qpassnolim(struct queue *q, struct block *b)
 	return __qbwrite(q, b, 0);
 }
 
+/* Like qpass(), but first offers b to merge(), which can fold b's contents into
+ * the last block in q, e.g. to coalesce datagrams of a flow.  merge() is called
+ * with the q locked, so it can't block, and returns TRUE if it took b's
+ * contents, in which case we free b.  Since q wasn't empty, no one needs a
+ * wakeup. */
+ssize_t qpass_merge(struct queue *q, struct block *b,
+                    bool (*merge)(struct block *last, struct block *b,
+                                  void *arg), void *arg)
+{
+	struct block *last;
+	size_t old_len;
+	ssize_t ret;
+
+	spin_lock_irqsave(&q->lock);
+	last = q->bfirst ? q->blast : NULL;
+	if (last && !(q->state & Qclosed) && (q->dlen < q->limit)) {
+		old_len = BLEN(last);
+		if (merge(last, b, arg)) {
+			ret = BLEN(last) - old_len;
+			q->dlen += ret;
+			spin_unlock_irqsave(&q->lock);
+			freeblist(b);
+			return ret;
+		}
+	}
+	spin_unlock_irqsave(&q->lock);
+	return qpass(q, b);
+}
+
 /*
  *  if the allocated space is way out of line with the used
  *  space, reallocate to a smaller block
@@ -969,6 +1008,8 @@ static size_t point_to_body(struct block *b, uint8_t *body_rp,
 	ebd->base = (uintptr_t)b;
 	ebd->off = (uint32_t)(body_rp - (uint8_t*)b);
 	ebd->len = MIN(b->wp - body_rp, len);	/* think of body_rp as b->rp */
+	ebd->csum_len = 0;
+	ebd->ext_ref = NULL;
 	assert((int)ebd->len >= 0);
 	newb->extra_len += ebd->len;
 	return ebd->len;
@@ -989,10 +1030,14 @@ static size_t point_to_buf(struct block *b, unsigned int b_idx, uint32_t b_off,
 	assert(b_idx < b->nr_extra_bufs);
 	assert(newb_idx < newb->nr_extra_bufs);
 
-	kmalloc_incref((void*)b_ebd->base);
+	ebd_incref(b_ebd);
 	n_ebd->base = b_ebd->base;
+	n_ebd->ext_ref = b_ebd->ext_ref;
 	n_ebd->off = b_ebd->off + b_off;
 	n_ebd->len = MIN(b_ebd->len - b_off, len);
+	/* A clone of all of the buffer can reuse its csum */
+	n_ebd->csum_len = b_ebd->csum_len;
+	n_ebd->csum = b_ebd->csum;
 	newb->extra_len += n_ebd->len;
 	return n_ebd->len;
 }
@@ -1102,6 +1147,25 @@ struct block *blist_clone(struct block *blist, int header_len, int len,
 	return newb;
 }
 
+/* Appends all of from's contents to to's extra_data, pointing at them rather
+ * than copying, like blist_clone().  from is unchanged; the caller still frees
+ * it.  Returns 0 on success or -1 if we couldn't get the extra_data. */
+int block_append_block(struct block *to, struct block *from, int mem_flags)
+{
+	unsigned int idx = to->nr_extra_bufs;
+
+	if (block_add_extd(to, idx + 1 + from->nr_extra_bufs, mem_flags))
+		return -1;
+	if (BHLEN(from))
+		point_to_body(from, from->rp, to, idx++, BHLEN(from));
+	for (int i = 0; i < from->nr_extra_bufs; i++) {
+		if (!from->extra_data[i].base)
+			continue;
+		point_to_buf(from, i, 0, to, idx++, from->extra_data[i].len);
+	}
+	return 0;
+}
+
 /* given a queue, makes a single block with header_len reserved space in the
  * block main body, and the contents of [offset, len + offset) pointed to in the
  * new blocks ext_data.  This does not make a copy of the q's contents, though
@@ -1555,9 +1619,12 @@ ssize_t qibwrite(struct queue *q, struct block *b)
 	return __qbwrite(q, b, 0);
 }
 
-/* Helper, allocs a block and copies [from, from + len) into it.  Returns the
- * block on success, 0 on failure. */
-static struct block *build_block(void *from, size_t len, int mem_flags)
+/* Helper, allocs a block and copies [from, from + len) into it.  If csum, we
+ * checksum the data while we copy it and save the sum in the extra_data, so
+ * the protocol doesn't have to read it again.  Returns the block on success, 0
+ * on failure. */
+static struct block *build_block(void *from, size_t len, bool csum,
+                                 int mem_flags)
 {
 	struct block *b;
 	void *ext_buf;
@@ -1578,12 +1645,19 @@ static struct block *build_block(void *from, size_t len, int mem_flags)
 		kfree(b);
 		return 0;
 	}
-	memcpy(ext_buf, from, len);
 	if (block_add_extd(b, 1, mem_flags)) {
 		kfree(ext_buf);
 		kfree(b);
 		return 0;
 	}
+	if (csum) {
+		b->extra_data[0].csum = ptclbcopysum(ext_buf, from, len);
+		b->extra_data[0].csum_len = len;
+	} else {
+		memcpy(ext_buf, from, len);
+		b->extra_data[0].csum_len = 0;
+	}
+	b->extra_data[0].ext_ref = NULL;
 	b->extra_data[0].base = (uintptr_t)ext_buf;
 	b->extra_data[0].off = 0;
 	b->extra_data[0].len = len;
@@ -1617,7 +1691,7 @@ static ssize_t __qwrite(struct queue *q, void *vp, size_t len, int mem_flags,
 		 * value? */
 		if (n > Maxatomic)
 			n = Maxatomic;
-		b = build_block(p + sofar, n, mem_flags);
+		b = build_block(p + sofar, n, q->state & Qcsum, mem_flags);
 		if (!b)
 			break;
 		if (__qbwrite(q, b, qio_flags) < 0)
@@ -1831,6 +1905,30 @@ void q_toggle_qcoalesce(struct queue *q, bool onoff)
 	spin_unlock_irqsave(&q->lock);
 }
 
+/* For Qmsg queues whose readers can take several messages at once, e.g. UDP's
+ * batched data file, where each message has its own header. */
+void q_toggle_qbatch(struct queue *q, bool onoff)
+{
+	spin_lock_irqsave(&q->lock);
+	if (onoff)
+		q->state |= Qbatch;
+	else
+		q->state &= ~Qbatch;
+	spin_unlock_irqsave(&q->lock);
+}
+
+/* For protocols that will checksum whatever is written to q, e.g. UDP's
+ * bypass wq. */
+void q_toggle_qcsum(struct queue *q, bool onoff)
+{
+	spin_lock_irqsave(&q->lock);
+	if (onoff)
+		q->state |= Qcsum;
+	else
+		q->state &= ~Qcsum;
+	spin_unlock_irqsave(&q->lock);
+}
+
 /*
  *  flush the output queue
  */
@@ -81,6 +81,19 @@ void tf_kref_put(struct tree_file *tf)
 	kref_put(&tf->kref);
 }
 
+/* PM pin ops, for tree filesystems.  The PM's host is the tree_file's fs_file.
+ * The caller holds a lock that keeps the PM (and thus the TF) from being freed,
+ * but not from being released to the LRU. */
+bool tf_pm_pin(struct page_map *pm)
+{
+	return tf_kref_get((struct tree_file*)pm->pm_file);
+}
+
+void tf_pm_unpin(struct page_map *pm)
+{
+	tf_kref_put((struct tree_file*)pm->pm_file);
+}
+
 static void __tf_free(struct tree_file *tf)
 {
 	struct tree_file *parent = tf->parent;
@@ -1103,6 +1116,14 @@ struct chan *tree_file_alloc_chan(struct tree_file *tf, struct dev *dev,
 	return c;
 }
 
+/* Negative entries are cheap to recreate: a lookup on the backend. */
+static size_t tfs_neg_shrink(struct shrinker *s, size_t goal)
+{
+	struct tree_filesystem *tfs = s->priv;
+
+	return tfs_lru_prune_neg(tfs) * sizeof(struct tree_file);
+}
+
 /* Caller needs to set its customizable fields: tf_ops, pm_ops, etc.  root is
  * created with a ref of 1, but needs filled in by the particular TFS. */
 void tfs_init(struct tree_filesystem *tfs)
@@ -1113,10 +1134,16 @@ void tfs_init(struct tree_filesystem *tfs)
 	tfs->root->flags |= TF_F_IS_ROOT;
 	assert(!(tfs->root->flags & TF_F_ON_LRU));
 	__kref_get(&tfs->root->kref, 1);
+	tfs->neg_shrinker.name = "tree_file_negatives";
+	tfs->neg_shrinker.priority = SHRINKER_PRIO_META;
+	tfs->neg_shrinker.shrink = tfs_neg_shrink;
+	tfs->neg_shrinker.priv = tfs;
+	register_shrinker(&tfs->neg_shrinker);
 }
 
 void tfs_destroy(struct tree_filesystem *tfs)
 {
+	unregister_shrinker(&tfs->neg_shrinker);
 	tfs->root = NULL;	/* was just freed in __tf_free() */
 	wc_destroy(&tfs->wc);
 }
@@ -1292,13 +1319,14 @@ void __tfs_dump_tf(struct tree_file *tf)
  * Since we're only on one list at a time ('wc->lru' or 'work'), we can use the
  * lru list_head in the TF.  We know that so long as we hold our kref on a TF,
  * no one will attempt to put it back on the LRU list. */
-void tfs_lru_for_each(struct tree_filesystem *tfs, bool cb(struct tree_file *),
-                      size_t max_tfs)
+size_t tfs_lru_for_each(struct tree_filesystem *tfs,
+                        bool cb(struct tree_file *), size_t max_tfs)
 {
 	struct list_head work = LIST_HEAD_INIT(work);
 	struct walk_cache *wc = &tfs->wc;
 	struct tree_file *tf, *temp, *parent;
 	size_t nr_tfs = 0;
+	size_t nr_freed = 0;
 
 	/* We can have multiple LRU workers in flight, though a given TF will be
 	 * on only one CB list at a time. */
@@ -1387,18 +1415,21 @@ void tfs_lru_for_each(struct tree_filesystem *tfs, bool cb(struct tree_file *),
 		 * the ref == 1 and it is disconnected.  Directly freeing
 		 * bypasses call_rcu. */
 		__tf_free(tf);
+		nr_freed++;
 	}
+	return nr_freed;
 }
 
 /* Does a one-cycle 'clock' algorithm to detect use.  On a given pass, we either
  * clear HAS_BEEN_USED xor we remove it.  For negative entries, that bit is used
  * when we look at an entry (use it), compared to positive entries, which is
  * used when we get a reference.  (we never get refs on negatives). */
-void tfs_lru_prune_neg(struct tree_filesystem *tfs)
+size_t tfs_lru_prune_neg(struct tree_filesystem *tfs)
 {
 	struct list_head work = LIST_HEAD_INIT(work);
 	struct walk_cache *wc = &tfs->wc;
 	struct tree_file *tf, *temp, *parent;
+	size_t nr_freed = 0;
 
 	spin_lock(&wc->lru_lock);
 	list_for_each_entry_safe(tf, temp, &wc->lru, lru) {
@@ -1443,5 +1474,7 @@ void tfs_lru_prune_neg(struct tree_filesystem *tfs)
 		assert(kref_refcnt(&tf->kref) == 0);
 		list_del(&tf->lru);
 		__tf_free(tf);
+		nr_freed++;
 	}
+	return nr_freed;
 }
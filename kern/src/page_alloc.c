@@ -9,16 +9,27 @@
 #include <pmap.h>
 #include <kmalloc.h>
 #include <arena.h>
+#include <reclaim.h>
+
+static void page_release(struct kref *kref)
+{
+	struct page *page = container_of(kref, struct page, pg_kref);
+
+	kpages_free(page2kva(page), PGSIZE);
+}
 
 /* Helper, allocates a free page. */
 static struct page *get_a_free_page(void)
 {
 	void *addr;
+	struct page *page;
 
 	addr = kpages_alloc(PGSIZE, MEM_ATOMIC);
 	if (!addr)
 		return NULL;
-	return kva2page(addr);
+	page = kva2page(addr);
+	kref_init(&page->pg_kref, page_release, 1);
+	return page;
 }
 
 /**
@@ -77,12 +88,15 @@ void *kpage_zalloc_addr(void)
  * later since we might send the caller to a different NUMA domain. */
 void *kpages_alloc(size_t size, int flags)
 {
-	return arena_alloc(kpages_arena, size, flags);
+	void *ret = arena_alloc(kpages_arena, size, flags);
+
+	reclaim_check();
+	return ret;
 }
 
 void *kpages_zalloc(size_t size, int flags)
 {
-	void *ret = arena_alloc(kpages_arena, size, flags);
+	void *ret = kpages_alloc(size, flags);
 
 	if (!ret)
 		return NULL;
@@ -100,8 +114,11 @@ void kpages_free(void *addr, size_t size)
  * bnx2x). */
 void *get_cont_pages(size_t order, int flags)
 {
-	return arena_xalloc(kpages_arena, PGSIZE << order, PGSIZE << order,
-	                    0, 0, NULL, NULL, flags);
+	void *ret = arena_xalloc(kpages_arena, PGSIZE << order,
+				 PGSIZE << order, 0, 0, NULL, NULL, flags);
+
+	reclaim_check();
+	return ret;
 }
 
 void free_cont_pages(void *buf, size_t order)
@@ -109,11 +126,19 @@ void free_cont_pages(void *buf, size_t order)
 	arena_xfree(kpages_arena, buf, PGSIZE << order);
 }
 
-/* Frees the page */
+/* Gets another reference on a non-PM page, e.g. when sharing it with a CoW
+ * child.  PM pages are refcounted by the page map, not here. */
+void page_incref(page_t *page)
+{
+	assert(!page_is_pagemap(page));
+	kref_get(&page->pg_kref, 1);
+}
+
+/* Drops a reference, freeing the page when the last one is gone. */
 void page_decref(page_t *page)
 {
 	assert(!page_is_pagemap(page));
-	kpages_free(page2kva(page), PGSIZE);
+	kref_put(&page->pg_kref);
 }
 
 /* Attempts to get a lock on the page for IO operations.  If it is already
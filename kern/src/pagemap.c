@@ -8,11 +8,50 @@
 #include <pmap.h>
 #include <atomic.h>
 #include <radix.h>
+#include <kmalloc.h>
 #include <kref.h>
 #include <assert.h>
 #include <stdio.h>
 #include <pagemap.h>
 #include <rcu.h>
+#include <rendez.h>
+#include <time.h>
+#include <linker_func.h>
+#include <reclaim.h>
+
+/* Dirty page accounting, across all PMs.  PMs with dirty pages are on the
+ * dirty list, oldest first, for the background flusher.  The dirty lock
+ * protects a page's PG_DIRTY transitions, its dirty tag, and the counters, so
+ * that they all agree.  It nests inside pte_lock and outside the radix tag lock.
+ *
+ * TODO: this is a global lock, grabbed once per page per dirtying.  If it gets
+ * hot, we can split it per PM, but the list will still need a lock. */
+static spinlock_t pm_dirty_lock = SPINLOCK_INITIALIZER;
+static TAILQ_HEAD(pm_dirty_tailq, page_map) pm_dirty_list =
+                          TAILQ_HEAD_INITIALIZER(pm_dirty_list);
+static unsigned long pm_nr_dirty_pms;
+static unsigned long pm_nr_dirty_pages;
+
+/* Writers throttle above the limit.  The flusher starts working at the
+ * background limit, or when a PM has been dirty for too long. */
+static unsigned long pm_dirty_limit;
+static unsigned long pm_dirty_bg_limit;
+#define PM_DIRTY_EXPIRE_NSEC (CONFIG_PM_DIRTY_EXPIRE_SECS * 1000000000ULL)
+#define PM_FLUSH_INTERVAL_USEC 5000000
+/* Most times a writer waits for the flusher, PM_FLUSH_INTERVAL_USEC / 10 each */
+#define PM_THROTTLE_MAX_ROUNDS 10
+
+static struct rendez pm_flusher_rv;
+static struct rendez pm_throttle_rv;
+
+/* Reclaimable PMs with pages are on the LRU list, ordered by when they last
+ * loaded a page from their backing store.  The reclaim shrinker drops clean,
+ * unused pages from the least-recently loaded PMs first.  The LRU lock nests
+ * inside PM qlocks. */
+static spinlock_t pm_lru_lock = SPINLOCK_INITIALIZER;
+static TAILQ_HEAD(pm_lru_tailq, page_map) pm_lru =
+                          TAILQ_HEAD_INITIALIZER(pm_lru);
+static unsigned long pm_nr_on_lru;
 
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr)
 {
@@ -96,6 +135,35 @@ void pm_init(struct page_map *pm, struct page_map_operations *op, void *host)
 	qlock_init(&pm->pm_qlock);
 	spinlock_init(&pm->pm_lock);
 	TAILQ_INIT(&pm->pm_vmrs);
+	pm->pm_nr_dirty = 0;
+	pm->pm_flags = 0;
+}
+
+/* Moves pm to the MRU end of the LRU list. */
+static void pm_lru_touch(struct page_map *pm)
+{
+	if (!(pm->pm_flags & PM_F_RECLAIMABLE))
+		return;
+	spin_lock(&pm_lru_lock);
+	if (pm->pm_flags & PM_F_ON_LRU) {
+		TAILQ_REMOVE(&pm_lru, pm, pm_lru_link);
+	} else {
+		pm->pm_flags |= PM_F_ON_LRU;
+		pm_nr_on_lru++;
+	}
+	TAILQ_INSERT_TAIL(&pm_lru, pm, pm_lru_link);
+	spin_unlock(&pm_lru_lock);
+}
+
+static void pm_lru_remove(struct page_map *pm)
+{
+	spin_lock(&pm_lru_lock);
+	if (pm->pm_flags & PM_F_ON_LRU) {
+		pm->pm_flags &= ~PM_F_ON_LRU;
+		TAILQ_REMOVE(&pm_lru, pm, pm_lru_link);
+		pm_nr_on_lru--;
+	}
+	spin_unlock(&pm_lru_lock);
 }
 
 /* Looks up the index'th page in the page map, returning a refcnt'd reference
@@ -159,6 +227,9 @@ static int pm_insert_page(struct page_map *pm, unsigned long index,
 	slot_val = pm_slot_inc_refcnt(slot_val);
 	/* passing the page ref from the caller to the slot */
 	slot_val = pm_slot_set_page(slot_val, page);
+	/* Allocate the rnodes before locking, so other PM users don't wait on
+	 * the allocator.  MEM_WAIT can't fail. */
+	radix_preload(&pm->pm_tree, MEM_WAIT);
 	qlock(&pm->pm_qlock);
 	ret = radix_insert(&pm->pm_tree, index, slot_val, &tree_slot);
 	if (ret) {
@@ -167,6 +238,7 @@ static int pm_insert_page(struct page_map *pm, unsigned long index,
 	}
 	page->pg_tree_slot = tree_slot;
 	pm->pm_num_pages++;
+	pm_lru_touch(pm);
 	qunlock(&pm->pm_qlock);
 	return 0;
 }
@@ -243,7 +315,13 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
 	/* fall through */
 load_locked_page:
 	error = pm->pm_op->readpage(pm, page);
-	assert(!error);
+	if (error) {
+		/* The page stays in the PM, !UPTODATE.  The next loader will
+		 * try again. */
+		unlock_page(page);
+		pm_put_page(page);
+		return error;
+	}
 	assert(atomic_read(&page->pg_flags) & PG_UPTODATE);
 	unlock_page(page);
 	*pp = page;
@@ -268,6 +346,133 @@ int pm_load_page_nowait(struct page_map *pm, unsigned long index,
 	return 0;
 }
 
+#define PM_READAHEAD_BATCH 32
+
+/* Starts reading in the pages in [index, index + nr_pgs) that aren't in the PM
+ * yet, without waiting for them.  Anyone who wants one of them before it's read
+ * will block on its page lock in pm_load_page().  Only for PMs with a readpages
+ * op, and it's just a hint: we give up on any trouble. */
+void pm_readahead(struct page_map *pm, unsigned long index,
+                  unsigned long nr_pgs)
+{
+	struct page *pages[PM_READAHEAD_BATCH];
+	unsigned long present[PM_READAHEAD_BATCH];
+	unsigned long end = index + nr_pgs;
+	unsigned long next_lookup = index;
+	unsigned int nr_present = 0, p = 0;
+	struct page *page;
+	unsigned int nr = 0;
+
+	if (!pm->pm_op->readpages)
+		return;
+	for (unsigned long i = index; i < end; i++) {
+		/* Find the present pages a batch at a time.  It's racy, but
+		 * inserting a page that showed up in the meantime just fails.
+		 */
+		if (i >= next_lookup) {
+			nr_present = radix_gang_lookup(&pm->pm_tree, NULL,
+						       present, i,
+						       PM_READAHEAD_BATCH);
+			p = 0;
+			next_lookup = nr_present == PM_READAHEAD_BATCH ?
+				      present[nr_present - 1] + 1 : end;
+		}
+		if (p < nr_present && present[p] == i) {
+			p++;
+			continue;
+		}
+		if (kpage_alloc(&page))
+			break;
+		/* Same as pm_load_page(): locked and !UPTODATE */
+		atomic_set(&page->pg_flags, PG_LOCKED | PG_PAGEMAP);
+		sem_init(&page->pg_sem, 0);
+		if (pm_insert_page(pm, i, page)) {
+			atomic_set(&page->pg_flags, 0);
+			page_decref(page);
+			continue;
+		}
+		/* readpages gets our PM slot ref */
+		pages[nr++] = page;
+		if (nr == PM_READAHEAD_BATCH) {
+			pm->pm_op->readpages(pm, pages, nr);
+			nr = 0;
+		}
+	}
+	if (nr)
+		pm->pm_op->readpages(pm, pages, nr);
+}
+
+/* Marks the PM page dirty, tagging it in its PM for writeback.  The caller needs
+ * to keep the page in the PM, e.g. with a PM slot ref or a mapping in a VMR. */
+void pm_set_page_dirty(struct page *page)
+{
+	struct page_map *pm = page->pg_mapping;
+
+	assert(page_is_pagemap(page));
+	/* Racy peek.  If it's already dirty, whoever cleans it will write our
+	 * changes too, since they clear the flag before writing back. */
+	if (atomic_read(&page->pg_flags) & PG_DIRTY)
+		return;
+	spin_lock(&pm_dirty_lock);
+	if (atomic_read(&page->pg_flags) & PG_DIRTY) {
+		spin_unlock(&pm_dirty_lock);
+		return;
+	}
+	atomic_or(&page->pg_flags, PG_DIRTY);
+	radix_tag_set(&pm->pm_tree, page->pg_index, PM_TAG_DIRTY);
+	if (!pm->pm_nr_dirty++) {
+		pm->pm_dirtied_at = nsec();
+		TAILQ_INSERT_TAIL(&pm_dirty_list, pm, pm_dirty_link);
+		pm_nr_dirty_pms++;
+	}
+	pm_nr_dirty_pages++;
+	spin_unlock(&pm_dirty_lock);
+}
+
+/* Clears the page's dirty flag and tag, returning true if it was dirty. */
+static bool pm_clear_page_dirty(struct page_map *pm, struct page *page)
+{
+	if (!(atomic_read(&page->pg_flags) & PG_DIRTY))
+		return false;
+	spin_lock(&pm_dirty_lock);
+	if (!(atomic_read(&page->pg_flags) & PG_DIRTY)) {
+		spin_unlock(&pm_dirty_lock);
+		return false;
+	}
+	atomic_and(&page->pg_flags, ~PG_DIRTY);
+	radix_tag_clear(&pm->pm_tree, page->pg_index, PM_TAG_DIRTY);
+	assert(pm->pm_nr_dirty);
+	if (!--pm->pm_nr_dirty) {
+		TAILQ_REMOVE(&pm_dirty_list, pm, pm_dirty_link);
+		pm_nr_dirty_pms--;
+	}
+	pm_nr_dirty_pages--;
+	spin_unlock(&pm_dirty_lock);
+	return true;
+}
+
+static int pm_below_dirty_limit(void *arg)
+{
+	return ACCESS_ONCE(pm_nr_dirty_pages) <= pm_dirty_limit;
+}
+
+/* Writers call this after dirtying pages.  If there's too much dirty memory in
+ * the system, we kick the flusher and wait for it to catch up.  Don't hold
+ * locks the flusher might need, e.g. PM qlocks or file qlocks.
+ *
+ * The flusher might not be able to clean anything, e.g. because the FS can't
+ * pin its files, so we only wait so long before letting the write go ahead. */
+void pm_balance_dirty(void)
+{
+	for (int i = 0; i < PM_THROTTLE_MAX_ROUNDS; i++) {
+		if (pm_below_dirty_limit(NULL))
+			return;
+		rendez_wakeup(&pm_flusher_rv);
+		rendez_sleep_timeout(&pm_throttle_rv, pm_below_dirty_limit,
+				     NULL, PM_FLUSH_INTERVAL_USEC / 10);
+	}
+}
+
 static bool vmr_has_page_idx(struct vm_region *vmr, unsigned long pg_idx)
 {
 	unsigned long nr_pgs = (vmr->vm_end - vmr->vm_base) >> PGSHIFT;
@@ -350,9 +555,11 @@ static bool __remove_or_zero_cb(void **slot, unsigned long tree_idx, void *arg)
 	/* We yanked the page out.  The radix tree still has an item until we
 	 * return true, but this is fine.  Future lock-free lookups will now
 	 * fail (since the page is 0), and insertions will block on the write
-	 * lock. */
+	 * lock.  Any dirty data is being removed, not written. */
+	pm_clear_page_dirty(pm, page);
 	atomic_set(&page->pg_flags, 0);	/* cause/catch bugs */
 	page_decref(page);
+	pm->pm_num_pages--;
 	return true;
 }
 
@@ -376,8 +583,7 @@ static int __pm_mark_and_clear_dirty(struct proc *p, pte_t pte, void *va,
 
 	if (!pte_is_present(pte) || !pte_is_dirty(pte))
 		return 0;
-	if (!(atomic_read(&page->pg_flags) & PG_DIRTY))
-		atomic_or(&page->pg_flags, PG_DIRTY);
+	pm_set_page_dirty(page);
 	pte_clear_dirty(pte);
 	vmr->vm_shootdown_needed = true;
 	return 0;
@@ -411,61 +617,90 @@ static void mark_and_clear_dirty_ptes(struct page_map *pm)
 
 static void shootdown_vmrs(struct page_map *pm)
 {
-	struct vm_region *vmr_i;
+	struct vm_region *vmr_i, *vmr_j;
+	bool already_shot;
 
 	/* The VMR flag shootdown_needed is owned by the PM.  Each VMR is hooked
-	 * to at most one file, so there's no issue there.  We might have a proc
-	 * that has multiple non-private VMRs in the same file, but it shouldn't
-	 * be a big enough issue to worry about. */
+	 * to at most one file, so there's no issue there.  A proc that has
+	 * multiple non-private VMRs in the same file only gets one shootdown,
+	 * since we flush the entire address space. */
 	spin_lock(&pm->pm_lock);
 	TAILQ_FOREACH(vmr_i, &pm->pm_vmrs, vm_pm_link) {
-		if (vmr_i->vm_shootdown_needed) {
-			vmr_i->vm_shootdown_needed = false;
-			proc_tlbshootdown(vmr_i->vm_proc, 0, 0);
+		if (!vmr_i->vm_shootdown_needed)
+			continue;
+		vmr_i->vm_shootdown_needed = false;
+		already_shot = false;
+		TAILQ_FOREACH(vmr_j, &pm->pm_vmrs, vm_pm_link) {
+			if (vmr_j == vmr_i)
+				break;
+			if (vmr_j->vm_proc == vmr_i->vm_proc) {
+				already_shot = true;
+				break;
+			}
 		}
+		if (!already_shot)
+			proc_tlbshootdown(vmr_i->vm_proc, 0, 0);
 	}
 	spin_unlock(&pm->pm_lock);
 }
 
+#define PM_WB_BATCH 32
+
+struct pm_wb_batch {
+	struct page_map			*pm;
+	unsigned int			nr;
+	struct page			*pages[PM_WB_BATCH];
+};
+
 /* Send any queued WBs that haven't been sent yet. */
-static void flush_queued_writebacks(struct page_map *pm)
+static void flush_queued_writebacks(struct pm_wb_batch *wb)
 {
-	/* TODO (WB) */
+	if (!wb->nr)
+		return;
+	wb->pm->pm_op->writepages(wb->pm, wb->pages, wb->nr);
+	wb->nr = 0;
 }
 
-/* Batches up pages to be written back, preferably as one big op.  If we have a
- * bunch outstanding, we'll send them. */
-static void queue_writeback(struct page_map *pm, struct page *page)
+/* Batches up pages to be written back, so PMs with a writepages op can send
+ * them to the device as a few big ops.  The tree walk gives us the pages in
+ * index order.  If we have a bunch outstanding, we'll send them.  The PM qlock
+ * keeps the pages in the PM until then. */
+static void queue_writeback(struct pm_wb_batch *wb, struct page *page)
 {
-	/* TODO (WB): add a bulk op (instead of only writepage()), collect
-	 * extents, and send them to the device.  Probably do something similar
-	 * for reads. */
-	pm->pm_op->writepage(pm, page);
+	if (!wb->pm->pm_op->writepages) {
+		wb->pm->pm_op->writepage(wb->pm, page);
+		return;
+	}
+	wb->pages[wb->nr++] = page;
+	if (wb->nr == PM_WB_BATCH)
+		flush_queued_writebacks(wb);
 }
 
 static bool __writeback_cb(void **slot, unsigned long tree_idx, void *arg)
 {
-	struct page_map *pm = arg;
+	struct pm_wb_batch *wb = arg;
 	struct page *page = pm_slot_get_page(*slot);
 
 	/* We're qlocked, so all items should have pages. */
 	assert(page);
-	if (atomic_read(&page->pg_flags) & PG_DIRTY) {
-		atomic_and(&page->pg_flags, ~PG_DIRTY);
-		queue_writeback(pm, page);
-	}
+	if (pm_clear_page_dirty(wb->pm, page))
+		queue_writeback(wb, page);
 	return false;
 }
 
 /* Every dirty page gets written back, regardless of whether it's in a VMR or
- * not.  All the dirty bits get cleared too, before writing back. */
+ * not.  All the dirty bits get cleared too, before writing back.  Only the
+ * pages tagged dirty are visited, not the entire PM. */
 void pm_writeback_pages(struct page_map *pm)
 {
+	struct pm_wb_batch wb = {.pm = pm};
+
 	qlock(&pm->pm_qlock);
 	mark_and_clear_dirty_ptes(pm);
 	shootdown_vmrs(pm);
-	radix_for_each_slot(&pm->pm_tree, __writeback_cb, pm);
-	flush_queued_writebacks(pm);
+	radix_for_each_tagged_slot(&pm->pm_tree, PM_TAG_DIRTY, __writeback_cb,
+				   &wb);
+	flush_queued_writebacks(&wb);
 	qunlock(&pm->pm_qlock);
 }
 
@@ -507,7 +742,7 @@ static bool __flush_unused_cb(void **slot, unsigned long tree_idx, void *arg)
 	/* Need to check PG_DIRTY *after* checking VMRs.  o/w we could check,
 	 * PAUSE, see no VMRs.  But in the meantime, we had a VMR that munmapped
 	 * and wrote-back the dirty flag. */
-	if (atomic_read(&page->pg_flags) & PG_DIRTY) {
+	if (pm_clear_page_dirty(pm, page)) {
 		/* If we want to batch these, we'll also have to batch the
 		 * freeing, which isn't a big deal.  Just do it before freeing
 		 * and before unlocking the PM; we don't want someone to load
@@ -517,6 +752,7 @@ static bool __flush_unused_cb(void **slot, unsigned long tree_idx, void *arg)
 	/* All clear - the page is unused and (now) clean. */
 	atomic_set(&page->pg_flags, 0);	/* catch bugs */
 	page_decref(page);
+	pm->pm_num_pages--;
 	return true;
 }
 
@@ -534,21 +770,134 @@ void pm_free_unused_pages(struct page_map *pm)
 
 static bool __destroy_cb(void **slot, unsigned long tree_idx, void *arg)
 {
+	struct page_map *pm = arg;
 	struct page *page = pm_slot_get_page(*slot);
 
 	/* Should be no users or need to sync */
 	assert(pm_slot_check_refcnt(*slot) == 0);
+	/* Owners that care have written back by now.  This takes us off the
+	 * dirty list once the last dirty page is gone. */
+	pm_clear_page_dirty(pm, page);
 	atomic_set(&page->pg_flags, 0);	/* catch bugs */
 	page_decref(page);
+	pm->pm_num_pages--;
 	return true;
 }
 
 void pm_destroy(struct page_map *pm)
 {
+	pm_lru_remove(pm);
 	radix_for_each_slot(&pm->pm_tree, __destroy_cb, pm);
+	assert(!pm->pm_nr_dirty);
 	radix_tree_destroy(&pm->pm_tree);
 }
 
+static int pm_flusher_should_run(void *arg)
+{
+	return ACCESS_ONCE(pm_nr_dirty_pages) > pm_dirty_bg_limit;
+}
+
+/* Writes back PMs that have been dirty for too long, and, if there's too much
+ * dirty memory, everything else too, oldest first.  Each PM we visit goes to
+ * the back of the line. */
+static void pm_flush_dirty(void)
+{
+	struct page_map *pm;
+	unsigned long nr_to_visit;
+	uint64_t now = nsec();
+
+	spin_lock(&pm_dirty_lock);
+	nr_to_visit = pm_nr_dirty_pms;
+	while (nr_to_visit--) {
+		pm = TAILQ_FIRST(&pm_dirty_list);
+		if (!pm)
+			break;
+		if (!pm_flusher_should_run(NULL) &&
+		    (now - pm->pm_dirtied_at < PM_DIRTY_EXPIRE_NSEC))
+			break;
+		TAILQ_REMOVE(&pm_dirty_list, pm, pm_dirty_link);
+		TAILQ_INSERT_TAIL(&pm_dirty_list, pm, pm_dirty_link);
+		pm->pm_dirtied_at = now;
+		/* Holding the dirty lock keeps pm from being destroyed, so we
+		 * can try to pin it.  pin must not block. */
+		if (!pm->pm_op->pin || !pm->pm_op->pin(pm))
+			continue;
+		spin_unlock(&pm_dirty_lock);
+		pm_writeback_pages(pm);
+		pm->pm_op->unpin(pm);
+		rendez_wakeup(&pm_throttle_rv);
+		spin_lock(&pm_dirty_lock);
+	}
+	spin_unlock(&pm_dirty_lock);
+}
+
+static void pm_flusher(void *arg)
+{
+	while (1) {
+		rendez_sleep_timeout(&pm_flusher_rv, pm_flusher_should_run,
+				     NULL, PM_FLUSH_INTERVAL_USEC);
+		pm_flush_dirty();
+		rendez_wakeup(&pm_throttle_rv);
+	}
+}
+
+static void __init pm_flusher_init(void)
+{
+	pm_dirty_limit = max_nr_pages * CONFIG_PM_DIRTY_RATIO / 100;
+	pm_dirty_bg_limit = pm_dirty_limit / 2;
+	rendez_init(&pm_flusher_rv);
+	rendez_init(&pm_throttle_rv);
+	ktask("pm_flusher", pm_flusher, NULL);
+}
+init_func_2(pm_flusher_init);
+
+/* Drops clean, unused pages from reclaimable PMs, least-recently loaded first.
+ * Dirty pages get written back first (see pm_free_unused_pages()).  Each PM we
+ * visit goes to the back of the line, or off the list if it's empty. */
+static size_t pm_shrink(struct shrinker *s, size_t goal)
+{
+	struct page_map *pm;
+	unsigned long nr_to_visit, nr_before;
+	size_t amt = 0;
+
+	spin_lock(&pm_lru_lock);
+	nr_to_visit = pm_nr_on_lru;
+	while (nr_to_visit-- && amt < goal) {
+		pm = TAILQ_FIRST(&pm_lru);
+		if (!pm)
+			break;
+		TAILQ_REMOVE(&pm_lru, pm, pm_lru_link);
+		TAILQ_INSERT_TAIL(&pm_lru, pm, pm_lru_link);
+		/* Holding the LRU lock keeps pm from being destroyed. */
+		if (!pm->pm_op->pin(pm))
+			continue;
+		spin_unlock(&pm_lru_lock);
+		qlock(&pm->pm_qlock);
+		nr_before = pm->pm_num_pages;
+		radix_for_each_slot(&pm->pm_tree, __flush_unused_cb, pm);
+		amt += (nr_before - pm->pm_num_pages) * PGSIZE;
+		if (!pm->pm_num_pages)
+			pm_lru_remove(pm);
+		qunlock(&pm->pm_qlock);
+		pm->pm_op->unpin(pm);
+		spin_lock(&pm_lru_lock);
+	}
+	spin_unlock(&pm_lru_lock);
+	return amt;
+}
+
+static struct shrinker pm_shrinker = {
+	.name = "page_maps",
+	.priority = SHRINKER_PRIO_DATA,
+	.shrink = pm_shrink,
+};
+
+static void __init pm_reclaim_init(void)
+{
+	register_shrinker(&pm_shrinker);
+}
+init_func_2(pm_reclaim_init);
+
 void print_page_map_info(struct page_map *pm)
 {
 	struct vm_region *vmr_i;
@@ -461,6 +461,7 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 	memset(&p->vmm, 0, sizeof(struct vmm));
 	spinlock_init(&p->vmm.lock);
 	qlock_init(&p->vmm.qlock);
+	spinlock_init(&p->vmm.db_lock);
 	qlock_init(&p->dev_qlock);
 	TAILQ_INIT(&p->pci_devs);
 	INIT_LIST_HEAD(&p->iommus);
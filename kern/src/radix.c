@@ -2,7 +2,8 @@
  * Barret Rhoden <brho@cs.berkeley.edu>
  * See LICENSE for details.
  *
- * Radix Trees!  Just the basics, doesn't do tagging or anything fancy. */
+ * Radix Trees!  Just the basics, plus tagging, gang lookups, and multi-order
+ * entries. */
 
 #include <ros/errno.h>
 #include <radix.h>
@@ -15,8 +16,11 @@
 struct kmem_cache *radix_kcache;
 static struct radix_node *__radix_lookup_node(struct radix_tree *tree,
                                               unsigned long key,
-                                              bool extend);
-static void __radix_remove_slot(struct radix_node *r_node, struct radix_node **slot);
+                                              unsigned int stop_lvl,
+                                              bool extend,
+                                              unsigned int *idx_p);
+static void __radix_remove_slot(struct radix_node *r_node,
+                                struct radix_node **slot);
 
 /* Initializes the radix tree system, mostly just builds the kcache */
 void radix_init(void)
@@ -31,9 +35,12 @@ void radix_init(void)
 void radix_tree_init(struct radix_tree *tree)
 {
 	tree->seq = SEQCTR_INITIALIZER;
+	spinlock_init(&tree->tag_lock);
 	tree->root = 0;
 	tree->depth = 0;
 	tree->upper_bound = 0;
+	tree->preload = NULL;
+	tree->nr_preload = 0;
 }
 
 static bool __should_not_run_cb(void **slot, unsigned long tree_idx, void *a)
@@ -48,6 +55,8 @@ static bool __should_not_run_cb(void **slot, unsigned long tree_idx, void *a)
  * slot. */
 void radix_tree_destroy(struct radix_tree *tree)
 {
+	struct radix_node *r_node;
+
 	/* Currently, we may have a root node, even if all the elements were
 	 * removed */
 	radix_for_each_slot(tree, __should_not_run_cb, NULL);
@@ -55,24 +64,43 @@ void radix_tree_destroy(struct radix_tree *tree)
 		kmem_cache_free(radix_kcache, tree->root);
 		tree->root = NULL;
 	}
+	while (tree->preload) {
+		r_node = tree->preload;
+		tree->preload = r_node->parent;
+		kmem_cache_free(radix_kcache, r_node);
+	}
+	tree->nr_preload = 0;
 }
 
-/* Attempts to insert an item in the tree at the given key.  ENOMEM if we ran
- * out of memory, EEXIST if an item is already in the tree.  On success, will
- * also return the slot pointer, if requested.
+/* Gets a zeroed rnode, from the preload list if there are any. */
+static struct radix_node *__rnode_alloc(struct radix_tree *tree)
+{
+	struct radix_node *r_node;
+
+	spin_lock(&tree->tag_lock);
+	r_node = tree->preload;
+	if (r_node) {
+		tree->preload = r_node->parent;
+		tree->nr_preload--;
+	}
+	spin_unlock(&tree->tag_lock);
+	if (!r_node)
+		r_node = kmem_cache_alloc(radix_kcache, MEM_WAIT);
+	memset(r_node, 0, sizeof(struct radix_node));
+	return r_node;
+}
+
+/* Adds levels to the top of the tree until key fits.
  *
  * Caller must maintain mutual exclusion (qlock) */
-int radix_insert(struct radix_tree *tree, unsigned long key, void *item,
-                 void ***slot_p)
+static void __radix_grow(struct radix_tree *tree, unsigned long key)
 {
 	struct radix_node *r_node;
-	void **slot;
 
 	/* Is the tree tall enough?  if not, it needs to grow a level.  This
 	 * will also create the initial node (upper bound starts at 0). */
-	while (key >= tree->upper_bound) {
-		r_node = kmem_cache_alloc(radix_kcache, MEM_WAIT);
-		memset(r_node, 0, sizeof(struct radix_node));
+	while (key >= tree->upper_bound && tree->depth < RADIX_MAX_DEPTH) {
+		r_node = __rnode_alloc(tree);
 		if (tree->root) {
 			/* tree->root is the old root, now a child of the future
 			 * root */
@@ -88,27 +116,83 @@ int radix_insert(struct radix_tree *tree, unsigned long key, void *item,
 			r_node->parent = 0;
 		}
 		/* Need to atomically change root, depth, and upper_bound for
-		 * our readers, who will check the seq ctr. */
+		 * our readers, who will check the seq ctr.  The tag lock keeps
+		 * taggers from tagging the old root after we copied its tags.
+		 */
+		spin_lock(&tree->tag_lock);
+		if (tree->root) {
+			for (int i = 0; i < RADIX_NR_TAGS; i++) {
+				if (tree->root->tags[i])
+					r_node->tags[i] = 1;
+			}
+		}
 		__seq_start_write(&tree->seq);
 		tree->root = r_node;
 		r_node->my_slot = &tree->root;
 		tree->depth++;
-		tree->upper_bound = 1ULL << (LOG_RNODE_SLOTS * tree->depth);
+		if (LOG_RNODE_SLOTS * tree->depth >= sizeof(unsigned long) * 8)
+			tree->upper_bound = ULONG_MAX;
+		else
+			tree->upper_bound =
+				1UL << (LOG_RNODE_SLOTS * tree->depth);
 		__seq_end_write(&tree->seq);
+		spin_unlock(&tree->tag_lock);
 	}
+}
+
+/* Attempts to insert an item in the tree at the given key.  ENOMEM if we ran
+ * out of memory, EEXIST if an item is already in the tree.  On success, will
+ * also return the slot pointer, if requested.
+ *
+ * Caller must maintain mutual exclusion (qlock) */
+int radix_insert(struct radix_tree *tree, unsigned long key, void *item,
+                 void ***slot_p)
+{
+	return radix_insert_order(tree, key, 0, item, slot_p);
+}
+
+/* Inserts an item covering [key, key + 2^order).  key must be aligned to the
+ * order.  EEXIST if any key in the range already has an item.
+ *
+ * Caller must maintain mutual exclusion (qlock) */
+int radix_insert_order(struct radix_tree *tree, unsigned long key,
+                       unsigned int order, void *item, void ***slot_p)
+{
+	unsigned int lvl = order / LOG_RNODE_SLOTS + 1;
+	unsigned int nr_slots = 1 << (order % LOG_RNODE_SLOTS);
+	unsigned long mask;
+	struct radix_node *r_node;
+	unsigned int idx;
+
+	if (order >= sizeof(unsigned long) * 8 || key & ((1UL << order) - 1))
+		return -EINVAL;
+	__radix_grow(tree, key + (1UL << order) - 1);
+	/* The entry needs an rnode at its level, even if the keys fit in a
+	 * shorter tree. */
+	while (tree->depth < lvl)
+		__radix_grow(tree, tree->upper_bound);
 	assert(tree->root);
-	/* the tree now thinks it is tall enough, so find the last node, insert
-	 * in it, etc */
-	/* This gives us an rcu-protected pointer, though we hold the lock. */
-	r_node = __radix_lookup_node(tree, key, TRUE);
+	/* the tree now thinks it is tall enough, so find the node at our level,
+	 * insert in it, etc.  This gives us an rcu-protected pointer, though
+	 * we hold the lock.  If some entry above our level already covers key,
+	 * we'll get its node and idx, and fail below. */
+	r_node = __radix_lookup_node(tree, key, lvl, TRUE, &idx);
 	assert(r_node);	/* we want an ENOMEM actually, but i want to see this */
-	slot = &r_node->items[key & (NR_RNODE_SLOTS - 1)];
-	if (*slot)
-		return -EEXIST;
-	rcu_assign_pointer(*slot, item);
-	r_node->num_items++;
+	for (int i = 0; i < nr_slots; i++) {
+		if (r_node->items[idx + i])
+			return -EEXIST;
+	}
+	/* Readers look at the slot, then the bitmaps, so the bits need to be
+	 * set before the items are.  rcu_assign_pointer has the wmb. */
+	mask = ((1UL << nr_slots) - 1) << idx;
+	if (lvl > 1)
+		r_node->entries |= mask;
+	r_node->siblings |= mask & ~(1UL << idx);
+	for (int i = nr_slots - 1; i >= 0; i--)
+		rcu_assign_pointer(r_node->items[idx + i], item);
+	r_node->num_items += nr_slots;
 	if (slot_p)
-		*slot_p = slot;	/* passing back an rcu-protected pointer */
+		*slot_p = &r_node->items[idx];	/* an rcu-protected pointer */
 	return 0;
 }
 
@@ -119,14 +203,58 @@ static void __rnode_free_rcu(struct rcu_head *head)
 	kmem_cache_free(radix_kcache, r_node);
 }
 
+/* Returns the index of r_node's slot in its parent */
+static unsigned int __rnode_idx(struct radix_node *r_node)
+{
+	return (void**)r_node->my_slot - r_node->parent->items;
+}
+
+/* Clears tag for the idx'th slot of r_node, clearing it in the parents too if
+ * nothing else under them has the tag.  Hold the tag lock. */
+static void __rnode_clear_tag(struct radix_node *r_node, unsigned int idx,
+                              int tag)
+{
+	r_node->tags[tag] &= ~(1UL << idx);
+	while (!r_node->tags[tag] && r_node->parent) {
+		idx = __rnode_idx(r_node);
+		r_node = r_node->parent;
+		r_node->tags[tag] &= ~(1UL << idx);
+	}
+}
+
+/* Returns the number of slots used by the item in slot idx: 1 plus any
+ * siblings. */
+static unsigned int __rnode_nr_slots(struct radix_node *r_node,
+                                     unsigned int idx)
+{
+	unsigned int nr = 1;
+
+	while (idx + nr < NR_RNODE_SLOTS &&
+	       ACCESS_ONCE(r_node->siblings) & (1UL << (idx + nr)))
+		nr++;
+	return nr;
+}
+
 /* Removes an item from it's parent's structure, freeing the parent if there is
- * nothing left, potentially recursively. */
+ * nothing left, potentially recursively.  Hold the tag lock. */
 static void __radix_remove_slot(struct radix_node *r_node,
                                 struct radix_node **slot)
 {
+	unsigned int idx = (void**)slot - r_node->items;
+	unsigned int nr_slots = __rnode_nr_slots(r_node, idx);
+	unsigned long mask = ((1UL << nr_slots) - 1) << idx;
+
 	assert(*slot);		/* make sure there is something there */
-	rcu_assign_pointer(*slot, NULL);
-	r_node->num_items--;
+	for (int i = 0; i < RADIX_NR_TAGS; i++) {
+		if (r_node->tags[i] & (1UL << idx))
+			__rnode_clear_tag(r_node, idx, i);
+	}
+	for (int i = 0; i < nr_slots; i++)
+		rcu_assign_pointer(r_node->items[idx + i], NULL);
+	/* Whoever reuses the slots will wmb before publishing. */
+	r_node->entries &= ~mask;
+	r_node->siblings &= ~mask;
+	r_node->num_items -= nr_slots;
 	/* this check excludes the root, but the if else handles it.  For now,
 	 * once we have a root, we'll always keep it (will need some changing in
 	 * radix_insert() */
@@ -140,7 +268,8 @@ static void __radix_remove_slot(struct radix_node *r_node,
 }
 
 /* Removes a key/item from the tree, returning that item (the void*).  If it
- * detects a radix_node is now unused, it will dealloc that node.  Though the
+ * detects a radix_node is now unused, it will dealloc that node.  Any key of a
+ * multi-order entry removes the whole entry.  Though the
  * tree will still think it is tall enough to handle its old upper_bound.  It
  * won't "shrink".
  *
@@ -150,15 +279,18 @@ void *radix_delete(struct radix_tree *tree, unsigned long key)
 	void **slot;
 	void *retval;
 	struct radix_node *r_node;
+	unsigned int idx;
 
 	/* This is an rcu-protected pointer, though the caller holds a lock. */
-	r_node = __radix_lookup_node(tree, key, false);
+	r_node = __radix_lookup_node(tree, key, 1, FALSE, &idx);
 	if (!r_node)
 		return 0;
-	slot = &r_node->items[key & (NR_RNODE_SLOTS - 1)];
+	slot = &r_node->items[idx];
 	retval = rcu_dereference(*slot);
 	if (retval) {
+		spin_lock(&tree->tag_lock);
 		__radix_remove_slot(r_node, (struct radix_node**)slot);
+		spin_unlock(&tree->tag_lock);
 	} else {
 		/* it's okay to delete an empty, but i want to know about it for
 		 * now */
@@ -180,48 +312,72 @@ void *radix_lookup(struct radix_tree *tree, unsigned long key)
 	return rcu_dereference(*slot);
 }
 
-/* Returns a pointer to the radix_node holding a given key.  0 if there is no
- * such node, due to the tree being too small or something.
+/* Reads the tree's root and depth for a reader. */
+static struct radix_node *__radix_get_root(struct radix_tree *tree,
+                                           unsigned int *depth_p,
+                                           unsigned long *upper_bound_p)
+{
+	struct radix_node *r_node;
+	seq_ctr_t seq;
+
+	do {
+		seq = ACCESS_ONCE(tree->seq);
+		rmb();
+		r_node = rcu_dereference(tree->root);
+		*depth_p = tree->depth;
+		*upper_bound_p = tree->upper_bound;
+	} while (seqctr_retry(tree->seq, seq));
+	return r_node;
+}
+
+/* Returns a pointer to the radix_node holding a given key, and the key's index
+ * in it via idx_p.  0 if there is no such node, due to the tree being too small
+ * or something.
  *
  * If the depth is greater than one, we need to walk down the tree a level.  The
  * key is 'partitioned' among the levels of the tree, like so:
  * ......444444333333222222111111
  *
+ * The walk stops at level stop_lvl (1 is the leaves), or at a multi-order entry
+ * covering the key.  Either way, the index is of the entry's first slot, not a
+ * sibling.
+ *
  * If an interior node of the tree is missing, this will add one if it was
  * directed to extend the tree.
  *
  * If we might extend, the caller must maintain mutual exclusion (qlock) */
 static struct radix_node *__radix_lookup_node(struct radix_tree *tree,
-                                              unsigned long key, bool extend)
+                                              unsigned long key,
+                                              unsigned int stop_lvl,
+                                              bool extend,
+                                              unsigned int *idx_p)
 {
 	unsigned long idx, upper_bound;
 	unsigned int depth;
-	seq_ctr_t seq;
 	struct radix_node *child_node, *r_node;
 
-	do {
-		seq = ACCESS_ONCE(tree->seq);
-		rmb();
-		r_node = rcu_dereference(tree->root);
-		depth = tree->depth;
-		upper_bound = tree->upper_bound;
-	} while (seqctr_retry(tree->seq, seq));
-
-	if (key	>= upper_bound) {
+	r_node = __radix_get_root(tree, &depth, &upper_bound);
+	if (key	>= upper_bound || !r_node) {
 		if (extend)
 			warn("Bound (%d) not set for key %d!\n", upper_bound,
 			     key);
 		return 0;
 	}
-	for (int i = depth; i > 1; i--) {	 /* i = ..., 4, 3, 2 */
+	for (int i = depth; ; i--) {	 /* i = ..., 4, 3, 2, 1 */
 		idx = (key >> (LOG_RNODE_SLOTS * (i - 1)))
 		      & (NR_RNODE_SLOTS - 1);
+		if (i <= stop_lvl)
+			break;
+		child_node = rcu_dereference(r_node->items[idx]);
+		/* pairs with the wmb in insert: slot, then bitmaps */
+		rmb();
+		if (ACCESS_ONCE(r_node->entries) & (1UL << idx))
+			break;
 		/* There might not be a node at this part of the tree */
-		if (!r_node->items[idx]) {
+		if (!child_node) {
 			if (!extend)
 				return 0;
-			child_node = kmem_cache_alloc(radix_kcache, MEM_WAIT);
-			memset(child_node, 0, sizeof(struct radix_node));
+			child_node = __rnode_alloc(tree);
 			/* when we are on the last iteration (i == 2), the child
 			 * will be a leaf. */
 			child_node->leaf = (i == 2) ? TRUE : FALSE;
@@ -231,24 +387,27 @@ static struct radix_node *__radix_lookup_node(struct radix_tree *tree,
 			r_node->num_items++;
 			rcu_assign_pointer(r_node->items[idx], child_node);
 		}
-		r_node =
-		    (struct radix_node*)rcu_dereference(r_node->items[idx]);
+		r_node = child_node;
 	}
+	while (idx && ACCESS_ONCE(r_node->siblings) & (1UL << idx))
+		idx--;
+	*idx_p = idx;
 	return r_node;
 }
 
 /* Returns a pointer to the slot for the given key.  0 if there is no such slot,
- * etc */
+ * etc.  For multi-order entries, that's the entry's first slot. */
 void **radix_lookup_slot(struct radix_tree *tree, unsigned long key)
 {
-	struct radix_node *r_node = __radix_lookup_node(tree, key, FALSE);
+	unsigned int idx;
+	struct radix_node *r_node = __radix_lookup_node(tree, key, 1, FALSE,
+							 &idx);
 
 	if (!r_node)
 		return 0;
-	key = key & (NR_RNODE_SLOTS - 1);
 	/* r_node is rcu-protected.  Our retval is too, since it's a pointer
 	 * into the same object as r_node. */
-	return &r_node->items[key];
+	return &r_node->items[idx];
 }
 
 /* [x_left, x_right) and [y_left, y_right). */
@@ -259,19 +418,19 @@ static bool ranges_overlap(unsigned long x_left, unsigned long x_right,
 	       ((y_left <= x_left) && (x_left < y_right));
 }
 
-/* Given an index at a depth for a child, returns whether part of it is in the
- * global range.
+/* Given an index at a depth for a child, returns whether part of it (or of the
+ * nr_slots starting at it) is in the global range.
  *
  * Recall the key is partitioned like so: ....444444333333222222111111.  The
  * depth is 1 when we're in the last rnode and our children are items.  When
  * we're an intermediate node, our depth is higher, and our start/end is the
  * entire reach of us + our children. */
-static bool child_overlaps_range(unsigned long idx, int depth,
-                                 unsigned long glb_start_idx,
+static bool child_overlaps_range(unsigned long idx, unsigned int nr_slots,
+                                 int depth, unsigned long glb_start_idx,
                                  unsigned long glb_end_idx)
 {
 	unsigned long start = idx << (LOG_RNODE_SLOTS * (depth - 1));
-	unsigned long end = (idx + 1) << (LOG_RNODE_SLOTS * (depth - 1));
+	unsigned long end = (idx + nr_slots) << (LOG_RNODE_SLOTS * (depth - 1));
 
 	return ranges_overlap(start, end, glb_start_idx, glb_end_idx);
 }
@@ -287,17 +446,24 @@ static bool child_overlaps_range(unsigned long idx, int depth,
  * - glb_start_idx and glb_end_idx is the global start and end for the entire
  *   for_each operation.
  *
+ * - tag, if not -1, limits the walk to items (and subtrees) with that tag.
+ * - multi-order entries are passed to cb with their first key.  Siblings are
+ *   skipped.
+ *
  * Returns true if our r_node *was already deleted*.  When we call
  * __radix_remove_slot(), if we removed the last item for r_node, the removal
  * code will recurse *up* the tree, such that r_node might already be freed.
  * Same goes for our parent!  Hence, we're careful to only access r_node when we
  * know we have children (once we enter the loop and might remove a slot). */
-static bool rnode_for_each(struct radix_node *r_node, int depth,
-                           unsigned long tree_idx, unsigned long glb_start_idx,
-                           unsigned long glb_end_idx,
+static bool rnode_for_each(struct radix_tree *tree, struct radix_node *r_node,
+                           int depth, unsigned long tree_idx,
+                           unsigned long glb_start_idx,
+                           unsigned long glb_end_idx, int tag,
                            radix_cb_t cb, void *arg)
 {
 	unsigned int num_children = ACCESS_ONCE(r_node->num_items);
+	unsigned int nr_slots;
+	bool is_item;
 
 	/* The tree_idx we were passed was from our parent's perspective.  We
 	 * need shift it over each time we walk down to put it in terms of our
@@ -306,22 +472,32 @@ static bool rnode_for_each(struct radix_node *r_node, int depth,
 	tree_idx <<= LOG_RNODE_SLOTS;
 	for (int i = 0; num_children && (i < NR_RNODE_SLOTS); i++) {
 		if (r_node->items[i]) {
+			if (r_node->siblings & (1UL << i))
+				continue;
+			is_item = depth == 1 || (r_node->entries & (1UL << i));
+			nr_slots = is_item ? __rnode_nr_slots(r_node, i) : 1;
 			/* If we really care, we can try to abort the rest of
 			 * the loop.  Not a big deal */
-			if (!child_overlaps_range(tree_idx + i, depth,
+			if (!child_overlaps_range(tree_idx + i, nr_slots, depth,
 						  glb_start_idx, glb_end_idx))
 				continue;
-			if (depth > 1) {
-				if (rnode_for_each(r_node->items[i], depth - 1,
-						   tree_idx + i, glb_start_idx,
-						   glb_end_idx, cb, arg))
+			if ((tag >= 0) && !(r_node->tags[tag] & (1UL << i)))
+				continue;
+			if (!is_item) {
+				if (rnode_for_each(tree, r_node->items[i],
+						   depth - 1, tree_idx + i,
+						   glb_start_idx, glb_end_idx,
+						   tag, cb, arg))
 					num_children--;
 			} else {
-				if (cb(&r_node->items[i], tree_idx + i, arg)) {
+				if (cb(&r_node->items[i], (tree_idx + i) <<
+				       (LOG_RNODE_SLOTS * (depth - 1)), arg)) {
+					spin_lock(&tree->tag_lock);
 					__radix_remove_slot(r_node,
 						(struct radix_node**)
 						&r_node->items[i]);
-					num_children--;
+					spin_unlock(&tree->tag_lock);
+					num_children -= nr_slots;
 				}
 			}
 		}
@@ -339,7 +515,8 @@ void radix_for_each_slot_in_range(struct radix_tree *tree,
 {
 	if (!tree->root)
 		return;
-	rnode_for_each(tree->root, tree->depth, 0, start_idx, end_idx, cb, arg);
+	rnode_for_each(tree, tree->root, tree->depth, 0, start_idx, end_idx, -1,
+		       cb, arg);
 }
 
 /* Caller must maintain mutual exclusion (qlock) */
@@ -348,56 +525,227 @@ void radix_for_each_slot(struct radix_tree *tree, radix_cb_t cb, void *arg)
 	radix_for_each_slot_in_range(tree, 0, ULONG_MAX, cb, arg);
 }
 
-int radix_gang_lookup(struct radix_tree *tree, void **results,
-                      unsigned long first, unsigned int max_items)
+struct radix_gang {
+	void				**results;
+	unsigned long			*indices;
+	unsigned long			first;
+	unsigned int			max_items;
+	unsigned int			nr_items;
+	int				tag;
+};
+
+/* Helper for the gang lookups, like rnode_for_each but for readers.  Returns
+ * TRUE once the gang is full.
+ *
+ * We skip the slots before the one holding first, if first is under us.  If
+ * that slot is a sibling, its entry covers first, so we start at the entry. */
+static bool rnode_gang_lookup(struct radix_node *r_node, int depth,
+                              unsigned long tree_idx, bool holds_first,
+                              struct radix_gang *g)
 {
-	panic("Not implemented");
-	return -1; /* TODO! */
+	unsigned long bits;
+	unsigned int shift = LOG_RNODE_SLOTS * (depth - 1);
+	unsigned int start = 0;
+	void *child;
+	int i;
+
+	tree_idx <<= LOG_RNODE_SLOTS;
+	if (holds_first) {
+		start = (g->first >> shift) & (NR_RNODE_SLOTS - 1);
+		while (start && ACCESS_ONCE(r_node->siblings) & (1UL << start))
+			start--;
+	}
+	bits = ~0UL << start;
+	if (g->tag >= 0)
+		bits &= ACCESS_ONCE(r_node->tags[g->tag]);
+	while (bits) {
+		i = __builtin_ctzl(bits);
+		bits &= bits - 1;
+		child = rcu_dereference(r_node->items[i]);
+		if (!child)
+			continue;
+		/* pairs with the wmb in insert: slot, then bitmaps */
+		rmb();
+		if (ACCESS_ONCE(r_node->siblings) & (1UL << i))
+			continue;
+		if (depth > 1 && !(ACCESS_ONCE(r_node->entries) & (1UL << i))) {
+			if (rnode_gang_lookup(child, depth - 1, tree_idx + i,
+					      holds_first && i == start, g))
+				return TRUE;
+			continue;
+		}
+		if (g->results)
+			g->results[g->nr_items] = child;
+		if (g->indices)
+			g->indices[g->nr_items] = (tree_idx + i) << shift;
+		if (++g->nr_items == g->max_items)
+			return TRUE;
+	}
+	return FALSE;
 }
 
+static unsigned int __radix_gang_lookup(struct radix_tree *tree,
+                                        void **results, unsigned long *indices,
+                                        unsigned long first,
+                                        unsigned int max_items, int tag)
+{
+	struct radix_gang g = {results, indices, first, max_items, 0, tag};
+	struct radix_node *root;
+	unsigned long upper_bound;
+	unsigned int depth;
 
+	if (!max_items)
+		return 0;
+	rcu_read_lock();
+	root = __radix_get_root(tree, &depth, &upper_bound);
+	if (root && first < upper_bound)
+		rnode_gang_lookup(root, depth, 0, TRUE, &g);
+	rcu_read_unlock();
+	return g.nr_items;
+}
+
+/* Finds up to max_items items at or after key first, in key order, returning
+ * how many we found.  A multi-order entry that covers first counts.
+ *
+ * Like radix_lookup(), the items themselves have limited protections: the
+ * caller needs to keep them alive, e.g. with RCU or the writer's lock. */
+unsigned int radix_gang_lookup(struct radix_tree *tree, void **results,
+                               unsigned long *indices, unsigned long first,
+                               unsigned int max_items)
+{
+	return __radix_gang_lookup(tree, results, indices, first, max_items,
+				   -1);
+}
+
+/* Makes the tree tall enough to hold keys up to max.
+ *
+ * Caller must maintain mutual exclusion (qlock) */
 int radix_grow(struct radix_tree *tree, unsigned long max)
 {
-	panic("Not implemented");
-	return -1; /* TODO! */
+	__radix_grow(tree, max);
+	return 0;
 }
 
+/* Stocks the tree's preload list with enough rnodes for one insert of any key
+ * that needs at most one new level.  Call this before grabbing the writer's
+ * lock, so the insert doesn't need to allocate, with whatever flags you want.
+ * Returns 0 on success, -ENOMEM if flags didn't let us wait for memory. */
 int radix_preload(struct radix_tree *tree, int flags)
 {
-	panic("Not implemented");
-	return -1; /* TODO! */
-}
+	unsigned int want = MIN(ACCESS_ONCE(tree->depth) + 1, RADIX_MAX_DEPTH);
+	struct radix_node *r_node;
 
+	while (ACCESS_ONCE(tree->nr_preload) < want) {
+		r_node = kmem_cache_alloc(radix_kcache, flags);
+		if (!r_node)
+			return -ENOMEM;
+		spin_lock(&tree->tag_lock);
+		r_node->parent = tree->preload;
+		tree->preload = r_node;
+		tree->nr_preload++;
+		spin_unlock(&tree->tag_lock);
+	}
+	return 0;
+}
 
+/* Sets the tag for key, returning the item, or 0 if there was no item (and no
+ * tag was set). */
 void *radix_tag_set(struct radix_tree *tree, unsigned long key, int tag)
 {
-	panic("Tagging not implemented!");
-	return (void*)-1; /* TODO! */
+	struct radix_node *r_node;
+	unsigned int idx;
+	void *item = 0;
+
+	spin_lock(&tree->tag_lock);
+	r_node = __radix_lookup_node(tree, key, 1, FALSE, &idx);
+	if (!r_node)
+		goto out;
+	item = r_node->items[idx];
+	if (!item)
+		goto out;
+	/* Once we find a set bit, all of the parents are set too */
+	while (!(r_node->tags[tag] & (1UL << idx))) {
+		r_node->tags[tag] |= 1UL << idx;
+		if (!r_node->parent)
+			break;
+		idx = __rnode_idx(r_node);
+		r_node = r_node->parent;
+	}
+out:
+	spin_unlock(&tree->tag_lock);
+	return item;
 }
 
+/* Clears the tag for key, returning the item, or 0 if there was no item. */
 void *radix_tag_clear(struct radix_tree *tree, unsigned long key, int tag)
 {
-	panic("Tagging not implemented!");
-	return (void*)-1; /* TODO! */
+	struct radix_node *r_node;
+	unsigned int idx;
+	void *item = 0;
+
+	spin_lock(&tree->tag_lock);
+	r_node = __radix_lookup_node(tree, key, 1, FALSE, &idx);
+	if (!r_node)
+		goto out;
+	item = r_node->items[idx];
+	if (!item)
+		goto out;
+	if (r_node->tags[tag] & (1UL << idx))
+		__rnode_clear_tag(r_node, idx, tag);
+out:
+	spin_unlock(&tree->tag_lock);
+	return item;
 }
 
+/* Returns whether key has the tag.  Like a lookup, this is racy with
+ * concurrent tag changers. */
 int radix_tag_get(struct radix_tree *tree, unsigned long key, int tag)
 {
-	panic("Tagging not implemented!");
-	return -1; /* TODO! */
+	struct radix_node *r_node;
+	unsigned int idx;
+	int ret = 0;
+
+	rcu_read_lock();
+	r_node = __radix_lookup_node(tree, key, 1, FALSE, &idx);
+	if (r_node)
+		ret = ACCESS_ONCE(r_node->tags[tag]) & (1UL << idx) ? 1 : 0;
+	rcu_read_unlock();
+	return ret;
 }
 
+/* Returns whether any item in the tree has the tag. */
 int radix_tree_tagged(struct radix_tree *tree, int tag)
 {
-	panic("Tagging not implemented!");
-	return -1; /* TODO! */
+	struct radix_node *root;
+	int ret = 0;
+
+	rcu_read_lock();
+	root = rcu_dereference(tree->root);
+	if (root)
+		ret = ACCESS_ONCE(root->tags[tag]) ? 1 : 0;
+	rcu_read_unlock();
+	return ret;
 }
 
-int radix_tag_gang_lookup(struct radix_tree *tree, void **results,
-                          unsigned long first, unsigned int max_items, int tag)
+/* Caller must maintain mutual exclusion (qlock).  Items tagged concurrently
+ * might not be visited. */
+void radix_for_each_tagged_slot(struct radix_tree *tree, int tag,
+                                radix_cb_t cb, void *arg)
 {
-	panic("Tagging not implemented!");
-	return -1; /* TODO! */
+	if (!tree->root)
+		return;
+	rnode_for_each(tree, tree->root, tree->depth, 0, 0, ULONG_MAX, tag, cb,
+		       arg);
+}
+
+/* Like radix_gang_lookup(), but only finds items with the tag.  Untagged
+ * subtrees are skipped. */
+unsigned int radix_tag_gang_lookup(struct radix_tree *tree, void **results,
+                                   unsigned long *indices, unsigned long first,
+                                   unsigned int max_items, int tag)
+{
+	return __radix_gang_lookup(tree, results, indices, first, max_items,
+				   tag);
 }
 
 void print_radix_tree(struct radix_tree *tree)
@@ -418,7 +766,9 @@ void print_radix_tree(struct radix_tree *tree)
 		for (int i = 0; i < NR_RNODE_SLOTS; i++) {
 			if (!r_node->items[i])
 				continue;
-			if (r_node->leaf)
+			if (r_node->siblings & (1UL << i))
+				continue;
+			if (r_node->leaf || (r_node->entries & (1UL << i)))
 				printk("\t%sRnode Item %d: %p\n", buf, i,
 				       r_node->items[i]);
 			else
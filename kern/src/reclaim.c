@@ -0,0 +1,197 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Memory reclaim: a ktask that runs the registered shrinkers when free memory
+ * gets low.  See reclaim.h for the interface.
+ *
+ * The watermarks are fractions of the base arena's total memory.  Below the low
+ * watermark, allocations poke the reclaimer, which shrinks until we're above
+ * the high watermark or the shrinkers run dry.
+ *
+ * TODO: NUMA.  There's only one base arena for now, and we only watch it. */
+
+#include <reclaim.h>
+#include <kmalloc.h>
+#include <kthread.h>
+#include <rendez.h>
+#include <linker_func.h>
+#include <smp.h>
+#include <trap.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* low = total >> 6 (~1.5%), high = total >> 5 (~3%) */
+#define RECLAIM_LOW_WMARK_SHIFT		6
+#define RECLAIM_HIGH_WMARK_SHIFT	5
+/* How long an allocation waits for a reclaim pass, and how many passes it waits
+ * for, before giving up. */
+#define RECLAIM_WAIT_USEC		1000000
+#define RECLAIM_WAIT_NR_TRIES		5
+
+static qlock_t shrinker_lock = QLOCK_INITIALIZER(shrinker_lock);
+static struct shrinker_tailq shrinkers = TAILQ_HEAD_INITIALIZER(shrinkers);
+
+size_t reclaim_low_wmark;
+static size_t reclaim_high_wmark;
+
+static bool reclaim_ready;
+static struct kthread *reclaimer;
+static atomic_t reclaim_poked;
+static struct rendez reclaim_rv;
+/* Waiters sleep until the reclaimer finishes a pass. */
+static struct rendez reclaim_done_rv;
+static unsigned long reclaim_nr_passes;
+static size_t reclaim_last_amt;
+
+/* Keeps the list sorted by priority, FIFO within a priority. */
+void register_shrinker(struct shrinker *s)
+{
+	struct shrinker *s_i;
+
+	s->nr_calls = 0;
+	s->amt_reclaimed = 0;
+	qlock(&shrinker_lock);
+	TAILQ_FOREACH(s_i, &shrinkers, link) {
+		if (s_i->priority > s->priority) {
+			TAILQ_INSERT_BEFORE(s_i, s, link);
+			qunlock(&shrinker_lock);
+			return;
+		}
+	}
+	TAILQ_INSERT_TAIL(&shrinkers, s, link);
+	qunlock(&shrinker_lock);
+}
+
+void unregister_shrinker(struct shrinker *s)
+{
+	qlock(&shrinker_lock);
+	TAILQ_REMOVE(&shrinkers, s, link);
+	qunlock(&shrinker_lock);
+}
+
+/* Runs the shrinkers, in order, until they freed @goal bytes.  Returns the
+ * amount they claim to have freed. */
+size_t reclaim_memory(size_t goal)
+{
+	struct shrinker *s_i;
+	size_t amt, total = 0;
+
+	qlock(&shrinker_lock);
+	TAILQ_FOREACH(s_i, &shrinkers, link) {
+		if (total >= goal)
+			break;
+		amt = s_i->shrink(s_i, goal - total);
+		s_i->nr_calls++;
+		s_i->amt_reclaimed += amt;
+		total += amt;
+	}
+	qunlock(&shrinker_lock);
+	return total;
+}
+
+/* Safe to call from IRQ context.  Only the first poke between passes actually
+ * wakes the reclaimer. */
+void reclaim_poke(void)
+{
+	if (!reclaim_ready)
+		return;
+	if (atomic_swap(&reclaim_poked, 1))
+		return;
+	rendez_wakeup(&reclaim_rv);
+}
+
+static int reclaim_was_poked(void *arg)
+{
+	return atomic_read(&reclaim_poked);
+}
+
+static int reclaim_pass_done(void *arg)
+{
+	unsigned long old_nr_passes = (unsigned long)arg;
+
+	return ACCESS_ONCE(reclaim_nr_passes) != old_nr_passes;
+}
+
+/* Called when a MEM_WAIT allocation is about to fail.  Waits for the reclaimer
+ * to make a pass, returning TRUE if it's worth trying again (i.e. the
+ * reclaimer freed something).  Returns FALSE if we can't wait, e.g. we are the
+ * reclaimer or it's too early in boot. */
+bool reclaim_wait(size_t amt)
+{
+	unsigned long nr_passes;
+
+	if (!reclaimer || current_kthread == reclaimer)
+		return FALSE;
+	if (!can_block(this_pcpui_ptr()))
+		return FALSE;
+	for (int i = 0; i < RECLAIM_WAIT_NR_TRIES; i++) {
+		nr_passes = ACCESS_ONCE(reclaim_nr_passes);
+		reclaim_poke();
+		rendez_sleep_timeout(&reclaim_done_rv, reclaim_pass_done,
+				     (void*)nr_passes, RECLAIM_WAIT_USEC);
+		if (!reclaim_pass_done((void*)nr_passes))
+			continue;
+		if (ACCESS_ONCE(reclaim_last_amt) ||
+		    arena_amt_free(base_arena) >= amt)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void reclaim_ktask(void *arg)
+{
+	size_t amt_free;
+
+	reclaimer = current_kthread;
+	while (1) {
+		rendez_sleep(&reclaim_rv, reclaim_was_poked, NULL);
+		amt_free = arena_amt_free(base_arena);
+		if (amt_free < reclaim_high_wmark)
+			reclaim_last_amt =
+				reclaim_memory(reclaim_high_wmark - amt_free);
+		else
+			reclaim_last_amt = 0;
+		reclaim_nr_passes++;
+		/* Clear after the pass, so pokes during the pass don't cause
+		 * another pass right away.  Any waiters will poke again. */
+		atomic_set(&reclaim_poked, 0);
+		rendez_wakeup(&reclaim_done_rv);
+	}
+}
+
+struct sized_alloc *reclaim_build_stats(void)
+{
+	struct sized_alloc *sza;
+	struct shrinker *s_i;
+	size_t alloc_amt = 200;
+
+	qlock(&shrinker_lock);
+	TAILQ_FOREACH(s_i, &shrinkers, link)
+		alloc_amt += 80;
+	sza = sized_kzmalloc(alloc_amt, MEM_WAIT);
+	sza_printf(sza, "Low watermark : %15llu\n", reclaim_low_wmark);
+	sza_printf(sza, "High watermark: %15llu\n", reclaim_high_wmark);
+	sza_printf(sza, "Nr passes     : %15llu\n", reclaim_nr_passes);
+	sza_printf(sza, "%-24s:%4s:%12s:%16s\n", "Shrinker", "Pri", "Nr calls",
+		   "Amt reclaimed");
+	TAILQ_FOREACH(s_i, &shrinkers, link)
+		sza_printf(sza, "%-24s:%4d:%12llu:%16llu\n", s_i->name,
+			   s_i->priority, s_i->nr_calls, s_i->amt_reclaimed);
+	qunlock(&shrinker_lock);
+	return sza;
+}
+
+static void __init reclaim_init(void)
+{
+	size_t total = arena_amt_total(base_arena);
+
+	rendez_init(&reclaim_rv);
+	rendez_init(&reclaim_done_rv);
+	reclaim_high_wmark = total >> RECLAIM_HIGH_WMARK_SHIFT;
+	ktask("reclaim", reclaim_ktask, NULL);
+	/* Once these are set, allocations will start poking. */
+	wmb();
+	reclaim_ready = TRUE;
+	reclaim_low_wmark = total >> RECLAIM_LOW_WMARK_SHIFT;
+}
+init_func_2(reclaim_init);
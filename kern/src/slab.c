@@ -70,7 +70,6 @@
  *   grab a pcc lock.
  *
  * TODO:
- * - Add reclaim function.
  * - When resizing, do we want to go through the depot and consolidate
  *   magazines?  (probably not a big deal.  maybe we'd deal with it when we
  *   clean up our excess mags.)
@@ -87,6 +86,8 @@
 #include <hash.h>
 #include <arena.h>
 #include <hashtable.h>
+#include <reclaim.h>
+#include <linker_func.h>
 
 #define SLAB_POISON ((void*)0xdead1111)
 
@@ -900,23 +901,82 @@ err_slab:
 	return FALSE;
 }
 
-/* This deallocs every slab from the empty list.  TODO: think a bit more about
- * this.  We can do things like not free all of the empty lists to prevent
- * thrashing.  See 3.4 in the paper. */
-void kmem_cache_reap(struct kmem_cache *cp)
+/* Gives the cache's unused memory back to its source.  The objects in the
+ * depot's magazines go back to their slabs, then we dealloc every slab from the
+ * empty list, as well as the depot's empty magazines.  The pcpu caches'
+ * magazines are left alone; they are the working set.  Returns the amount of
+ * memory freed to the source.
+ *
+ * TODO: think a bit more about this.  We can do things like not free all of the
+ * empty lists to prevent thrashing.  See 3.4 in the paper. */
+size_t kmem_cache_reap(struct kmem_cache *cp)
 {
-	struct kmem_slab *a_slab, *next;
+	struct kmem_depot *depot = &cp->depot;
+	struct kmem_slab_list empty = TAILQ_HEAD_INITIALIZER(empty);
+	struct kmem_mag_slist mags = SLIST_HEAD_INITIALIZER(mags);
+	struct kmem_magazine *mag;
+	struct kmem_slab *a_slab;
+	size_t amt = 0;
+
+	lock_depot(depot);
+	while ((mag = SLIST_FIRST(&depot->not_empty))) {
+		SLIST_REMOVE_HEAD(&depot->not_empty, link);
+		depot->nr_not_empty--;
+		drain_mag(cp, mag);
+		SLIST_INSERT_HEAD(&mags, mag, link);
+	}
+	while ((mag = SLIST_FIRST(&depot->empty))) {
+		SLIST_REMOVE_HEAD(&depot->empty, link);
+		depot->nr_empty--;
+		SLIST_INSERT_HEAD(&mags, mag, link);
+	}
+	unlock_depot(depot);
+	/* Freeing a magazine could recurse into this cache's depot (if we are
+	 * the magazine cache), so we do it unlocked. */
+	while ((mag = SLIST_FIRST(&mags))) {
+		SLIST_REMOVE_HEAD(&mags, link);
+		kmem_cache_free(kmem_magazine_cache, mag);
+	}
 
-	// Destroy all empty slabs.  Refer to the notes about the while loop
 	spin_lock_irqsave(&cp->cache_lock);
-	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
-	while (a_slab) {
-		next = TAILQ_NEXT(a_slab, link);
+	TAILQ_CONCAT(&empty, &cp->empty_slab_list, link);
+	spin_unlock_irqsave(&cp->cache_lock);
+	/* Similarly, destroying slabs frees to other caches and arenas. */
+	while ((a_slab = TAILQ_FIRST(&empty))) {
+		TAILQ_REMOVE(&empty, a_slab, link);
+		amt += __use_bufctls(cp) ? cp->import_amt : PGSIZE;
 		kmem_slab_destroy(cp, a_slab);
-		a_slab = next;
 	}
-	spin_unlock_irqsave(&cp->cache_lock);
+	return amt;
+}
+
+/* Shrinker for the regular slab caches.  Arena qcaches have their own. */
+static size_t kmem_cache_shrink(struct shrinker *s, size_t goal)
+{
+	struct kmem_cache *kc_i;
+	size_t amt = 0;
+
+	qlock(&arenas_and_slabs_lock);
+	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link) {
+		if (kc_i->flags & KMC_QCACHE)
+			continue;
+		amt += kmem_cache_reap(kc_i);
+	}
+	qunlock(&arenas_and_slabs_lock);
+	return amt;
+}
+
+static struct shrinker kmem_cache_shrinker = {
+	.name = "kmem_caches",
+	.priority = SHRINKER_PRIO_SLAB,
+	.shrink = kmem_cache_shrink,
+};
+
+static void __init kmem_cache_reclaim_init(void)
+{
+	register_shrinker(&kmem_cache_shrinker);
 }
+init_func_2(kmem_cache_reclaim_init);
 
 
 /* Tracing */
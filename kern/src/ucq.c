@@ -10,6 +10,9 @@
 #include <mm.h>
 #include <atomic.h>
 
+/* Most slots we claim at once in send_ucq_msgs() */
+#define UCQ_BULK_MAX 32
+
 /* Proc p needs to be current, and you should have checked that ucq is valid
  * memory.  We'll assert it here, to catch any of your bugs.  =) */
 void send_ucq_msg(struct ucq *ucq, struct proc *p, struct event_msg *msg)
@@ -131,6 +134,69 @@ error_addr:
 	 * to protect itself. */
 }
 
+/* Sends nr messages to the ucq, claiming a run of slots with one
+ * fetch_and_add instead of one per message.  The messages are written, then
+ * marked ready after a single wmb.  Any messages that don't fit on the current
+ * page go through send_ucq_msg(), which handles the overflow and new page, after
+ * which we can go back to bulk claims.
+ *
+ * We never claim more than UCQ_BULK_MAX at once, so that a few concurrent bulk
+ * producers can't run the counter in the page offset into the page address
+ * before someone sees the overflow. */
+void send_ucq_msgs(struct ucq *ucq, struct proc *p, struct event_msg *msgs,
+                   unsigned int nr)
+{
+	uintptr_t first_slot;
+	unsigned int nr_claim, nr_good;
+	struct msg_container *my_msgs;
+
+	assert(is_user_rwaddr(ucq, sizeof(struct ucq)));
+	if (!ucq->ucq_ready) {
+		if (__proc_is_mcp(p))
+			warn("proc %d is _M with an uninitialized ucq %p\n",
+			     p->pid, ucq);
+		return;
+	}
+	while (nr) {
+		if (nr == 1 || ucq->prod_overflow) {
+			send_ucq_msg(ucq, p, msgs);
+			msgs++;
+			nr--;
+			continue;
+		}
+		nr_claim = MIN(nr, UCQ_BULK_MAX);
+		first_slot = (uintptr_t)atomic_fetch_and_add(&ucq->prod_idx,
+							     nr_claim);
+		nr_good = 0;
+		if (slot_is_good(first_slot))
+			nr_good = MIN(nr_claim,
+				      NR_MSG_PER_PAGE - PGOFF(first_slot));
+		/* Some of our slots may be past the end of the page.  The
+		 * consumer skips those, just like the bad slots of single
+		 * producers. */
+		if (nr_good < nr_claim)
+			ucq->prod_overflow = TRUE;
+		if (!nr_good) {
+			/* Next loop goes through the locked path */
+			continue;
+		}
+		/* The good slots are contiguous, on one page */
+		my_msgs = slot2msg(first_slot);
+		if (!is_user_rwaddr(my_msgs,
+				    sizeof(struct msg_container) * nr_good)) {
+			warn("Invalid user address, not sending messages");
+			return;
+		}
+		for (int i = 0; i < nr_good; i++)
+			my_msgs[i].ev_msg = msgs[i];
+		wmb();
+		for (int i = 0; i < nr_good; i++)
+			my_msgs[i].ready = TRUE;
+		msgs += nr_good;
+		nr -= nr_good;
+	}
+}
+
 /* Debugging */
 #include <smp.h>
 #include <pmap.h>
@@ -0,0 +1,67 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Harness for the throughput benches in tests/: runs a few threads for a fixed
+ * time, each counting its own operations, and sums up the counts. */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+
+/* One per thread, on its own cache line so the counters don't bounce */
+struct bench_thread {
+	uint64_t			nr_ops;
+	uint64_t			end_tsc;
+	void				*arg;
+	pthread_t			pth;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static inline bool bench_thread_running(struct bench_thread *bt)
+{
+	return read_tsc() < bt->end_tsc;
+}
+
+/* Runs fn in nr_threads threads for secs seconds and returns the sum of their
+ * nr_ops.  fn gets its struct bench_thread, with arg in bt->arg, and should
+ * loop while bench_thread_running(bt).
+ *
+ * Benches driven from the outside pass a ctl, which the calling thread runs
+ * with the same nr_threads, end_tsc and arg before joining the threads. */
+static inline uint64_t bench_run_threads(int nr_threads, int secs,
+					 void *(*fn)(void *), void *arg,
+					 void (*ctl)(int nr_threads,
+						     uint64_t end_tsc,
+						     void *arg))
+{
+	struct bench_thread *bts;
+	uint64_t end_tsc = read_tsc() + sec2tsc(secs);
+	uint64_t total = 0;
+
+	if (posix_memalign((void**)&bts, ARCH_CL_SIZE,
+			   sizeof(struct bench_thread) * nr_threads)) {
+		perror("posix_memalign");
+		exit(-1);
+	}
+	memset(bts, 0, sizeof(struct bench_thread) * nr_threads);
+	for (int i = 0; i < nr_threads; i++) {
+		bts[i].end_tsc = end_tsc;
+		bts[i].arg = arg;
+		if (pthread_create(&bts[i].pth, NULL, fn, &bts[i])) {
+			perror("pthread_create");
+			exit(-1);
+		}
+	}
+	if (ctl)
+		ctl(nr_threads, end_tsc, arg);
+	for (int i = 0; i < nr_threads; i++) {
+		pthread_join(bts[i].pth, NULL);
+		total += bts[i].nr_ops;
+	}
+	free(bts);
+	return total;
+}
@@ -0,0 +1,144 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * connect_bench: TCP connect and accept rate over loopback.  An acceptor thread
+ * accepts and closes connections, while NR_THREADS clients connect and close in
+ * a loop.  NR_HELD connections are opened first and kept open for the whole
+ * run, to see how the rate holds up with many conversations around.
+ *
+ * Usage: connect_bench [NR_THREADS] [SECONDS] [NR_HELD] [PORT] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+
+static struct sockaddr_in srv;
+static volatile bool stop;
+static unsigned long nr_accepts;
+
+static int connect_one(void)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (fd < 0) {
+		perror("socket");
+		exit(-1);
+	}
+	if (connect(fd, (struct sockaddr*)&srv, sizeof(srv))) {
+		perror("connect");
+		exit(-1);
+	}
+	return fd;
+}
+
+static void *acceptor(void *arg)
+{
+	int lfd = (int)(long)arg;
+	int fd;
+
+	for (;;) {
+		fd = accept(lfd, NULL, NULL);
+		if (fd < 0) {
+			perror("accept");
+			exit(-1);
+		}
+		nr_accepts++;
+		close(fd);
+	}
+	return 0;
+}
+
+static void *client(void *arg)
+{
+	unsigned long *nr_connects = arg;
+
+	while (!stop) {
+		close(connect_one());
+		(*nr_connects)++;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int nr_threads = 4;
+	int secs = 5;
+	int nr_held = 0;
+	int port = 5555;
+	int lfd;
+	int *held;
+	pthread_t acc, *clients;
+	unsigned long *nr_connects, total = 0;
+	uint64_t t0, usecs;
+
+	if (argc > 1)
+		nr_threads = atoi(argv[1]);
+	if (argc > 2)
+		secs = atoi(argv[2]);
+	if (argc > 3)
+		nr_held = atoi(argv[3]);
+	if (argc > 4)
+		port = atoi(argv[4]);
+	printf("%d threads, %d secs, %d held conns, port %d\n", nr_threads,
+	       secs, nr_held, port);
+
+	srv.sin_family = AF_INET;
+	srv.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	srv.sin_port = htons(port);
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0) {
+		perror("socket");
+		exit(-1);
+	}
+	if (bind(lfd, (struct sockaddr*)&srv, sizeof(srv))) {
+		perror("bind");
+		exit(-1);
+	}
+	if (listen(lfd, 128)) {
+		perror("listen");
+		exit(-1);
+	}
+	if (pthread_create(&acc, NULL, acceptor, (void*)(long)lfd)) {
+		perror("pthread_create");
+		exit(-1);
+	}
+
+	held = malloc(sizeof(int) * nr_held);
+	t0 = read_tsc();
+	for (int i = 0; i < nr_held; i++)
+		held[i] = connect_one();
+	if (nr_held)
+		printf("held: %10lu connects/sec\n", (uint64_t)nr_held *
+		       1000000 / MAX(tsc2usec(read_tsc() - t0), 1));
+
+	clients = malloc(sizeof(pthread_t) * nr_threads);
+	nr_connects = calloc(nr_threads, sizeof(unsigned long));
+	t0 = read_tsc();
+	for (int i = 0; i < nr_threads; i++) {
+		if (pthread_create(&clients[i], NULL, client,
+				   &nr_connects[i])) {
+			perror("pthread_create");
+			exit(-1);
+		}
+	}
+	sleep(secs);
+	stop = TRUE;
+	for (int i = 0; i < nr_threads; i++) {
+		pthread_join(clients[i], NULL);
+		total += nr_connects[i];
+	}
+	usecs = MAX(tsc2usec(read_tsc() - t0), 1);
+	printf("loop: %10lu connects/sec, %lu accepts total\n",
+	       total * 1000000 / usecs, nr_accepts);
+
+	for (int i = 0; i < nr_held; i++)
+		close(held[i]);
+	return 0;
+}
@@ -0,0 +1,78 @@
+/* Copyright (c) 2026 Google Inc.
+ * See LICENSE for details.
+ *
+ * fork_bench: measures fork() latency as the parent's resident memory grows.
+ * With CoW fork, the cost should track the page tables, not the RSS.  Also
+ * checks that the child and parent don't see each other's writes.
+ *
+ * Usage: fork_bench [MAX_MB] [NR_LOOPS] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+
+static uint64_t fork_once(char *buf, size_t len)
+{
+	uint64_t start, end;
+	int status;
+	pid_t pid;
+
+	start = read_tsc();
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(-1);
+	}
+	if (!pid) {
+		/* Touch one byte per page: each write should unshare a page */
+		for (size_t i = 0; i < len; i += PGSIZE)
+			buf[i] = 'c';
+		exit(0);
+	}
+	end = read_tsc();
+	waitpid(pid, &status, 0);
+	for (size_t i = 0; i < len; i += PGSIZE) {
+		if (buf[i] != 'p') {
+			printf("Parent saw the child's write at offset %lu!\n",
+			       i);
+			exit(-1);
+		}
+	}
+	return end - start;
+}
+
+int main(int argc, char **argv)
+{
+	size_t max_mb = 256;
+	int nr_loops = 10;
+	uint64_t total;
+	size_t len;
+	char *buf;
+
+	if (argc > 1)
+		max_mb = strtoul(argv[1], 0, 10);
+	if (argc > 2)
+		nr_loops = atoi(argv[2]);
+	printf("%10s %16s\n", "RSS (MB)", "fork (usec)");
+	for (size_t mb = 1; mb <= max_mb; mb *= 2) {
+		len = mb << 20;
+		buf = mmap(0, len, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+		if (buf == MAP_FAILED) {
+			perror("mmap");
+			exit(-1);
+		}
+		memset(buf, 'p', len);
+		total = 0;
+		for (int i = 0; i < nr_loops; i++)
+			total += fork_once(buf, len);
+		printf("%10lu %16lu\n", mb, tsc2usec(total / nr_loops));
+		munmap(buf, len);
+	}
+	return 0;
+}
@@ -0,0 +1,193 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * futex_bench: measures futex wait/wake throughput with a Drepper-style futex
+ * mutex and condvar, like the ones in glibc or a C++ runtime.  Runs with 1, 2,
+ * 4, ... NR_VCORES threads:
+ * - mutex: every thread does lock/unlock on one contended mutex.
+ * - bcast: one thread broadcasts a condvar to the others, waiting for all of
+ *   them to wake up before the next broadcast.  Once with FUTEX_WAKE of all
+ *   waiters, and once with FUTEX_CMP_REQUEUE of the waiters onto the mutex.
+ *
+ * Usage: futex_bench [NR_VCORES] [SECONDS] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <futex.h>
+#include <parlib/parlib.h>
+#include <parlib/vcore.h>
+#include "bench_threads.h"
+
+/* 0: unlocked, 1: locked, 2: locked with (possible) waiters */
+struct fmutex {
+	int val;
+};
+
+struct fcond {
+	int seq;
+};
+
+static void fmutex_lock(struct fmutex *m)
+{
+	int c = __sync_val_compare_and_swap(&m->val, 0, 1);
+
+	if (!c)
+		return;
+	if (c != 2)
+		c = __sync_lock_test_and_set(&m->val, 2);
+	while (c) {
+		futex(&m->val, FUTEX_WAIT, 2, NULL, NULL, 0);
+		c = __sync_lock_test_and_set(&m->val, 2);
+	}
+}
+
+static void fmutex_unlock(struct fmutex *m)
+{
+	if (__sync_fetch_and_sub(&m->val, 1) != 1) {
+		m->val = 0;
+		futex(&m->val, FUTEX_WAKE, 1, NULL, NULL, 0);
+	}
+}
+
+static void fcond_wait(struct fcond *c, struct fmutex *m)
+{
+	int seq = ACCESS_ONCE(c->seq);
+
+	fmutex_unlock(m);
+	futex(&c->seq, FUTEX_WAIT, seq, NULL, NULL, 0);
+	/* We might have been requeued onto the mutex, so we must leave it
+	 * marked as contended. */
+	while (__sync_lock_test_and_set(&m->val, 2))
+		futex(&m->val, FUTEX_WAIT, 2, NULL, NULL, 0);
+}
+
+/* Caller holds m */
+static void fcond_broadcast(struct fcond *c, struct fmutex *m, bool requeue)
+{
+	int seq = __sync_add_and_fetch(&c->seq, 1);
+
+	if (!requeue) {
+		futex(&c->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+		return;
+	}
+	/* Waiters moved to the mutex need the unlocker to wake them */
+	m->val = 2;
+	while (futex(&c->seq, FUTEX_CMP_REQUEUE, 1, (void*)(long)INT_MAX,
+		     &m->val, seq) < 0 && errno == EAGAIN)
+		seq = ACCESS_ONCE(c->seq);
+}
+
+static struct fmutex mtx;
+static struct fcond cond;
+static int gen;
+static int nr_acks;
+static bool stop;
+
+static void *mutex_thread(void *arg)
+{
+	struct bench_thread *bt = arg;
+	static int counter;
+
+	while (bench_thread_running(bt)) {
+		fmutex_lock(&mtx);
+		counter++;
+		fmutex_unlock(&mtx);
+		bt->nr_ops++;
+	}
+	return 0;
+}
+
+static void *bcast_waiter(void *arg)
+{
+	int my_gen;
+
+	fmutex_lock(&mtx);
+	while (!stop) {
+		my_gen = gen;
+		nr_acks++;
+		while (gen == my_gen)
+			fcond_wait(&cond, &mtx);
+	}
+	fmutex_unlock(&mtx);
+	return 0;
+}
+
+/* Runs in the calling thread while the waiters wait.  arg says whether to
+ * requeue. */
+static void bcast_driver(int nr_threads, uint64_t end_tsc, void *arg)
+{
+	bool requeue = (bool)(long)arg;
+	uint64_t nr_bcasts = 0;
+	uint64_t t0 = read_tsc();
+
+	while (1) {
+		/* Yield, in case the waiters share our vcore */
+		while (ACCESS_ONCE(nr_acks) != nr_threads)
+			pthread_yield();
+		fmutex_lock(&mtx);
+		nr_acks = 0;
+		gen++;
+		if (read_tsc() >= end_tsc)
+			stop = TRUE;
+		fcond_broadcast(&cond, &mtx, requeue);
+		fmutex_unlock(&mtx);
+		if (stop)
+			break;
+		nr_bcasts++;
+	}
+	printf("\t%3d waiters: %10lu bcasts/sec (%s)\n", nr_threads,
+	       nr_bcasts * 1000000 / tsc2usec(read_tsc() - t0),
+	       requeue ? "requeue" : "wake all");
+}
+
+static void run_mutex(int nr_threads, int secs)
+{
+	uint64_t total;
+
+	total = bench_run_threads(nr_threads, secs, mutex_thread, NULL, NULL);
+	printf("\t%3d threads: %10lu lock/unlocks/sec\n", nr_threads,
+	       total / secs);
+}
+
+static void run_bcast(int nr_threads, int secs, bool requeue)
+{
+	stop = FALSE;
+	nr_acks = 0;
+	bench_run_threads(nr_threads, secs, bcast_waiter, (void*)(long)requeue,
+			  bcast_driver);
+}
+
+int main(int argc, char **argv)
+{
+	int nr_vcores = 1;
+	int secs = 2;
+
+	if (argc > 1)
+		nr_vcores = atoi(argv[1]);
+	if (argc > 2)
+		secs = atoi(argv[2]);
+	if (nr_vcores > max_vcores()) {
+		printf("Asked for %d vcores, but only %d are available\n",
+		       nr_vcores, max_vcores());
+		nr_vcores = max_vcores();
+	}
+	printf("futex bench, %d vcores, %d sec per test\n", nr_vcores, secs);
+	if (nr_vcores > 1) {
+		parlib_never_yield = TRUE;
+		pthread_mcp_init();
+		vcore_request_total(nr_vcores);
+		parlib_never_vc_request = TRUE;
+	}
+	printf("Contended mutex:\n");
+	for (int i = 1; i <= nr_vcores; i *= 2)
+		run_mutex(i, secs);
+	printf("Condvar broadcast:\n");
+	for (int i = 1; i <= nr_vcores; i *= 2) {
+		run_bcast(i, secs, FALSE);
+		run_bcast(i, secs, TRUE);
+	}
+	return 0;
+}
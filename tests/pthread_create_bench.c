@@ -0,0 +1,76 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * pthread_create_bench: measures thread churn.  NR_CREATORS threads each
+ * create and join short-lived threads for SECONDS, with the stacks' cold pages
+ * kept and then trimmed when they are recycled.
+ *
+ * Usage: pthread_create_bench [NR_CREATORS] [SECONDS] [NR_VCORES] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <parlib/parlib.h>
+#include <parlib/vcore.h>
+#include "bench_threads.h"
+
+static void *child(void *arg)
+{
+	/* Touch a few pages of stack, like a thread that does some work. */
+	volatile char buf[4 * PGSIZE];
+
+	for (int i = 0; i < sizeof(buf); i += PGSIZE)
+		buf[i] = i;
+	return arg;
+}
+
+static void *creator(void *arg)
+{
+	struct bench_thread *bt = arg;
+	pthread_t th;
+
+	while (bench_thread_running(bt)) {
+		if (pthread_create(&th, NULL, child, NULL)) {
+			perror("pthread_create");
+			exit(-1);
+		}
+		pthread_join(th, NULL);
+		bt->nr_ops++;
+	}
+	return 0;
+}
+
+static void run(int nr_creators, int secs, bool trim)
+{
+	uint64_t total;
+
+	pthread_trim_cached_stacks(trim);
+	total = bench_run_threads(nr_creators, secs, creator, NULL, NULL);
+	printf("%s: %10lu create/joins/sec\n", trim ? "trimmed" : "cached ",
+	       total / secs);
+}
+
+int main(int argc, char **argv)
+{
+	int nr_creators = 1;
+	int secs = 5;
+	int nr_vcores = 0;
+
+	if (argc > 1)
+		nr_creators = atoi(argv[1]);
+	if (argc > 2)
+		secs = atoi(argv[2]);
+	if (argc > 3)
+		nr_vcores = atoi(argv[3]);
+	printf("%d creators, %d sec per test, %d vcores\n", nr_creators, secs,
+	       nr_vcores);
+	if (nr_vcores) {
+		parlib_never_yield = TRUE;
+		pthread_mcp_init();
+		vcore_request_total(nr_vcores);
+		parlib_never_vc_request = TRUE;
+	}
+	run(nr_creators, secs, FALSE);
+	run(nr_creators, secs, TRUE);
+	return 0;
+}
@@ -0,0 +1,66 @@
+/* Copyright (c) 2026 Google Inc.
+ * See LICENSE for details.
+ *
+ * random_bench: measures #random throughput, with NR_THREADS threads reading
+ * 16 bytes at a time (e.g. TLS nonces) and then 1MB at a time.  With per-core
+ * generators, the small reads should scale with the number of threads.
+ *
+ * Usage: random_bench [NR_THREADS] [SECONDS] [FILE] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "bench_threads.h"
+
+static const char *path = "/dev/urandom";
+static size_t read_sz;
+
+static void *reader(void *arg)
+{
+	struct bench_thread *bt = arg;
+	uint8_t *buf = malloc(read_sz);
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0 || !buf) {
+		perror("reader setup");
+		exit(-1);
+	}
+	while (bench_thread_running(bt)) {
+		if (read(fd, buf, read_sz) != read_sz) {
+			perror("read");
+			exit(-1);
+		}
+		bt->nr_ops++;
+	}
+	close(fd);
+	free(buf);
+	return 0;
+}
+
+static void run(int nr_threads, int secs, size_t sz)
+{
+	uint64_t total;
+
+	read_sz = sz;
+	total = bench_run_threads(nr_threads, secs, reader, NULL, NULL);
+	printf("%8lu byte reads: %12lu reads/sec %10lu MB/sec\n", sz,
+	       total / secs, total * sz / secs / (1024 * 1024));
+}
+
+int main(int argc, char **argv)
+{
+	int nr_threads = 1;
+	int secs = 5;
+
+	if (argc > 1)
+		nr_threads = atoi(argv[1]);
+	if (argc > 2)
+		secs = atoi(argv[2]);
+	if (argc > 3)
+		path = argv[3];
+	printf("%s, %d threads, %d sec per test\n", path, nr_threads, secs);
+	run(nr_threads, secs, 16);
+	run(nr_threads, secs, 1 << 20);
+	return 0;
+}
@@ -0,0 +1,154 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * task_bench: request/response over pipes, with the server side as stackless
+ * tasks and then as pthreads.  Each of NR_CONNS connections has a request pipe
+ * and a response pipe.  Every round, the client writes a byte to each request
+ * pipe and reads each response.  A server handler reads a request and writes
+ * it back.
+ *
+ * Usage: task_bench [NR_CONNS] [NR_ROUNDS] [NR_VCORES] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <parlib/parlib.h>
+#include <parlib/vcore.h>
+#include <parlib/uthread.h>
+#include <parlib/timing.h>
+#include <parlib/task.h>
+
+enum {
+	CONN_READ,
+	CONN_WRITE,
+};
+
+struct conn {
+	struct task			task;
+	int				req[2];
+	int				resp[2];
+	int				state;
+	char				buf;
+};
+
+static struct conn *conns;
+static int nr_conns;
+static uth_semaphore_t servers_done;
+
+static void conn_task(struct task *task)
+{
+	struct conn *c = task->arg;
+
+	for (;;) {
+		switch (c->state) {
+		case CONN_READ:
+			c->state = CONN_WRITE;
+			syscall_async(&task->sysc, SYS_read, c->req[0],
+				      &c->buf, 1);
+			if (task_await_sysc(task, conn_task))
+				return;
+			break;
+		case CONN_WRITE:
+			if (task->sysc.retval != 1 || c->buf == 'q') {
+				uth_semaphore_up(&servers_done);
+				return;
+			}
+			c->state = CONN_READ;
+			syscall_async(&task->sysc, SYS_write, c->resp[1],
+				      &c->buf, 1);
+			if (task_await_sysc(task, conn_task))
+				return;
+			break;
+		}
+	}
+}
+
+static void *conn_thread(void *arg)
+{
+	struct conn *c = arg;
+
+	while (read(c->req[0], &c->buf, 1) == 1 && c->buf != 'q')
+		write(c->resp[1], &c->buf, 1);
+	uth_semaphore_up(&servers_done);
+	return 0;
+}
+
+static void run_client(const char *name, int nr_rounds)
+{
+	uint64_t t0 = read_tsc();
+	char buf = 'x';
+
+	for (int r = 0; r < nr_rounds; r++) {
+		for (int i = 0; i < nr_conns; i++)
+			write(conns[i].req[1], &buf, 1);
+		for (int i = 0; i < nr_conns; i++)
+			read(conns[i].resp[0], &buf, 1);
+	}
+	printf("%s: %10lu requests/sec\n", name,
+	       (uint64_t)nr_rounds * nr_conns * 1000000 /
+	       tsc2usec(read_tsc() - t0));
+	buf = 'q';
+	for (int i = 0; i < nr_conns; i++)
+		write(conns[i].req[1], &buf, 1);
+	for (int i = 0; i < nr_conns; i++)
+		uth_semaphore_down(&servers_done);
+}
+
+static void run(int nr_rounds, bool tasks)
+{
+	pthread_t *threads = malloc(sizeof(pthread_t) * nr_conns);
+
+	for (int i = 0; i < nr_conns; i++) {
+		if (tasks) {
+			conns[i].state = CONN_READ;
+			task_init(&conns[i].task, conn_task, &conns[i]);
+			task_run(&conns[i].task);
+		} else {
+			if (pthread_create(&threads[i], NULL, conn_thread,
+					   &conns[i])) {
+				perror("pthread_create");
+				exit(-1);
+			}
+		}
+	}
+	run_client(tasks ? "tasks   " : "pthreads", nr_rounds);
+	if (!tasks) {
+		for (int i = 0; i < nr_conns; i++)
+			pthread_join(threads[i], NULL);
+	}
+	free(threads);
+}
+
+int main(int argc, char **argv)
+{
+	int nr_rounds = 10000;
+	int nr_vcores = 0;
+
+	nr_conns = 64;
+	if (argc > 1)
+		nr_conns = atoi(argv[1]);
+	if (argc > 2)
+		nr_rounds = atoi(argv[2]);
+	if (argc > 3)
+		nr_vcores = atoi(argv[3]);
+	printf("%d conns, %d rounds, %d vcores\n", nr_conns, nr_rounds,
+	       nr_vcores);
+	conns = calloc(nr_conns, sizeof(struct conn));
+	for (int i = 0; i < nr_conns; i++) {
+		if (pipe(conns[i].req) || pipe(conns[i].resp)) {
+			perror("pipe");
+			exit(-1);
+		}
+	}
+	uth_semaphore_init(&servers_done, 0);
+	if (nr_vcores) {
+		parlib_never_yield = TRUE;
+		pthread_mcp_init();
+		vcore_request_total(nr_vcores);
+		parlib_never_vc_request = TRUE;
+	}
+	run(nr_rounds, TRUE);
+	run(nr_rounds, FALSE);
+	return 0;
+}
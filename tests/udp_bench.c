@@ -0,0 +1,228 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * udp_bench: UDP datagram rate over loopback, three ways: one datagram per
+ * write, BATCH records per write with "batch" on, and one write of BATCH
+ * datagrams split by the kernel with "segment" on the sender and "gro" on the
+ * receiver.  A receiver thread reads with headers on, in batches for the last
+ * two, and counts what it gets.  Datagrams the receiver can't keep up with are
+ * dropped, as usual for UDP.
+ *
+ * Usage: udp_bench [NR_DGRAMS] [SIZE] [BATCH] [PORT] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+#include <iplib/iplib.h>
+
+enum {
+	MODE_SINGLE,
+	MODE_BATCH,
+	MODE_GSO,
+};
+
+enum {
+	UDP_HDR_SZ = 52,	/* "headers" Udphdr */
+	REC_HDR_SZ = 4,		/* len[2] segsize[2] */
+	BUF_SZ = 64 * 1024 + 512,
+};
+
+static const char *mode_names[] = {"single", "batch ", "gso   "};
+
+struct rx {
+	int				fd;
+	int				mode;
+	unsigned long			nr;
+	uint64_t			last_tsc;
+	volatile bool			done;
+};
+
+static void ctl(int cfd, const char *msg)
+{
+	if (write(cfd, msg, strlen(msg)) < 0) {
+		perror(msg);
+		exit(-1);
+	}
+}
+
+/* Counts the datagrams of a record.  Returns TRUE on the quit datagram. */
+static bool rx_count(struct rx *rx, uint8_t *data, unsigned int dlen,
+		     unsigned int segsize)
+{
+	if (!segsize)
+		segsize = dlen;
+	for (unsigned int off = 0; off < dlen; off += segsize) {
+		if (data[off] == 'q')
+			return TRUE;
+		rx->nr++;
+	}
+	rx->last_tsc = read_tsc();
+	return FALSE;
+}
+
+static void *receiver(void *arg)
+{
+	struct rx *rx = arg;
+	uint8_t *buf = malloc(BUF_SZ);
+	uint8_t *p, *end;
+	unsigned int len;
+	ssize_t n;
+
+	for (;;) {
+		n = read(rx->fd, buf, BUF_SZ);
+		if (n <= 0) {
+			perror("read");
+			exit(-1);
+		}
+		if (rx->mode == MODE_SINGLE) {
+			if (rx_count(rx, buf + UDP_HDR_SZ, n - UDP_HDR_SZ, 0))
+				break;
+			continue;
+		}
+		end = buf + n;
+		for (p = buf; p + REC_HDR_SZ <= end; p += REC_HDR_SZ + len) {
+			len = p[0] << 8 | p[1];
+			if (rx_count(rx, p + REC_HDR_SZ + UDP_HDR_SZ,
+				     len - UDP_HDR_SZ, p[2] << 8 | p[3]))
+				goto out;
+		}
+	}
+out:
+	free(buf);
+	rx->done = TRUE;
+	return 0;
+}
+
+/* Fills buf with what one write sends in mode: nr datagrams of size bytes,
+ * each starting with c.  Returns the length of the write. */
+static size_t fill(uint8_t *buf, int mode, int size, int nr, char c)
+{
+	uint8_t *p = buf;
+
+	for (int i = 0; i < nr; i++) {
+		if (mode == MODE_BATCH) {
+			p[0] = size >> 8;
+			p[1] = size;
+			p[2] = p[3] = 0;
+			p += REC_HDR_SZ;
+		}
+		memset(p, 'd', size);
+		*p = c;
+		p += size;
+	}
+	return p - buf;
+}
+
+static void run(int mode, int port, unsigned long nr_dgrams, int size,
+		int batch)
+{
+	char addr[64], adir[40], path[64], msg[32];
+	int acfd, txfd, txcfd;
+	struct rx rx = {.mode = mode};
+	pthread_t rx_thread;
+	uint8_t *buf = malloc(BUF_SZ);
+	uint8_t *qbuf = malloc(BUF_SZ);
+	size_t buflen, qlen;
+	unsigned long sent = 0;
+	int per_write = mode == MODE_SINGLE ? 1 : batch;
+	uint64_t t0, tx_usecs, rx_usecs;
+
+	snprintf(addr, sizeof(addr), "udp!*!%d", port);
+	acfd = announce9(addr, adir, 0);
+	if (acfd < 0) {
+		perror("announce9");
+		exit(-1);
+	}
+	ctl(acfd, "headers");
+	if (mode == MODE_BATCH)
+		ctl(acfd, "batch");
+	else if (mode == MODE_GSO)
+		ctl(acfd, "gro");
+	snprintf(path, sizeof(path), "%s/data", adir);
+	rx.fd = open(path, O_RDWR);
+	if (rx.fd < 0) {
+		perror(path);
+		exit(-1);
+	}
+	snprintf(addr, sizeof(addr), "udp!127.0.0.1!%d", port);
+	txfd = dial9(addr, 0, 0, &txcfd, 0);
+	if (txfd < 0) {
+		perror("dial9");
+		exit(-1);
+	}
+	if (mode == MODE_BATCH) {
+		ctl(txcfd, "batch");
+	} else if (mode == MODE_GSO) {
+		snprintf(msg, sizeof(msg), "segment %d", size);
+		ctl(txcfd, msg);
+	}
+	if (pthread_create(&rx_thread, NULL, receiver, &rx)) {
+		perror("pthread_create");
+		exit(-1);
+	}
+
+	buflen = fill(buf, mode, size, per_write, 'd');
+	qlen = fill(qbuf, mode, size, 1, 'q');
+	t0 = read_tsc();
+	while (sent < nr_dgrams) {
+		if (write(txfd, buf, buflen) != (ssize_t)buflen) {
+			perror("write");
+			exit(-1);
+		}
+		sent += per_write;
+	}
+	tx_usecs = MAX(tsc2usec(read_tsc() - t0), 1);
+	/* The quit datagram can be dropped too */
+	while (!rx.done) {
+		write(txfd, qbuf, qlen);
+		usleep(10000);
+	}
+	pthread_join(rx_thread, NULL);
+	rx_usecs = rx.last_tsc > t0 ? MAX(tsc2usec(rx.last_tsc - t0), 1) : 1;
+	printf("%s: %10lu sent/sec, %10lu received/sec, %lu of %lu received\n",
+	       mode_names[mode], sent * 1000000 / tx_usecs,
+	       rx.nr * 1000000 / rx_usecs, rx.nr, sent);
+
+	close(txfd);
+	close(txcfd);
+	close(rx.fd);
+	close(acfd);
+	free(buf);
+	free(qbuf);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long nr_dgrams = 1000000;
+	int size = 1200;
+	int batch = 32;
+	int port = 5555;
+
+	if (argc > 1)
+		nr_dgrams = atol(argv[1]);
+	if (argc > 2)
+		size = atoi(argv[2]);
+	if (argc > 3)
+		batch = atoi(argv[3]);
+	if (argc > 4)
+		port = atoi(argv[4]);
+	if (size < 1 || size > 65000 || batch < 1) {
+		fprintf(stderr, "bad size %d or batch %d\n", size, batch);
+		exit(-1);
+	}
+	/* A batch has to fit in one 64K write */
+	batch = MIN(batch, 64 * 1024 / (size + REC_HDR_SZ));
+	batch = MAX(batch, 1);
+	printf("%lu datagrams, %d bytes, batches of %d, port %d\n", nr_dgrams,
+	       size, batch, port);
+
+	run(MODE_SINGLE, port, nr_dgrams, size, batch);
+	run(MODE_BATCH, port + 1, nr_dgrams, size, batch);
+	run(MODE_GSO, port + 2, nr_dgrams, size, batch);
+	return 0;
+}
@@ -23,6 +23,7 @@
 #include <vmm/linux_bootparam.h>
 #include <getopt.h>
 #include <parlib/alarm.h>
+#include <parlib/timing.h>
 
 #include <vmm/virtio.h>
 #include <vmm/virtio_blk.h>
@@ -52,6 +53,11 @@ void vapic_status_dump(FILE *f, void *vapic);
 #define BITOP_ADDR(x) "+m" (*(volatile long *) (x))
 #endif
 
+/* Interrupt moderation for the vqs that complete guest requests.  Queues that
+ * block on host input (console and net rx) signal every buffer. */
+#define VQ_IRQ_COALESCE_COUNT 16
+#define VQ_IRQ_COALESCE_USEC 50
+
 static void virtio_poke_guest(uint8_t vec, uint32_t dest)
 {
 	if (dest < vm->nr_gpcs) {
@@ -130,7 +136,9 @@ static struct virtio_vq_dev net_vqdev = {
 			.name = "net_transmitq",
 			.qnum_max = 64,
 			.srv_fn = net_transmitq_fn,
-			.vqdev = &net_vqdev
+			.vqdev = &net_vqdev,
+			.irq_coalesce_count = VQ_IRQ_COALESCE_COUNT,
+			.irq_coalesce_usec = VQ_IRQ_COALESCE_USEC
 		},
 	}
 };
@@ -160,7 +168,9 @@ static struct virtio_vq_dev blk_vqdev = {
 			.name = "blk_request",
 			.qnum_max = 64,
 			.srv_fn = blk_request,
-			.vqdev = &blk_vqdev
+			.vqdev = &blk_vqdev,
+			.irq_coalesce_count = VQ_IRQ_COALESCE_COUNT,
+			.irq_coalesce_usec = VQ_IRQ_COALESCE_USEC
 		},
 	}
 };
@@ -385,6 +395,7 @@ int main(int argc, char **argv)
 	void *a = (void *)0xe0000;
 	int vmmflags = 0;
 	uint64_t entry = 0;
+	uint64_t mem_tsc;
 	int ret;
 	struct vm_trapframe *vm_tf;
 	char *cmdlinep;
@@ -559,7 +570,11 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	mem_tsc = read_tsc();
 	mmap_memory(vm, memstart, memsize);
+	if (debug)
+		fprintf(stderr, "Populated %llu MB of guest memory in %lu usec\n",
+			memsize >> 20, tsc2usec(read_tsc() - mem_tsc));
 
 	entry = load_elf(argv[0], 0, &kernel_max_address, NULL);
 	if (entry == 0) {
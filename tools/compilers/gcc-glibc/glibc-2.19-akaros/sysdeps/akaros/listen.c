@@ -45,6 +45,11 @@ int __listen(int fd, int backlog)
 	switch (r->domain) {
 	case PF_INET:
 		lip = (struct sockaddr_in *)&r->addr;
+		if (backlog > 0) {
+			snprintf(msg, sizeof msg, "backlog %d", backlog);
+			/* older kernels don't know it; not fatal */
+			write(r->ctl_fd, msg, strlen(msg));
+		}
 		if (lip->sin_port >= 0) {
 			if (write(r->ctl_fd, "bind 0", 6) < 0) {
 				errno = EINVAL;	//EGREG;
@@ -3,6 +3,7 @@
  * See LICENSE for details. */
 
 #include <errno.h>
+#include <unistd.h>
 #include <sys/socket.h>
 
 #include <sys/plan9_helpers.h>
@@ -10,6 +11,17 @@
 static int sol_socket_sso(Rock *r, int optname, void *optval, socklen_t optlen)
 {
 	switch (optname) {
+	case (SO_REUSEPORT):
+		if (optlen < sizeof(int)) {
+			__set_errno(EINVAL);
+			return -1;
+		}
+		/* The kernel can't turn it back off */
+		if (!*(int*)optval)
+			break;
+		if (write(r->ctl_fd, "reuseport", 9) < 0)
+			return -1;
+		break;
 	#if 0
 	/* We don't support setting any options yet */
 	case (SO_FOO):
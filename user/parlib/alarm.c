@@ -8,15 +8,18 @@
  * of the kernel alarms.  Under the hood, the user alarm uses the #alarm service
  * for the root of the alarm chain.
  *
- * There's only one timer chain, unlike in the kernel, for the entire process.
- * If you want one-off timers unrelated to the chain (and sent to other vcores),
- * use #alarm directly.
+ * Like the kernel, there is a timer chain per vcore, once we're an MCP.  Before
+ * then, there is one global chain.  Each chain has its own #alarm, and is a
+ * hashed timing wheel instead of a sorted list.  If you want one-off timers
+ * unrelated to the chains (and sent to other vcores), use #alarm directly.
  *
- * Your handlers will run from vcore context.
+ * Your handlers will run from vcore context, usually on the vcore that set the
+ * alarm.  If that vcore is offline when the alarm goes off, whichever vcore
+ * gets the event runs the handlers and takes over the rest of the chain.
  *
  * Code differences from the kernel (for future porting):
- * - init_alarm_service, run as a constructor
- * - set_alarm() and friends are __tc_set_alarm(), passing global_tchain.
+ * - init_alarm_service, run as a constructor, and alarm_mcp_init()
+ * - set_alarm() and friends are __tc_set_alarm(), passing our vcore's tchain.
  * - reset_tchain_interrupt() uses #alarm
  * - spinlocks -> spin_pdr_locks (cv's lock, actually)
  * - ev_q wrappers for converting #alarm events to __triggers
@@ -108,31 +111,60 @@ int devalarm_disable(int timerfd)
 /* Helpers, basically renamed kernel interfaces, with the *tchain. */
 static void __tc_set_alarm(struct timer_chain *tchain,
                            struct alarm_waiter *waiter);
-static bool __tc_unset_alarm(struct timer_chain *tchain,
-                             struct alarm_waiter *waiter);
+static bool __tc_unset_alarm(struct alarm_waiter *waiter);
 static bool __tc_reset_alarm_abs(struct timer_chain *tchain,
                                  struct alarm_waiter *waiter,
                                  uint64_t abs_time);
 static void handle_user_alarm(struct event_msg *ev_msg, unsigned int ev_type,
                               void *data);
 
-/* One chain to rule them all. */
+/* The chain for SCPs, and for anyone before we're an MCP. */
 struct timer_chain global_tchain;
 
-/* Helper, resets the earliest/latest times, based on the elements of the list.
- * If the list is empty, we set the times to be the 12345 poison time.  Since
- * the list is empty, the alarm shouldn't be going off. */
-static void reset_tchain_times(struct timer_chain *tchain)
-{
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		tchain->earliest_time = ALARM_POISON_TIME;
-		tchain->latest_time = ALARM_POISON_TIME;
-	} else {
-		tchain->earliest_time =
-		    TAILQ_FIRST(&tchain->waiters)->wake_up_time;
-		tchain->latest_time =
-		    TAILQ_LAST(&tchain->waiters, awaiters_tailq)->wake_up_time;
-	}
+/* Per-vcore chains, set up once we're an MCP.  NULL until they all exist. */
+static struct timer_chain **vc_tchains;
+
+/* Each tchain is a hashed timing wheel.  A waiter goes in the slot for its
+ * tick, regardless of how many laps ahead it is, and each slot is unsorted.
+ * Inserts and removals are O(1); only the alarm handler walks the wheel.
+ *
+ * A waiter's tick is never less than the chain's cur_tick, so that waiters set
+ * for the past are still in the slots the next trigger looks at. */
+#define TCHAIN_TICK_SHIFT 20	/* ~1M TSC cycles per tick */
+
+static uint64_t __tsc_to_tick(uint64_t tsc)
+{
+	return tsc >> TCHAIN_TICK_SHIFT;
+}
+
+static struct awaiters_tailq *__tchain_slot(struct timer_chain *tchain,
+                                            uint64_t tick)
+{
+	return &tchain->wheel[tick % TCHAIN_WHEEL_SLOTS];
+}
+
+static void tchain_init(struct timer_chain *tchain)
+{
+	for (int i = 0; i < TCHAIN_WHEEL_SLOTS; i++)
+		TAILQ_INIT(&tchain->wheel[i]);
+	tchain->nr_waiters = 0;
+	tchain->cur_tick = __tsc_to_tick(read_tsc());
+	tchain->earliest_time = ALARM_POISON_TIME;
+	tchain->running = NULL;
+	uth_cond_var_init(&tchain->cv);
+}
+
+/* Gets the tchain its own #alarm, whose events go to ev_q. */
+static int tchain_get_devalarm(struct timer_chain *tchain,
+                               struct event_queue *ev_q)
+{
+	if (devalarm_get_fds(&tchain->ctlfd, &tchain->timerfd,
+			     &tchain->alarmid))
+		return -1;
+	if (devalarm_set_evq(tchain->timerfd, ev_q, tchain->alarmid))
+		return -1;
+	tchain->ev_q = ev_q;	/* mostly for debugging */
+	return 0;
 }
 
 static void devalarm_forked(void)
@@ -142,29 +174,22 @@ static void devalarm_forked(void)
 	if (devalarm_get_fds(&global_tchain.ctlfd, &global_tchain.timerfd,
 			     NULL))
 		perror("Useralarm on fork");
+	/* The child starts as an SCP; it'll use the global chain. */
+	vc_tchains = NULL;
 }
 
 static void __attribute__((constructor)) alarm_service_ctor(void)
 {
-	int ctlfd, timerfd, alarmid;
 	struct event_queue *ev_q;
 	static struct fork_cb devalarm_fork_cb = {.func = devalarm_forked};
 
 	if (__in_fake_parlib())
 		return;
-	/* Sets up timer chain (only one chain per process) */
-	TAILQ_INIT(&global_tchain.waiters);
-	global_tchain.running = NULL;
-	reset_tchain_times(&global_tchain);
-	uth_cond_var_init(&global_tchain.cv);
-
-	if (devalarm_get_fds(&ctlfd, &timerfd, &alarmid)) {
-		perror("Useralarm: devalarm_get_fds");
-		return;
-	}
+	tchain_init(&global_tchain);
+	global_tchain.vcoreid = 0;
+	register_ev_handler(EV_ALARM, handle_user_alarm, 0);
 	/* Since we're doing SPAM_PUBLIC later, we actually don't need a big
 	 * ev_q.  But someone might copy/paste this and change a flag. */
-	register_ev_handler(EV_ALARM, handle_user_alarm, 0);
 	if (!(ev_q = get_eventq(EV_MBOX_UCQ))) {
 		perror("Useralarm: Failed ev_q");
 		return;
@@ -175,19 +200,52 @@ static void __attribute__((constructor)) alarm_service_ctor(void)
 	 * use an INDIR (probably with SPAM_INDIR too) instead of SPAM_PUBLIC.
 	 */
 	ev_q->ev_flags = EVENT_IPI | EVENT_SPAM_PUBLIC | EVENT_WAKEUP;
-	if (devalarm_set_evq(timerfd, ev_q, alarmid)) {
-		perror("set_alarm_evq");
-		return;
-	}
 	/* now the alarm is all set, just need to write the timer whenever we
 	 * want it to go off. */
-	global_tchain.alarmid = alarmid;
-	global_tchain.ctlfd = ctlfd;
-	global_tchain.timerfd = timerfd;
-	global_tchain.ev_q = ev_q;	/* mostly for debugging */
+	if (tchain_get_devalarm(&global_tchain, ev_q)) {
+		perror("Useralarm: global tchain");
+		return;
+	}
 	register_fork_cb(&devalarm_fork_cb);
 }
 
+/* Called when we're about to become an MCP.  Each vcore gets its own chain,
+ * with its own #alarm that prefers to send its events to that vcore.  The
+ * events are SPAM_PUBLIC, so if the vcore is offline, another vcore will run
+ * the chain, and will take over its waiters.  See __trigger_tchain(). */
+void alarm_mcp_init(void)
+{
+	struct timer_chain **tchains;
+	struct timer_chain *tchain;
+	struct event_queue *ev_q;
+	int ret;
+
+	if (__in_fake_parlib())
+		return;
+	tchains = calloc(max_vcores(), sizeof(struct timer_chain*));
+	assert(tchains);
+	for (int i = 0; i < max_vcores(); i++) {
+		ret = posix_memalign((void**)&tchain,
+				     __alignof__(struct timer_chain),
+				     sizeof(struct timer_chain));
+		assert(!ret);
+		tchain_init(tchain);
+		tchain->vcoreid = i;
+		ev_q = get_eventq_slim();
+		ev_q->ev_vcore = i;
+		ev_q->ev_flags = EVENT_IPI | EVENT_SPAM_PUBLIC | EVENT_WAKEUP;
+		if (tchain_get_devalarm(tchain, ev_q)) {
+			/* Leaks the chains.  We'll keep using the global
+			 * chain. */
+			perror("Useralarm: vcore tchain");
+			return;
+		}
+		tchains[i] = tchain;
+	}
+	wmb();	/* fully init'd before publishing */
+	vc_tchains = tchains;
+}
+
 /* Initializes a new awaiter. */
 void init_awaiter(struct alarm_waiter *waiter,
                   void (*func) (struct alarm_waiter *awaiter))
@@ -196,6 +254,7 @@ void init_awaiter(struct alarm_waiter *waiter,
 	assert(func);
 	waiter->func = func;
 	waiter->on_tchain = false;
+	waiter->tchain = NULL;
 }
 
 /* Give this the absolute time.  For now, abs_time is the TSC time that you want
@@ -235,149 +294,248 @@ void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep)
 	waiter->wake_up_time += usec2tsc(usleep);
 }
 
-/* User interface to the global tchain */
+/* Picks the chain for a new alarm: our vcore's, if we have them.  A uthread
+ * might migrate right after reading vcore_id(), but that just means the alarm
+ * goes on another vcore's chain. */
+static struct timer_chain *__get_tchain(void)
+{
+	struct timer_chain **tchains = ACCESS_ONCE(vc_tchains);
+
+	if (!tchains)
+		return &global_tchain;
+	return tchains[vcore_id()];
+}
+
+/* User interface to the tchains */
 void set_alarm(struct alarm_waiter *waiter)
 {
-	__tc_set_alarm(&global_tchain, waiter);
+	__tc_set_alarm(__get_tchain(), waiter);
 }
 
 bool unset_alarm(struct alarm_waiter *waiter)
 {
-	return __tc_unset_alarm(&global_tchain, waiter);
+	return __tc_unset_alarm(waiter);
 }
 
 bool reset_alarm_abs(struct alarm_waiter *waiter, uint64_t abs_time)
 {
-	return __tc_reset_alarm_abs(&global_tchain, waiter, abs_time);
+	return __tc_reset_alarm_abs(__get_tchain(), waiter, abs_time);
 }
 
-/* Helper, makes sure the kernel alarm is turned on at the right time. */
+/* Helper, sets the kernel alarm for the chain's earliest_time.  We never
+ * bother to turn it off.  If it goes off when nothing is due, the trigger just
+ * finds nothing to do. */
 static void reset_tchain_interrupt(struct timer_chain *tchain)
 {
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		/* Turn it off */
-		printd("Turning alarm off\n");
-		if (devalarm_disable(tchain->timerfd)) {
-			printf("Useralarm: unable to disarm alarm!\n");
-			return;
+	if (tchain->earliest_time == ALARM_POISON_TIME)
+		return;
+	/* TODO: check for times in the past or very close to now */
+	printd("Turning alarm on for %llu\n", tchain->earliest_time);
+	if (devalarm_set_time(tchain->timerfd, tchain->earliest_time))
+		perror("Useralarm: Failed to set timer");
+}
+
+/* Helper, returns when the earliest waiter on the chain goes off, or the poison
+ * time if there are none.  Looks at most a lap ahead on the wheel, then falls
+ * back to checking every waiter.  Caller holds the lock. */
+static uint64_t __tchain_next_time(struct timer_chain *tchain)
+{
+	struct alarm_waiter *i;
+	uint64_t earliest = UINT64_MAX;
+
+	if (!tchain->nr_waiters)
+		return ALARM_POISON_TIME;
+	for (uint64_t tick = tchain->cur_tick;
+	     tick < tchain->cur_tick + TCHAIN_WHEEL_SLOTS;
+	     tick++) {
+		/* Waiters from later laps share the slot */
+		TAILQ_FOREACH(i, __tchain_slot(tchain, tick), next) {
+			if (i->tick == tick)
+				earliest = MIN(earliest, i->wake_up_time);
 		}
-	} else {
-		/* Make sure it is on and set to the earliest time */
-		assert(tchain->earliest_time != ALARM_POISON_TIME);
-		/* TODO: check for times in the past or very close to now */
-		printd("Turning alarm on for %llu\n", tchain->earliest_time);
-		if (devalarm_set_time(tchain->timerfd, tchain->earliest_time)) {
-			perror("Useralarm: Failed to set timer");
-			return;
+		if (earliest != UINT64_MAX)
+			return earliest;
+	}
+	for (int s = 0; s < TCHAIN_WHEEL_SLOTS; s++) {
+		TAILQ_FOREACH(i, &tchain->wheel[s], next)
+			earliest = MIN(earliest, i->wake_up_time);
+	}
+	return earliest;
+}
+
+/* Helper, inserts the waiter into the tchain, returning TRUE if we still need
+ * to reset the tchain interrupt.  Caller holds the lock. */
+static bool __insert_awaiter(struct timer_chain *tchain,
+                             struct alarm_waiter *waiter)
+{
+	waiter->tick = MAX(__tsc_to_tick(waiter->wake_up_time),
+			   tchain->cur_tick);
+	TAILQ_INSERT_TAIL(__tchain_slot(tchain, waiter->tick), waiter, next);
+	waiter->on_tchain = TRUE;
+	waiter->tchain = tchain;
+	tchain->nr_waiters++;
+	if (tchain->earliest_time == ALARM_POISON_TIME ||
+	    waiter->wake_up_time < tchain->earliest_time) {
+		tchain->earliest_time = waiter->wake_up_time;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/* Helper, rips the waiter from the tchain, knowing that it is on the list.
+ * This never resets the interrupt: if the waiter was the earliest, the alarm
+ * will go off early, and the trigger will rearm it.  That's a lot cheaper for
+ * the common case of cancelling a timeout.  Callers hold the lock. */
+static void __remove_awaiter(struct timer_chain *tchain,
+                             struct alarm_waiter *waiter)
+{
+	TAILQ_REMOVE(__tchain_slot(tchain, waiter->tick), waiter, next);
+	tchain->nr_waiters--;
+	waiter->on_tchain = FALSE;
+}
+
+/* Locks both chains, in address order. */
+static void __lock_tchain_pair(struct timer_chain *a, struct timer_chain *b)
+{
+	if (a > b) {
+		struct timer_chain *temp = a;
+
+		a = b;
+		b = temp;
+	}
+	spin_pdr_lock(&a->cv.lock);
+	if (a != b)
+		spin_pdr_lock(&b->cv.lock);
+}
+
+static void __unlock_tchain_pair(struct timer_chain *a, struct timer_chain *b)
+{
+	spin_pdr_unlock(&a->cv.lock);
+	if (a != b)
+		spin_pdr_unlock(&b->cv.lock);
+}
+
+/* Moves all of from's waiters to to.  We do this when from's vcore is offline
+ * (yielded or preempted), so that its waiters don't keep bouncing events
+ * around. */
+static void __migrate_tchain(struct timer_chain *from, struct timer_chain *to)
+{
+	struct alarm_waiter *i;
+	bool reset_int = FALSE;
+
+	__lock_tchain_pair(from, to);
+	/* Someone else is triggering from; they'll deal with it */
+	if (from->running) {
+		__unlock_tchain_pair(from, to);
+		return;
+	}
+	for (int s = 0; s < TCHAIN_WHEEL_SLOTS; s++) {
+		while ((i = TAILQ_FIRST(&from->wheel[s]))) {
+			__remove_awaiter(from, i);
+			reset_int |= __insert_awaiter(to, i);
 		}
 	}
+	/* from's #alarm isn't set (the trigger that sent us here didn't rearm
+	 * it), so the next waiter added to from must set it. */
+	from->earliest_time = ALARM_POISON_TIME;
+	if (reset_int && !to->running)
+		reset_tchain_interrupt(to);
+	__unlock_tchain_pair(from, to);
 }
 
 /* This is called when the kernel alarm triggers a tchain, and needs to wake up
  * everyone whose time is up.  Called from vcore context. */
 static void __trigger_tchain(struct timer_chain *tchain)
 {
-	struct alarm_waiter *i, *temp;
+	struct alarm_waiter *i;
+	struct awaiters_tailq *slot;
 	struct uthread *unsetter;
+	uint64_t now, now_tick;
+	bool migrate;
 
 	spin_pdr_lock(&tchain->cv.lock);
-	/* It's possible we have multiple contexts running a single tchain.  It
-	 * shouldn't be possible for per-core tchains, but it is possible
-	 * otherwise.  In that case, we can just abort, treating the event/IRQ
-	 * that woke us up as a 'poke'. */
+	/* It's possible we have multiple contexts running a single tchain, e.g.
+	 * spurious events sent to several vcores.  In that case, we can just
+	 * abort, treating the event/IRQ that woke us up as a 'poke'. */
 	if (tchain->running) {
 		spin_pdr_unlock(&tchain->cv.lock);
 		return;
 	}
-	while ((i = TAILQ_FIRST(&tchain->waiters))) {
-		/* TODO: Could also do something in cases where it's close to
-		 * expiring. */
-		if (i->wake_up_time > read_tsc())
-			break;
-		TAILQ_REMOVE(&tchain->waiters, i, next);
-		i->on_tchain = false;
-		tchain->running = i;
-
-		/* Need the tchain times (earliest/latest) in sync when
-		 * unlocked. */
-		reset_tchain_times(tchain);
-
-		spin_pdr_unlock(&tchain->cv.lock);
+	/* The kernel alarm went off, so it's no longer set.  Any waiters added
+	 * while we run handlers won't reset it either (since we're running);
+	 * we'll set it once we're done. */
+	tchain->earliest_time = ALARM_POISON_TIME;
+	now = read_tsc();
+	now_tick = __tsc_to_tick(now);
+	/* If we're more than a lap behind, every slot could have waiters due */
+	if (now_tick - tchain->cur_tick >= TCHAIN_WHEEL_SLOTS)
+		tchain->cur_tick = now_tick - TCHAIN_WHEEL_SLOTS + 1;
+	for (; tchain->cur_tick <= now_tick; tchain->cur_tick++) {
+		slot = __tchain_slot(tchain, tchain->cur_tick);
+again:
+		TAILQ_FOREACH(i, slot, next) {
+			/* Could be from a later lap */
+			if (i->wake_up_time > now)
+				continue;
+			__remove_awaiter(tchain, i);
+			tchain->running = i;
+			spin_pdr_unlock(&tchain->cv.lock);
 
-		/* Don't touch the waiter after running it, since the memory can
-		 * be used immediately */
-		i->func(i);
+			/* Don't touch the waiter after running it, since the
+			 * memory can be used immediately */
+			i->func(i);
 
-		spin_pdr_lock(&tchain->cv.lock);
-		tchain->running = NULL;
-
-		/* This is the guts of a signal, but we're optimizing for the
-		 * common case where there is no unsetter.  Uthread CV
-		 * signal/broadcast wakes the uthreads up outside of the CV
-		 * lock, which will avoid any lock-ordering issues with the 2LS
-		 * and the CV - in this case, the alarm service. */
-		unsetter = __uth_cond_var_wake_one(&tchain->cv);
-		if (unsetter) {
-			spin_pdr_unlock(&tchain->cv.lock);
-			uthread_runnable(unsetter);
 			spin_pdr_lock(&tchain->cv.lock);
+			tchain->running = NULL;
+
+			/* This is the guts of a signal, but we're optimizing
+			 * for the common case where there is no unsetter.
+			 * Uthread CV signal/broadcast wakes the uthreads up
+			 * outside of the CV lock, which will avoid any
+			 * lock-ordering issues with the 2LS and the CV - in
+			 * this case, the alarm service. */
+			unsetter = __uth_cond_var_wake_one(&tchain->cv);
+			if (unsetter) {
+				spin_pdr_unlock(&tchain->cv.lock);
+				uthread_runnable(unsetter);
+				spin_pdr_lock(&tchain->cv.lock);
+			}
+			/* The slot could have changed while we were unlocked */
+			goto again;
 		}
 	}
-	reset_tchain_interrupt(tchain);
+	tchain->cur_tick = now_tick;
+	tchain->earliest_time = __tchain_next_time(tchain);
+	/* The kernel sends a vcore's alarms elsewhere when the vcore is
+	 * offline.  Pull its remaining waiters over to our chain. */
+	migrate = tchain->earliest_time != ALARM_POISON_TIME &&
+		  tchain != &global_tchain && tchain->vcoreid != vcore_id();
+	if (!migrate)
+		reset_tchain_interrupt(tchain);
 	spin_pdr_unlock(&tchain->cv.lock);
+	if (migrate)
+		__migrate_tchain(tchain, vc_tchains[vcore_id()]);
 }
 
 static void handle_user_alarm(struct event_msg *ev_msg, unsigned int ev_type,
                               void *data)
 {
+	struct timer_chain **tchains = ACCESS_ONCE(vc_tchains);
+	int alarmid = devalarm_get_id(ev_msg);
+
 	assert(ev_type == EV_ALARM);
-	if (devalarm_get_id(ev_msg) == global_tchain.alarmid)
+	if (alarmid == global_tchain.alarmid) {
 		__trigger_tchain(&global_tchain);
-}
-
-/* Helper, inserts the waiter into the tchain, returning TRUE if we still need
- * to reset the tchain interrupt.  Caller holds the lock. */
-static bool __insert_awaiter(struct timer_chain *tchain,
-                             struct alarm_waiter *waiter)
-{
-	struct alarm_waiter *i, *temp;
-
-	waiter->on_tchain = TRUE;
-	/* Either the list is empty, or not. */
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		tchain->earliest_time = waiter->wake_up_time;
-		tchain->latest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
-		/* Need to turn on the timer interrupt later */
-		return TRUE;
-	}
-	/* If not, either we're first, last, or in the middle.  Reset the
-	 * interrupt and adjust the tchain's times accordingly. */
-	if (waiter->wake_up_time < tchain->earliest_time) {
-		tchain->earliest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
-		/* Changed the first entry; we'll need to reset the interrupt
-		 * later */
-		return TRUE;
-	}
-	/* If there is a tie for last, the newer one will really go last.  We
-	 * need to handle equality here since the loop later won't catch it. */
-	if (waiter->wake_up_time >= tchain->latest_time) {
-		tchain->latest_time = waiter->wake_up_time;
-		/* Proactively put it at the end if we know we're last */
-		TAILQ_INSERT_TAIL(&tchain->waiters, waiter, next);
-		return FALSE;
+		return;
 	}
-	/* Insert before the first one you are earlier than.  This won't scale
-	 * well (TODO) if we have a lot of inserts.  The proactive insert_tail
-	 * up above will help a bit. */
-	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
-		if (waiter->wake_up_time < i->wake_up_time) {
-			TAILQ_INSERT_BEFORE(i, waiter, next);
-			return FALSE;
+	if (!tchains)
+		return;
+	for (int i = 0; i < max_vcores(); i++) {
+		if (alarmid == tchains[i]->alarmid) {
+			__trigger_tchain(tchains[i]);
+			return;
 		}
 	}
-	panic("Could not find a spot for awaiter %p\n", waiter);
 }
 
 static void __tc_set_alarm(struct timer_chain *tchain,
@@ -387,49 +545,41 @@ static void __tc_set_alarm(struct timer_chain *tchain,
 	assert(!waiter->on_tchain);
 
 	spin_pdr_lock(&tchain->cv.lock);
-	if (__insert_awaiter(tchain, waiter))
+	if (__insert_awaiter(tchain, waiter) && !tchain->running)
 		reset_tchain_interrupt(tchain);
 	spin_pdr_unlock(&tchain->cv.lock);
 }
 
-/* Helper, rips the waiter from the tchain, knowing that it is on the list.
- * Returns TRUE if the tchain interrupt needs to be reset.  Callers hold the
- * lock. */
-static bool __remove_awaiter(struct timer_chain *tchain,
-                             struct alarm_waiter *waiter)
+/* Returns the waiter's tchain, locked, or NULL if it was never set.  The
+ * waiter can move between chains (e.g. migration), so we need to check again
+ * once we hold the lock. */
+static struct timer_chain *__lock_awaiter_tchain(struct alarm_waiter *waiter)
 {
-	struct alarm_waiter *temp;
-	bool reset_int = FALSE;	/* whether or not to reset the interrupt */
+	struct timer_chain *tchain;
 
-	/* Need to make sure earliest and latest are set, in case we're mucking
-	 * with the first and/or last element of the chain. */
-	if (TAILQ_FIRST(&tchain->waiters) == waiter) {
-		temp = TAILQ_NEXT(waiter, next);
-		tchain->earliest_time = (temp) ? temp->wake_up_time :
-			                         ALARM_POISON_TIME;
-		reset_int = TRUE; /* we'll need to reset the timer later */
-	}
-	if (TAILQ_LAST(&tchain->waiters, awaiters_tailq) == waiter) {
-		temp = TAILQ_PREV(waiter, awaiters_tailq, next);
-		tchain->latest_time = (temp) ? temp->wake_up_time :
-			                       ALARM_POISON_TIME;
+	while ((tchain = ACCESS_ONCE(waiter->tchain))) {
+		spin_pdr_lock(&tchain->cv.lock);
+		if (tchain == ACCESS_ONCE(waiter->tchain))
+			return tchain;
+		spin_pdr_unlock(&tchain->cv.lock);
 	}
-	TAILQ_REMOVE(&tchain->waiters, waiter, next);
-	waiter->on_tchain = FALSE;
-	return reset_int;
+	return NULL;
 }
 
-/* Removes waiter from the tchain before it goes off.  Returns TRUE if we
+/* Removes waiter from its tchain before it goes off.  Returns TRUE if we
  * disarmed before the alarm went off, FALSE if it already fired.  May block,
- * since the handler may be running asynchronously. */
-static bool __tc_unset_alarm(struct timer_chain *tchain,
-                             struct alarm_waiter *waiter)
+ * since the handler may be running asynchronously.  Only locks the waiter's
+ * chain. */
+static bool __tc_unset_alarm(struct alarm_waiter *waiter)
 {
-	spin_pdr_lock(&tchain->cv.lock);
+	struct timer_chain *tchain;
+
 	for (;;) {
+		tchain = __lock_awaiter_tchain(waiter);
+		if (!tchain)
+			return false;
 		if (waiter->on_tchain) {
-			if (__remove_awaiter(tchain, waiter))
-				reset_tchain_interrupt(tchain);
+			__remove_awaiter(tchain, waiter);
 			spin_pdr_unlock(&tchain->cv.lock);
 			return true;
 		}
@@ -438,18 +588,19 @@ static bool __tc_unset_alarm(struct timer_chain *tchain,
 			return false;
 		}
 		/* It's running.  We'll need to try again.  Note the alarm could
-		 * have resubmitted itself, so ideally the caller can tell it to
-		 * not resubmit.
+		 * have resubmitted itself, possibly to another chain, so
+		 * ideally the caller can tell it to not resubmit.
 		 *
 		 * Despite the slightly more difficult wake-up code in userspace
 		 * compared to the kernel, it's still better to use a CV here.
 		 * Some go tests in qemu were more likely to timeout/starve even
 		 * if we did some form of unlock/yield/relock pattern. */
 		uth_cond_var_wait(&tchain->cv, NULL);
+		spin_pdr_unlock(&tchain->cv.lock);
 	}
 }
 
-/* waiter may be on the tchain, or it might have fired already and be off the
+/* waiter may be on a tchain, or it might have fired already and be off the
  * tchain.  Either way, this will put the waiter on the list, set to go off at
  * abs_time.  If you know the alarm has fired, don't call this.  Just set the
  * awaiter, and then set_alarm() */
@@ -458,7 +609,7 @@ static bool __tc_reset_alarm_abs(struct timer_chain *tchain,
 {
 	bool ret;
 
-	ret = __tc_unset_alarm(tchain, waiter);
+	ret = __tc_unset_alarm(waiter);
 	__set_awaiter_abs(waiter, abs_time);
 	__tc_set_alarm(tchain, waiter);
 	return ret;
@@ -468,12 +619,10 @@ static bool __tc_reset_alarm_abs(struct timer_chain *tchain,
 
 void print_chain(struct timer_chain *tchain)
 {
-	struct alarm_waiter *i;
 	spin_pdr_lock(&tchain->cv.lock);
-	printf("Chain %p is%s empty, early: %llu latest: %llu\n", tchain,
-	       TAILQ_EMPTY(&tchain->waiters) ? "" : " not",
-	       tchain->earliest_time,
-	       tchain->latest_time);
+	printf("Chain %p (vcore %d) has %u waiters, early: %llu tick: %llu\n",
+	       tchain, tchain->vcoreid, tchain->nr_waiters,
+	       tchain->earliest_time, tchain->cur_tick);
 	spin_pdr_unlock(&tchain->cv.lock);
 }
 
@@ -8,9 +8,9 @@
  * the kernel alarms.  Under the hood, the user alarm uses the #A service for
  * the root of the alarm chain.
  *
- * There's only one timer chain, unlike in the kernel, for the entire process.
- * If you want one-off timers unrelated to the chain (and sent to other vcores),
- * use #A directly.
+ * Once the process is an MCP, each vcore has its own timer chain, like in the
+ * kernel.  If you want one-off timers unrelated to the chains (and sent to
+ * other vcores), use #A directly.
  *
  * Your handlers will run from vcore context.
  *
@@ -47,6 +47,8 @@ int devalarm_disable(int timerfd);
 
 /* Alarm service */
 
+struct timer_chain;
+
 /* Specifc waiter, per alarm */
 struct alarm_waiter {
 	uint64_t 			wake_up_time;	/* tsc time */
@@ -54,23 +56,31 @@ struct alarm_waiter {
 	void				*data;
 	TAILQ_ENTRY(alarm_waiter)	next;
 	bool				on_tchain;
+	/* Internal to the alarm service */
+	struct timer_chain		*tchain;
+	uint64_t			tick;
 };
-TAILQ_HEAD(awaiters_tailq, alarm_waiter);	/* ideally not a LL */
+TAILQ_HEAD(awaiters_tailq, alarm_waiter);
 
 typedef void (*alarm_handler)(struct alarm_waiter *waiter);
 
-/* Sorted collection of alarms. */
+#define TCHAIN_WHEEL_SLOTS		64
+
+/* Collection of alarms, hashed by expiration tick into a timing wheel. */
 struct timer_chain {
-	struct awaiters_tailq		waiters;
+	struct awaiters_tailq		wheel[TCHAIN_WHEEL_SLOTS];
+	unsigned int			nr_waiters;
+	uint64_t			cur_tick;
 	struct alarm_waiter		*running;
+	/* When the #alarm is set to go off, or the poison time */
 	uint64_t			earliest_time;
-	uint64_t			latest_time;
 	struct uth_cond_var		cv;
 	int				ctlfd;
 	int				timerfd;
 	int				alarmid;
+	uint32_t			vcoreid;
 	struct event_queue		*ev_q;
-};
+} __attribute__((aligned(ARCH_CL_SIZE)));
 
 /* For fresh alarm waiters.  func == 0 for kthreads */
 void init_awaiter(struct alarm_waiter *waiter,
@@ -94,6 +104,9 @@ void set_alarm(struct alarm_waiter *waiter);
 bool unset_alarm(struct alarm_waiter *waiter);
 bool reset_alarm_abs(struct alarm_waiter *waiter, uint64_t abs_time);
 
+/* Sets up the per-vcore chains.  Called when becoming an MCP. */
+void alarm_mcp_init(void);
+
 /* "parlib" alarm handlers */
 void alarm_abort_sysc(struct alarm_waiter *awaiter);
 
@@ -0,0 +1,55 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Stackless tasks.  A task is a function and a little state, run to completion
+ * in vcore context, on whichever vcores the 2LS has.  Instead of blocking, a
+ * task issues an async syscall and returns, naming the function to resume at.
+ * When the kernel says the syscall is done, the event handler runs the task
+ * directly.  There is no stack and no context switch per task.
+ *
+ * A task runs in vcore context, so it must not block, and it runs on the small
+ * vcore transition stack, so keep it shallow.  Anything long-running belongs in
+ * a uthread.
+ *
+ * A task's syscall looks like:
+ *
+ *	syscall_async(&task->sysc, SYS_read, fd, buf, len);
+ *	if (task_await_sysc(task, got_read))
+ *		return;
+ *	got_read(task);
+ *
+ * Once a task has been handed back (task_run(), task_await_sysc() returning
+ * TRUE), another vcore may already be running it, so don't touch it again.  A
+ * task is done when its function returns without handing it back; the owner
+ * can free it then.
+ *
+ * parlib/task_coro.h wraps these in C++20 coroutines. */
+
+#pragma once
+
+#include <parlib/common.h>
+#include <ros/syscall.h>
+#include <sys/queue.h>
+
+__BEGIN_DECLS
+
+struct task;
+typedef void (*task_fn_t)(struct task *task);
+
+struct task {
+	TAILQ_ENTRY(task)		link;
+	task_fn_t			func;
+	void				*arg;
+	struct syscall			sysc;
+};
+TAILQ_HEAD(task_tailq, task);
+
+void task_init(struct task *task, task_fn_t func, void *arg);
+void task_run(struct task *task);
+void task_yield(struct task *task, task_fn_t next);
+bool task_await_sysc(struct task *task, task_fn_t next);
+
+/* Called by vcore context, e.g. the 2LS before it yields a vcore */
+bool task_run_ready(void);
+
+__END_DECLS
@@ -0,0 +1,114 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * C++20 coroutines on parlib's stackless tasks.  The coroutine's frame holds
+ * its task, and the task resumes the coroutine.  co_await parlib::syscall(...)
+ * issues an async syscall and suspends until it is done, unless it finished
+ * right away.  For example:
+ *
+ *	parlib::coro_task echo(int fd)
+ *	{
+ *		char buf[64];
+ *		long ret;
+ *
+ *		while ((ret = co_await parlib::syscall(SYS_read, fd, buf,
+ *						       sizeof(buf))) > 0)
+ *			co_await parlib::syscall(SYS_write, fd, buf, ret);
+ *	}
+ *
+ *	echo(fd).start();
+ *
+ * The same rules as any task apply: the coroutine runs in vcore context, so it
+ * must not block.  The frame is freed when the coroutine returns. */
+
+#pragma once
+
+#if defined(__cplusplus) && __cplusplus >= 202002L
+
+#include <parlib/task.h>
+#include <parlib/parlib.h>
+#include <coroutine>
+#include <cstdlib>
+
+namespace parlib {
+
+class coro_task {
+public:
+	struct promise_type {
+		struct task task;
+
+		coro_task get_return_object()
+		{
+			return coro_task(std::coroutine_handle<promise_type>::
+					 from_promise(*this));
+		}
+		/* Nothing runs until start(), which hands it to a vcore */
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { abort(); }
+	};
+
+	explicit coro_task(std::coroutine_handle<promise_type> h) : handle(h) {}
+
+	/* Runs the coroutine as a task.  Don't use the coro_task after this */
+	void start()
+	{
+		struct task *task = &handle.promise().task;
+
+		task_init(task, resume_task, handle.address());
+		task_run(task);
+	}
+
+	static void resume_task(struct task *task)
+	{
+		std::coroutine_handle<promise_type>::from_address(task->arg)
+			.resume();
+	}
+
+private:
+	std::coroutine_handle<promise_type> handle;
+};
+
+/* Awaitable for an async syscall on the coroutine's task.  Resumes with the
+ * syscall's retval; errno is in the task's sysc.err. */
+class syscall {
+public:
+	template <typename... Args>
+	explicit syscall(unsigned long num, Args... args)
+		: num(num), args{(long)args...} {}
+
+	bool await_ready() { return false; }
+
+	bool await_suspend(std::coroutine_handle<coro_task::promise_type> h)
+	{
+		task = &h.promise().task;
+		syscall_async(&task->sysc, num, args[0], args[1], args[2],
+			      args[3], args[4], args[5]);
+		/* FALSE resumes the coroutine right away */
+		return task_await_sysc(task, coro_task::resume_task);
+	}
+
+	long await_resume() { return task->sysc.retval; }
+
+private:
+	unsigned long num;
+	long args[6];
+	struct task *task = nullptr;
+};
+
+/* Awaitable that lets other tasks and uthreads run */
+struct yield {
+	bool await_ready() { return false; }
+
+	void await_suspend(std::coroutine_handle<coro_task::promise_type> h)
+	{
+		task_yield(&h.promise().task, coro_task::resume_task);
+	}
+
+	void await_resume() {}
+};
+
+} // namespace parlib
+
+#endif
@@ -32,6 +32,14 @@ static inline void SET_BITMASK_BIT_ATOMIC(uint8_t *name, size_t bit)
 	atomic_orb(&name[bit / 8], 1 << (bit % 8));
 }
 
+/* Sets the bit and returns its old value */
+static inline bool TEST_AND_SET_BITMASK_BIT_ATOMIC(uint8_t *name, size_t bit)
+{
+	uint8_t mask = 1 << (bit % 8);
+
+	return __sync_fetch_and_or(&name[bit / 8], mask) & mask ? TRUE : FALSE;
+}
+
 static inline void CLR_BITMASK_BIT_ATOMIC(uint8_t *name, size_t bit)
 {
 	atomic_andb(&name[bit / 8], ~(1 << (bit % 8)));
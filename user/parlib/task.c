@@ -0,0 +1,128 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Stackless task executor.  See parlib/task.h.
+ *
+ * Ready tasks sit on one global queue.  Any vcore drains it on its way into the
+ * 2LS's sched_entry (uthread_vcore_entry()), and the 2LS drains it again before
+ * it yields a vcore.  We ask for vcores the same way a 2LS does for runnable
+ * threads.
+ *
+ * Tasks blocked on syscalls aren't on any queue.  Each vcore has a UCQ ev_q for
+ * syscall completions, like the pthread 2LS's sysc_mgmt.  The ev_q has its own
+ * handler, which runs each finished syscall's task right away. */
+
+#include <parlib/task.h>
+#include <parlib/parlib.h>
+#include <parlib/vcore.h>
+#include <parlib/event.h>
+#include <parlib/spinlock.h>
+#include <parlib/assert.h>
+#include <stdlib.h>
+
+/* Most tasks a vcore runs from the ready queue per call, so that uthreads and
+ * events still get a turn. */
+#define TASK_RUN_BATCH 32
+
+static struct task_tailq ready_tasks = TAILQ_HEAD_INITIALIZER(ready_tasks);
+static struct spin_pdr_lock ready_lock = SPINPDR_INITIALIZER;
+static unsigned long nr_ready_tasks;
+static struct event_queue **task_sysc_evqs;
+static parlib_once_t task_once = PARLIB_ONCE_INIT;
+
+static void task_handle_sysc_evq(struct event_queue *ev_q)
+{
+	struct event_msg msg;
+	struct syscall *sysc;
+	struct task *task;
+
+	while (extract_one_mbox_msg(ev_q->ev_mbox, &msg)) {
+		sysc = msg.ev_arg3;
+		assert(sysc);
+		task = sysc->u_data;
+		task->func(task);
+	}
+}
+
+static void task_lib_init(void *arg)
+{
+	struct event_queue *ev_q;
+
+	task_sysc_evqs = malloc(sizeof(struct event_queue*) * max_vcores());
+	assert(task_sysc_evqs);
+	for (int i = 0; i < max_vcores(); i++) {
+		ev_q = get_eventq(EV_MBOX_UCQ);
+		ev_q->ev_flags = EVENT_IPI | EVENT_INDIR | EVENT_SPAM_INDIR |
+		                 EVENT_WAKEUP;
+		ev_q->ev_vcore = i;
+		ev_q->ev_handler = task_handle_sysc_evq;
+		task_sysc_evqs[i] = ev_q;
+	}
+}
+
+void task_init(struct task *task, task_fn_t func, void *arg)
+{
+	parlib_run_once(&task_once, task_lib_init, NULL);
+	task->func = func;
+	task->arg = arg;
+}
+
+/* Makes task runnable, at task->func.  Callable from uthreads or vcore
+ * context. */
+void task_run(struct task *task)
+{
+	unsigned long nr_ready;
+
+	spin_pdr_lock(&ready_lock);
+	TAILQ_INSERT_TAIL(&ready_tasks, task, link);
+	nr_ready = ++nr_ready_tasks;
+	spin_pdr_unlock(&ready_lock);
+	/* Like a 2LS's thread_runnable.  Anything already in vcore context will
+	 * run it before it yields. */
+	vcore_request_more(nr_ready);
+}
+
+/* Lets other tasks and uthreads run, then resumes task at next. */
+void task_yield(struct task *task, task_fn_t next)
+{
+	task->func = next;
+	task_run(task);
+}
+
+/* Call after issuing an async syscall on task->sysc.  Returns TRUE if the
+ * syscall is still going, in which case task will run at next once it is done.
+ * Returns FALSE if it already finished, in which case the caller continues the
+ * task itself. */
+bool task_await_sysc(struct task *task, task_fn_t next)
+{
+	struct syscall *sysc = &task->sysc;
+
+	if (atomic_read(&sysc->flags) & SC_DONE)
+		return FALSE;
+	task->func = next;
+	sysc->u_data = task;
+	/* Once registered, the event could be handled on another vcore */
+	return register_evq(sysc, task_sysc_evqs[vcore_id()]);
+}
+
+/* Runs a batch of ready tasks.  Returns TRUE if it ran any. */
+bool task_run_ready(void)
+{
+	struct task *batch[TASK_RUN_BATCH];
+	int nr = 0;
+
+	/* Unlocked peek, we'll get anything we miss on our next pass */
+	if (TAILQ_EMPTY(&ready_tasks))
+		return FALSE;
+	spin_pdr_lock(&ready_lock);
+	while (nr < TASK_RUN_BATCH && !TAILQ_EMPTY(&ready_tasks)) {
+		batch[nr] = TAILQ_FIRST(&ready_tasks);
+		TAILQ_REMOVE(&ready_tasks, batch[nr], link);
+		nr++;
+	}
+	nr_ready_tasks -= nr;
+	spin_pdr_unlock(&ready_lock);
+	for (int i = 0; i < nr; i++)
+		batch[i]->func(batch[i]);
+	return nr != 0;
+}
@@ -8,6 +8,9 @@
 #include <parlib/vcore.h>
 #include <parlib/uthread.h>
 #include <parlib/event.h>
+#include <parlib/alarm.h>
+#include <parlib/spinlock.h>
+#include <parlib/task.h>
 #include <stdlib.h>
 #include <parlib/assert.h>
 #include <parlib/stdio.h>
@@ -123,6 +126,9 @@ void uthread_mcp_init()
 	register_kevent_q(preempt_ev_q, EV_CHECK_MSGS);
 	printd("[user] registered %08p (flags %08p) for preempt messages\n",
 	       preempt_ev_q, preempt_ev_q->ev_flags);
+	/* Per-vcore alarms.  Setting them up needs syscalls that block, which
+	 * is easier before we're an MCP. */
+	alarm_mcp_init();
 	/* Get ourselves into _M mode.  Could consider doing this elsewhere. */
 	vcore_change_to_m();
 }
@@ -306,6 +312,9 @@ void __attribute__((noreturn)) uthread_vcore_entry(void)
 	/* Otherwise, go about our usual vcore business (messages, etc). */
 	handle_events(vcoreid);
 	__check_preempt_pending(vcoreid);
+	/* Stackless tasks share our vcores, and are cheap enough to run before
+	 * the 2LS picks a thread. */
+	task_run_ready();
 	/* double check, in case an event changed it */
 	assert(in_vcore_context());
 	sched_ops->sched_entry();
@@ -1246,11 +1255,52 @@ static inline bool __uthread_has_tls(struct uthread *uthread)
 	return uthread->tls_desc != UTH_TLSDESC_NOTLS;
 }
 
+/* Freed TLS blocks are kept for reuse, like the 2LS's stacks, so that thread
+ * churn doesn't malloc and free a TLS block and its DTV every time.  Reused
+ * blocks are reinitialized, the same as when a uthread is reinit'd. */
+#define UTH_TLS_CACHE_NR 64
+
+static struct spin_pdr_lock tls_cache_lock = SPINPDR_INITIALIZER;
+static void *tls_cache[UTH_TLS_CACHE_NR];
+static unsigned int tls_cache_nr;
+
+static void *__uthread_get_cached_tls(void)
+{
+	void *tls_desc = NULL;
+
+	if (!ACCESS_ONCE(tls_cache_nr))
+		return NULL;
+	spin_pdr_lock(&tls_cache_lock);
+	if (tls_cache_nr)
+		tls_desc = tls_cache[--tls_cache_nr];
+	spin_pdr_unlock(&tls_cache_lock);
+	return tls_desc;
+}
+
+static bool __uthread_cache_tls(void *tls_desc)
+{
+	bool cached = FALSE;
+
+	spin_pdr_lock(&tls_cache_lock);
+	if (tls_cache_nr < UTH_TLS_CACHE_NR) {
+		tls_cache[tls_cache_nr++] = tls_desc;
+		cached = TRUE;
+	}
+	spin_pdr_unlock(&tls_cache_lock);
+	return cached;
+}
+
 /* TLS helpers */
 static int __uthread_allocate_tls(struct uthread *uthread)
 {
+	void *tls_desc;
+
 	assert(!uthread->tls_desc);
-	uthread->tls_desc = allocate_tls();
+	tls_desc = __uthread_get_cached_tls();
+	if (tls_desc)
+		uthread->tls_desc = reinit_tls(tls_desc);
+	else
+		uthread->tls_desc = allocate_tls();
 	if (!uthread->tls_desc) {
 		errno = ENOMEM;
 		return -1;
@@ -1270,7 +1320,8 @@ static int __uthread_reinit_tls(struct uthread *uthread)
 
 static void __uthread_free_tls(struct uthread *uthread)
 {
-	free_tls(uthread->tls_desc);
+	if (!__uthread_cache_tls(uthread->tls_desc))
+		free_tls(uthread->tls_desc);
 	uthread->tls_desc = NULL;
 }
 
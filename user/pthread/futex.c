@@ -7,56 +7,115 @@
 #include <parlib/stdio.h>
 #include <errno.h>
 #include <parlib/slab.h>
-#include <parlib/mcs.h>
+#include <parlib/spinlock.h>
+#include <parlib/arch/atomic.h>
 #include <parlib/alarm.h>
 
+/* Waiters are hashed by uaddr into buckets, each with its own lock, so that
+ * unrelated futexes don't serialize on one lock and wakers only scan the
+ * waiters that hash to their bucket.  An element's bucket and uaddr can change
+ * while it waits (FUTEX_REQUEUE), but only with both buckets locked. */
+#define FUTEX_HASH_BITS 8
+#define FUTEX_NR_BUCKETS (1 << FUTEX_HASH_BITS)
+
+struct futex_bucket;
+
 struct futex_element {
 	TAILQ_ENTRY(futex_element) link;
 	int *uaddr;
+	struct futex_bucket *bucket;
 	bool on_list;
 	bool waker_using;
 	uth_cond_var_t cv;
 };
 TAILQ_HEAD(futex_queue, futex_element);
 
-struct futex_data {
-	struct mcs_pdr_lock lock;
+struct futex_bucket {
+	struct spin_pdr_lock lock;
 	struct futex_queue queue;
-};
-static struct futex_data __futex;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct futex_bucket futex_buckets[FUTEX_NR_BUCKETS];
 
 static inline void futex_init(void *arg)
 {
-	mcs_pdr_init(&__futex.lock);
-	TAILQ_INIT(&__futex.queue);
+	for (int i = 0; i < FUTEX_NR_BUCKETS; i++) {
+		spin_pdr_init(&futex_buckets[i].lock);
+		TAILQ_INIT(&futex_buckets[i].queue);
+	}
+}
+
+static struct futex_bucket *futex_hash(int *uaddr)
+{
+	uint64_t key = (uintptr_t)uaddr * 0x9e3779b97f4a7c15ULL;
+
+	return &futex_buckets[key >> (64 - FUTEX_HASH_BITS)];
+}
+
+/* Locks both buckets (which may be the same) in address order. */
+static void futex_lock_pair(struct futex_bucket *b1, struct futex_bucket *b2)
+{
+	if (b1 > b2) {
+		struct futex_bucket *temp = b1;
+
+		b1 = b2;
+		b2 = temp;
+	}
+	spin_pdr_lock(&b1->lock);
+	if (b1 != b2)
+		spin_pdr_lock(&b2->lock);
+}
+
+static void futex_unlock_pair(struct futex_bucket *b1, struct futex_bucket *b2)
+{
+	spin_pdr_unlock(&b1->lock);
+	if (b1 != b2)
+		spin_pdr_unlock(&b2->lock);
+}
+
+/* Returns e's bucket, locked.  A requeue could move e while we wait for the
+ * lock, so we need to check again once we have it. */
+static struct futex_bucket *futex_lock_elem_bucket(struct futex_element *e)
+{
+	struct futex_bucket *b;
+
+	while (1) {
+		b = ACCESS_ONCE(e->bucket);
+		spin_pdr_lock(&b->lock);
+		if (b == ACCESS_ONCE(e->bucket))
+			return b;
+		spin_pdr_unlock(&b->lock);
+	}
 }
 
 static inline int futex_wait(int *uaddr, int val,
                              const struct timespec *abs_timeout)
 {
 	struct futex_element e[1];
+	struct futex_bucket *b = futex_hash(uaddr);
 	bool timed_out;
 
-	mcs_pdr_lock(&__futex.lock);
+	spin_pdr_lock(&b->lock);
 	if (*uaddr != val) {
-		mcs_pdr_unlock(&__futex.lock);
+		spin_pdr_unlock(&b->lock);
 		return 0;
 	}
 	e->uaddr = uaddr;
+	e->bucket = b;
 	uth_cond_var_init(&e->cv);
 	e->waker_using = false;
 	e->on_list = true;
-	TAILQ_INSERT_TAIL(&__futex.queue, e, link);
-	/* Lock switch.  Any waker will grab the global lock, then grab ours.
+	TAILQ_INSERT_TAIL(&b->queue, e, link);
+	/* Lock switch.  Any waker will grab the bucket lock, then grab ours.
 	 * We're downgrading to the CV lock, which still protects us from
 	 * missing the signal (which is someone calling Wake after changing
 	 * *uaddr).  The CV code will atomically block (with timeout) and unlock
 	 * the CV lock.
 	 *
-	 * Ordering is __futex.lock -> CV lock, but you can have the inner lock
+	 * Ordering is bucket lock -> CV lock, but you can have the inner lock
 	 * without holding the outer lock. */
 	uth_cond_var_lock(&e->cv);
-	mcs_pdr_unlock(&__futex.lock);
+	spin_pdr_unlock(&b->lock);
 
 	timed_out = !uth_cond_var_timed_wait(&e->cv, NULL, abs_timeout);
 	/* CV wait returns with the lock held, which is unneccessary for
@@ -66,16 +125,16 @@ static inline int futex_wait(int *uaddr, int val,
 	uth_cond_var_unlock(&e->cv);
 
 	/* In the common case, the waker woke us and already cleared on_list,
-	 * and we'd rather not grab the __futex lock again.  Note the outer
+	 * and we'd rather not grab the bucket lock again.  Note the outer
 	 * on_list check is an optimization, and we need the lock to be sure.
 	 * Also note the waker sets waker_using before on_list, so if we happen
 	 * to see !on_list (while the waker is mucking with the list), we'll see
 	 * waker_using and spin below. */
 	if (e->on_list) {
-		mcs_pdr_lock(&__futex.lock);
+		b = futex_lock_elem_bucket(e);
 		if (e->on_list)
-			TAILQ_REMOVE(&__futex.queue, e, link);
-		mcs_pdr_unlock(&__futex.lock);
+			TAILQ_REMOVE(&b->queue, e, link);
+		spin_pdr_unlock(&b->lock);
 	}
 	rmb();	/* read on_list before waker_using */
 	/* The waker might have yanked us and is about to kick the CV.  Need to
@@ -90,40 +149,194 @@ static inline int futex_wait(int *uaddr, int val,
 	return 0;
 }
 
-static inline int futex_wake(int *uaddr, int count)
+/* Moves up to count of b's waiters on uaddr to q, returning how many it moved.
+ * Caller holds b's lock and has notifs disabled until futex_signal_queue(). */
+static int __futex_wake_locked(struct futex_bucket *b, int *uaddr, int count,
+                               struct futex_queue *q)
 {
-	int max = count;
 	struct futex_element *e, *temp;
-	struct futex_queue q = TAILQ_HEAD_INITIALIZER(q);
+	int nr_woken = 0;
 
-	/* The waiter spins on us with cpu_relax_any().  That code assumes the
-	 * target of the wait/spin is in vcore context, or at least has notifs
-	 * disabled. */
-	uth_disable_notifs();
-	mcs_pdr_lock(&__futex.lock);
-	TAILQ_FOREACH_SAFE(e, &__futex.queue, link, temp) {
-		if (count <= 0)
+	TAILQ_FOREACH_SAFE(e, &b->queue, link, temp) {
+		if (nr_woken >= count)
 			break;
 		if (e->uaddr == uaddr) {
 			e->waker_using = true;
 			/* flag waker_using before saying !on_list */
 			wmb();
 			e->on_list = false;
-			TAILQ_REMOVE(&__futex.queue, e, link);
-			TAILQ_INSERT_TAIL(&q, e, link);
-			count--;
+			TAILQ_REMOVE(&b->queue, e, link);
+			TAILQ_INSERT_TAIL(q, e, link);
+			nr_woken++;
 		}
 	}
-	mcs_pdr_unlock(&__futex.lock);
-	TAILQ_FOREACH_SAFE(e, &q, link, temp) {
-		TAILQ_REMOVE(&q, e, link);
+	return nr_woken;
+}
+
+/* Call without any bucket locks held. */
+static void futex_signal_queue(struct futex_queue *q)
+{
+	struct futex_element *e, *temp;
+
+	TAILQ_FOREACH_SAFE(e, q, link, temp) {
+		TAILQ_REMOVE(q, e, link);
 		uth_cond_var_signal(&e->cv);
 		/* Do not touch e after marking it. */
 		e->waker_using = false;
 	}
+}
+
+static inline int futex_wake(int *uaddr, int count)
+{
+	struct futex_bucket *b = futex_hash(uaddr);
+	struct futex_queue q = TAILQ_HEAD_INITIALIZER(q);
+	int nr_woken;
+
+	/* The waiter spins on us with cpu_relax_any().  That code assumes the
+	 * target of the wait/spin is in vcore context, or at least has notifs
+	 * disabled. */
+	uth_disable_notifs();
+	spin_pdr_lock(&b->lock);
+	nr_woken = __futex_wake_locked(b, uaddr, count, &q);
+	spin_pdr_unlock(&b->lock);
+	futex_signal_queue(&q);
 	uth_enable_notifs();
 
-	return max - count;
+	return nr_woken;
+}
+
+/* Wakes up to nr_wake waiters on uaddr, and moves up to nr_requeue of the rest
+ * to wait on uaddr2.  e.g. a condvar broadcast wakes one waiter and requeues
+ * the others onto the mutex, instead of waking them all to fight over it.
+ * With cmp, fails with EAGAIN unless *uaddr == val3. */
+static int futex_requeue(int *uaddr, int nr_wake, int *uaddr2, int nr_requeue,
+                         bool cmp, int val3)
+{
+	struct futex_bucket *b1 = futex_hash(uaddr);
+	struct futex_bucket *b2 = futex_hash(uaddr2);
+	struct futex_queue q = TAILQ_HEAD_INITIALIZER(q);
+	struct futex_element *e, *temp;
+	int nr_woken, nr_requeued = 0;
+
+	uth_disable_notifs();
+	futex_lock_pair(b1, b2);
+	if (cmp && *uaddr != val3) {
+		futex_unlock_pair(b1, b2);
+		uth_enable_notifs();
+		errno = EAGAIN;
+		return -1;
+	}
+	nr_woken = __futex_wake_locked(b1, uaddr, nr_wake, &q);
+	TAILQ_FOREACH_SAFE(e, &b1->queue, link, temp) {
+		if (nr_requeued >= nr_requeue)
+			break;
+		if (e->uaddr != uaddr)
+			continue;
+		e->uaddr = uaddr2;
+		if (b1 != b2) {
+			TAILQ_REMOVE(&b1->queue, e, link);
+			TAILQ_INSERT_TAIL(&b2->queue, e, link);
+			e->bucket = b2;
+		}
+		nr_requeued++;
+	}
+	futex_unlock_pair(b1, b2);
+	futex_signal_queue(&q);
+	uth_enable_notifs();
+
+	return nr_woken + nr_requeued;
+}
+
+static int sign_extend_12(int x)
+{
+	return (x << 20) >> 20;
+}
+
+/* Atomically applies encoded_op's operation to *uaddr, returning the old value
+ * in *oldval.  Returns -1 for an unknown op. */
+static int futex_atomic_op(int *uaddr, int encoded_op, int *oldval)
+{
+	int op = (encoded_op >> 28) & 7;
+	int oparg = sign_extend_12(encoded_op >> 12);
+	int old, new;
+
+	if (encoded_op & (FUTEX_OP_OPARG_SHIFT << 28))
+		oparg = 1 << (oparg & 31);
+	do {
+		old = ACCESS_ONCE(*uaddr);
+		switch (op) {
+		case FUTEX_OP_SET:
+			new = oparg;
+			break;
+		case FUTEX_OP_ADD:
+			new = old + oparg;
+			break;
+		case FUTEX_OP_OR:
+			new = old | oparg;
+			break;
+		case FUTEX_OP_ANDN:
+			new = old & ~oparg;
+			break;
+		case FUTEX_OP_XOR:
+			new = old ^ oparg;
+			break;
+		default:
+			return -1;
+		}
+	} while (!atomic_cas_u32((uint32_t*)uaddr, old, new));
+	*oldval = old;
+	return 0;
+}
+
+static bool futex_op_cmp(int encoded_op, int oldval)
+{
+	int cmparg = sign_extend_12(encoded_op);
+
+	switch ((encoded_op >> 24) & 15) {
+	case FUTEX_OP_CMP_EQ:
+		return oldval == cmparg;
+	case FUTEX_OP_CMP_NE:
+		return oldval != cmparg;
+	case FUTEX_OP_CMP_LT:
+		return oldval < cmparg;
+	case FUTEX_OP_CMP_LE:
+		return oldval <= cmparg;
+	case FUTEX_OP_CMP_GT:
+		return oldval > cmparg;
+	case FUTEX_OP_CMP_GE:
+		return oldval >= cmparg;
+	}
+	return false;
+}
+
+/* Atomically modifies *uaddr2, wakes up to nr_wake waiters on uaddr, and if
+ * the old value of *uaddr2 passes the comparison, also wakes up to nr_wake2 on
+ * uaddr2.  Both buckets are locked across the operation, so no waiter can slip
+ * in between the modification and the wakeups. */
+static int futex_wake_op(int *uaddr, int nr_wake, int *uaddr2, int nr_wake2,
+                         int encoded_op)
+{
+	struct futex_bucket *b1 = futex_hash(uaddr);
+	struct futex_bucket *b2 = futex_hash(uaddr2);
+	struct futex_queue q = TAILQ_HEAD_INITIALIZER(q);
+	int oldval, nr_woken;
+
+	uth_disable_notifs();
+	futex_lock_pair(b1, b2);
+	if (futex_atomic_op(uaddr2, encoded_op, &oldval)) {
+		futex_unlock_pair(b1, b2);
+		uth_enable_notifs();
+		errno = ENOSYS;
+		return -1;
+	}
+	nr_woken = __futex_wake_locked(b1, uaddr, nr_wake, &q);
+	if (futex_op_cmp(encoded_op, oldval))
+		nr_woken += __futex_wake_locked(b2, uaddr2, nr_wake2, &q);
+	futex_unlock_pair(b1, b2);
+	futex_signal_queue(&q);
+	uth_enable_notifs();
+
+	return nr_woken;
 }
 
 int futex(int *uaddr, int op, int val, const struct timespec *timeout,
@@ -131,13 +344,20 @@ int futex(int *uaddr, int op, int val, const struct timespec *timeout,
 {
 	static parlib_once_t once = PARLIB_ONCE_INIT;
 	struct timespec abs_timeout[1];
+	/* Like Linux, the requeue and wake_op ops pass a second count in the
+	 * timeout argument. */
+	int val2 = (int)(uintptr_t)timeout;
 
 	parlib_run_once(&once, futex_init, NULL);
-	assert(uaddr2 == NULL);
-	assert(val3 == 0);
+	/* All of our futexes are process-private */
+	op &= ~FUTEX_PRIVATE_FLAG;
 
-	/* futex timeouts are relative.  Internally, we use absolute timeouts */
-	if (timeout) {
+	switch (op) {
+	case FUTEX_WAIT:
+		if (!timeout)
+			return futex_wait(uaddr, val, NULL);
+		/* futex timeouts are relative.  Internally, we use absolute
+		 * timeouts */
 		clock_gettime(CLOCK_MONOTONIC, abs_timeout);
 		/* timespec_add is available inside glibc, but not out here. */
 		abs_timeout->tv_sec += timeout->tv_sec;
@@ -146,13 +366,15 @@ int futex(int *uaddr, int op, int val, const struct timespec *timeout,
 			abs_timeout->tv_nsec -= 1000000000;
 			abs_timeout->tv_sec++;
 		}
-	}
-
-	switch (op) {
-	case FUTEX_WAIT:
-		return futex_wait(uaddr, val, timeout ? abs_timeout : NULL);
+		return futex_wait(uaddr, val, abs_timeout);
 	case FUTEX_WAKE:
 		return futex_wake(uaddr, val);
+	case FUTEX_REQUEUE:
+		return futex_requeue(uaddr, val, uaddr2, val2, false, 0);
+	case FUTEX_CMP_REQUEUE:
+		return futex_requeue(uaddr, val, uaddr2, val2, true, val3);
+	case FUTEX_WAKE_OP:
+		return futex_wake_op(uaddr, val, uaddr2, val2, val3);
 	default:
 		errno = ENOSYS;
 		return -1;
@@ -4,11 +4,38 @@
 
 __BEGIN_DECLS
 
+/* Ops and FUTEX_WAKE_OP encodings match Linux's */
 enum {
-	FUTEX_WAIT,
-	FUTEX_WAKE
+	FUTEX_WAIT = 0,
+	FUTEX_WAKE = 1,
+	FUTEX_REQUEUE = 3,
+	FUTEX_CMP_REQUEUE = 4,
+	FUTEX_WAKE_OP = 5,
 };
 
+#define FUTEX_PRIVATE_FLAG	128
+
+/* FUTEX_WAKE_OP operations on *uaddr2 */
+#define FUTEX_OP_SET		0	/* *uaddr2 = oparg; */
+#define FUTEX_OP_ADD		1	/* *uaddr2 += oparg; */
+#define FUTEX_OP_OR		2	/* *uaddr2 |= oparg; */
+#define FUTEX_OP_ANDN		3	/* *uaddr2 &= ~oparg; */
+#define FUTEX_OP_XOR		4	/* *uaddr2 ^= oparg; */
+#define FUTEX_OP_OPARG_SHIFT	8	/* Use (1 << oparg) as operand */
+
+/* FUTEX_WAKE_OP comparisons of the old *uaddr2 */
+#define FUTEX_OP_CMP_EQ		0
+#define FUTEX_OP_CMP_NE		1
+#define FUTEX_OP_CMP_LT		2
+#define FUTEX_OP_CMP_LE		3
+#define FUTEX_OP_CMP_GT		4
+#define FUTEX_OP_CMP_GE		5
+
+/* oparg and cmparg are 12 bit signed values */
+#define FUTEX_OP(op, oparg, cmp, cmparg) \
+	((((op) & 0xf) << 28) | (((cmp) & 0xf) << 24) | \
+	 (((oparg) & 0xfff) << 12) | ((cmparg) & 0xfff))
+
 int futex(int *uaddr, int op, int val, const struct timespec *timeout,
           int *uaddr2, int val3);
 
@@ -2,6 +2,7 @@
 #include "pthread.h"
 #include <parlib/vcore.h>
 #include <parlib/mcs.h>
+#include <parlib/spinlock.h>
 #include <stdlib.h>
 #include <string.h>
 #include <parlib/assert.h>
@@ -21,6 +22,7 @@
 #include <sys/fork_cb.h>
 
 #include <parlib/alarm.h>
+#include <parlib/task.h>
 #include <futex.h>
 #include <parlib/serialize.h>
 
@@ -49,6 +51,27 @@ static uint64_t fork_generation;
  * overflow.  Init'd in pth_init(). */
 struct sysc_mgmt *sysc_mgmt = 0;
 
+/* Stacks of the default size are recycled through a small per-vcore cache,
+ * backed by a global depot, instead of being mmapped and munmapped for every
+ * thread.  Every stack has a guard page below it.  Optionally, the cold parts
+ * of a stack (everything but the top PTH_STACK_HOT_SZ) are dropped when it is
+ * cached, at the cost of a syscall. */
+#define PTH_STACK_GUARD_SZ PGSIZE
+#define PTH_STACK_CACHE_NR 4
+#define PTH_STACK_DEPOT_NR 64
+#define PTH_STACK_HOT_SZ (16 * PGSIZE)
+
+struct pth_stack_cache {
+	void *stacktops[PTH_STACK_CACHE_NR];
+	unsigned int nr;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct pth_stack_cache *stack_caches;
+static struct spin_pdr_lock stack_depot_lock = SPINPDR_INITIALIZER;
+static void *stack_depot[PTH_STACK_DEPOT_NR];
+static unsigned int stack_depot_nr;
+static bool trim_cached_stacks = FALSE;
+
 /* Helper / local functions */
 static int get_next_pid(void);
 static inline void pthread_exit_no_cleanup(void *ret);
@@ -140,6 +163,9 @@ static void __attribute__((noreturn)) pth_sched_entry(void)
 			break;
 		}
 		mcs_pdr_unlock(&queue_lock);
+		/* Tasks could have become ready since vcore entry */
+		if (task_run_ready())
+			continue;
 		/* no new thread, try to yield */
 		printd("[P] No threads, vcore %d is yielding\n", vcore_id());
 		/* TODO: you can imagine having something smarter here, like
@@ -527,6 +553,11 @@ void pthread_need_tls(bool need)
 	need_tls = need;
 }
 
+void pthread_trim_cached_stacks(bool trim)
+{
+	trim_cached_stacks = trim;
+}
+
 /* Pthread interface stuff and helpers */
 
 int pthread_attr_init(pthread_attr_t *a)
@@ -546,22 +577,107 @@ int pthread_attr_destroy(pthread_attr_t *a)
 	return 0;
 }
 
-static void __pthread_free_stack(struct pthread_tcb *pt)
+static void __pthread_unmap_stack(void *stacktop, size_t stacksize)
 {
-	int ret = munmap(pt->stacktop - pt->stacksize, pt->stacksize);
+	int ret = munmap(stacktop - stacksize - PTH_STACK_GUARD_SZ,
+	                 stacksize + PTH_STACK_GUARD_SZ);
 	assert(!ret);
 }
 
+/* Replaces all but the top of the stack with fresh, unpopulated memory.  The
+ * kernel frees the old pages. */
+static void __pthread_trim_stack(void *stacktop)
+{
+	void *stackbot = stacktop - PTHREAD_STACK_SIZE;
+	void *ret;
+
+	ret = mmap(stackbot, PTHREAD_STACK_SIZE - PTH_STACK_HOT_SZ,
+	           PROT_READ | PROT_WRITE | PROT_EXEC,
+	           MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	assert(ret == stackbot);
+}
+
+/* Returns FALSE if the caches are full.  Only stacks we keep get trimmed. */
+static bool __pthread_cache_stack(void *stacktop)
+{
+	struct pth_stack_cache *sc;
+	bool cached = FALSE;
+
+	uth_disable_notifs();
+	sc = &stack_caches[vcore_id()];
+	if (sc->nr < PTH_STACK_CACHE_NR) {
+		sc->stacktops[sc->nr++] = stacktop;
+		/* Only this vcore takes from its cache, and it's busy with us */
+		if (trim_cached_stacks)
+			__pthread_trim_stack(stacktop);
+		cached = TRUE;
+	} else if (ACCESS_ONCE(stack_depot_nr) < PTH_STACK_DEPOT_NR) {
+		/* Other vcores can take it as soon as it's in the depot, so we
+		 * trim first.  If the depot fills up in the meantime, the trim
+		 * was wasted. */
+		if (trim_cached_stacks)
+			__pthread_trim_stack(stacktop);
+		spin_pdr_lock(&stack_depot_lock);
+		if (stack_depot_nr < PTH_STACK_DEPOT_NR) {
+			stack_depot[stack_depot_nr++] = stacktop;
+			cached = TRUE;
+		}
+		spin_pdr_unlock(&stack_depot_lock);
+	}
+	uth_enable_notifs();
+	return cached;
+}
+
+static void *__pthread_get_cached_stack(void)
+{
+	struct pth_stack_cache *sc;
+	void *stacktop = NULL;
+
+	uth_disable_notifs();
+	sc = &stack_caches[vcore_id()];
+	if (sc->nr) {
+		stacktop = sc->stacktops[--sc->nr];
+	} else if (ACCESS_ONCE(stack_depot_nr)) {
+		spin_pdr_lock(&stack_depot_lock);
+		if (stack_depot_nr)
+			stacktop = stack_depot[--stack_depot_nr];
+		spin_pdr_unlock(&stack_depot_lock);
+	}
+	uth_enable_notifs();
+	return stacktop;
+}
+
+static void __pthread_free_stack(struct pthread_tcb *pt)
+{
+	if (pt->stacksize == PTHREAD_STACK_SIZE &&
+	    __pthread_cache_stack(pt->stacktop))
+		return;
+	__pthread_unmap_stack(pt->stacktop, pt->stacksize);
+}
+
 static int __pthread_allocate_stack(struct pthread_tcb *pt)
 {
 	int force_a_page_fault;
+	void *stackbot;
+
 	assert(pt->stacksize);
-	void* stackbot = mmap(0, pt->stacksize,
-	                      PROT_READ | PROT_WRITE | PROT_EXEC,
-	                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (pt->stacksize == PTHREAD_STACK_SIZE) {
+		pt->stacktop = __pthread_get_cached_stack();
+		if (pt->stacktop)
+			return 0;
+	}
+	stackbot = mmap(0, pt->stacksize + PTH_STACK_GUARD_SZ,
+	                PROT_READ | PROT_WRITE | PROT_EXEC,
+	                MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
 	if (stackbot == MAP_FAILED)
 		return -1; // errno set by mmap
-	pt->stacktop = stackbot + pt->stacksize;
+	/* The guard page catches stack overflows, instead of letting them
+	 * scribble on whatever is mapped below. */
+	if (mprotect(stackbot, PTH_STACK_GUARD_SZ, PROT_NONE)) {
+		munmap(stackbot, pt->stacksize + PTH_STACK_GUARD_SZ);
+		return -1;
+	}
+	pt->stacktop = stackbot + PTH_STACK_GUARD_SZ + pt->stacksize;
 	/* Want the top of the stack populated, but not the rest of the stack;
 	 * that'll grow on demand (up to pt->stacksize) */
 	force_a_page_fault = ACCESS_ONCE(*(int*)(pt->stacktop - sizeof(int)));
@@ -692,6 +808,11 @@ void pth_sched_init(void)
 	/* Set up the per-vcore structs to track outstanding syscalls */
 	sysc_mgmt = malloc(sizeof(struct sysc_mgmt) * max_vcores());
 	assert(sysc_mgmt);
+	ret = posix_memalign((void**)&stack_caches,
+	                     __alignof__(struct pth_stack_cache),
+	                     sizeof(struct pth_stack_cache) * max_vcores());
+	assert(!ret);
+	memset(stack_caches, 0, sizeof(struct pth_stack_cache) * max_vcores());
 #if 1   /* Independent ev_mboxes per vcore */
 	/* Get a block of pages for our per-vcore (but non-VCPD) ev_qs */
 	mmap_block = (uintptr_t)mmap(0, PGSIZE * 2 * max_vcores(),
@@ -137,6 +137,7 @@ typedef dtls_key_t pthread_key_t;
 
 /* Akaros pthread extensions / hacks */
 void pthread_need_tls(bool need);			/* default is TRUE */
+void pthread_trim_cached_stacks(bool trim);		/* default is FALSE */
 void pthread_mcp_init(void);
 void __pthread_generic_yield(struct pthread_tcb *pthread);
 
@@ -1,5 +1,7 @@
 #include <utest/utest.h>
+#include <pthread.h>
 #include <parlib/alarm.h>
+#include <parlib/uthread.h>
 
 TEST_SUITE("ALARMS");
 
@@ -32,10 +34,79 @@ bool test_alarm(void) {
 	return true;
 }
 
+/* A vcore's alarm goes off while the vcore is offline, so another vcore runs it
+ * and takes the rest of the vcore's chain.  When the vcore is back, alarms it
+ * sets, even later ones, must still fire. */
+bool test_alarm_migrate(void)
+{
+	static uth_semaphore_t sem = UTH_SEMAPHORE_INIT(0);
+	static volatile bool spin_started, spin_done, late_fired;
+	struct alarm_waiter first, second, late;
+	pthread_t spinner;
+	uint64_t deadline;
+
+	void *spin(void *arg)
+	{
+		spin_started = TRUE;
+		while (!spin_done)
+			cpu_relax();
+		return 0;
+	}
+	void wake_handler(struct alarm_waiter *waiter)
+	{
+		uth_semaphore_up(&sem);
+	}
+	void nop_handler(struct alarm_waiter *waiter)
+	{
+	}
+	void late_handler(struct alarm_waiter *waiter)
+	{
+		late_fired = TRUE;
+	}
+
+	if (max_vcores() < 2)
+		return true;
+	parlib_never_yield = FALSE;
+	parlib_never_vc_request = FALSE;
+	pthread_mcp_init();
+	vcore_request_total(2);
+	/* The spinner keeps one vcore busy, so ours can go offline */
+	UT_ASSERT(!pthread_create(&spinner, NULL, spin, NULL));
+	while (!spin_started)
+		cpu_relax();
+
+	init_awaiter(&first, wake_handler);
+	init_awaiter(&second, nop_handler);
+	init_awaiter(&late, late_handler);
+	set_awaiter_rel(&first, 10000);
+	set_awaiter_rel(&second, 30000);
+	/* Both go on our vcore's chain */
+	uth_disable_notifs();
+	set_alarm(&first);
+	set_alarm(&second);
+	uth_enable_notifs();
+	/* Our vcore has nothing to run, so it yields */
+	uth_semaphore_down(&sem);
+
+	/* Later than second, which was the old chain's next alarm */
+	set_awaiter_rel(&late, 60000);
+	set_alarm(&late);
+	deadline = read_tsc() + usec2tsc(1000000);
+	while (!late_fired && read_tsc() < deadline)
+		cpu_relax();
+	unset_alarm(&second);
+	unset_alarm(&late);
+	spin_done = TRUE;
+	pthread_join(spinner, NULL);
+	UT_ASSERT_M("Alarm set after migration never fired", late_fired);
+	return true;
+}
+
 /* <--- End definition of test cases ---> */
 
 struct utest utests[] = {
 	UTEST_REG(alarm),
+	UTEST_REG(alarm_migrate),
 };
 int num_utests = sizeof(utests) / sizeof(struct utest);
 
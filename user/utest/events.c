@@ -0,0 +1,154 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Event delivery from FD taps.  Each test checks that every event arrives, and
+ * prints the event throughput. */
+
+#include <utest/utest.h>
+#include <parlib/event.h>
+#include <parlib/timing.h>
+#include <parlib/parlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <stdio.h>
+
+TEST_SUITE("EVENTS");
+
+/* <--- Begin definition of test cases ---> */
+
+#define NR_TAPS 8
+#define NR_WRITES 2000
+
+static int tap_fd(int fd, int ev_id, struct event_queue *ev_q, int cmd)
+{
+	struct fd_tap_req tap_req = {0};
+
+	tap_req.fd = fd;
+	tap_req.cmd = cmd;
+	tap_req.filter = FDTAP_FILT_READABLE;
+	tap_req.ev_id = ev_id;
+	tap_req.ev_q = ev_q;
+	tap_req.data = (void*)(long)fd;
+	return sys_tap_fds(&tap_req, 1) == 1 ? 0 : -1;
+}
+
+static void print_rate(const char *name, unsigned long nr_evs, uint64_t tsc)
+{
+	printf("\t%s: %lu events in %lu usec, %lu events/sec\n", name, nr_evs,
+	       tsc2usec(tsc), nr_evs * 1000000 / MAX(tsc2usec(tsc), 1));
+}
+
+/* Several taps on one eventfd, all into one UCQ.  Each write fires all of the
+ * taps at once, and spills over a few UCQ pages. */
+bool test_ucq_taps(void)
+{
+	struct event_queue *ev_q = get_eventq(EV_MBOX_UCQ);
+	struct event_msg msg;
+	int fds[NR_TAPS];
+	unsigned long counts[NR_TAPS] = {0};
+	unsigned long nr_msgs = 0;
+	uint64_t t0;
+
+	ev_q->ev_flags = 0;
+	fds[0] = eventfd(0, EFD_NONBLOCK);
+	UT_ASSERT_FMT("eventfd failed", fds[0] >= 0);
+	for (int i = 1; i < NR_TAPS; i++) {
+		fds[i] = dup(fds[0]);
+		UT_ASSERT_FMT("dup failed", fds[i] >= 0);
+	}
+	for (int i = 0; i < NR_TAPS; i++)
+		UT_ASSERT_FMT("Failed to tap fd %d",
+			      !tap_fd(fds[i], i, ev_q, FDTAP_CMD_ADD), fds[i]);
+	t0 = read_tsc();
+	for (int i = 0; i < NR_WRITES; i++)
+		eventfd_write(fds[0], 1);
+	while (extract_one_mbox_msg(ev_q->ev_mbox, &msg)) {
+		UT_ASSERT_FMT("Bad ev_type %d", msg.ev_type < NR_TAPS,
+			      msg.ev_type);
+		UT_ASSERT_FMT("Bad filter %p",
+			      msg.ev_arg2 == FDTAP_FILT_READABLE, msg.ev_arg2);
+		UT_ASSERT_FMT("Bad data %p",
+			      msg.ev_arg3 == (void*)(long)fds[msg.ev_type],
+			      msg.ev_arg3);
+		counts[msg.ev_type]++;
+		nr_msgs++;
+	}
+	print_rate("UCQ", nr_msgs, read_tsc() - t0);
+	for (int i = 0; i < NR_TAPS; i++) {
+		UT_ASSERT_FMT("Tap %d got %lu events, wanted %d",
+			      counts[i] == NR_WRITES, i, counts[i], NR_WRITES);
+		tap_fd(fds[i], i, ev_q, FDTAP_CMD_REM);
+		close(fds[i]);
+	}
+	put_eventq(ev_q);
+	return TRUE;
+}
+
+#define NR_CEQ_FDS 64
+#define NR_CEQ_ROUNDS 200
+
+/* Many eventfds, one tap each, into one CEQ.  Every round makes them all
+ * readable, then consumes the events, which should coalesce to one per fd. */
+bool test_ceq_taps(void)
+{
+	struct event_queue *ev_q = get_eventq_raw();
+	struct event_msg msg;
+	int fds[NR_CEQ_FDS];
+	bool seen[NR_CEQ_FDS];
+	unsigned long nr_msgs = 0;
+	uint64_t t0;
+	eventfd_t efd_val;
+
+	ev_q->ev_mbox->type = EV_MBOX_CEQ;
+	ceq_init(&ev_q->ev_mbox->ceq, CEQ_OR, NR_CEQ_FDS, CEQ_DEFAULT_SZ);
+	ev_q->ev_flags = 0;
+	for (int i = 0; i < NR_CEQ_FDS; i++) {
+		fds[i] = eventfd(0, EFD_NONBLOCK);
+		UT_ASSERT_FMT("eventfd failed", fds[i] >= 0);
+		UT_ASSERT_FMT("Failed to tap fd %d",
+			      !tap_fd(fds[i], i, ev_q, FDTAP_CMD_ADD), fds[i]);
+	}
+	t0 = read_tsc();
+	for (int r = 0; r < NR_CEQ_ROUNDS; r++) {
+		memset(seen, 0, sizeof(seen));
+		/* Twice each, so the second one coalesces */
+		for (int i = 0; i < NR_CEQ_FDS * 2; i++)
+			eventfd_write(fds[i % NR_CEQ_FDS], 1);
+		while (extract_one_mbox_msg(ev_q->ev_mbox, &msg)) {
+			UT_ASSERT_FMT("Bad ev_type %d",
+				      msg.ev_type < NR_CEQ_FDS, msg.ev_type);
+			UT_ASSERT_FMT("Bad filter %p",
+				      msg.ev_arg2 == FDTAP_FILT_READABLE,
+				      msg.ev_arg2);
+			seen[msg.ev_type] = TRUE;
+			nr_msgs++;
+			eventfd_read(fds[msg.ev_type], &efd_val);
+		}
+		for (int i = 0; i < NR_CEQ_FDS; i++)
+			UT_ASSERT_FMT("Round %d, missed fd %d", seen[i], r, i);
+	}
+	print_rate("CEQ", nr_msgs, read_tsc() - t0);
+	for (int i = 0; i < NR_CEQ_FDS; i++) {
+		tap_fd(fds[i], i, ev_q, FDTAP_CMD_REM);
+		close(fds[i]);
+	}
+	ceq_cleanup(&ev_q->ev_mbox->ceq);
+	put_eventq_raw(ev_q);
+	return TRUE;
+}
+
+/* <--- End definition of test cases ---> */
+
+struct utest utests[] = {
+	UTEST_REG(ucq_taps),
+	UTEST_REG(ceq_taps),
+};
+int num_utests = sizeof(utests) / sizeof(struct utest);
+
+int main(int argc, char *argv[])
+{
+	char **whitelist = &argv[1];
+	int whitelist_len = argc - 1;
+
+	RUN_TEST_SUITE(utests, num_utests, whitelist, whitelist_len);
+}
@@ -169,6 +169,23 @@ struct x86_decode {
 	.rex_b = false, \
 }
 
+/* Per-gth cache of decoded instructions, keyed by (CR3, RIP).  Guests hammer
+ * the same few driver instructions for MMIO, so on a hit we skip the guest page
+ * table walk and the decode.  On a hit, we still compare the cached bytes
+ * against the instruction at the cached GPA, in case the guest changed its
+ * code.  We don't catch the guest remapping the RIP to a different GPA under
+ * the same CR3; kernels don't do that to their MMIO code. */
+#define INSN_CACHE_NR_ENTRIES	64
+
+struct insn_cache_entry {
+	uint64_t cr3;
+	uint64_t rip;
+	uint64_t rip_gpa;
+	struct x86_decode d;
+	uint8_t insn_sz;	/* 0 means empty */
+	uint8_t insn[VMM_MAX_INSN_SZ];
+};
+
 static void print_decoded_insn(uint8_t *insn, struct x86_decode *d);
 static void run_decode_hokey_tests(void);
 
@@ -641,6 +658,15 @@ static int decode_inst_size(uint8_t *insn, struct x86_decode *d)
 	       + d->imm_sz;
 }
 
+static int decode_insn(uint8_t *insn, struct x86_decode *d)
+{
+	if (decode_prefix(insn, d) < 0)
+		return -1;
+	if (decode_opcode(insn, d) < 0)
+		return -1;
+	return 0;
+}
+
 /* Emulates a memory operation that faulted/vmexited.  Despite the file name,
  * this is x86-specific, so we only have at most one address involved.  We have
  * at least one address involved, since it is a memory operation.
@@ -663,9 +689,7 @@ int emulate_mem_insn(struct guest_thread *gth, uint8_t *insn,
 	// we don't have to find the source address in registers,
 	// only the register holding or receiving the value.
 	gpa = gth_to_vmtf(gth)->tf_guest_pa;
-	if (decode_prefix(insn, d) < 0)
-		return -1;
-	if (decode_opcode(insn, d) < 0)
+	if (decode_insn(insn, d) < 0)
 		return -1;
 	if (execute_op(gth, insn, d, access, gpa) < 0)
 		return -1;
@@ -680,6 +704,72 @@ int emulate_mem_insn(struct guest_thread *gth, uint8_t *insn,
 	return 0;
 }
 
+static struct insn_cache_entry *insn_cache_slot(struct guest_thread *gth,
+						uint64_t rip)
+{
+	struct insn_cache_entry *cache = gth->insn_cache;
+
+	if (!cache) {
+		cache = calloc(INSN_CACHE_NR_ENTRIES,
+			       sizeof(struct insn_cache_entry));
+		if (!cache)
+			return NULL;
+		gth->insn_cache = cache;
+	}
+	return &cache[(rip ^ (rip >> 12)) % INSN_CACHE_NR_ENTRIES];
+}
+
+static bool insn_cache_hit(struct insn_cache_entry *ice,
+			   struct vm_trapframe *vm_tf)
+{
+	return ice->insn_sz && ice->rip == vm_tf->tf_rip &&
+	       ice->cr3 == vm_tf->tf_cr3 &&
+	       !memcmp((void*)ice->rip_gpa, ice->insn, ice->insn_sz);
+}
+
+/* Like emulate_mem_insn(), but fetches the instruction at the guest's RIP
+ * itself, going through the gth's decode cache.  Returns -EFAULT if we could
+ * not translate the RIP (the caller should inject a page fault), and -1 if we
+ * could not emulate the instruction. */
+int emulate_mem_insn_at_rip(struct guest_thread *gth, emu_mem_access access,
+			    int *advance)
+{
+	struct vm_trapframe *vm_tf = gth_to_vmtf(gth);
+	struct insn_cache_entry *ice, scratch;
+	struct x86_decode d[1];
+	uint64_t start_tsc = read_tsc();
+
+	ice = insn_cache_slot(gth, vm_tf->tf_rip);
+	if (ice && insn_cache_hit(ice, vm_tf)) {
+		gth->nr_insn_cache_hits++;
+	} else {
+		if (!ice)
+			ice = &scratch;
+		ice->insn_sz = 0;
+		if (rippa(gth, &ice->rip_gpa))
+			return -EFAULT;
+		memcpy(ice->insn, (void*)ice->rip_gpa, VMM_MAX_INSN_SZ);
+		ice->d = (struct x86_decode)X86_DECODE_64_DEFAULT;
+		if (decode_insn(ice->insn, &ice->d) < 0)
+			return -1;
+		ice->rip = vm_tf->tf_rip;
+		ice->cr3 = vm_tf->tf_cr3;
+		ice->insn_sz = decode_inst_size(ice->insn, &ice->d);
+	}
+	/* execute_op() gets a copy; the cached decode is read-only */
+	*d = ice->d;
+	if (execute_op(gth, ice->insn, d, access, vm_tf->tf_guest_pa) < 0)
+		return -1;
+	*advance = ice->insn_sz;
+	gth->nr_mmio_emus++;
+	gth->mmio_emu_tsc += read_tsc() - start_tsc;
+	if (debug_decode) {
+		fprintf(stderr, "gpa %p", vm_tf->tf_guest_pa);
+		print_decoded_insn(ice->insn, d);
+	}
+	return 0;
+}
+
 /* Debugging */
 
 static void print_decoded_insn(uint8_t *insn, struct x86_decode *d)
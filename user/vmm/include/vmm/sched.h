@@ -33,7 +33,14 @@ struct guest_thread {
 	unsigned int			gpc_id;
 	uth_mutex_t			*halt_mtx;
 	uth_cond_var_t			*halt_cv;
+	/* Set while sleeping in sleep_til_irq(), under halt_mtx */
+	bool				halted;
 	unsigned long			nr_vmexits;
+	/* MMIO emulation: the decoded insn cache and its stats */
+	void				*insn_cache;
+	unsigned long			nr_mmio_emus;
+	unsigned long			nr_insn_cache_hits;
+	uint64_t			mmio_emu_tsc;
 	struct vmm_gpcore_init		gpci;
 	void				*user_data;
 };
@@ -17,6 +17,7 @@
 #include <stdint.h>
 #include <err.h>
 #include <sys/uio.h>
+#include <parlib/alarm.h>
 #include <vmm/virtio_ring.h>
 #include <vmm/sched.h>
 
@@ -76,6 +77,19 @@ struct virtio_vq {
 
 	// Write eventfd to wake up the service function; it blocks on eventfd read
 	int eventfd;
+
+	// Interrupt moderation: if irq_coalesce_count is set, used buffers are
+	// signalled to the guest once irq_coalesce_count of them are pending or
+	// the oldest has been pending for irq_coalesce_usec, whichever is first.
+	// Pending interrupts are always flushed before the service function
+	// blocks. The alarm enforces irq_coalesce_usec when no further buffers
+	// are used; it flushes from a task thread in vm, so nr_held_irqs is
+	// only swapped atomically.
+	uint32_t irq_coalesce_count;
+	uint32_t irq_coalesce_usec;
+	uint32_t nr_held_irqs;
+	struct alarm_waiter irq_coalesce_alarm;
+	struct virtual_machine *vm;
 };
 
 struct virtio_vq_dev {
@@ -230,6 +230,14 @@ struct virtio_mmio_dev {
 // register for the device
 void virtio_mmio_set_vring_irq(struct virtio_mmio_dev *mmio_dev);
 
+// Tells the guest that the device used buffers from vq: sets the
+// VIRTIO_MMIO_INT_VRING bit and pokes the guest, subject to the vq's
+// interrupt moderation settings.
+void virtio_mmio_vq_irq(struct virtio_vq *vq);
+
+// Sends any interrupt held back by the vq's interrupt moderation
+void virtio_mmio_vq_flush_irq(struct virtio_vq *vq);
+
 // Sets the VIRTIO_MMIO_INT_CONFIG bit in the interrupt status
 // register for the device
 void virtio_mmio_set_cfg_irq(struct virtio_mmio_dev *mmio_dev);
@@ -94,6 +94,8 @@ typedef int (*emu_mem_access)(struct guest_thread *gth, uintptr_t gpa,
 			      bool store);
 int emulate_mem_insn(struct guest_thread *gth, uint8_t *insn,
 		     emu_mem_access access, int *advance);
+int emulate_mem_insn_at_rip(struct guest_thread *gth, emu_mem_access access,
+			    int *advance);
 int io(struct guest_thread *vm_thread);
 void showstatus(FILE *f, struct guest_thread *vm_thread);
 int gva2gpa(struct guest_thread *vm_thread, uint64_t va, uint64_t *pa);
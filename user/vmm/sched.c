@@ -17,6 +17,7 @@
 #include <parlib/ros_debug.h>
 #include <parlib/vcore_tick.h>
 #include <parlib/slab.h>
+#include <parlib/timing.h>
 
 int vmm_sched_period_usec = 1000;
 
@@ -529,6 +530,7 @@ static void destroy_guest_thread(struct guest_thread *gth)
 	uthread_cleanup((struct uthread*)cth);
 	free(cth);
 	uthread_cleanup((struct uthread*)gth);
+	free(gth->insn_cache);
 	free(gth);
 }
 
@@ -591,11 +593,20 @@ static void ev_handle_diag(struct event_msg *ev_msg, unsigned int ev_type,
 		        ((struct vmm_thread*)gth)->nr_runs,
 		        ((struct vmm_thread*)cth)->nr_runs,
 		        gth->nr_vmexits);
+		fprintf(stderr, "\t        %lu MMIO emulations, %lu%% insn cache hits, %lu usec avg\n",
+			gth->nr_mmio_emus,
+			gth->nr_mmio_emus ? gth->nr_insn_cache_hits * 100 /
+					    gth->nr_mmio_emus : 0,
+			gth->nr_mmio_emus ? tsc2usec(gth->mmio_emu_tsc) /
+					    gth->nr_mmio_emus : 0);
 		if (reset) {
 			((struct vmm_thread*)gth)->nr_resched = 0;
 			((struct vmm_thread*)gth)->nr_runs = 0;
 			((struct vmm_thread*)cth)->nr_runs = 0;
 			gth->nr_vmexits = 0;
+			gth->nr_mmio_emus = 0;
+			gth->nr_insn_cache_hits = 0;
+			gth->mmio_emu_tsc = 0;
 		}
 	}
 	fprintf(stderr, "\n\tNr unblocked gpc %lu, Nr unblocked tasks %lu\n",
@@ -34,6 +34,7 @@
 #include <vmm/virtio.h>
 #include <vmm/virtio_ids.h>
 #include <vmm/virtio_config.h>
+#include <vmm/virtio_mmio.h>
 
 // The purpose is to make sure the addresses provided by the guest are not
 // outside the bounds of the guest's memory.
@@ -160,7 +161,10 @@ uint32_t virtio_next_avail_vq_desc(struct virtio_vq *vq, struct iovec iov[],
 
 		// NOTE: lguest kicks the guest with an irq before they wait on
 		// the eventfd. Instead, I delegate that responsibility to the
-		// queue service functions.
+		// queue service functions. The only irqs we send here are ones
+		// held back by interrupt moderation, which must go out before
+		// we block.
+		virtio_mmio_vq_flush_irq(vq);
 
 		// We're about to wait on the eventfd, so we need to tell the
 		// guest that we want a notification when it adds new buffers
@@ -41,8 +41,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/eventfd.h>
+#include <parlib/timing.h>
 #include <vmm/virtio_config.h>
 #include <vmm/virtio_mmio.h>
+#include <vmm/vmm.h>
 
 #define VIRT_MAGIC 0x74726976 /* 'virt' */
 
@@ -55,6 +57,60 @@ void virtio_mmio_set_vring_irq(struct virtio_mmio_dev *mmio_dev)
 	mmio_dev->isr |= VIRTIO_MMIO_INT_VRING;
 }
 
+static void __virtio_mmio_vq_irq(struct virtio_vq *vq)
+{
+	struct virtio_mmio_dev *mmio_dev = vq->vqdev->transport_dev;
+
+	virtio_mmio_set_vring_irq(mmio_dev);
+	if (mmio_dev->poke_guest)
+		mmio_dev->poke_guest(mmio_dev->vec, mmio_dev->dest);
+}
+
+static void *virtio_mmio_vq_alarm_task(void *arg)
+{
+	struct virtio_vq *vq = arg;
+
+	/* The service thread may have flushed since the alarm went off */
+	if (atomic_swap_u32(&vq->nr_held_irqs, 0))
+		__virtio_mmio_vq_irq(vq);
+	return NULL;
+}
+
+/* Runs in vcore context, and poking the guest may block, so we hand the flush
+ * to a task. */
+static void virtio_mmio_vq_alarm(struct alarm_waiter *waiter)
+{
+	struct virtio_vq *vq = container_of(waiter, struct virtio_vq,
+					    irq_coalesce_alarm);
+
+	vmm_run_task(vq->vm, virtio_mmio_vq_alarm_task, vq);
+}
+
+void virtio_mmio_vq_irq(struct virtio_vq *vq)
+{
+	if (!vq->irq_coalesce_count) {
+		__virtio_mmio_vq_irq(vq);
+		return;
+	}
+	/* The first held IRQ starts the deadline.  A stale alarm task can
+	 * empty the count while the alarm is still armed, so this resets
+	 * rather than sets. */
+	if (!__sync_fetch_and_add(&vq->nr_held_irqs, 1))
+		reset_alarm_abs(&vq->irq_coalesce_alarm,
+				read_tsc() + usec2tsc(vq->irq_coalesce_usec));
+	if (ACCESS_ONCE(vq->nr_held_irqs) >= vq->irq_coalesce_count)
+		virtio_mmio_vq_flush_irq(vq);
+}
+
+void virtio_mmio_vq_flush_irq(struct virtio_vq *vq)
+{
+	if (!ACCESS_ONCE(vq->nr_held_irqs))
+		return;
+	unset_alarm(&vq->irq_coalesce_alarm);
+	if (atomic_swap_u32(&vq->nr_held_irqs, 0))
+		__virtio_mmio_vq_irq(vq);
+}
+
 void virtio_mmio_set_cfg_irq(struct virtio_mmio_dev *mmio_dev)
 {
 	mmio_dev->isr |= VIRTIO_MMIO_INT_CONFIG;
@@ -574,9 +630,24 @@ void virtio_mmio_wr(struct virtual_machine *vm,
 
 				mmio_dev->vqdev->vqs[mmio_dev->qsel].eventfd =
 					eventfd(0, 0);
+				// Let the kernel kick the eventfd directly when
+				// the guest notifies this queue.  If that
+				// fails, QueueNotify writes still exit to us.
+				syscall(SYS_vmm_ctl, VMM_CTL_ADD_DOORBELL,
+					mmio_dev->addr +
+						VIRTIO_MMIO_QUEUE_NOTIFY,
+					mmio_dev->qsel,
+					mmio_dev->vqdev->vqs[mmio_dev->qsel].eventfd,
+					0);
 				mmio_dev->vqdev->vqs[mmio_dev->qsel].qready =
 					0x1;
 
+				init_awaiter(
+					&mmio_dev->vqdev->vqs[mmio_dev->qsel]
+						.irq_coalesce_alarm,
+					virtio_mmio_vq_alarm);
+				mmio_dev->vqdev->vqs[mmio_dev->qsel].vm = vm;
+
 				mmio_dev->vqdev->vqs[mmio_dev->qsel].srv_th =
 						vmm_run_task(vm,
 								mmio_dev->vqdev->vqs[mmio_dev->qsel].srv_fn,
@@ -115,8 +115,7 @@ void *net_receiveq_fn(void *_vq)
 		net_header->gso_type = VIRTIO_NET_HDR_GSO_NONE;
 		virtio_add_used_desc(vq, head, num_read + VIRTIO_HEADER_SIZE);
 
-		virtio_mmio_set_vring_irq(dev);
-		dev->poke_guest(dev->vec, dev->dest);
+		virtio_mmio_vq_irq(vq);
 	}
 	return 0;
 }
@@ -159,8 +158,7 @@ void *net_transmitq_fn(void *_vq)
 
 		virtio_add_used_desc(vq, head, 0);
 
-		virtio_mmio_set_vring_irq(dev);
-		dev->poke_guest(dev->vec, dev->dest);
+		virtio_mmio_vq_irq(vq);
 	}
 	return 0;
 }
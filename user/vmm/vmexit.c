@@ -10,8 +10,10 @@
 #include <vmm/vmm.h>
 #include <parlib/arch/trap.h>
 #include <parlib/bitmask.h>
+#include <ros/arch/mmu.h>
 #include <parlib/stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 
 static bool pir_notif_is_set(struct vmm_gpcore_init *gpci)
 {
@@ -66,12 +68,16 @@ static void sleep_til_irq(struct guest_thread *gth)
 	 * hardware will deliver the virtual IRQ at the appropriate time.
 	 *
 	 * The more traditional race here is if the halt starts concurrently
-	 * with the post; that's why we sync with the mutex to make sure there
-	 * is an ordering between the actual halt (this function) and the
-	 * posting. */
+	 * with the post.  Posters don't grab the mutex unless they see
+	 * 'halted', so we set it before checking notif, and they set notif
+	 * before checking 'halted'.  The mutex then orders the actual halt
+	 * (this function) with the posters' CV signal. */
 	uth_mutex_lock(gth->halt_mtx);
+	gth->halted = TRUE;
+	mb();	/* write halted before reading notif */
 	while (!(pir_notif_is_set(gpci) || virtual_irq_is_pending(gth)))
 		uth_cond_var_wait(gth->halt_cv, gth->halt_mtx);
+	gth->halted = FALSE;
 	uth_mutex_unlock(gth->halt_mtx);
 }
 
@@ -179,20 +185,26 @@ static bool handle_ept_fault(struct guest_thread *gth)
 	int size;
 	int advance;
 	int ret;
-	uint8_t insn[VMM_MAX_INSN_SZ];
 
 	if (vm_tf->tf_flags & VMCTX_FL_EPT_VMR_BACKED) {
-		ret = ros_syscall(SYS_populate_va, vm_tf->tf_guest_pa, 1, 0, 0,
-				  0, 0);
+		/* Fault around: populate the rest of the 2MB region too.
+		 * Guests tend to keep touching the memory they faulted on, and
+		 * each page costs an exit and a syscall.  The region can run
+		 * past the end of the VMR or its file, in which case we just
+		 * get the one page. */
+		gpa = ROUNDDOWN(vm_tf->tf_guest_pa, PGSIZE);
+		ret = ros_syscall(SYS_populate_va, gpa,
+				  (ROUNDUP(gpa + 1, PML1_REACH) - gpa) >> PGSHIFT,
+				  0, 0, 0, 0);
+		if (ret <= 0)
+			ret = ros_syscall(SYS_populate_va, gpa, 1, 0, 0, 0, 0);
 		if (ret <= 0)
 			panic("[user] handle_ept_fault: populate_va failed: ret = %d\n",
 			      ret);
 		return TRUE;
 	}
-	/* TODO: consider pushing the PF stuff into fetch, since rippa has a
-	 * bunch of callers.  Though we'll still need to know to return true to
-	 * restart the guest, instead of killing them with e.g. a failed emu. */
-	if (fetch_insn(gth, insn)) {
+	ret = emulate_mem_insn_at_rip(gth, ept_mem_access, &advance);
+	if (ret == -EFAULT) {
 		/* We were unable to translate RIP due to an ept fault */
 		vm_tf->tf_trap_inject = VM_TRAP_VALID
 		                      | VM_TRAP_ERROR_CODE
@@ -200,7 +212,6 @@ static bool handle_ept_fault(struct guest_thread *gth)
 		                      | HW_TRAP_PAGE_FAULT;
 		return true;
 	}
-	ret = emulate_mem_insn(gth, insn, ept_mem_access, &advance);
 	if (ret < 0) {
 		fprintf(stderr, "emulate failed!\n");
 		return false;
@@ -376,17 +387,18 @@ static bool handle_apic_access(struct guest_thread *gth)
 	bool store;
 	int size;
 	int advance;
-	uint8_t insn[VMM_MAX_INSN_SZ];
+	int ret;
 	struct vm_trapframe *vm_tf = gth_to_vmtf(gth);
 
-	if (fetch_insn(gth, insn)) {
+	ret = emulate_mem_insn_at_rip(gth, __apic_access, &advance);
+	if (ret == -EFAULT) {
 		vm_tf->tf_trap_inject = VM_TRAP_VALID
 		                      | VM_TRAP_ERROR_CODE
 		                      | VM_TRAP_HARDWARE
 		                      | HW_TRAP_PAGE_FAULT;
 		return true;
 	}
-	if (emulate_mem_insn(gth, insn, __apic_access, &advance))
+	if (ret)
 		return FALSE;
 	vm_tf->tf_rip += advance;
 	return TRUE;
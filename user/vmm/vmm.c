@@ -32,21 +32,34 @@ int vmm_interrupt_guest(struct virtual_machine *vm, unsigned int gpcoreid,
 		        VMX_POSTED_OUTSTANDING_NOTIF - 1);
 		return -1;
 	}
-	/* Syncing with halting guest threads.  The Mutex protects changes to
-	 * the posted irq descriptor. */
-	uth_mutex_lock(gth->halt_mtx);
-	SET_BITMASK_BIT_ATOMIC(gpci->posted_irq_desc, vector);
-	/* Atomic op provides the mb() btw writing the vector and mucking with
-	 * OUTSTANDING_NOTIF.
+	/* Device threads post directly to the descriptor, without the mutex.
+	 * The atomic op provides the mb() btw writing the vector and mucking
+	 * with OUTSTANDING_NOTIF.
+	 *
+	 * If notif is already set, whoever set it is responsible for the IPI
+	 * (or the kernel will resend it when the guest next runs), and our
+	 * vector will be picked up with theirs.  If our test-and-set flipped
+	 * notif, it's on us to inject the IRQ.  The kernel only IPIs the
+	 * guest's pcore if it is running.
 	 *
-	 * If we set notif, it's on us to inject the IRQ.  Either way, notif
-	 * will be set and we must kick the CV, unconditionally. */
-	if (!GET_BITMASK_BIT(gpci->posted_irq_desc,
-			     VMX_POSTED_OUTSTANDING_NOTIF)) {
-		SET_BITMASK_BIT_ATOMIC(gpci->posted_irq_desc,
-		                       VMX_POSTED_OUTSTANDING_NOTIF);
-		ros_syscall(SYS_vmm_poke_guest, gpcoreid, 0, 0, 0, 0, 0);
+	 * The only time we need to sync with the guest thread is if it is
+	 * halted in sleep_til_irq().  That sets 'halted' and then checks notif,
+	 * and we set notif and then check 'halted', so at least one of us will
+	 * see the other.  If it is halted, we must kick the CV, even if someone
+	 * else set notif, since the kernel's ICR fast path sets notif without
+	 * kicking. */
+	SET_BITMASK_BIT_ATOMIC(gpci->posted_irq_desc, vector);
+	if (!TEST_AND_SET_BITMASK_BIT_ATOMIC(gpci->posted_irq_desc,
+					     VMX_POSTED_OUTSTANDING_NOTIF)) {
+		if (!ACCESS_ONCE(gth->halted)) {
+			ros_syscall(SYS_vmm_poke_guest, gpcoreid, 0, 0, 0, 0,
+				    0);
+			return 0;
+		}
+	} else if (!ACCESS_ONCE(gth->halted)) {
+		return 0;
 	}
+	uth_mutex_lock(gth->halt_mtx);
 	uth_cond_var_signal(gth->halt_cv);
 	uth_mutex_unlock(gth->halt_mtx);
 	return 0;